@@ -36,6 +36,7 @@
 #define ILOC_H
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
@@ -50,6 +51,40 @@
 #else
 #define SERIAL
 #endif
+/*
+ * POSIX threads (multi-threaded batch mode)
+ *    event-level state (errorcode, verbose, logfp, PrevLat, ...) is kept
+ *    per thread; GCD blocks rely on the process-wide state, so it remains
+ *    global and the batch mode falls back to serial processing with GCD
+ */
+#include <pthread.h>
+/*
+ * Unix-domain sockets and fork (iLoc serve daemon mode, prefork workers)
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+/*
+ * memory-mapped binary travel-time tables
+ */
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef GCD
+#define THREADLOCAL
+#else
+#define THREADLOCAL __thread
+#endif
+#ifdef __GNUC__
+#define ALWAYSINLINE static inline __attribute__((always_inline))
+#else
+#define ALWAYSINLINE static inline
+#endif
 /*
  * Lapack (MacOS)
  */
@@ -123,6 +158,10 @@
 #define STALEN 7                                 /* max station code length */
 #define PHALEN 9                                   /* max phase name length */
 #define MAXBUF 1024                                      /* max buffer size */
+/*
+ * default Unix-domain socket for iLoc serve
+ */
+#define ILOC_SOCKET "/tmp/iLoc.sock"
 /*
  * tolerance values
  */
@@ -140,6 +179,7 @@
 #define MAXNUMPHA 200                   /* max number of IASPEI phase names */
 #define MAXTTPHA 99                   /* max number of phases with TT table */
 #define MAXLOCALTTPHA 11        /* max number of phases with local TT table */
+#define MAXPHASECODE 2048             /* max number of interned phase names */
 #define MAXPHAINREADING 80             /* max number of phases in a reading */
 #define MAXMAG 4               /* max number of magnitudes computed by iLoc */
 /*
@@ -150,6 +190,8 @@
 #define DELTA_SAMPLES 6      /* max number of TT samples in delta direction */
 #define DEPTH_SAMPLES 4      /* max number of TT samples in depth direction */
 #define MIN_SAMPLES 2            /* min number of samples for interpolation */
+#define MIN_UNIFORM_RUN 4     /* min number of intervals in a uniform run */
+#define TTCACHEPROBE 8                  /* max probe length in the TT cache */
 /*
  *
  * Array sizes for neighbourhood algorithm routines
@@ -158,6 +200,8 @@
 #define NA_MAXND       4                  /* max number of model parameters */
 #define NA_MAXBIT     30       /* max direction numbers for Sobol sequences */
 #define NA_MAXDEG     10                  /* max degree for SAS polynomials */
+#define NA_WCACHE      8           /* projection matrices cached per thread */
+#define NA_WCACHEDEF 1000       /* max ndef for caching a projection matrix */
 /*
  * degree <-> rad conversions
  */
@@ -466,6 +510,7 @@ typedef struct pha_rec {
     double StaDepth;                  /* instrument depth below surface [m] */
     char ReportedPhase[PHALEN];                           /* reported phase */
     char phase[PHALEN];                      /* phase mapped to IASPEI code */
+    int phcode;            /* phase code set at phase identification, or -1 */
     char prevphase[PHALEN];                /* phase from previous iteration */
     int phase_fixed;              /* 1 to stop iscloc reidentifying a phase */
     int force_undef; /* 1 if forced to be undefining by editor, 0 otherwise */
@@ -517,6 +562,13 @@ typedef struct pha_rec {
     int duplicate;                           /* 1 if duplicate, 0 otherwise */
     int numamps;                           /* number of reported amplitudes */
     AMPREC a[MAXAMP];                                  /* amplitude records */
+    char elevphase[PHALEN];              /* phase of cached elevation terms */
+    double elevvel;                       /* cached surface velocity [km/s] */
+    double elevfactor;                   /* cached StaElev / (1000 elevvel) */
+    int bpset;                   /* 1 if a bounce point elevation is cached */
+    double bplat;                     /* cached bounce point latitude [deg] */
+    double bplon;                    /* cached bounce point longitude [deg] */
+    double bpelev;                    /* cached bounce point elevation [km] */
 } PHAREC;
 /*
  *
@@ -536,6 +588,28 @@ typedef struct PhaseMapRec {
     char ReportedPhase[PHALEN];                           /* reported phase */
     char phase[PHALEN];                                     /* IASPEI phase */
 } PHASEMAP;
+/*
+ *
+ * Phase properties structure (interned phase names)
+ *     phase names known from the model and phase configuration files are
+ *     interned once into small integer codes; the properties below are
+ *     looked up by code instead of scanning the phase lists
+ *
+ */
+typedef struct PhaseProp {
+    char phase[PHALEN];                                       /* phase name */
+    int ttindex;                 /* index in global TT tables or -1 if none */
+    int localttindex;             /* index in local TT tables or -1 if none */
+    int ecindex;        /* EC_COEF index, -1 if none, -2 if delta-dependent */
+    int noresidual;                              /* no-residual phase [0/1] */
+    int firstP;                            /* allowable first P phase [0/1] */
+    int firstPoptional;                     /* optional first P phase [0/1] */
+    int firstS;                            /* allowable first S phase [0/1] */
+    int firstSoptional;                     /* optional first S phase [0/1] */
+    int isP;                  /* P-type phase, including depth phases [0/1] */
+    int isS;                  /* S-type phase, including depth phases [0/1] */
+    int isDepthPhase;                    /* depth phase (pP, sS, ...) [0/1] */
+} PHASEPROP;
 /*
  *
  * A priori measurement error estimates structure
@@ -565,10 +639,27 @@ typedef struct sta_rec {
     double lon;                                                /* longitude */
     double elev;                                               /* elevation */
 } STAREC;
+/*
+ *
+ * run index of a sample vector for O(1) bracketing
+ *     the samples are split into runs that share their end samples; in
+ *     uniform runs the bracket is found arithmetically, in irregular runs
+ *     by binary search
+ *
+ */
+typedef struct RunIndex {
+    int nrun;                                             /* number of runs */
+    int *first;      /* index of the first sample of each run, nrun+1 items */
+    double *step;               /* sample interval of run or 0 if irregular */
+} RUNINDEX;
 /*
  *
  * travel time table structure
  *     TT tables are generated using libtau software
+ *     The bicubic patches hold, for each (delta, depth) cell, the
+ *     coefficients of the spline interpolant inside the cell; 16 per
+ *     quantity, c[4 * a + b] multiplying u^a v^b, where u and v are the
+ *     normalized delta and depth within the cell.
  *
  */
 typedef struct TTtables {
@@ -582,12 +673,179 @@ typedef struct TTtables {
     double **bpdel;        /* depth phase bounce point distance table [deg] */
     double **dtdd;                     /* horizontal slowness table [s/deg] */
     double **dtdh;                        /* vertical slowness table [s/km] */
+    int *cell;   /* bicubic patch of each (delta, depth) cell or -1 if none */
+    double *patch;         /* bicubic patches of tt, dtdd, dtdh [and bpdel] */
+    int npatch;                                /* number of bicubic patches */
+    RUNINDEX *delidx;                        /* run index of deltas or NULL */
+    RUNINDEX *depidx;                        /* run index of depths or NULL */
+    char *map;            /* binary TT file mapping if tables point into it */
+    size_t mapsize;                          /* size of the mapping [bytes] */
+    int pending;            /* 1 if the table is read on first use (lazy) */
 } TT_TABLE;
+/*
+ *
+ * binary travel-time table file (<model>.ttb, written by iLocTTcompile)
+ *     header, nphase directory entries, then the 8-byte aligned arrays of
+ *     each phase in native byte order; the entries hold byte offsets from
+ *     the start of the file. The checksum covers everything after the
+ *     header.
+ *
+ */
+#define TTB_MAGIC "iLocTTB"                           /* binary TT file tag */
+#define TTB_VERSION 1                             /* binary TT file version */
+#define TTB_BYTEORDER 0x01020304                       /* byte order marker */
+typedef struct TTBheader {
+    char magic[8];                                             /* TTB_MAGIC */
+    int version;                                             /* TTB_VERSION */
+    int byteorder;                                         /* TTB_BYTEORDER */
+    int nphase;                                         /* number of phases */
+    int entrysize;                             /* size of a directory entry */
+    char model[24];                                        /* TT model name */
+    long long size;                                    /* file size [bytes] */
+    unsigned long long checksum;                    /* checksum of the body */
+} TTB_HEADER;
+typedef struct TTBentry {
+    char phase[PHALEN];                                            /* phase */
+    int isbounce;                         /* surface reflection or multiple */
+    int ndel;                                 /* number of distance samples */
+    int ndep;                                    /* number of depth samples */
+    int npatch;                                /* number of bicubic patches */
+    long long deltas;                      /* offsets of the arrays [bytes] */
+    long long depths;
+    long long tt;
+    long long dtdd;
+    long long dtdh;
+    long long bpdel;                                   /* 0 if not a bounce */
+    long long cell;
+    long long patch;                                     /* 0 if no patches */
+} TTB_ENTRY;
+/*
+ *
+ * ETOPO bathymetry/elevation grid
+ *     either the nlat x nlon grid read into memory, or read-only mappings
+ *     of the tiled ETOPO file (<EtopoFile>.tiles, written by iLocEtopoTile).
+ *     The tiled file is a header block followed by ETT_TILE x ETT_TILE
+ *     sample tiles, row by row from the north-west corner, in native byte
+ *     order; the tiles at the east and south edges are padded.
+ *
+ */
+#define ETT_MAGIC "iLocETT"                         /* tiled ETOPO file tag */
+#define ETT_VERSION 1                           /* tiled ETOPO file version */
+#define ETT_BYTEORDER 0x01020304                       /* byte order marker */
+#define ETT_TILE 64                                  /* tile edge [samples] */
+#define ETOPOLRU 64               /* max mapped tiles in the per-thread LRU */
+#define ETOPOCELLS 512        /* bounce-point cell cache entries per thread */
+typedef struct ETTheader {
+    char magic[8];                                             /* ETT_MAGIC */
+    int version;                                             /* ETT_VERSION */
+    int byteorder;                                         /* ETT_BYTEORDER */
+    int nlat;                                 /* number of latitude samples */
+    int nlon;                                /* number of longitude samples */
+    int tilesize;                                    /* tile edge [samples] */
+    int ntilelat;                                /* number of rows of tiles */
+    int ntilelon;                             /* number of columns of tiles */
+    int pad;
+    long long size;                                    /* file size [bytes] */
+} ETT_HEADER;
+typedef struct Etopo {
+    int id;                    /* instance number for the per-thread caches */
+    int nlat;                                 /* number of latitude samples */
+    int nlon;                                /* number of longitude samples */
+    short int **grid;                /* nlat x nlon matrix or NULL if tiled */
+    int tilesize;                               /* tile edge [samples] or 0 */
+    int ntilelon;                             /* number of columns of tiles */
+    size_t tilebytes;                                  /* tile size [bytes] */
+    int fd;              /* tiled file if tiles are mapped one by one or -1 */
+    short int *tiles;                  /* first tile in the mapping or NULL */
+    char *map;                          /* tiled ETOPO file mapping or NULL */
+    size_t mapsize;                          /* size of the mapping [bytes] */
+} ETOPO;
+/*
+ *
+ * per-thread LRU of the tiles mapped from tiled ETOPO files
+ *     the LRUs of all threads are kept in a registry, so that FreeEtopo
+ *     can unmap the tiles of a tiled ETOPO file in every thread
+ *
+ */
+typedef struct EtopoLRU {
+    int owner[ETOPOLRU];                 /* ETOPO instance of the tile or 0 */
+    int tile[ETOPOLRU];                                      /* tile number */
+    unsigned long stamp[ETOPOLRU];                      /* time of last use */
+    unsigned long clock;                                     /* use counter */
+    size_t bytes[ETOPOLRU];                         /* mapping size [bytes] */
+    short int *map[ETOPOLRU];                       /* tile mapping or NULL */
+    struct EtopoLRU *next;                      /* next LRU in the registry */
+} ETOPO_LRU;
+/*
+ *
+ * travel time grid structure
+ *     regular (delta, depth) grid of TT table values used by the NA search;
+ *     the grid is shared by the NA sample threads; a depth column of nodes
+ *     is calculated from the TT tables under the lock when first needed and
+ *     published complete, so the threads read the grid without locking
+ *
+ */
+typedef struct TTgrid {
+    double dres;                                /* delta grid spacing [deg] */
+    double zres;                                 /* depth grid spacing [km] */
+    int ndel;                                    /* number of delta samples */
+    int ndep;                                    /* number of depth samples */
+    double **col[MAXTTPHA + MAXLOCALTTPHA];  /* tt, dtdd, dtdh, bpdel nodes */
+    pthread_mutex_t lock;             /* serializes the column calculations */
+    long nnodes;                              /* number of nodes calculated */
+} TT_GRID;
+/*
+ *
+ * per-event travel-time prediction cache
+ *     predictions are keyed on phase code, station, hypocentre and the
+ *     GetTravelTimePrediction flags; the hypocentre is either matched
+ *     exactly or quantized to a tolerance
+ *
+ */
+typedef struct TTcacheEntry {
+    int used;                          /* 1 if the entry holds a prediction */
+    int code;                                                 /* phase code */
+    int flags;               /* iszderiv, is2nderiv, isfirst and UseLocalTT */
+    double key[8];                   /* hypocentre, delta, esaz and station */
+    int ret;                        /* GetTravelTimePrediction return value */
+    char vmod[6];                                 /* travel time table type */
+    double ttime;                       /* travel time with corrections [s] */
+    double dtdd;                             /* horizontal slowness [s/deg] */
+    double dtdh;                                /* vertical slowness [s/km] */
+    double d2tdd;                                /* second time derivatives */
+    double d2tdh;                                /* second time derivatives */
+    double bpdel;                /* depth phase bounce point distance [deg] */
+    double rsttPickErr;                              /* RSTT pick error [s] */
+    double rsttTotalErr;    /* RSTT path-dependent (model + pick) error [s] */
+} TT_CACHE_ENTRY;
+typedef struct TTcache {
+    double tol;             /* hypocentre tolerance [km], 0 for exact match */
+    int size;                                     /* number of entries, 2^n */
+    TT_CACHE_ENTRY *entry;                                    /* hash table */
+    long nlookup;                                      /* number of lookups */
+    long nhit;                                            /* number of hits */
+    long nevict;                                     /* number of evictions */
+} TT_CACHE;
+/*
+ *
+ * station correction cache counters
+ *     the elevation correction terms of a (station, phase) and the bounce
+ *     point elevation of a depth phase are cached in the phase record
+ *
+ */
+typedef struct CorrStats {
+    long nelev;                  /* elevation corrections from cached terms */
+    long nelevcalc;                /* elevation correction terms calculated */
+    long nbounce;               /* bounce corrections with cached elevation */
+    long nbouncecalc;                  /* bounce point elevations looked up */
+} CORR_STATS;
 /*
  *
  * ak135 ellipticity correction coefficients structure
  *     Note: the tau corrections are stored at 5 degree intervals in distance
  *           and at the depths 0, 100, 200, 300, 500, 700 km.
+ *           The t0, t1 and t2 coefficients of distance sample i and depth
+ *           sample j are tau[3 * (i * numDepthSamples + j) + 0, 1, 2].
  *
  */
 typedef struct ec_coef {
@@ -598,9 +856,7 @@ typedef struct ec_coef {
     double maxdist;                               /* maximum distance [deg] */
     double depth[6];                                  /* depth samples [km] */
     double *delta;                                /* distance samples [deg] */
-    double **t0;                                         /* t0 coefficients */
-    double **t1;                                         /* t1 coefficients */
-    double **t2;                                         /* t2 coefficients */
+    double *tau;                   /* t0, t1, t2 interleaved at each sample */
 } EC_COEF;
 /*
  *
@@ -623,6 +879,8 @@ typedef struct NASearchspace {
     int epifix, otfix, depfix;                     /* fixed parameter flags */
     double lat, lon, ot, depth;                   /* center point of search */
     double lpnorm;         /* p = [1,2] for L1, L2 norm or anything between */
+    double epirange;                           /* search radius around epi */
+    double otrange;                            /* search radius around OT */
     double range[NA_MAXND][2];                       /* search space limits */
     double ranget[NA_MAXND][2];           /* normalized search space limits */
     double scale[NA_MAXND+1];                                    /* scaling */
@@ -701,6 +959,74 @@ typedef struct velmodel {
     int imoho;
 } VMODEL;
 
+/*
+ *
+ * Locator context
+ *    event-level configuration and state, error state and the aux data
+ *    needed to locate an event; each concurrent location gets its own
+ *
+ *    The context does not replace the event-level globals. The fields
+ *    from verbose to t0 are snapshots: the travel-time and phase
+ *    identification routines still read them from the THREADLOCAL
+ *    globals of the same name, so a context takes effect only when it
+ *    is bound to a thread. SetContext copies them to the globals of the
+ *    calling thread and GetContext copies them back. Locator binds
+ *    its context on entry and takes the snapshot on exit, so while an
+ *    event is located the globals are current and these fields may be
+ *    stale; refresh a copy with GetContext before handing it to other
+ *    threads. The cache counters and the aux data live in the context
+ *    only.
+ *
+ */
+typedef struct iloc_context {
+/*
+ *  event-level configuration (config file defaults overridden by instructions)
+ *      snapshot of the thread-local globals
+ */
+    int verbose;                                           /* verbose level */
+    int DoCorrelatedErrors;                            /* correlated errors */
+    int DoGridSearch;                                  /* initial NA search */
+    double NAsearchRadius;                              /* NA search radius */
+    double NAsearchOT;                                   /* NA OT range (s) */
+    long iseed;                                       /* random number seed */
+    int UseLocalTT;                             /* use local TT predictions */
+    double Moho;                                              /* Moho depth */
+    double Conrad;                                          /* Conrad depth */
+/*
+ *  state carried from event to event
+ *      snapshot of the thread-local globals
+ */
+    double PrevLat;                                   /* previous epicentre */
+    double PrevLon;                                   /* previous epicentre */
+/*
+ *  error state and diagnostics
+ *      errorcode, logfp and t0 are snapshots of the thread-local globals
+ */
+    int errorcode;                                            /* error code */
+    FILE *logfp;                                        /* log file pointer */
+    struct timeval t0;                                 /* wall clock start */
+    long TTcacheLookups;                    /* TT cache lookups, all events */
+    long TTcacheHits;                          /* TT cache hits, all events */
+    CORR_STATS CorrStats;          /* correction cache counters, all events */
+/*
+ *  aux data (shared read-only, except for dynamic local TT tables)
+ */
+    int ismbQ;                              /* apply magnitude attenuation? */
+    MAGQ *mbQ;                               /* magnitude attenuation table */
+    EC_COEF *ec;                     /* ellipticity correction coefficients */
+    int numECPhases;          /* number of phases with ellipticity correction */
+    TT_TABLE *TTtables;                        /* global travel-time tables */
+    TT_TABLE *LocalTTtables;                    /* local travel-time tables */
+    VARIOGRAM *variogram;                        /* generic variogram model */
+    double gres;                                  /* default depth grid res */
+    int ngrid;                               /* number of default depth grid */
+    double **DepthGrid;                               /* default depth grid */
+    FE *fe;                       /* Flinn-Engdahl geographic region numbers */
+    double *GrnDepth;                              /* default depths by grn */
+    ETOPO *topo;                              /* ETOPO bathymetry/elevation */
+    int *nref;             /* libiloc contexts sharing the aux data, if any */
+} ILOC_CONTEXT;
+
 /*
  *
  * function declarations
@@ -710,6 +1036,12 @@ typedef struct velmodel {
  * iLocCluster.c
  */
 int HierarchicalCluster(int nsta, double **distmatrix, STAORDER staorder[]);
+/*
+ * iLocContext.c
+ */
+void InitContext(ILOC_CONTEXT *ctx);
+void GetContext(ILOC_CONTEXT *ctx);
+void SetContext(ILOC_CONTEXT *ctx);
 /*
  * iLocDataCovariance.c
  */
@@ -719,6 +1051,9 @@ int GetStationIndex(int nsta, STAREC stalist[], char *sta);
 double **GetDistanceMatrix(int nsta, STAREC stalist[]);
 double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
         STAREC stalist[], double **distmatrix, VARIOGRAM *variogramp);
+int FillDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
+        STAREC stalist[], int staind[], double **distmatrix,
+        VARIOGRAM *variogramp, double **dcov);
 int ReadVariogram(char *fname, VARIOGRAM *variogramp);
 void FreeVariogram(VARIOGRAM *variogramp);
 /*
@@ -727,7 +1062,7 @@ void FreeVariogram(VARIOGRAM *variogramp);
 int DepthResolution(SOLREC *sp, READING *rdindx, PHAREC p[], int isverbose);
 int DepthPhaseCheck(SOLREC *sp, READING *rdindx, PHAREC p[], int isverbose);
 int DepthPhaseStack(SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
-        short int **topo);
+        ETOPO *topo);
 /*
  * iLocDistAzimuth.c
  */
@@ -740,9 +1075,20 @@ void PointAtDeltaAzimuth(double lat1, double lon1, double delta, double azim,
  * iLocEllipticityCorrection.c
  */
 EC_COEF *ReadEllipticityCorrectionTable(int *numECPhases, char *filename);
+int ECPhaseIndex(char *phase, double delta);
 void FreeEllipticityCorrectionTable(EC_COEF *ec, int numECPhases);
 double GetEllipticityCorrection(EC_COEF *ec, char *phase, double ecolat,
         double delta, double depth, double esaz);
+void GetEllipticityCorrections(EC_COEF *ec, double ecolat, double depth,
+        int numPhase, PHAREC p[], double *tcor);
+/*
+ * iLocEtopo.c
+ */
+ETOPO *ReadEtopo1(char *filename);
+void FreeEtopo(ETOPO *topo);
+void FreeEtopoTiles(void);
+int WriteEtopoTiles(char *fname, ETOPO *topo);
+double GetEtopoElevation(double lat, double lon, ETOPO *topo);
 /*
  * iLocGregion.c
  */
@@ -770,8 +1116,20 @@ double SplineInterpolation(double xp, int n, double *x, double *y, double *d2y,
         int isderiv, double *dydx, double *d2ydx);
 void FloatBracket(double xp, int n, double *x, int *jlo, int *jhi);
 void IntegerBracket(int xp, int n, int *x, int *jlo, int *jhi);
+RUNINDEX *BuildRunIndex(int n, double *x);
+void FreeRunIndex(RUNINDEX *runidx);
+void RunBracket(RUNINDEX *runidx, double xp, int n, double *x,
+        int *jlo, int *jhi);
 double BilinearInterpolation(double xp1, double xp2, int nx1, int nx2,
         double *x1, double *x2, double **y);
+/*
+ * iLocLibrary.c
+ */
+ILOC_CONTEXT *iloc_init(char *auxdir);
+ILOC_CONTEXT *iloc_copy(ILOC_CONTEXT *ctx);
+int iloc_locate(ILOC_CONTEXT *ctx, EVREC *e, HYPREC h[], PHAREC p[],
+        SOLREC *s);
+void iloc_free(ILOC_CONTEXT *ctx);
 /*
  * iLocLocalTT.c
  */
@@ -784,22 +1142,18 @@ double GetdUGapSgap(int nsta, double *esaz, double *gap, double *sgap);
 /*
  * iLocLocator.c
  */
-int Locator(int isf, int database, int *total, int *fail, int *opt, EVREC *e,
-        HYPREC h[], SOLREC *s, PHAREC p[], int ismbQ, MAGQ *mbQ, EC_COEF *ec,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtables[], VARIOGRAM *variogram,
-        double gres, int ngrid, double **DepthGrid, FE *fe, double *GrnDepth,
-        short int **topo, FILE *isfout, char *magbloc);
+int Locator(ILOC_CONTEXT *ctx, int isf, int database, int *total, int *fail,
+        int *opt, EVREC *e, HYPREC h[], SOLREC *s, PHAREC p[], FILE *isfout,
+        char *magbloc);
 void Synthetic(EVREC *ep, HYPREC *hp, SOLREC *sp, READING *rdindx, PHAREC p[],
         EC_COEF *ec, TT_TABLE *TTtables, TT_TABLE *LocalTTtables[],
-        short int **topo, int database, int isf);
+        ETOPO *topo, int database, int isf);
 void ResidualsForFixedHypocenter(EVREC *ep, HYPREC *hp, SOLREC *sp,
         READING *rdindx, PHAREC p[], EC_COEF *ec, TT_TABLE *TTtables,
-        TT_TABLE *LocalTTtables[], short int **topo);
-int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
-        READING *rdindx, PHAREC p[], EC_COEF *ec, TT_TABLE *TTtables,
-        TT_TABLE *LocalTTtable, STAREC stalist[], double **distmatrix,
-        VARIOGRAM *variogramp, STAORDER staorder[], short int **topo,
-        int is2nderiv);
+        TT_TABLE *LocalTTtables[], ETOPO *topo);
+int LocateEvent(ILOC_CONTEXT *ctx, int option, int nsta, int has_depdpres,
+        SOLREC *sp, READING *rdindx, PHAREC p[], STAREC stalist[],
+        double **distmatrix, STAORDER staorder[], int is2nderiv);
 int GetPhaseList(int numPhase, PHAREC p[], PHASELIST plist[]);
 void FreePhaseList(int nphases, PHASELIST plist[]);
 void Readings(int numPhase, int nreading, PHAREC p[], READING *rdindx);
@@ -812,27 +1166,33 @@ int ReadMagnitudeQ(char *filename, MAGQ * magq);
 /*
  * iLocNA.c
  */
-int SetNASearchSpace(SOLREC *sp, NASPACE *nasp);
-int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
-        TT_TABLE *LocalTTtable, EC_COEF *ec, short int **topo, STAREC stalist[],
-        double **distmatrix, VARIOGRAM *variogramp, STAORDER staorder[],
+int SetNASearchSpace(ILOC_CONTEXT *ctx, SOLREC *sp, NASPACE *nasp);
+int NASearch(ILOC_CONTEXT *ctx, int nsta, SOLREC *sp, PHAREC p[],
+        STAREC stalist[], double **distmatrix, STAORDER staorder[],
         NASPACE *nasp, char *filename, int is2nderiv);
+/*
+ * iLocPhaseCodes.c
+ */
+void InitPhaseCodes(void);
+int PhaseCode(char *phase);
+PHASEPROP *GetPhaseProperties(char *phase);
+void GetPhaseType(PHAREC *pp, int *isP, int *isS, int *isdepth);
+int isNoResidualPhase(char *phase);
 /*
  * iLocPhaseIdentification.c
  */
 int IdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, short int **topo,
+        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, ETOPO *topo,
         int *is2nderiv);
 int ReIdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, short int **topo,
+        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, ETOPO *topo,
         int is2nderiv);
 void IdentifyPFAKE(SOLREC *sp, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, short int **topo);
+        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, ETOPO *topo);
 void RemovePFAKE(SOLREC *sp, PHAREC p[]);
-int DuplicatePhases(SOLREC *sp, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, short int **topo);
+int DuplicatePhases(ILOC_CONTEXT *ctx, SOLREC *sp, PHAREC p[]);
 void ResidualsForReportedPhases(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, short int **topo);
+        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, ETOPO *topo);
 int NumTimeDef(int numPha, PHAREC p[]);
 /*
  * iLocPhaseOrder.c
@@ -841,6 +1201,11 @@ void SortPhasesFromISF(int numPhase, PHAREC p[]);
 void SortPhasesFromDatabase(int numPhase, PHAREC p[]);
 void SortPhasesForNA(int numPhase, int nsta, PHAREC p[], STAREC stalist[],
         STAORDER staorder[]);
+/*
+ * iLocServer.c
+ */
+int ServeLocator(char *sockpath, int isf, int nthreads, int maxchild,
+        char *auxdir, char *homedir, STAREC stalist[], ILOC_CONTEXT *ctx);
 /*
  * iLocSVD.c
  */
@@ -855,6 +1220,13 @@ double SVDnorm(int m, double sv[], double thres, double *cond);
 int ProjectionMatrix(int numPhase, PHAREC p[], int nd, double pctvar,
         double **cov, double **w, int *prank, int nunp, char **phundef,
         int ispchange);
+/*
+ * iLocThreads.c
+ */
+int BatchLocator(int nthreads, int isf, FILE *isfin, FILE *isfout, FILE *kml,
+        int isbull, EVREC *ep, STAREC stalist[], ILOC_CONTEXT *ctx,
+        int *total, int *fail, int *opt);
+int DeferISFOutput(SOLREC *s, STAMAG **stamag, STAMAG **rdmag, int grn);
 /*
  * iLocTimeFuncs.c
  */
@@ -870,22 +1242,35 @@ double ReadHumanTime(char *timestr);
  * iLocTravelTimes.c
  */
 TT_TABLE *ReadTTtables(char *dirname);
+int ReadTTtableFile(char *fname, TT_TABLE *tt_tablep);
+int WriteTTbinary(char *fname, char *model, TT_TABLE *tt_tables, int ntab);
+int MapTTbinary(char *fname, char *model, TT_TABLE *tt_tables, int ntab,
+        char phases[][PHALEN]);
+unsigned long long TTBchecksum(char *buf, size_t len, unsigned long long hash);
 void FreeTTtables(TT_TABLE *TTtables);
 void FreeLocalTTtables(TT_TABLE *TTtables);
-short int **ReadEtopo1(char *filename);
 int GetPhaseIndex(char *phase);
+int GetTTtableIndex(TT_TABLE *tt_tables, char *phase);
+int LoadTTtable(TT_TABLE *tt_tablep);
 int GetLocalPhaseIndex(char *phase);
 int TravelTimeResiduals(SOLREC *sp, PHAREC p[], char mode[4], EC_COEF *ec,
         TT_TABLE *TTtables, TT_TABLE *LocalTTtable,
-        short int **topo, int iszderiv, int is2nderiv);
+        ETOPO *topo, int iszderiv, int is2nderiv);
 int GetTravelTimePrediction(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
         TT_TABLE *TTtables, TT_TABLE *LocalTTtable,
-        short int **topo, int iszderiv, int isfirst, int is2nderiv);
+        ETOPO *topo, int iszderiv, int isfirst, int is2nderiv);
 double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
         int iszderiv, double *dtdd, double *dtdh, double *bpdel,
         int is2nderiv, double *d2tdd, double *d2tdh);
 double GetEtopoCorrection(int ips, double rayp, double bplat, double bplon,
-        short int **topo, double *tcorw);
+        ETOPO *topo, double *tcorw);
+int BicubicTTpatches(TT_TABLE *tt_tablep);
+TT_GRID *AllocateTTgrid(double dres, double zres);
+void FreeTTgrid(TT_GRID *ttgrid);
+TT_CACHE *AllocateTTcache(int numPhase, double tol);
+void ResetTTcache(TT_CACHE *ttcache);
+void FreeTTcache(TT_CACHE *ttcache);
+void ResetCorrectionCache(int numPhase, PHAREC p[]);
 /*
  * iLocUncertainties.c
  */
@@ -905,6 +1290,13 @@ void FreeLongMatrix(unsigned long **matrix);
 void Free(void *ptr);
 int CompareInt(const void *x, const void *y);
 int CompareDouble(const void *x, const void *y);
+/*
+ * iLocWorkers.c
+ */
+int PreforkWorkers(int nworkers, FILE *instructfp, int *total, int *fail,
+        int *opt);
+ssize_t GetInstructionLine(char **line, size_t *nbytes, FILE *instructfp);
+int ReportToSupervisor(int total, int fail, int *opt);
 /*
  *
  * I/O functions, text files
@@ -928,7 +1320,7 @@ int ReadInstructionFile(char *instruction, EVREC *ep, int isf,
  */
 int ReadAuxDataFiles(char *auxdir, int *ismbQ, MAGQ *mbQp, FE *fep,
         double **GrnDepth, double *gres, int *ngrid, double ***DepthGrid,
-        short int ***topo, int *numECPhases, EC_COEF *ec[],
+        ETOPO **topo, int *numECPhases, EC_COEF *ec[],
         TT_TABLE *TTtables[], VARIOGRAM *variogramp);
 /*
  * ISF/ISF2: iLocReadISF.c, iLocWriteISF.c
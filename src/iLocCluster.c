@@ -28,7 +28,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
+extern THREADLOCAL int verbose;
 
 /*
  *
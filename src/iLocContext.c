@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "iLoc.h"
+
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
+extern THREADLOCAL int errorcode;
+extern THREADLOCAL struct timeval t0;
+extern THREADLOCAL double Moho;                                 /* Moho depth */
+extern THREADLOCAL double Conrad;                             /* Conrad depth */
+extern THREADLOCAL int DoCorrelatedErrors;          /* correlated errors */
+extern THREADLOCAL int DoGridSearch;                   /* initial NA search */
+extern THREADLOCAL double NAsearchRadius;               /* NA search radius */
+extern THREADLOCAL double NAsearchOT;                    /* NA OT range (s) */
+extern THREADLOCAL long iseed;                          /* random number seed */
+extern THREADLOCAL int UseLocalTT;                /* use local TT predictions */
+extern THREADLOCAL double PrevLat;                      /* previous epicentre */
+extern THREADLOCAL double PrevLon;                      /* previous epicentre */
+
+/*
+ * Functions:
+ *    InitContext
+ *    GetContext
+ *    SetContext
+ */
+
+/*
+ *  Title:
+ *     InitContext
+ *  Synopsis:
+ *     Initializes a locator context from the event-level state of the
+ *     calling thread. The aux data pointers are left to the caller.
+ *  Output Arguments:
+ *     ctx - pointer to ILOC_CONTEXT structure
+ *  Called by:
+ *     main
+ *  Calls:
+ *     GetContext
+ */
+void InitContext(ILOC_CONTEXT *ctx)
+{
+    memset(ctx, 0, sizeof(ILOC_CONTEXT));
+    GetContext(ctx);
+}
+
+/*
+ *  Title:
+ *     GetContext
+ *  Synopsis:
+ *     Copies the event-level state of the calling thread into a context.
+ *     Only the fields mirrored by thread-local globals are set; the cache
+ *     counters and the aux data of the context are left untouched.
+ *  Output Arguments:
+ *     ctx - pointer to ILOC_CONTEXT structure
+ *  Called by:
+ *     main, InitContext, Locator, NASearch, NASampleWorker
+ */
+void GetContext(ILOC_CONTEXT *ctx)
+{
+    ctx->verbose = verbose;
+    ctx->DoCorrelatedErrors = DoCorrelatedErrors;
+    ctx->DoGridSearch = DoGridSearch;
+    ctx->NAsearchRadius = NAsearchRadius;
+    ctx->NAsearchOT = NAsearchOT;
+    ctx->iseed = iseed;
+    ctx->UseLocalTT = UseLocalTT;
+    ctx->Moho = Moho;
+    ctx->Conrad = Conrad;
+    ctx->PrevLat = PrevLat;
+    ctx->PrevLon = PrevLon;
+    ctx->errorcode = errorcode;
+    ctx->logfp = logfp;
+    ctx->t0 = t0;
+}
+
+/*
+ *  Title:
+ *     SetContext
+ *  Synopsis:
+ *     Binds a context to the calling thread: the travel-time and phase
+ *     identification routines that are not context-aware read the
+ *     event-level state from thread-local variables.
+ *  Input Arguments:
+ *     ctx - pointer to ILOC_CONTEXT structure
+ *  Called by:
+ *     Locator, BatchWorker, BatchWriter, NASampleWorker
+ */
+void SetContext(ILOC_CONTEXT *ctx)
+{
+    verbose = ctx->verbose;
+    DoCorrelatedErrors = ctx->DoCorrelatedErrors;
+    DoGridSearch = ctx->DoGridSearch;
+    NAsearchRadius = ctx->NAsearchRadius;
+    NAsearchOT = ctx->NAsearchOT;
+    iseed = ctx->iseed;
+    UseLocalTT = ctx->UseLocalTT;
+    Moho = ctx->Moho;
+    Conrad = ctx->Conrad;
+    PrevLat = ctx->PrevLat;
+    PrevLon = ctx->PrevLon;
+    errorcode = ctx->errorcode;
+    logfp = ctx->logfp;
+    t0 = ctx->t0;
+}
@@ -28,10 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 
 /*
  * Functions:
@@ -40,6 +40,7 @@ extern int errorcode;
  *    GetDistanceMatrix
  *    GetStationIndex
  *    GetDataCovarianceMatrix
+ *    FillDataCovarianceMatrix
  *    ReadVariogram
  *    FreeVariogram
  */
@@ -220,12 +221,41 @@ int GetStationIndex(int nsta, STAREC stalist[], char *sta)
     return -1;
 }
 
+/*
+ *  Title:
+ *     PhaseStationIndex
+ *  Synopsis:
+ *     Returns index of the station of a phase in the stalist array
+ *     Uses the precomputed station indices when available.
+ *  Input Arguments:
+ *     nsta      - number of distinct stations
+ *     stalist[] - array of starec structures
+ *     staind[]  - station index of each phase in stalist, or NULL
+ *     p[]       - array of phase structures
+ *     i         - phase index
+ *  Return:
+ *     station index or -1 on error
+ *  Called by:
+ *     FillDataCovarianceMatrix
+ *  Calls:
+ *     GetStationIndex
+ */
+static int PhaseStationIndex(int nsta, STAREC stalist[], int staind[],
+                             PHAREC p[], int i)
+{
+    if (staind)
+        return staind[i];
+    return GetStationIndex(nsta, stalist, p[i].prista);
+}
+
 /*
  *  Title:
  *     GetDataCovarianceMatrix
  *  Synopsis:
  *     Constructs full data covariance matrix from variogram (model errors)
  *     and prior phase variances (measurement errors)
+ *     Phases are compared by the phase codes set at phase identification;
+ *     every phase with a prior measurement error has a phase code.
  *  Input Arguments:
  *     nsta       - number of distinct stations
  *     numPhase   - number of associated phases
@@ -239,15 +269,12 @@ int GetStationIndex(int nsta, STAREC stalist[], char *sta)
  *  Called by:
  *     LocateEvent, NASearch
  *  Calls:
- *     AllocateFloatMatrix, FreeFloatMatrix, GetStationIndex,
- *     SplineInterpolation
+ *     AllocateFloatMatrix, FreeFloatMatrix, FillDataCovarianceMatrix
  */
 double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
                                 STAREC stalist[], double **distmatrix,
                                 VARIOGRAM *variogramp)
 {
-    int i, j, k, m, sind1 = 0, sind2 = 0;
-    double stasep = 0., var = 0., dydx = 0., d2ydx = 0.;
     double **dcov = (double **)NULL;
 /*
  *  allocate memory for dcov
@@ -258,6 +285,49 @@ double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
         errorcode = 1;
         return (double **)NULL;
     }
+    if (FillDataCovarianceMatrix(nsta, numPhase, nd, p, stalist, (int *)NULL,
+                                 distmatrix, variogramp, dcov)) {
+        FreeFloatMatrix(dcov);
+        return (double **)NULL;
+    }
+    return dcov;
+}
+
+/*
+ *  Title:
+ *     FillDataCovarianceMatrix
+ *  Synopsis:
+ *     Constructs full data covariance matrix from variogram (model errors)
+ *     and prior phase variances (measurement errors) in a caller-owned
+ *     nd x nd matrix, so that the NA can reuse one matrix per thread.
+ *  Input Arguments:
+ *     nsta       - number of distinct stations
+ *     numPhase   - number of associated phases
+ *     nd         - number of defining phases
+ *     p[]        - array of phase structures
+ *     stalist[]  - array of starec structures
+ *     staind[]   - station index of each phase in stalist, or NULL
+ *     distmatrix - matrix of station separations
+ *     variogramp - pointer to generic variogram model
+ *  Output Arguments:
+ *     dcov       - data covariance matrix
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     GetDataCovarianceMatrix, NAForwardProblem
+ *  Calls:
+ *     PhaseStationIndex, SplineInterpolation
+ */
+int FillDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
+                             STAREC stalist[], int staind[],
+                             double **distmatrix, VARIOGRAM *variogramp,
+                             double **dcov)
+{
+    int i, j, k, m, sind1 = 0, sind2 = 0;
+    double stasep = 0., var = 0., dydx = 0., d2ydx = 0.;
+    for (k = 0; k < nd; k++)
+        for (m = 0; m < nd; m++)
+            dcov[k][m] = 0.;
 /*
  *  construct data covariance matrix from variogram and prior measurement
  *  error variances
@@ -267,9 +337,8 @@ double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
  *      arrival time
  */
         if (p[i].timedef) {
-            if ((sind1 = GetStationIndex(nsta, stalist, p[i].prista)) < 0) {
-                FreeFloatMatrix(dcov);
-                return (double **)NULL;
+            if ((sind1 = PhaseStationIndex(nsta, stalist, staind, p, i)) < 0) {
+                return 1;
             }
 /*
  *          prior picking error variances add to the diagonal
@@ -294,13 +363,12 @@ double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
 /*
  *              different phases have different ray paths so they do not correlate
  */
-                if (strcmp(p[i].phase, p[j].phase)) {
+                if (p[i].phcode != p[j].phcode || p[i].phcode < 0) {
                     m++;
                     continue;
                 }
-                if ((sind2 = GetStationIndex(nsta, stalist, p[j].prista)) < 0) {
-                    FreeFloatMatrix(dcov);
-                    return (double **)NULL;
+                if ((sind2 = PhaseStationIndex(nsta, stalist, staind, p, j)) < 0) {
+                    return 1;
                 }
 /*
  *              station separation
@@ -336,9 +404,8 @@ double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
  *      azimuth
  */
         if (p[i].azimdef) {
-            if ((sind1 = GetStationIndex(nsta, stalist, p[i].prista)) < 0) {
-                FreeFloatMatrix(dcov);
-                return (double **)NULL;
+            if ((sind1 = PhaseStationIndex(nsta, stalist, staind, p, i)) < 0) {
+                return 1;
             }
 /*
  *          prior picking error variances add to the diagonal
@@ -357,13 +424,12 @@ double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
 /*
  *              different phases have different ray paths so they do not correlate
  */
-                if (strcmp(p[i].phase, p[j].phase)) {
+                if (p[i].phcode != p[j].phcode || p[i].phcode < 0) {
                     m++;
                     continue;
                 }
-                if ((sind2 = GetStationIndex(nsta, stalist, p[j].prista)) < 0) {
-                    FreeFloatMatrix(dcov);
-                    return (double **)NULL;
+                if ((sind2 = PhaseStationIndex(nsta, stalist, staind, p, j)) < 0) {
+                    return 1;
                 }
 /*
  *              station separation
@@ -399,9 +465,8 @@ double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
  *      slowness
  */
         if (p[i].slowdef) {
-            if ((sind1 = GetStationIndex(nsta, stalist, p[i].prista)) < 0) {
-                FreeFloatMatrix(dcov);
-                return (double **)NULL;
+            if ((sind1 = PhaseStationIndex(nsta, stalist, staind, p, i)) < 0) {
+                return 1;
             }
 /*
  *          prior picking error variances add to the diagonal
@@ -420,13 +485,12 @@ double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
 /*
  *              different phases have different ray paths so they do not correlate
  */
-                if (strcmp(p[i].phase, p[j].phase)) {
+                if (p[i].phcode != p[j].phcode || p[i].phcode < 0) {
                     m++;
                     continue;
                 }
-                if ((sind2 = GetStationIndex(nsta, stalist, p[j].prista)) < 0) {
-                    FreeFloatMatrix(dcov);
-                    return (double **)NULL;
+                if ((sind2 = PhaseStationIndex(nsta, stalist, staind, p, j)) < 0) {
+                    return 1;
                 }
 /*
  *              station separation
@@ -487,7 +551,7 @@ double **GetDataCovarianceMatrix(int nsta, int numPhase, int nd, PHAREC p[],
             }
         }
     }
-    return dcov;
+    return 0;
 }
 
 /*
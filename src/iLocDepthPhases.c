@@ -28,10 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 extern int numAgencies;
 extern char agencies[MAXBUF][AGLEN];
 extern double MaxHypocenterDepth;
@@ -51,7 +51,7 @@ extern double MaxHypocenterDepth;
  */
 static int PhaseTTh(double delta, double esaz, SOLREC *sp,
                       TT_TABLE *tt_tablep, TT_TABLE *Pfirst,
-                      short int **topo, int ips, int ispwP, double *pt);
+                      ETOPO *topo, int ips, int ispwP, double *pt);
 static void Stacker(int n, double moveout, double deltim,
                     double *pt, double *tz, double *depths,
                     double *pp, int *trace, int *stack);
@@ -362,10 +362,10 @@ int DepthPhaseCheck(SOLREC *sp, READING *rdindx, PHAREC p[], int isverbose)
  *  Called by:
  *     Locator
  *  Calls:
- *     GetPhaseIndex, PhaseTTh, Stacker, Free
+ *     GetTTtableIndex, PhaseTTh, Stacker, Free
  */
 int DepthPhaseStack(SOLREC *sp, PHAREC p[], TT_TABLE *tt_tables,
-                      short int **topo)
+                      ETOPO *topo)
 {
     int i, j, k, m, n, ndep = 0, ndel = 0, ndp = 0, ns = 0;
     int prev_rdid = 0, med = 0, d = 0, dlo = 0, dhi = 0;
@@ -430,12 +430,12 @@ int DepthPhaseStack(SOLREC *sp, PHAREC p[], TT_TABLE *tt_tables,
  *      get phase indexes
  */
         ipP = ipwP = ipS = isP = isS = 0;
-        if ((iP = GetPhaseIndex(p[i].phase)) < 0)
+        if ((iP = GetTTtableIndex(tt_tables, p[i].phase)) < 0)
             continue;
         if (p[i].pPindex) {
             k = p[i].pPindex;
             if (!p[k].timedef || p[k].duplicate) continue;
-            ipP = max(0, GetPhaseIndex(p[k].phase));
+            ipP = max(0, GetTTtableIndex(tt_tables, p[k].phase));
             if (ipP) {
                 n = tt_tables[ipP].ndel;
                 if (delta < tt_tables[ipP].deltas[0] ||
@@ -446,7 +446,7 @@ int DepthPhaseStack(SOLREC *sp, PHAREC p[], TT_TABLE *tt_tables,
         if (p[i].pwPindex) {
             k = p[i].pwPindex;
             if (!p[k].timedef || p[k].duplicate) continue;
-            ipwP = max(0, GetPhaseIndex(p[k].phase));
+            ipwP = max(0, GetTTtableIndex(tt_tables, p[k].phase));
             if (ipwP) {
                 n = tt_tables[ipwP].ndel;
                 if (delta < tt_tables[ipwP].deltas[0] ||
@@ -457,7 +457,7 @@ int DepthPhaseStack(SOLREC *sp, PHAREC p[], TT_TABLE *tt_tables,
         if (p[i].pSindex) {
             k = p[i].pSindex;
             if (!p[k].timedef || p[k].duplicate) continue;
-            ipS = max(0, GetPhaseIndex(p[k].phase));
+            ipS = max(0, GetTTtableIndex(tt_tables, p[k].phase));
             if (ipS) {
                 n = tt_tables[ipS].ndel;
                 if (delta < tt_tables[ipS].deltas[0] ||
@@ -468,7 +468,7 @@ int DepthPhaseStack(SOLREC *sp, PHAREC p[], TT_TABLE *tt_tables,
         if (p[i].sPindex) {
             k = p[i].sPindex;
             if (!p[k].timedef || p[k].duplicate) continue;
-            isP = max(0, GetPhaseIndex(p[k].phase));
+            isP = max(0, GetTTtableIndex(tt_tables, p[k].phase));
             if (isP) {
                 n = tt_tables[isP].ndel;
                 if (delta < tt_tables[isP].deltas[0] ||
@@ -479,7 +479,7 @@ int DepthPhaseStack(SOLREC *sp, PHAREC p[], TT_TABLE *tt_tables,
         if (p[i].sSindex) {
             k = p[i].sSindex;
             if (!p[k].timedef || p[k].duplicate) continue;
-            isS = max(0, GetPhaseIndex(p[k].phase));
+            isS = max(0, GetTTtableIndex(tt_tables, p[k].phase));
             if (isS) {
                 n = tt_tables[isS].ndel;
                 if (delta < tt_tables[isS].deltas[0] ||
@@ -716,11 +716,11 @@ int DepthPhaseStack(SOLREC *sp, PHAREC p[], TT_TABLE *tt_tables,
  *  Called by:
  *     DepthPhaseStack
  *  Calls:
- *     FloatBracket, SplineCoeffs, SplineInterpolation, PointAtDeltaAzimuth,
+ *     RunBracket, SplineCoeffs, SplineInterpolation, PointAtDeltaAzimuth,
  *     GetEtopoCorrection
  */
 static int PhaseTTh(double delta, double esaz, SOLREC *sp, TT_TABLE *tt_tablep,
-            TT_TABLE *Pfirst, short int **topo, int ips, int ispwP, double *pt)
+            TT_TABLE *Pfirst, ETOPO *topo, int ips, int ispwP, double *pt)
 {
     int i, j, k, m, exactdelta = 0;
     int ilo = 0, ihi = 0, jlo = 0, jhi = 0, idel = 0, jdel = 0;
@@ -736,7 +736,8 @@ static int PhaseTTh(double delta, double esaz, SOLREC *sp, TT_TABLE *tt_tablep,
 /*
  *  delta range
  */
-    FloatBracket(delta, ndel, tt_tablep->deltas, &ilo, &ihi);
+    RunBracket(tt_tablep->delidx, delta, ndel, tt_tablep->deltas,
+               &ilo, &ihi);
     if (fabs(delta - tt_tablep->deltas[ilo]) < DEPSILON) {
         idel = ilo;
         exactdelta = 1;
@@ -758,7 +759,7 @@ static int PhaseTTh(double delta, double esaz, SOLREC *sp, TT_TABLE *tt_tablep,
             ilo = ihi - DELTA_SAMPLES;
         }
     }
-    FloatBracket(delta, jndel, Pfirst->deltas, &jlo, &jhi);
+    RunBracket(Pfirst->delidx, delta, jndel, Pfirst->deltas, &jlo, &jhi);
     if (fabs(delta - Pfirst->deltas[jlo]) < DEPSILON) {
         jdel = jlo;
     }
@@ -28,7 +28,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
+extern THREADLOCAL int verbose;
 
 /*
  * Functions:
@@ -92,7 +92,7 @@ double DistAzimuth(double slat, double slon, double elat, double elon,
     double cslat = 0., sslat = 0., cdlon = 0., sdlon = 0., rdlon = 0.;
     double geoc_slat = 0., geoc_elat = 0.;
     double xazi = 0., xbaz = 0., yazi = 0., ybaz = 0., delta = 0., cdel = 0.;
-    static double celat = 0., selat = 0.;
+    double celat = 0., selat = 0.;
     double f = (1. - FLATTENING) * (1. - FLATTENING);
     if (fabs(slat - elat) < DEPSILON && fabs(slon - elon) < DEPSILON) {
         delta = 0.0;
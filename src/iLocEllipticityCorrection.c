@@ -28,23 +28,28 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 
 /*
  * Functions:
  *    GetEllipticityCorrection
+ *    GetEllipticityCorrections
+ *    ECPhaseIndex
  *    ReadEllipticityCorrectionTable
  *    FreeEllipticityCorrectionTable
  */
 
 /*
- * Local functions:
- *    ECPhaseIndex
+ * Local functions
+ *    ECColatitudeTerms
+ *    ECTauInterpolation
  */
-static int ECPhaseIndex(char *phase, double delta);
+static void ECColatitudeTerms(double ecolat, double *sc);
+static void ECTauInterpolation(EC_COEF *ecp, double delta, double depth,
+                               double *tau);
 
 /*
  *
@@ -64,6 +69,9 @@ static int ECPhaseIndex(char *phase, double delta);
  *      The ellipticity corrections are found by linear interpolation
  *          in terms of values calculated for the ak135 model for a wide
  *          range of phases to match the output of the libtau software.
+ *      The t0, t1 and t2 coefficients are interpolated together from the
+ *          interleaved table of the phase, and the colatitude terms are
+ *          only recalculated when the epicentre changes.
  *  Input Arguments:
  *      ec     - ellipticity correction coefs
  *      phase  - phase
@@ -76,7 +84,8 @@ static int ECPhaseIndex(char *phase, double delta);
  *  Called by:
  *     correct_ttime
  *  Calls:
- *      ECPhaseIndex, BilinearInterpolation
+ *      GetPhaseProperties, ECPhaseIndex, ECColatitudeTerms,
+ *      ECTauInterpolation
  *  Notes:
  *      The available phases and the tabulated distance ranges are:
  *      (Kennett and Gudmundsson, 1996)
@@ -150,16 +159,21 @@ static int ECPhaseIndex(char *phase, double delta);
 double GetEllipticityCorrection(EC_COEF *ec, char *phase, double ecolat,
                       double delta, double depth, double esaz)
 {
+    static THREADLOCAL double lastcolat = -1., sc[3];
     int k = -1;
-    double azim = 0., tau0 = 0., tau1 = 0., tau2 = 0.;
-    double s3 = sqrt(3.) / 2.;
+    PHASEPROP *pp = NULL;
+    double azim = 0., tau[3];
     double tcor = 0.;
-    double sc0 = 0., sc1 = 0., sc2 = 0.;
     azim = esaz * DEG_TO_RAD;
 /*
- *  get corresponding index in ec
+ *  get corresponding index in ec;
+ *  use the precomputed index unless it depends on delta
  */
-    k = ECPhaseIndex(phase, delta);
+    pp = GetPhaseProperties(phase);
+    if (pp != NULL && pp->ecindex > -2)
+        k = pp->ecindex;
+    else
+        k = ECPhaseIndex(phase, delta);
 /*
  *  no phase was found, return zero correction
  */
@@ -167,22 +181,127 @@ double GetEllipticityCorrection(EC_COEF *ec, char *phase, double ecolat,
 /*
  *  bilinear interpolation of tau coefficients of Dziewonski and Gilbert (1976)
  */
-    tau0 = BilinearInterpolation(delta, depth, ec[k].numDistanceSamples,
-                    ec[k].numDepthSamples, ec[k].delta, ec[k].depth, ec[k].t0);
-    tau1 = BilinearInterpolation(delta, depth, ec[k].numDistanceSamples,
-                    ec[k].numDepthSamples, ec[k].delta, ec[k].depth, ec[k].t1);
-    tau2 = BilinearInterpolation(delta, depth, ec[k].numDistanceSamples,
-                    ec[k].numDepthSamples, ec[k].delta, ec[k].depth, ec[k].t2);
+    ECTauInterpolation(&ec[k], delta, depth, tau);
 /*
  *  ellipticity correction: eqs. (22) and (26) of Dziewonski and Gilbert (1976)
  */
-    sc0 = 0.25 * (1.0 + 3.0 * cos(2.0 * ecolat));
-    sc1 = s3 * sin(2.0 * ecolat);
-    sc2 = s3 * sin(ecolat) * sin(ecolat);
-    tcor = sc0 * tau0 + sc1 * cos(azim) * tau1 + sc2 * cos(2. * azim) * tau2;
+    if (ecolat != lastcolat) {
+        ECColatitudeTerms(ecolat, sc);
+        lastcolat = ecolat;
+    }
+    tcor = sc[0] * tau[0] + sc[1] * cos(azim) * tau[1] +
+           sc[2] * cos(2. * azim) * tau[2];
     return tcor;
 }
 
+/*
+ *  Title:
+ *      GetEllipticityCorrections
+ *  Synopsis:
+ *      Calculates ellipticity corrections for the phases of an event.
+ *      Same as calling GetEllipticityCorrection for each phase, but the
+ *      colatitude terms are calculated only once.
+ *  Input Arguments:
+ *      ec       - ellipticity correction coefs
+ *      ecolat   - epicenter's co-latitude [rad]
+ *      depth    - source depth [km]
+ *      numPhase - number of associated phases
+ *      p        - array of phase structures (phase, delta and esaz are used)
+ *  Output Arguments:
+ *      tcor     - ellipticity corrections
+ *  Called by:
+ *      TravelTimeResiduals, library users
+ *  Calls:
+ *      GetPhaseProperties, ECPhaseIndex, ECColatitudeTerms,
+ *      ECTauInterpolation
+ */
+void GetEllipticityCorrections(EC_COEF *ec, double ecolat, double depth,
+        int numPhase, PHAREC p[], double *tcor)
+{
+    int i, k;
+    PHASEPROP *pp = NULL;
+    double azim = 0., tau[3], sc[3];
+    ECColatitudeTerms(ecolat, sc);
+    for (i = 0; i < numPhase; i++) {
+        pp = GetPhaseProperties(p[i].phase);
+        if (pp != NULL && pp->ecindex > -2)
+            k = pp->ecindex;
+        else
+            k = ECPhaseIndex(p[i].phase, p[i].delta);
+        if (k < 0) {
+            tcor[i] = 0.;
+            continue;
+        }
+        azim = p[i].esaz * DEG_TO_RAD;
+        ECTauInterpolation(&ec[k], p[i].delta, depth, tau);
+        tcor[i] = sc[0] * tau[0] + sc[1] * cos(azim) * tau[1] +
+                  sc[2] * cos(2. * azim) * tau[2];
+    }
+}
+
+/*
+ *  Title:
+ *      ECColatitudeTerms
+ *  Synopsis:
+ *      Calculates the colatitude terms of eqs. (22) and (26) of
+ *      Dziewonski and Gilbert (1976).
+ *  Input Arguments:
+ *      ecolat - epicenter's co-latitude [rad]
+ *  Output Arguments:
+ *      sc     - colatitude terms of the t0, t1 and t2 coefficients
+ *  Called by:
+ *      GetEllipticityCorrection, GetEllipticityCorrections
+ */
+static void ECColatitudeTerms(double ecolat, double *sc)
+{
+    double s3 = sqrt(3.) / 2.;
+    sc[0] = 0.25 * (1.0 + 3.0 * cos(2.0 * ecolat));
+    sc[1] = s3 * sin(2.0 * ecolat);
+    sc[2] = s3 * sin(ecolat) * sin(ecolat);
+}
+
+/*
+ *  Title:
+ *      ECTauInterpolation
+ *  Synopsis:
+ *      Bilinear interpolation of the t0, t1 and t2 coefficients of a phase.
+ *      The distance and depth are bracketed once and the interpolation
+ *      weights are shared by the three interleaved coefficients; the
+ *      results are the same as those of BilinearInterpolation.
+ *  Input Arguments:
+ *      ecp   - ellipticity correction coefs of a phase
+ *      delta - epicentral distance [deg]
+ *      depth - source depth [km]
+ *  Output Arguments:
+ *      tau   - interpolated t0, t1 and t2
+ *  Called by:
+ *      GetEllipticityCorrection, GetEllipticityCorrections
+ *  Calls:
+ *      FloatBracket
+ */
+static void ECTauInterpolation(EC_COEF *ecp, double delta, double depth,
+                               double *tau)
+{
+    int ilo = 0, ihi = 0, jlo = 0, jhi = 0, k, nz;
+    double f1 = 0., f2 = 0., w00, w10, w11, w01;
+    double *y00, *y10, *y11, *y01;
+    nz = ecp->numDepthSamples;
+    FloatBracket(delta, ecp->numDistanceSamples, ecp->delta, &ilo, &ihi);
+    FloatBracket(depth, nz, ecp->depth, &jlo, &jhi);
+    f1 = (delta - ecp->delta[ilo]) / (ecp->delta[ihi] - ecp->delta[ilo]);
+    f2 = (depth - ecp->depth[jlo]) / (ecp->depth[jhi] - ecp->depth[jlo]);
+    w00 = (1. - f1) * (1. - f2);
+    w10 = f1 * (1. - f2);
+    w11 = f1 * f2;
+    w01 = (1. - f1) * f2;
+    y00 = ecp->tau + 3 * (ilo * nz + jlo);
+    y10 = ecp->tau + 3 * (ihi * nz + jlo);
+    y11 = ecp->tau + 3 * (ihi * nz + jhi);
+    y01 = ecp->tau + 3 * (ilo * nz + jhi);
+    for (k = 0; k < 3; k++)
+        tau[k] = w00 * y00[k] + w10 * y10[k] + w11 * y11[k] + w01 * y01[k];
+}
+
 /*
  *  Title:
  *      ECPhaseIndex
@@ -192,7 +311,7 @@ double GetEllipticityCorrection(EC_COEF *ec, char *phase, double ecolat,
  *      phase - phase
  *      delta - delta
  *  Called by:
- *      GetEllipticityCorrection
+ *      GetEllipticityCorrection, GetEllipticityCorrections, InitPhaseCodes
  *
  *      Pup,    P,      Pdiff,  PKPab,  PKPbc,  PKPdf,  PKiKP,  pP,
  *      pPKPab, pPKPbc, pPKPdf, pPKiKP, sP,     sPKPab, sPKPbc, sPKPdf,
@@ -203,7 +322,7 @@ double GetEllipticityCorrection(EC_COEF *ec, char *phase, double ecolat,
  *      PKKSbc, PKKSdf, SKKSac, SKKSdf, SS,     S'S',   SP,     PS,
  *      PnS
  */
-static int ECPhaseIndex(char *phase, double delta)
+int ECPhaseIndex(char *phase, double delta)
 {
     if (streq(phase, "Pup")  ||
         streq(phase, "Pg")   ||
@@ -340,7 +459,7 @@ static int ECPhaseIndex(char *phase, double delta)
  *  Return:
  *     ec - pointer to ec_coef structure or NULL on error
  *  Calls:
- *     AllocateFloatMatrix, FreeEllipticityCorrectionTable
+ *     FreeEllipticityCorrectionTable
  *  Called by:
  *      ReadAuxDataFiles
  */
@@ -350,7 +469,7 @@ EC_COEF *ReadEllipticityCorrectionTable(int *numECPhases, char *filename)
     EC_COEF *ec = (EC_COEF *)NULL;
     char buf[LINLEN], phase[PHALEN];
     int num_pha = 0, num_dist = 0, numDepthSamples = 6;
-    int i, j, k;
+    int i, j, k, m;
     double mindist = 0., maxdist = 0., d = 0., t = 0.;
 /*
  *  open ellipticity correction file and get number of phases
@@ -397,26 +516,27 @@ EC_COEF *ReadEllipticityCorrectionTable(int *numECPhases, char *filename)
         ec[i].depth[5] = 700.;
 
         ec[i].delta = (double *)calloc(num_dist, sizeof(double));
-        ec[i].t0 = AllocateFloatMatrix(num_dist, numDepthSamples);
-        ec[i].t1 = AllocateFloatMatrix(num_dist, numDepthSamples);
-        if ((ec[i].t2 = AllocateFloatMatrix(num_dist, numDepthSamples)) == NULL) {
+        ec[i].tau = (double *)calloc(3 * num_dist * numDepthSamples,
+                                     sizeof(double));
+        if (ec[i].delta == NULL || ec[i].tau == NULL) {
+            fprintf(logfp, "ReadEllipticityCorrectionTable: cannot allocate memory\n");
+            fprintf(errfp, "ReadEllipticityCorrectionTable: cannot allocate memory\n");
             FreeEllipticityCorrectionTable(ec, num_pha);
+            fclose(fp);
+            errorcode = 1;
             return (EC_COEF *) NULL;
         }
+/*
+ *      t0, t1 and t2 rows of a distance sample are interleaved
+ */
         for (j = 0; j < num_dist; j++) {
             fscanf(fp, "%lf", &d);
             ec[i].delta[j] = d;
-            for (k = 0; k < numDepthSamples; k++) {
-                fscanf(fp, "%lf", &t);
-                ec[i].t0[j][k] = t;
-            }
-            for (k = 0; k < numDepthSamples; k++) {
-                fscanf(fp, "%lf", &t);
-                ec[i].t1[j][k] = t;
-            }
-            for (k = 0; k < numDepthSamples; k++) {
-                fscanf(fp, "%lf", &t);
-                ec[i].t2[j][k] = t;
+            for (m = 0; m < 3; m++) {
+                for (k = 0; k < numDepthSamples; k++) {
+                    fscanf(fp, "%lf", &t);
+                    ec[i].tau[3 * (j * numDepthSamples + k) + m] = t;
+                }
             }
         }
     }
@@ -433,7 +553,7 @@ EC_COEF *ReadEllipticityCorrectionTable(int *numECPhases, char *filename)
  *      ec         - ellipticity correction coefs
  *      numECPhases - number of distinct phases
  *  Calls:
- *     FreeFloatMatrix, Free
+ *     Free
  *  Called by:
  *      ReadAuxDataFiles, main
  */
@@ -441,9 +561,7 @@ void FreeEllipticityCorrectionTable(EC_COEF *ec, int numECPhases)
 {
     int i;
     for (i = 0; i < numECPhases; i++) {
-        FreeFloatMatrix(ec[i].t2);
-        FreeFloatMatrix(ec[i].t1);
-        FreeFloatMatrix(ec[i].t0);
+        Free(ec[i].tau);
         Free(ec[i].delta);
     }
     Free(ec);
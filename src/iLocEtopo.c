@@ -0,0 +1,651 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "iLoc.h"
+extern THREADLOCAL FILE *logfp;
+extern FILE *errfp;
+extern THREADLOCAL int errorcode;
+extern int EtopoNlon;                /* number of longitude samples in ETOPO */
+extern int EtopoNlat;                 /* number of latitude samples in ETOPO */
+extern double EtopoRes;                                 /* cellsize in ETOPO */
+extern int EtopoTileCache;              /* tiled ETOPO tiles kept per thread */
+extern int EtopoCellCache;               /* memoize bounce-point ETOPO cells */
+
+/*
+ * number of ETOPO instances read; identifies the owner of cache entries
+ */
+static int EtopoCount = 0;
+
+/*
+ * per-thread LRU of the mapped tiles of tiled ETOPO files and the registry
+ * of the LRUs of all threads; the lock guards the registry and any change
+ * to the mapped tiles, so a thread only looks up its own tiles without it
+ */
+static THREADLOCAL ETOPO_LRU *TileLRU = (ETOPO_LRU *)NULL;
+static THREADLOCAL short int TileBuffer[ETT_TILE * ETT_TILE];
+static ETOPO_LRU *TileLRUs = (ETOPO_LRU *)NULL;
+static pthread_mutex_t TileMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * per-thread cache of the corner elevations of bounce-point cells
+ */
+static THREADLOCAL int CellOwner[ETOPOCELLS];
+static THREADLOCAL int CellKey[ETOPOCELLS];
+static THREADLOCAL short int CellCorners[ETOPOCELLS][4];
+
+/*
+ * Functions:
+ *    ReadEtopo1
+ *    FreeEtopo
+ *    FreeEtopoTiles
+ *    WriteEtopoTiles
+ *    GetEtopoElevation
+ */
+
+/*
+ * Local functions
+ *    MapEtopoTiles
+ *    EtopoTile
+ *    EtopoSample
+ *    EtopoCorners
+ */
+static int MapEtopoTiles(char *fname, ETOPO *topo);
+static short int *EtopoTile(ETOPO *topo, int tile);
+static short int EtopoSample(ETOPO *topo, int m, int k);
+static void EtopoCorners(ETOPO *topo, int m, int k1, int k2, short int *z);
+
+/*
+ *  Title:
+ *      ReadEtopo1
+ *  Synopsis:
+ *      Reads ETOPO1 topography file into an ETOPO grid.
+ *      If the tiled version of the file (filename.tiles, see iLocEtopoTile)
+ *      is present and matches the ETOPO parameters, it is memory-mapped
+ *      instead, and the tiles are paged in when first used.
+ *      ETOPO1:
+ *         etopo1_bed_g_i2.bin
+ *         Amante, C. and B. W. Eakins,
+ *           ETOPO1 1 Arc-Minute Global Relief Model: Procedures, Data Sources
+ *           and Analysis.
+ *           NOAA Technical Memorandum NESDIS NGDC-24, 19 pp, March 2009.
+ *         NCOLS         21601
+ *         NROWS         10801
+ *         XLLCENTER     -180.000000
+ *         YLLCENTER     -90.000000
+ *         CELLSIZE      0.01666666667
+ *         NODATA_VALUE  -32768
+ *         BYTEORDER     LSBFIRST
+ *         NUMBERTYPE    2_BYTE_INTEGER
+ *         ZUNITS        METERS
+ *         MIN_VALUE     -10898
+ *         MAX_VALUE     8271
+ *         1'x1' resolution, 21601 lons, 10801 lats
+ *      Resampled ETOPO1 versions:
+ *         etopo2_bed_g_i2.bin
+ *           grdfilter -I2m etopo1_bed.grd -Fg10 -D4 -Getopo2_bed.grd
+ *             Gridline node registration used
+ *             x_min: -180 x_max: 180 x_inc: 0.0333333 name: nx: 10801
+ *             y_min: -90 y_max: 90 y_inc: 0.0333333 name: ny: 5401
+ *             z_min: -10648.7 z_max: 7399.13 name: m
+ *             scale_factor: 1 add_offset: 0
+ *         etopo5_bed_g_i2.bin
+ *           grdfilter -I5m etopo1_bed.grd -Fg15 -D4 -Getopo5_bed.grd
+ *             Gridline node registration used
+ *             x_min: -180 x_max: 180 x_inc: 0.0833333 nx: 4321
+ *             y_min: -90 y_max: 90 y_inc: 0.0833333 ny: 2161
+ *             z_min: -10515.5 z_max: 6917.75 name: m
+ *             scale_factor: 1 add_offset: 0
+ *  ETOPO parameters are specified in config.txt file:
+ *     EtopoFile - pathname for ETOPO file
+ *     EtopoNlon - number of longitude samples in ETOPO
+ *     EtopoNlat - number of latitude samples in ETOPO
+ *     EtopoRes  - cellsize in ETOPO
+ *  Input Arguments:
+ *     filename - filename pathname
+ *  Return:
+ *     topo - ETOPO bathymetry/elevation grid or NULL on error
+ *  Called by:
+ *     ReadAuxDataFiles, iLocEtopoTile
+ *  Calls:
+ *     MapEtopoTiles, AllocateShortMatrix, FreeEtopo, Free
+ */
+ETOPO *ReadEtopo1(char *filename)
+{
+    FILE *fp;
+    ETOPO *topo = (ETOPO *)NULL;
+    char fname[FILENAMELEN];
+    unsigned long n, m;
+    if ((topo = (ETOPO *)calloc(1, sizeof(ETOPO))) == NULL) {
+        fprintf(logfp, "ReadEtopo1: cannot allocate memory\n");
+        fprintf(errfp, "ReadEtopo1: cannot allocate memory\n");
+        errorcode = 1;
+        return (ETOPO *)NULL;
+    }
+    topo->id = __atomic_add_fetch(&EtopoCount, 1, __ATOMIC_RELAXED);
+    topo->nlat = EtopoNlat;
+    topo->nlon = EtopoNlon;
+    topo->fd = -1;
+/*
+ *  map the tiled etopo file if there is one
+ */
+    sprintf(fname, "%s.tiles", filename);
+    if (MapEtopoTiles(fname, topo) == 0)
+        return topo;
+/*
+ *  open etopo file
+ */
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        fprintf(stderr, "Cannot open %s!\n", filename);
+        errorcode = 2;
+        Free(topo);
+        return (ETOPO *)NULL;
+    }
+/*
+ *  allocate memory
+ */
+    if ((topo->grid = AllocateShortMatrix(EtopoNlat, EtopoNlon)) == NULL) {
+        fclose(fp);
+        Free(topo);
+        return (ETOPO *)NULL;
+    }
+/*
+ *  read etopo file
+ */
+    n = EtopoNlat * EtopoNlon;
+    if ((m = fread(topo->grid[0], sizeof(short int), n, fp)) != n) {
+        fprintf(stderr, "Corrupted %s!\n", filename);
+        fclose(fp);
+        FreeEtopo(topo);
+        return (ETOPO *)NULL;
+    }
+    fclose(fp);
+    return topo;
+}
+
+/*
+ *  Title:
+ *     MapEtopoTiles
+ *  Synopsis:
+ *     Opens a tiled ETOPO file. The file is rejected if its header or size
+ *     do not match the ETOPO parameters.
+ *     If EtopoTileCache is 0 the whole file is mapped read-only and the
+ *     kernel is advised of random access, so that touching a tile does not
+ *     read ahead the rest of the grid. Otherwise the file is kept open and
+ *     EtopoTile maps the tiles one by one.
+ *  Input Arguments:
+ *     fname - pathname of tiled ETOPO file
+ *     topo  - ETOPO structure
+ *  Output Arguments:
+ *     topo  - ETOPO structure pointing into the mapping
+ *  Return:
+ *     0/2 on success/no valid tiled ETOPO file
+ *  Called by:
+ *     ReadEtopo1
+ */
+static int MapEtopoTiles(char *fname, ETOPO *topo)
+{
+    ETT_HEADER hdr;
+    struct stat st;
+    char *map = (char *)NULL;
+    size_t size = 0, tilebytes = 0;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int fd, ntilelat = 0, ntilelon = 0;
+    if ((fd = open(fname, O_RDONLY)) < 0)
+        return 2;
+    if (fstat(fd, &st) ||
+        pread(fd, &hdr, sizeof(ETT_HEADER), 0) != sizeof(ETT_HEADER)) {
+        close(fd);
+        return 2;
+    }
+    size = (size_t)st.st_size;
+/*
+ *  check header
+ */
+    ntilelat = (EtopoNlat + ETT_TILE - 1) / ETT_TILE;
+    ntilelon = (EtopoNlon + ETT_TILE - 1) / ETT_TILE;
+    tilebytes = ETT_TILE * ETT_TILE * sizeof(short int);
+    if (strcmp(hdr.magic, ETT_MAGIC) || hdr.version != ETT_VERSION ||
+        hdr.byteorder != ETT_BYTEORDER || hdr.tilesize != ETT_TILE ||
+        hdr.nlat != EtopoNlat || hdr.nlon != EtopoNlon ||
+        hdr.ntilelat != ntilelat || hdr.ntilelon != ntilelon ||
+        hdr.size != (long long)size ||
+        size != tilebytes * (1 + (size_t)ntilelat * ntilelon)) {
+        fprintf(logfp, "ReadEtopo1: invalid %s, reading ETOPO file\n",
+                fname);
+        close(fd);
+        return 2;
+    }
+    topo->tilesize = ETT_TILE;
+    topo->ntilelon = ntilelon;
+    topo->tilebytes = tilebytes;
+/*
+ *  tiles are mapped on demand; they must be page aligned in the file
+ */
+    if (EtopoTileCache > 0 && pagesize > 0 && tilebytes % pagesize == 0) {
+        topo->fd = fd;
+        return 0;
+    }
+    map = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 2;
+    madvise(map, size, MADV_RANDOM);
+    topo->tiles = (short int *)(map + tilebytes);
+    topo->map = map;
+    topo->mapsize = size;
+    return 0;
+}
+
+/*
+ *  Title:
+ *     FreeEtopo
+ *  Synopsis:
+ *     Frees the ETOPO grid or unmaps/closes the tiled ETOPO file. The tiles
+ *     of the file still mapped by the LRU of any thread are unmapped.
+ *     No thread may use the ETOPO grid any more.
+ *  Input Arguments:
+ *     topo - ETOPO bathymetry/elevation grid
+ *  Called by:
+ *     ReadEtopo1, ReadAuxDataFiles, iloc_free, main
+ *  Calls:
+ *     FreeShortMatrix, Free
+ */
+void FreeEtopo(ETOPO *topo)
+{
+    ETOPO_LRU *lp = (ETOPO_LRU *)NULL;
+    int i;
+    if (topo == NULL) return;
+    if (topo->map != NULL)
+        munmap(topo->map, topo->mapsize);
+    if (topo->fd >= 0) {
+        pthread_mutex_lock(&TileMutex);
+        for (lp = TileLRUs; lp != NULL; lp = lp->next) {
+            for (i = 0; i < ETOPOLRU; i++) {
+                if (lp->map[i] == NULL || lp->owner[i] != topo->id)
+                    continue;
+                munmap(lp->map[i], lp->bytes[i]);
+                lp->map[i] = (short int *)NULL;
+                __atomic_store_n(&lp->owner[i], 0, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&TileMutex);
+        close(topo->fd);
+    }
+    FreeShortMatrix(topo->grid);
+    Free(topo);
+}
+
+/*
+ *  Title:
+ *     FreeEtopoTiles
+ *  Synopsis:
+ *     Unmaps the ETOPO tiles mapped by the calling thread and removes its
+ *     LRU from the registry. Called by the threads before they exit.
+ *  Called by:
+ *     NASampleThread, BatchWorker, iloc_free, main
+ *  Calls:
+ *     Free
+ */
+void FreeEtopoTiles(void)
+{
+    ETOPO_LRU **lpp = (ETOPO_LRU **)NULL, *lp = TileLRU;
+    int i;
+    if (lp == NULL) return;
+    pthread_mutex_lock(&TileMutex);
+    for (lpp = &TileLRUs; *lpp != NULL; lpp = &(*lpp)->next) {
+        if (*lpp == lp) {
+            *lpp = lp->next;
+            break;
+        }
+    }
+    for (i = 0; i < ETOPOLRU; i++) {
+        if (lp->map[i] != NULL)
+            munmap(lp->map[i], lp->bytes[i]);
+    }
+    pthread_mutex_unlock(&TileMutex);
+    Free(lp);
+    TileLRU = (ETOPO_LRU *)NULL;
+}
+
+/*
+ *  Title:
+ *     WriteEtopoTiles
+ *  Synopsis:
+ *     Writes an ETOPO grid to a tiled ETOPO file. The grid is cut into
+ *     ETT_TILE x ETT_TILE sample tiles that follow a header block of the
+ *     same size, so that each tile is page aligned in the mapping; the
+ *     tiles at the east and south edges are padded with zeros.
+ *     The file is written under a temporary name and renamed, so a
+ *     mapping of a previous version stays valid.
+ *  Input Arguments:
+ *     fname - pathname of tiled ETOPO file
+ *     topo  - ETOPO bathymetry/elevation grid
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     iLocEtopoTile
+ *  Calls:
+ *     EtopoSample, Free
+ */
+int WriteEtopoTiles(char *fname, ETOPO *topo)
+{
+    FILE *fp;
+    ETT_HEADER hdr;
+    short int *tile = (short int *)NULL, *hblock = (short int *)NULL;
+    char tmpname[FILENAMELEN];
+    int ntile = ETT_TILE * ETT_TILE, ntilelat, ntilelon;
+    int tr, tc, i, j, m, k, ret = 0;
+    ntilelat = (topo->nlat + ETT_TILE - 1) / ETT_TILE;
+    ntilelon = (topo->nlon + ETT_TILE - 1) / ETT_TILE;
+    if ((tile = (short int *)calloc(ntile, sizeof(short int))) == NULL ||
+        (hblock = (short int *)calloc(ntile, sizeof(short int))) == NULL) {
+        fprintf(logfp, "WriteEtopoTiles: cannot allocate memory\n");
+        fprintf(errfp, "WriteEtopoTiles: cannot allocate memory\n");
+        Free(tile);
+        return 1;
+    }
+    memset(&hdr, 0, sizeof(ETT_HEADER));
+    strcpy(hdr.magic, ETT_MAGIC);
+    hdr.version = ETT_VERSION;
+    hdr.byteorder = ETT_BYTEORDER;
+    hdr.nlat = topo->nlat;
+    hdr.nlon = topo->nlon;
+    hdr.tilesize = ETT_TILE;
+    hdr.ntilelat = ntilelat;
+    hdr.ntilelon = ntilelon;
+    hdr.size = (long long)ntile * sizeof(short int) *
+               (1 + (long long)ntilelat * ntilelon);
+    memcpy(hblock, &hdr, sizeof(ETT_HEADER));
+    sprintf(tmpname, "%s.tmp", fname);
+    if ((fp = fopen(tmpname, "wb")) == NULL) {
+        fprintf(logfp, "WriteEtopoTiles: cannot open %s\n", tmpname);
+        fprintf(errfp, "WriteEtopoTiles: cannot open %s\n", tmpname);
+        Free(tile); Free(hblock);
+        return 1;
+    }
+/*
+ *  header block, then the tiles row by row
+ */
+    ret = (fwrite(hblock, sizeof(short int), ntile, fp) != (size_t)ntile);
+    for (tr = 0; tr < ntilelat && !ret; tr++) {
+        for (tc = 0; tc < ntilelon && !ret; tc++) {
+            for (i = 0; i < ETT_TILE; i++) {
+                m = tr * ETT_TILE + i;
+                for (j = 0; j < ETT_TILE; j++) {
+                    k = tc * ETT_TILE + j;
+                    if (m < topo->nlat && k < topo->nlon)
+                        tile[i * ETT_TILE + j] = EtopoSample(topo, m, k);
+                    else
+                        tile[i * ETT_TILE + j] = 0;
+                }
+            }
+            ret = (fwrite(tile, sizeof(short int), ntile, fp) !=
+                   (size_t)ntile);
+        }
+    }
+    Free(tile); Free(hblock);
+    if (fclose(fp) || ret || rename(tmpname, fname)) {
+        fprintf(logfp, "WriteEtopoTiles: cannot write %s\n", fname);
+        fprintf(errfp, "WriteEtopoTiles: cannot write %s\n", fname);
+        remove(tmpname);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Title:
+ *     EtopoTile
+ *  Synopsis:
+ *     Returns a pointer to a tile of a tiled ETOPO grid.
+ *     If the whole file is mapped the tile is located in the mapping.
+ *     Otherwise the tile is looked up in a per-thread LRU of EtopoTileCache
+ *     mapped tiles; on a miss the tile is mapped and the least recently
+ *     used one is unmapped, which bounds the resident grid to a few tiles
+ *     per thread. The LRU of a thread is allocated and registered on its
+ *     first miss. If a tile cannot be mapped it is read into a per-thread
+ *     buffer instead.
+ *  Input Arguments:
+ *     topo - tiled ETOPO grid
+ *     tile - tile number, row by row from the north-west corner
+ *  Return:
+ *     pointer to the first sample of the tile
+ *  Called by:
+ *     EtopoSample, EtopoCorners
+ */
+static short int *EtopoTile(ETOPO *topo, int tile)
+{
+    ETOPO_LRU *lp = TileLRU;
+    short int *tp = (short int *)MAP_FAILED;
+    off_t offset = (off_t)topo->tilebytes * (tile + 1);
+    int i, j = 0, n;
+    if (topo->fd < 0)
+        return topo->tiles + (size_t)tile * ETT_TILE * ETT_TILE;
+    if (lp == NULL &&
+        (lp = (ETOPO_LRU *)calloc(1, sizeof(ETOPO_LRU))) != NULL) {
+        pthread_mutex_lock(&TileMutex);
+        lp->next = TileLRUs;
+        TileLRUs = lp;
+        pthread_mutex_unlock(&TileMutex);
+        TileLRU = lp;
+    }
+    if (lp != NULL) {
+        n = EtopoTileCache < ETOPOLRU ? EtopoTileCache : ETOPOLRU;
+        lp->clock++;
+        for (i = 0; i < n; i++) {
+            if (__atomic_load_n(&lp->owner[i], __ATOMIC_RELAXED) == topo->id &&
+                lp->tile[i] == tile) {
+                lp->stamp[i] = lp->clock;
+                return lp->map[i];
+            }
+            if (lp->stamp[i] < lp->stamp[j]) j = i;
+        }
+/*
+ *      miss: replace the least recently used tile
+ */
+        pthread_mutex_lock(&TileMutex);
+        if (lp->map[j] != NULL)
+            munmap(lp->map[j], lp->bytes[j]);
+        lp->owner[j] = 0;
+        lp->map[j] = (short int *)NULL;
+        tp = (short int *)mmap(NULL, topo->tilebytes, PROT_READ, MAP_SHARED,
+                               topo->fd, offset);
+        if (tp != (short int *)MAP_FAILED) {
+            lp->tile[j] = tile;
+            lp->stamp[j] = lp->clock;
+            lp->bytes[j] = topo->tilebytes;
+            lp->map[j] = tp;
+            lp->owner[j] = topo->id;
+        }
+        pthread_mutex_unlock(&TileMutex);
+        if (tp != (short int *)MAP_FAILED)
+            return tp;
+    }
+    if (pread(topo->fd, TileBuffer, topo->tilebytes, offset) !=
+        (ssize_t)topo->tilebytes) {
+        fprintf(logfp, "EtopoTile: cannot read ETOPO tile %d\n", tile);
+        memset(TileBuffer, 0, sizeof(TileBuffer));
+    }
+    return TileBuffer;
+}
+
+/*
+ *  Title:
+ *     EtopoSample
+ *  Synopsis:
+ *     Returns an ETOPO grid sample.
+ *  Input Arguments:
+ *     topo - ETOPO bathymetry/elevation grid
+ *     m    - latitude index
+ *     k    - longitude index
+ *  Return:
+ *     elevation [m]
+ *  Called by:
+ *     EtopoCorners, WriteEtopoTiles
+ *  Calls:
+ *     EtopoTile
+ */
+static short int EtopoSample(ETOPO *topo, int m, int k)
+{
+    short int *tp;
+    int n = topo->tilesize;
+    if (topo->grid != NULL)
+        return topo->grid[m][k];
+    tp = EtopoTile(topo, (m / n) * topo->ntilelon + k / n);
+    return tp[(m % n) * n + k % n];
+}
+
+/*
+ *  Title:
+ *     EtopoCorners
+ *  Synopsis:
+ *     Returns the samples at the corners of an ETOPO grid cell; in a tiled
+ *     grid the tile is looked up once unless the cell straddles tiles.
+ *     If EtopoCellCache is set the corners are memoized per thread, keyed
+ *     by the cell, so that bounce points that stay in the same cell from
+ *     one iteration to the next do not touch the grid again.
+ *  Input Arguments:
+ *     topo - ETOPO bathymetry/elevation grid
+ *     m    - latitude index of the northern edge of the cell
+ *     k1   - longitude index of the western edge of the cell
+ *     k2   - longitude index of the eastern edge of the cell
+ *  Output Arguments:
+ *     z    - samples at (m, k1), (m+1, k1), (m, k2), (m+1, k2)
+ *  Called by:
+ *     GetEtopoElevation
+ *  Calls:
+ *     EtopoTile, EtopoSample
+ */
+static void EtopoCorners(ETOPO *topo, int m, int k1, int k2, short int *z)
+{
+    short int *tp;
+    int key = 0, h = 0, n;
+    if (EtopoCellCache) {
+        key = m * topo->nlon + k1;
+        h = key % ETOPOCELLS;
+        if (CellOwner[h] == topo->id && CellKey[h] == key) {
+            memcpy(z, CellCorners[h], 4 * sizeof(short int));
+            return;
+        }
+    }
+    n = topo->tilesize;
+    if (topo->grid == NULL && k2 == k1 + 1 &&
+        (m + 1) % n && (k1 + 1) % n) {
+/*
+ *      the cell lies within a tile
+ */
+        tp = EtopoTile(topo, (m / n) * topo->ntilelon + k1 / n);
+        tp += (m % n) * n + k1 % n;
+        z[0] = tp[0];
+        z[1] = tp[n];
+        z[2] = tp[1];
+        z[3] = tp[n+1];
+    }
+    else {
+        z[0] = EtopoSample(topo, m, k1);
+        z[1] = EtopoSample(topo, m + 1, k1);
+        z[2] = EtopoSample(topo, m, k2);
+        z[3] = EtopoSample(topo, m + 1, k2);
+    }
+    if (EtopoCellCache) {
+        CellOwner[h] = topo->id;
+        CellKey[h] = key;
+        memcpy(CellCorners[h], z, 4 * sizeof(short int));
+    }
+}
+
+/*
+ *  Title:
+ *      GetEtopoElevation
+ *  Synopsis:
+ *      Returns ETOPO1 topography in kilometers for a lat, lon pair.
+ *  ETOPO parameters are specified in config.txt file:
+ *     EtopoFile - pathname for ETOPO file
+ *     EtopoNlon - number of longitude samples in ETOPO
+ *     EtopoNlat - number of latitude samples in ETOPO
+ *     EtopoRes  - cellsize in ETOPO
+ *  Input Arguments:
+ *      lat, lon - latitude, longitude in degrees
+ *      topo     - ETOPO bathymetry/elevation grid
+ *  Returns:
+ *      elevation above sea level [km]
+ *      topography above sea level is taken positive,
+ *                 below sea level negative.
+ *  Called by:
+ *     GetEtopoCorrection
+ *  Calls:
+ *     EtopoCorners
+ */
+double GetEtopoElevation(double lat, double lon, ETOPO *topo)
+{
+    int i, j, m, k1, k2;
+    double a1, a2, lat2, lon2, lat1, lon1;
+    double top, topo1, topo2, topo3, topo4;
+    short int z[4];
+/*
+ *  bounding box
+ */
+    i = (int)((lon + 180.) / EtopoRes);
+    j = (int)((90. - lat) / EtopoRes);
+    lon1 = (double)(i) * EtopoRes - 180.;
+    lat1 = 90. - (double)(j) * EtopoRes;
+    lon2 = (double)(i + 1) * EtopoRes - 180.;
+    lat2 = 90. - (double)(j + 1) * EtopoRes;
+    k1 = i;
+    k2 = i + 1;
+    m = j;
+    a1 = (lon2 - lon) / (lon2 - lon1);
+    a2 = (lat2 - lat) / (lat2 - lat1);
+/*
+ *  take care of grid boundaries
+ */
+    if (i < 0 || i > EtopoNlon - 2) {
+        k1 = EtopoNlon - 1;
+        k2 = 0;
+    }
+    if (j < 0) {
+        m = 0;
+        a2 = 0.;
+    }
+    if (j > EtopoNlat - 2) {
+        m = EtopoNlat - 2;
+        a2 = 1.;
+    }
+/*
+ *  interpolate
+ */
+    EtopoCorners(topo, m, k1, k2, z);
+    topo1 = (double)z[0];
+    topo2 = (double)z[1];
+    topo3 = (double)z[2];
+    topo4 = (double)z[3];
+    top = (1. - a1) * (1. - a2) * topo1 + a1 * (1. - a2) * topo3 +
+          (1. - a1) * a2 * topo2 + a1 * a2 * topo4;
+    return top / 1000.;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * iLocEtopoTile
+ *    Writes the tiled version of an ETOPO file. ReadEtopo1 maps the tiled
+ *    file (<etopofile>.tiles) when it is present next to the ETOPO file,
+ *    so that only the tiles around bounce points are paged in instead of
+ *    reading the whole grid at every start-up.
+ *
+ *    The tiled file is in native byte order; rerun iLocEtopoTile after
+ *    replacing the ETOPO file or moving the auxdata to another platform.
+ *
+ * Usage:
+ *    iLocEtopoTile etopofile nlon nlat
+ *       etopofile - ETOPO file, e.g. auxdata/topo/etopo5_bed_g_i2.bin
+ *       nlon      - number of longitude samples in ETOPO (EtopoNlon)
+ *       nlat      - number of latitude samples in ETOPO (EtopoNlat)
+ *    writes etopofile.tiles
+ */
+#include "iLoc.h"
+extern THREADLOCAL FILE *logfp;
+extern FILE *errfp;
+extern int EtopoNlon;                /* number of longitude samples in ETOPO */
+extern int EtopoNlat;                 /* number of latitude samples in ETOPO */
+
+/*
+ *
+ * main body
+ *
+ */
+int main(int argc, char *argv[])
+{
+    ETOPO *topo = (ETOPO *)NULL;
+    char fname[FILENAMELEN];
+    logfp = stderr;
+    errfp = stderr;
+    if (argc != 4) {
+        fprintf(stderr, "Usage: iLocEtopoTile etopofile nlon nlat\n");
+        fprintf(stderr, "    writes etopofile.tiles\n");
+        return 1;
+    }
+    EtopoNlon = atoi(argv[2]);
+    EtopoNlat = atoi(argv[3]);
+    if (EtopoNlon < 2 || EtopoNlat < 2) {
+        fprintf(stderr, "iLocEtopoTile: invalid grid size %s x %s\n",
+                argv[2], argv[3]);
+        return 1;
+    }
+/*
+ *  read ETOPO grid and write it tile by tile
+ */
+    if ((topo = ReadEtopo1(argv[1])) == NULL) {
+        fprintf(stderr, "iLocEtopoTile: cannot read %s\n", argv[1]);
+        return 1;
+    }
+    sprintf(fname, "%s.tiles", argv[1]);
+    if (WriteEtopoTiles(fname, topo)) {
+        FreeEtopo(topo);
+        return 1;
+    }
+    fprintf(stderr, "iLocEtopoTile: %d x %d samples written to %s\n",
+            EtopoNlat, EtopoNlon, fname);
+    FreeEtopo(topo);
+    return 0;
+}
@@ -28,10 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 extern char InputDB[VALLEN];       /* read data from this DB account, if any */
 extern char OutputDB[VALLEN];    /* write results to this DB account, if any */
 
@@ -36,6 +36,9 @@
  *    BilinearInterpolation
  *    FloatBracket
  *    IntegerBracket
+ *    BuildRunIndex
+ *    FreeRunIndex
+ *    RunBracket
  */
 
 /*
@@ -139,8 +142,8 @@ double SplineInterpolation(double xp, int n, double *x, double *y, double *d2y,
  *     jlo - lower index
  *     jhi - upper index
  *  Called by:
- *     SplineInterpolation, BilinearInterpolation,
- *     GetTravelTimeTableValue, PhaseTTh, StationTrace
+ *     SplineInterpolation, BilinearInterpolation, RunBracket, StationTrace,
+ *     TTdeltaCubics, TTdepthPatch
  */
 void FloatBracket(double xp, int n, double *x, int *jlo, int *jhi)
 {
@@ -212,7 +215,7 @@ void IntegerBracket(int xp, int n, int *x, int *jlo, int *jhi)
  *  Return:
  *     interpolated function value yp = f(xp1, xp2)
  *  Called by:
- *     GetEllipticityCorrection, GetMagnitudeQ
+ *     GetMagnitudeQ
  *  Calls:
  *     FloatBracket
  */
@@ -239,3 +242,147 @@ double BilinearInterpolation(double xp1, double xp2, int nx1, int nx2,
     return yp;
 }
 
+/*
+ *  Title:
+ *     BuildRunIndex
+ *  Synopsis:
+ *     Splits an ascending sample vector into uniform and irregular runs so
+ *     that RunBracket can bracket a point arithmetically. A uniform run has
+ *     at least MIN_UNIFORM_RUN equal sample intervals; the samples between
+ *     uniform runs form irregular runs.
+ *  Input Arguments:
+ *     n - number of points in x
+ *     x - x array
+ *  Return:
+ *     runidx - pointer to RUNINDEX structure or NULL if x has less than
+ *              two points or on memory error
+ *  Called by:
+ *     ReadTTtables, GenerateLocalTTtables
+ */
+RUNINDEX *BuildRunIndex(int n, double *x)
+{
+    RUNINDEX *runidx = (RUNINDEX *)NULL;
+    double h = 0.;
+    int i, j, k = 0;
+    if (n < 2)
+        return (RUNINDEX *)NULL;
+    runidx = (RUNINDEX *)calloc(1, sizeof(RUNINDEX));
+    if (runidx == NULL)
+        return (RUNINDEX *)NULL;
+    runidx->first = (int *)calloc(n + 1, sizeof(int));
+    runidx->step = (double *)calloc(n, sizeof(double));
+    if (runidx->first == NULL || runidx->step == NULL) {
+        FreeRunIndex(runidx);
+        return (RUNINDEX *)NULL;
+    }
+    for (i = 0; i < n - 1; i = j) {
+/*
+ *      equal intervals from sample i
+ */
+        h = x[i+1] - x[i];
+        for (j = i + 1; j < n - 1; j++)
+            if (fabs(x[j+1] - x[j] - h) > 1.e-6 * fabs(h)) break;
+        if (j - i >= MIN_UNIFORM_RUN && h > 0.) {
+            runidx->first[k] = i;
+            runidx->step[k++] = (x[j] - x[i]) / (double)(j - i);
+        }
+/*
+ *      irregular samples; merged with the previous irregular run
+ */
+        else {
+            j = i + 1;
+            if (k == 0 || runidx->step[k-1] > 0.) {
+                runidx->first[k] = i;
+                runidx->step[k++] = 0.;
+            }
+        }
+    }
+    runidx->nrun = k;
+    runidx->first[k] = n - 1;
+    return runidx;
+}
+
+/*
+ *  Title:
+ *     FreeRunIndex
+ *  Synopsis:
+ *     Frees memory allocated to a RUNINDEX structure.
+ *  Input Arguments:
+ *     runidx - pointer to RUNINDEX structure or NULL
+ *  Called by:
+ *     BuildRunIndex, FreeTTtables, FreeLocalTTtables
+ */
+void FreeRunIndex(RUNINDEX *runidx)
+{
+    if (runidx == NULL)
+        return;
+    Free(runidx->first);
+    Free(runidx->step);
+    Free(runidx);
+}
+
+/*
+ *  Title:
+ *     RunBracket
+ *  Synopsis:
+ *     Same as FloatBracket, but uses the run index of x if there is one.
+ *     The run of xp is found by a linear scan over the few runs; in a
+ *     uniform run the bracket is computed from the sample interval and
+ *     adjusted against x, so the indices are always those of FloatBracket.
+ *  Input Arguments:
+ *     runidx - pointer to RUNINDEX structure of x or NULL
+ *     xp     - x point to be bracketed
+ *     n      - number of points in x
+ *     x      - x array
+ *  Output Arguments:
+ *     jlo - lower index
+ *     jhi - upper index
+ *  Called by:
+ *     TTtableBracket, PhaseTTh
+ *  Calls:
+ *     FloatBracket
+ */
+void RunBracket(RUNINDEX *runidx, double xp, int n, double *x,
+        int *jlo, int *jhi)
+{
+    int r = 0, k = 0, m = 0;
+    if (runidx == NULL || n < 2) {
+        FloatBracket(xp, n, x, jlo, jhi);
+        return;
+    }
+/*
+ *  outside the samples (NaN is taken as above, as in FloatBracket)
+ */
+    if (xp < x[0]) {
+        *jlo = 0;
+        *jhi = 1;
+        return;
+    }
+    if (!(xp < x[n-1])) {
+        *jlo = n - 2;
+        *jhi = n - 1;
+        return;
+    }
+/*
+ *  run of xp
+ */
+    while (r < runidx->nrun - 1 && x[runidx->first[r+1]] <= xp)
+        r++;
+    k = runidx->first[r];
+    m = runidx->first[r+1];
+    if (runidx->step[r] > 0.) {
+        k += (int)((xp - x[k]) / runidx->step[r]);
+        if (k > m - 1) k = m - 1;
+/*
+ *      rounding at the samples
+ */
+        while (k > 0 && x[k] > xp) k--;
+        while (k < n - 2 && x[k+1] <= xp) k++;
+    }
+    else {
+        FloatBracket(xp, m - k + 1, x + k, jlo, jhi);
+        k += *jlo;
+    }
+    *jlo = k;
+    *jhi = k + 1;
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "iLoc.h"
+
+extern THREADLOCAL int verbose;                             /* verbose level */
+extern THREADLOCAL FILE *logfp;                                  /* log file */
+extern FILE *errfp;                                            /* error file */
+extern THREADLOCAL int errorcode;                              /* error code */
+extern THREADLOCAL struct timeval t0;                    /* wall clock start */
+extern THREADLOCAL int UseLocalTT;               /* use local TT predictions */
+extern THREADLOCAL double PrevLat;                     /* previous epicentre */
+extern THREADLOCAL double PrevLon;                     /* previous epicentre */
+extern char ISFOutputFile[FILENAMELEN];               /* output ISF filename */
+extern char KMLEventFile[FILENAMELEN];                 /* KML event filename */
+extern char KMLBulletinFile[FILENAMELEN];           /* KML bulletin filename */
+extern char LocalVmodelFile[FILENAMELEN];            /* local velocity model */
+extern int UpdateLocalTT;                          /* static/dynamic local TT */
+extern char RSTTmodel[FILENAMELEN];                            /* RSTT model */
+extern int UseRSTT;                                  /* use RSTT predictions */
+
+/*
+ *  protects the reference counts of the shared aux data
+ */
+static pthread_mutex_t nrefmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Functions:
+ *    iloc_init
+ *    iloc_copy
+ *    iloc_locate
+ *    iloc_free
+ */
+
+/*
+ *  Title:
+ *     iloc_init
+ *  Synopsis:
+ *     Initializes the embeddable locator library.
+ *     Reads the configuration file and the auxiliary data files (travel-time
+ *        tables, ellipticity corrections, ETOPO, Flinn-Engdahl regions,
+ *        default depths, variogram, magnitude attenuation) once, initializes
+ *        SLBM and reads the RSTT model if required.
+ *     Log and error messages go to stderr unless the caller has already set
+ *        logfp/errfp; the log can be redirected later via ctx->logfp.
+ *     There is only one RSTT instance per process, so iloc_init should be
+ *        called once.
+ *     The returned context is used by one thread at a time. To locate
+ *        events concurrently, get a context for each further thread with
+ *        iloc_copy; a plain struct copy is not safe, as Locator replaces
+ *        the local TT tables of the context when UpdateLocalTT is set.
+ *  Input Arguments:
+ *     auxdir - pathname for the auxiliary data files directory
+ *              ($ILOCROOT/auxdata)
+ *  Return:
+ *     pointer to locator context or NULL on error
+ *  Calls:
+ *     ReadConfigFile, ReadAuxDataFiles, GenerateLocalTTtables, InitContext,
+ *     iloc_free, secs
+ */
+ILOC_CONTEXT *iloc_init(char *auxdir)
+{
+    ILOC_CONTEXT *ctx = (ILOC_CONTEXT *)NULL;
+    char interpolator[FILENAMELEN];
+    double d = DEG_TO_RAD * MAX_RSTT_DIST;   /* max RSTT distance in radians */
+/*
+ *  set timezone to get epoch times right and other inits
+ */
+    setenv("TZ", "", 1);
+    tzset();
+    if (logfp == NULL) logfp = stderr;
+    if (errfp == NULL) errfp = stderr;
+    gettimeofday(&t0, NULL);
+    verbose = 0;
+    errorcode = 0;
+    PrevLat = PrevLon = 89.;
+/*
+ *  read configuration file from auxdir/iLocpars directory
+ */
+    if (ReadConfigFile(auxdir, getenv("HOME")))
+        return (ILOC_CONTEXT *)NULL;
+/*
+ *  events are located in memory; no ISF or KML output
+ */
+    strcpy(ISFOutputFile, "");
+    strcpy(KMLEventFile, "");
+    strcpy(KMLBulletinFile, "");
+    if ((ctx = (ILOC_CONTEXT *)calloc(1, sizeof(ILOC_CONTEXT))) == NULL) {
+        fprintf(errfp, "iloc_init: cannot allocate memory\n");
+        errorcode = 1;
+        return (ILOC_CONTEXT *)NULL;
+    }
+/*
+ *  event-level configuration and state from the config file defaults
+ */
+    InitContext(ctx);
+    ctx->mbQ = (MAGQ *)calloc(1, sizeof(MAGQ));
+    ctx->fe = (FE *)calloc(1, sizeof(FE));
+    ctx->nref = (int *)calloc(1, sizeof(int));
+    if ((ctx->variogram = (VARIOGRAM *)calloc(1, sizeof(VARIOGRAM))) == NULL ||
+        ctx->mbQ == NULL || ctx->fe == NULL || ctx->nref == NULL) {
+        fprintf(errfp, "iloc_init: cannot allocate memory\n");
+        Free(ctx->mbQ); Free(ctx->fe); Free(ctx->variogram);
+        Free(ctx->nref);
+        Free(ctx);
+        errorcode = 1;
+        return (ILOC_CONTEXT *)NULL;
+    }
+    *ctx->nref = 1;
+/*
+ *  read various data files from config directory
+ */
+    if (ReadAuxDataFiles(auxdir, &ctx->ismbQ, ctx->mbQ, ctx->fe,
+                         &ctx->GrnDepth, &ctx->gres, &ctx->ngrid,
+                         &ctx->DepthGrid, &ctx->topo, &ctx->numECPhases,
+                         &ctx->ec, &ctx->TTtables, ctx->variogram)) {
+        Free(ctx->mbQ); Free(ctx->fe); Free(ctx->variogram);
+        Free(ctx->nref);
+        Free(ctx);
+        return (ILOC_CONTEXT *)NULL;
+    }
+    if (verbose) fprintf(logfp, "ReadAuxDataFiles (%.4f) done\n", secs(&t0));
+/*
+ *  generate static local TT tables from local velocity model if given
+ */
+    if (UseLocalTT) {
+        fprintf(logfp, "    read local velocity model: %s\n", LocalVmodelFile);
+        if ((ctx->LocalTTtables = GenerateLocalTTtables(LocalVmodelFile,
+                                                        0., 0.)) == NULL) {
+            fprintf(errfp, "Cannot generate static local TT tables!\n");
+            fprintf(logfp, "Cannot generate static local TT tables!\n");
+            UseLocalTT = ctx->UseLocalTT = 0;
+        }
+    }
+/*
+ *  initialize SLBM and read RSTT model
+ */
+    if (UseRSTT) {
+        fprintf(logfp, "    Read RSTT model: %s\n", RSTTmodel);
+        slbm_shell_create();
+        if (slbm_shell_loadVelocityModelBinary(RSTTmodel)) {
+            fprintf(errfp, "iloc_init: cannot open RSTT model %s\n", RSTTmodel);
+            slbm_shell_delete();
+            UseRSTT = 0;
+            iloc_free(ctx);
+            errorcode = 1;
+            return (ILOC_CONTEXT *)NULL;
+        }
+        slbm_shell_setMaxDistance(&d);
+        strcpy(interpolator, "NATUTAL_NEIGHBOR");
+        slbm_shell_setInterpolatorType(interpolator);
+    }
+    return ctx;
+}
+
+/*
+ *  Title:
+ *     iloc_copy
+ *  Synopsis:
+ *     Makes a locator context for another thread from a context returned
+ *        by iloc_init or iloc_copy, with the event-level state of ctx.
+ *     The aux data are shared read-only and reference-counted, so they
+ *        are freed with the last context that uses them.
+ *     If local TT tables are regenerated on the fly (UpdateLocalTT), the
+ *        copy gets its own local TT tables, as in the multi-threaded
+ *        batch mode; otherwise the static local TT tables are shared.
+ *  Input Arguments:
+ *     ctx - pointer to locator context
+ *  Return:
+ *     pointer to locator context or NULL on error
+ *  Calls:
+ *     GenerateLocalTTtables
+ */
+ILOC_CONTEXT *iloc_copy(ILOC_CONTEXT *ctx)
+{
+    ILOC_CONTEXT *cp = (ILOC_CONTEXT *)NULL;
+    if (ctx == NULL || ctx->nref == NULL)
+        return (ILOC_CONTEXT *)NULL;
+    if ((cp = (ILOC_CONTEXT *)calloc(1, sizeof(ILOC_CONTEXT))) == NULL) {
+        fprintf(errfp, "iloc_copy: cannot allocate memory\n");
+        errorcode = 1;
+        return (ILOC_CONTEXT *)NULL;
+    }
+    memmove(cp, ctx, sizeof(ILOC_CONTEXT));
+/*
+ *  own copy of local TT tables as Locator may regenerate them
+ */
+    if (UpdateLocalTT) {
+        cp->LocalTTtables = (TT_TABLE *)NULL;
+        if (cp->UseLocalTT &&
+            (cp->LocalTTtables = GenerateLocalTTtables(LocalVmodelFile,
+                                             cp->PrevLat, cp->PrevLon)) == NULL)
+            cp->UseLocalTT = 0;
+    }
+    pthread_mutex_lock(&nrefmutex);
+    (*cp->nref)++;
+    pthread_mutex_unlock(&nrefmutex);
+    return cp;
+}
+
+/*
+ *  Title:
+ *     iloc_locate
+ *  Synopsis:
+ *     Locates a single event held in memory.
+ *     The caller fills the event, hypocentre and phase records the same way
+ *        ReadISF does (station coordinates in the phase records, phases
+ *        ordered by hypocentre, time and station; EVREC counters set).
+ *     Nothing is written to files or databases; the solution is returned
+ *        in s and the phase records are updated with residuals, phase
+ *        names and defining flags.
+ *     The epicentre is remembered in the context as the previous solution.
+ *  Input Arguments:
+ *     ctx - pointer to locator context returned by iloc_init
+ *     e   - pointer to event record
+ *     h   - array of hypocentre records
+ *     p   - array of phase structures
+ *  Output Arguments:
+ *     s   - pointer to solution record
+ *  Return:
+ *     0/1 on success/error; ctx->errorcode is set on error
+ *  Calls:
+ *     Locator
+ */
+int iloc_locate(ILOC_CONTEXT *ctx, EVREC *e, HYPREC h[], PHAREC p[],
+                SOLREC *s)
+{
+    int total = 0, fail = 0, opt[7] = {0, 0, 0, 0, 0, 0, 0};
+    int ret;
+    char magbloc[LINLEN];
+    if (ctx == NULL) {
+        errorcode = 1;
+        return 1;
+    }
+    strcpy(magbloc, "");
+    gettimeofday(&ctx->t0, NULL);
+    ctx->errorcode = 0;
+    ret = Locator(ctx, 1, 0, &total, &fail, opt, e, h, s, p, NULL, magbloc);
+    if (!ret) {
+        ctx->PrevLat = s->lat;
+        ctx->PrevLon = s->lon;
+    }
+    return ret;
+}
+
+/*
+ *  Title:
+ *     iloc_free
+ *  Synopsis:
+ *     Frees a locator context. The auxiliary data are freed and the SLBM
+ *     instance is deleted with the last context that shares them.
+ *  Input Arguments:
+ *     ctx - pointer to locator context returned by iloc_init or iloc_copy
+ *  Called by:
+ *     iloc_init
+ *  Calls:
+ *     FreeFlinnEngdahl, FreeFloatMatrix, FreeEtopo, FreeEtopoTiles,
+ *     FreeTTtables, FreeLocalTTtables, FreeEllipticityCorrectionTable, FreeVariogram, Free
+ */
+void iloc_free(ILOC_CONTEXT *ctx)
+{
+    int nref = 0;
+    if (ctx == NULL) return;
+/*
+ *  dynamic local TT tables are owned by the context
+ */
+    if (UpdateLocalTT && ctx->LocalTTtables != NULL) {
+        FreeLocalTTtables(ctx->LocalTTtables);
+        ctx->LocalTTtables = (TT_TABLE *)NULL;
+    }
+    pthread_mutex_lock(&nrefmutex);
+    nref = --(*ctx->nref);
+    pthread_mutex_unlock(&nrefmutex);
+    if (nref > 0) {
+        Free(ctx);
+        return;
+    }
+/*
+ *  free default depth grid and etopo
+ */
+    FreeFlinnEngdahl(ctx->fe);
+    FreeFloatMatrix(ctx->DepthGrid);
+    FreeEtopo(ctx->topo);
+    FreeEtopoTiles();
+    Free(ctx->GrnDepth);
+/*
+ *  free travel-time tables
+ */
+    if (ctx->TTtables != NULL)
+        FreeTTtables(ctx->TTtables);
+    if (ctx->LocalTTtables != NULL)
+        FreeLocalTTtables(ctx->LocalTTtables);
+/*
+ *  free ellipticity correction coefficients
+ */
+    if (ctx->ec != NULL)
+        FreeEllipticityCorrectionTable(ctx->ec, ctx->numECPhases);
+/*
+ *  free mbQ
+ */
+    if (ctx->ismbQ) {
+        Free(ctx->mbQ->deltas);
+        Free(ctx->mbQ->depths);
+        FreeFloatMatrix(ctx->mbQ->q);
+    }
+/*
+ *  free variogram
+ */
+    FreeVariogram(ctx->variogram);
+/*
+ *  delete SLBM instance
+ */
+    if (UseRSTT) {
+        slbm_shell_delete();
+    }
+    Free(ctx->mbQ);
+    Free(ctx->fe);
+    Free(ctx->variogram);
+    Free(ctx->nref);
+    Free(ctx);
+}
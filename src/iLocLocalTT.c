@@ -29,15 +29,30 @@
  */
 #include "iLoc.h"
 
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
-extern double Moho;                                            /* Moho depth */
-extern double Conrad;                                        /* Conrad depth */
+extern THREADLOCAL int errorcode;
+extern THREADLOCAL double Moho;                                /* Moho depth */
+extern THREADLOCAL double Conrad;                            /* Conrad depth */
 // extern int LocalTTfromRSTT;            /* get local velocity model from RSTT */
 extern int numLocalPhaseTT;                        /* number of local phases */
 extern char LocalPhaseTT[MAXLOCALTTPHA][PHALEN];         /* local phase list */
+extern int LocalTTthreads;          /* threads generating the local TT tables */
+extern char LocalTTcacheDir[FILENAMELEN];   /* dir of cached local TT tables */
+extern THREADLOCAL TT_CACHE *TTcache;      /* per-event TT prediction cache */
+
+/*
+ *  local TT table generation shared by the worker threads
+ */
+typedef struct LocalTTJob {
+    int ithread;                                            /* thread index */
+    int nthreads;                                      /* number of threads */
+    int ndists;                                     /* number of distances */
+    int ndepths;                                       /* number of depths */
+    TT_TABLE *TTtables;                                 /* local TT tables */
+    VMODEL *LocalVelocityModelp;                   /* local velocity model */
+} LOCALTTJOB;
 
 /*
  * Local functions
@@ -45,6 +60,12 @@ extern char LocalPhaseTT[MAXLOCALTTPHA][PHALEN];         /* local phase list */
 static int ReadLocalVelocityModel(char *fname, VMODEL *LocalVelocityModelp);
 static void FreeLocalVelocityModel(VMODEL *LocalVelocityModelp);
 static TT_TABLE *AllocateLocalTTtable(int ndepths, int ndists);
+static int isLocalTTbounce(char *phase);
+static void LocalTTcacheKey(VMODEL *LocalVelocityModelp, int ndists,
+        double *dists, int ndepths, double *depths, char *key);
+static TT_TABLE *MapLocalTTcache(char *fname, char *key);
+static void WriteLocalTTcache(char *fname, char *key, TT_TABLE *TTtables);
+static void *LocalTTWorker(void *arg);
 static int GetVelocityProfileFromRSTT(double lat, double lon,
         VMODEL *LocalVelocityModelp);
 static int GenerateLocalTT(double depth, double delta,
@@ -63,6 +84,11 @@ static void CriticalDistanceTTIntercept(int n, double *v, double *vsq,
 #define MAXLAY 21
 #define NDEP 33
 #define NDIS 28
+/*
+ * version of the generated tables; part of the local TT cache key, so bump
+ * it whenever GenerateLocalTT changes its results
+ */
+#define LOCALTTVERSION 1
 
 
 /*
@@ -76,17 +102,20 @@ static void CriticalDistanceTTIntercept(int n, double *v, double *vsq,
  *  Return:
  *     TTtables - pointer to TT_TABLE structure or NULL on error
  *  Calls:
- *     ReadLocalVelocityModel, AllocateLocalTTtable, GenerateLocalTT,
- *     GetLocalPhaseIndex, FreeLocalVelocityModel
+ *     ReadLocalVelocityModel, AllocateLocalTTtable, LocalTTWorker,
+ *     FreeLocalVelocityModel, FreeLocalTTtables, BuildRunIndex,
+ *     ResetTTcache, LocalTTcacheKey, MapLocalTTcache, WriteLocalTTcache,
+ *     Free
  */
 TT_TABLE *GenerateLocalTTtables(char *filename, double lat, double lon)
 {
-    char *phcd[MAXLOCALTTPHA], phcd_buf[MAXLOCALTTPHA * PHALEN];
-    double ttc[MAXLOCALTTPHA], dtdd[MAXLOCALTTPHA], dtdh[MAXLOCALTTPHA];
     TT_TABLE *TTtables = (TT_TABLE *)NULL;
+    char key[24], fname[FILENAMELEN + 32];
     VMODEL LocalVelocityModel;
-    double hmax, hd, delta, depth, h[2 * MAXLAY];
-    int npha, n, i, j, k, ind, ndists, ndepths, icon, imoh;
+    LOCALTTJOB *jobs = (LOCALTTJOB *)NULL;
+    pthread_t *workers = (pthread_t *)NULL;
+    double hmax, hd, h[2 * MAXLAY];
+    int n, i, j, k, ind, ndists, ndepths, icon, imoh, nthreads, nw;
     static double dists[NDIS] = {
           0.0,  0.025, 0.05, 0.1, 0.25, 0.5, 0.75, 1.0, 1.25, 1.5,
           1.75, 2.0,   2.5,  3.0, 3.5,  4.0, 4.5,  5.0, 5.5,  6.0,
@@ -98,7 +127,10 @@ TT_TABLE *GenerateLocalTTtables(char *filename, double lat, double lon)
         100.0, 150.0, 200.0, 250.0, 300.0, 350.0, 400.0, 450.0, 500.0, 550.0,
         600.0, 650.0, 700.0
     };
-    for (i = 0; i < MAXLOCALTTPHA; i++) phcd[i] = phcd_buf + i * PHALEN;
+/*
+ *  cached predictions may come from the previous local TT tables
+ */
+    ResetTTcache(TTcache);
 //    if (LocalTTfromRSTT) {
 /*
  *      get local velocity model from RSTT velocity profile at lat,lon
@@ -190,6 +222,18 @@ TT_TABLE *GenerateLocalTTtables(char *filename, double lat, double lon)
  */
     ndepths = k;
     ndists = NDIS;
+/*
+ *  map the tables from the local TT cache if they were generated before
+ */
+    if (LocalTTcacheDir[0]) {
+        LocalTTcacheKey(&LocalVelocityModel, ndists, dists, ndepths, h, key);
+        sprintf(fname, "%s/%s.ttb", LocalTTcacheDir, key);
+        if ((TTtables = MapLocalTTcache(fname, key)) != NULL) {
+            fprintf(logfp, "Local TT tables from %s\n", fname);
+            FreeLocalVelocityModel(&LocalVelocityModel);
+            return TTtables;
+        }
+    }
     if ((TTtables = AllocateLocalTTtable(ndepths, ndists)) == NULL) {
         FreeLocalVelocityModel(&LocalVelocityModel);
         return (TT_TABLE *)NULL;
@@ -202,58 +246,130 @@ TT_TABLE *GenerateLocalTTtables(char *filename, double lat, double lon)
             TTtables[ind].deltas[i] = dists[i];
         for (j = 0; j < ndepths; j++)
             TTtables[ind].depths[j] = h[j];
+        TTtables[ind].delidx = BuildRunIndex(ndists, TTtables[ind].deltas);
+        TTtables[ind].depidx = BuildRunIndex(ndepths, TTtables[ind].depths);
     }
 /*
  *  generate TT tables
+ *      each thread takes every nthreads-th (delta, depth) node of the grid;
+ *      the nodes are independent, so the tables do not depend on the
+ *      number of threads
+ */
+    nthreads = max(1, min(LocalTTthreads, ndists * ndepths));
+    jobs = (LOCALTTJOB *)calloc(nthreads, sizeof(LOCALTTJOB));
+    workers = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if (jobs == NULL || workers == NULL) {
+        Free(jobs); Free(workers);
+        FreeLocalTTtables(TTtables);
+        FreeLocalVelocityModel(&LocalVelocityModel);
+        fprintf(logfp, "GenerateLocalTTtables: cannot allocate memory\n");
+        fprintf(errfp, "GenerateLocalTTtables: cannot allocate memory\n");
+        errorcode = 1;
+        return (TT_TABLE *)NULL;
+    }
+    for (k = 0; k < nthreads; k++) {
+        jobs[k].ithread = k;
+        jobs[k].nthreads = nthreads;
+        jobs[k].ndists = ndists;
+        jobs[k].ndepths = ndepths;
+        jobs[k].TTtables = TTtables;
+        jobs[k].LocalVelocityModelp = &LocalVelocityModel;
+    }
+    for (nw = 1; nw < nthreads; nw++) {
+        if (pthread_create(&workers[nw], NULL, LocalTTWorker, &jobs[nw]))
+            break;
+    }
+/*
+ *  the calling thread picks up its own share and that of threads not started
+ */
+    LocalTTWorker(&jobs[0]);
+    for (k = nw; k < nthreads; k++)
+        LocalTTWorker(&jobs[k]);
+    for (k = 1; k < nw; k++)
+        pthread_join(workers[k], NULL);
+    Free(jobs); Free(workers);
+/*
+ *  store the tables in the local TT cache
+ */
+    if (LocalTTcacheDir[0])
+        WriteLocalTTcache(fname, key, TTtables);
+    FreeLocalVelocityModel(&LocalVelocityModel);
+    return TTtables;
+}
+
+/*
+ *  Title:
+ *     LocalTTWorker
+ *  Desc:
+ *     Thread function filling every nthreads-th (delta, depth) node of the
+ *     local travel-time tables. A node only writes its own entries of the
+ *     tables, so the function may run in any thread, including the caller.
+ *  Input Arguments:
+ *     arg - pointer to LOCALTTJOB structure
+ *  Return:
+ *     NULL
+ *  Called by:
+ *     GenerateLocalTTtables
+ *  Calls:
+ *     GenerateLocalTT, GetLocalPhaseIndex
  */
-    for (i = 0; i < ndists; i++) {
+static void *LocalTTWorker(void *arg)
+{
+    LOCALTTJOB *job = (LOCALTTJOB *)arg;
+    TT_TABLE *TTtables = job->TTtables;
+    char *phcd[MAXLOCALTTPHA], phcd_buf[MAXLOCALTTPHA * PHALEN];
+    double ttc[MAXLOCALTTPHA], dtdd[MAXLOCALTTPHA], dtdh[MAXLOCALTTPHA];
+    double delta, depth;
+    int node, npha, i, j, k, ind;
+    for (i = 0; i < MAXLOCALTTPHA; i++) phcd[i] = phcd_buf + i * PHALEN;
+    for (node = job->ithread; node < job->ndists * job->ndepths;
+         node += job->nthreads) {
+        i = node / job->ndepths;
+        j = node % job->ndepths;
         delta = TTtables[0].deltas[i];
-        for (j = 0; j < ndepths; j++) {
-            depth = TTtables[0].depths[j];
-            for (k = 0; k < numLocalPhaseTT; k++) {
-                TTtables[k].tt[i][j] = NULLVAL;
-                TTtables[k].dtdd[i][j] = -999.;
-                TTtables[k].dtdh[i][j] = -999.;
-                if (TTtables[k].isbounce)
-                    TTtables[k].bpdel[i][j] = -999.;
-            }
-            npha = GenerateLocalTT(depth, delta, &LocalVelocityModel,
-                                   phcd, ttc, dtdd, dtdh);
-            if (npha) {
-                for (k = 0; k < npha; k++) {
-                    ind = GetLocalPhaseIndex(phcd[k]);
-                    TTtables[ind].tt[i][j] = ttc[k];
-                    TTtables[ind].dtdd[i][j] = dtdd[k];
-                    TTtables[ind].dtdh[i][j] = dtdh[k];
-                    if (ttc[k] < 0.) continue;
-/*
- *                  first arriving P
- */
-                    if (LocalPhaseTT[ind][0] == 'P' &&
-                        ttc[k] < TTtables[0].tt[i][j]) {
-                        TTtables[0].tt[i][j] = ttc[k];
-                        TTtables[0].dtdd[i][j] = dtdd[k];
-                        TTtables[0].dtdh[i][j] = dtdh[k];
-                    }
-/*
- *                  first arriving S
- */
-                    if (LocalPhaseTT[ind][0] == 'S' &&
-                        ttc[k] < TTtables[1].tt[i][j]) {
-                        TTtables[1].tt[i][j] = ttc[k];
-                        TTtables[1].dtdd[i][j] = dtdd[k];
-                        TTtables[1].dtdh[i][j] = dtdh[k];
-                    }
+        depth = TTtables[0].depths[j];
+        for (k = 0; k < numLocalPhaseTT; k++) {
+            TTtables[k].tt[i][j] = NULLVAL;
+            TTtables[k].dtdd[i][j] = -999.;
+            TTtables[k].dtdh[i][j] = -999.;
+            if (TTtables[k].isbounce)
+                TTtables[k].bpdel[i][j] = -999.;
+        }
+        npha = GenerateLocalTT(depth, delta, job->LocalVelocityModelp,
+                               phcd, ttc, dtdd, dtdh);
+        if (npha) {
+            for (k = 0; k < npha; k++) {
+                ind = GetLocalPhaseIndex(phcd[k]);
+                TTtables[ind].tt[i][j] = ttc[k];
+                TTtables[ind].dtdd[i][j] = dtdd[k];
+                TTtables[ind].dtdh[i][j] = dtdh[k];
+                if (ttc[k] < 0.) continue;
+/*
+ *              first arriving P
+ */
+                if (LocalPhaseTT[ind][0] == 'P' &&
+                    ttc[k] < TTtables[0].tt[i][j]) {
+                    TTtables[0].tt[i][j] = ttc[k];
+                    TTtables[0].dtdd[i][j] = dtdd[k];
+                    TTtables[0].dtdh[i][j] = dtdh[k];
+                }
+/*
+ *              first arriving S
+ */
+                if (LocalPhaseTT[ind][0] == 'S' &&
+                    ttc[k] < TTtables[1].tt[i][j]) {
+                    TTtables[1].tt[i][j] = ttc[k];
+                    TTtables[1].dtdd[i][j] = dtdd[k];
+                    TTtables[1].dtdh[i][j] = dtdh[k];
                 }
-            }
-            for (k = 0; k < numLocalPhaseTT; k++) {
-                if (TTtables[k].tt[i][j] == NULLVAL)
-                    TTtables[k].tt[i][j] = -999.;
             }
         }
+        for (k = 0; k < numLocalPhaseTT; k++) {
+            if (TTtables[k].tt[i][j] == NULLVAL)
+                TTtables[k].tt[i][j] = -999.;
+        }
     }
-    FreeLocalVelocityModel(&LocalVelocityModel);
-    return TTtables;
+    return NULL;
 }
 
 /*
@@ -266,6 +382,8 @@ TT_TABLE *GenerateLocalTTtables(char *filename, double lat, double lon)
  *     ndists - number of delta samples
  *  Return:
  *     TTtables - pointer to TT_TABLE structure or NULL on error
+ *  Calls:
+ *     isLocalTTbounce, AllocateFloatMatrix, FreeLocalTTtables
  */
 static TT_TABLE *AllocateLocalTTtable(int ndepths, int ndists)
 {
@@ -289,11 +407,7 @@ static TT_TABLE *AllocateLocalTTtable(int ndepths, int ndists)
 /*
  *      initialize TTtables for this phase
  */
-        isbounce = 0;
-        if (LocalPhaseTT[ind][0] == 'p' || LocalPhaseTT[ind][0] == 's' ||
-            LocalPhaseTT[ind][0] == LocalPhaseTT[ind][1] ||
-            !strncmp(&LocalPhaseTT[ind][0], &LocalPhaseTT[ind][2], 2))
-            isbounce = 1;
+        isbounce = isLocalTTbounce(LocalPhaseTT[ind]);
         strcpy(TTtables[ind].phase, LocalPhaseTT[ind]);
         TTtables[ind].ndel = ndists;
         TTtables[ind].ndep = ndepths;
@@ -324,6 +438,143 @@ static TT_TABLE *AllocateLocalTTtable(int ndepths, int ndists)
     return TTtables;
 }
 
+/*
+ *  Title:
+ *     isLocalTTbounce
+ *  Desc:
+ *     Tells if a local phase is a surface reflection or multiple
+ *  Input Arguments:
+ *     phase - local phase
+ *  Return:
+ *     1 if bounce phase, 0 otherwise
+ *  Called by:
+ *     AllocateLocalTTtable, MapLocalTTcache
+ */
+static int isLocalTTbounce(char *phase)
+{
+    if (phase[0] == 'p' || phase[0] == 's' || phase[0] == phase[1] ||
+        !strncmp(&phase[0], &phase[2], 2))
+        return 1;
+    return 0;
+}
+
+/*
+ *  Title:
+ *     LocalTTcacheKey
+ *  Desc:
+ *     Computes the local TT cache key of a set of local TT tables: the
+ *     FNV-1a hash of the velocity model (layer depths, Vp, Vs, Conrad and
+ *     Moho layers), the delta and depth samples, the local phase list and
+ *     LOCALTTVERSION, in hex, prefixed by "local".
+ *  Input Arguments:
+ *     LocalVelocityModelp - local velocity model
+ *     ndists  - number of delta samples
+ *     dists   - delta samples
+ *     ndepths - number of depth samples
+ *     depths  - depth samples
+ *  Output Arguments:
+ *     key - local TT cache key (22 characters)
+ *  Called by:
+ *     GenerateLocalTTtables
+ *  Calls:
+ *     TTBchecksum
+ */
+static void LocalTTcacheKey(VMODEL *LocalVelocityModelp, int ndists,
+        double *dists, int ndepths, double *depths, char *key)
+{
+    unsigned long long phases[(MAXLOCALTTPHA * PHALEN + 7) / 8];
+    unsigned long long hash = 0;
+    double head[7];
+    int n = LocalVelocityModelp->n;
+    size_t len = (numLocalPhaseTT * PHALEN + 7) / 8 * 8;
+    head[0] = LOCALTTVERSION;
+    head[1] = n;
+    head[2] = LocalVelocityModelp->iconr;
+    head[3] = LocalVelocityModelp->imoho;
+    head[4] = ndists;
+    head[5] = ndepths;
+    head[6] = numLocalPhaseTT;
+    memset(phases, 0, sizeof(phases));
+    memcpy(phases, LocalPhaseTT, numLocalPhaseTT * PHALEN);
+    hash = TTBchecksum((char *)head, sizeof(head), hash);
+    hash = TTBchecksum((char *)LocalVelocityModelp->h, 8 * n, hash);
+    hash = TTBchecksum((char *)LocalVelocityModelp->vp, 8 * n, hash);
+    hash = TTBchecksum((char *)LocalVelocityModelp->vs, 8 * n, hash);
+    hash = TTBchecksum((char *)dists, 8 * ndists, hash);
+    hash = TTBchecksum((char *)depths, 8 * ndepths, hash);
+    hash = TTBchecksum((char *)phases, len, hash);
+    sprintf(key, "local%016llx", hash);
+}
+
+/*
+ *  Title:
+ *     MapLocalTTcache
+ *  Desc:
+ *     Maps a set of local TT tables from the local TT cache
+ *  Input Arguments:
+ *     fname - pathname of the cached binary TT file
+ *     key   - local TT cache key
+ *  Return:
+ *     TTtables - pointer to TT_TABLE structure or NULL if not cached
+ *  Called by:
+ *     GenerateLocalTTtables
+ *  Calls:
+ *     isLocalTTbounce, MapTTbinary, BuildRunIndex, FreeLocalTTtables, Free
+ */
+static TT_TABLE *MapLocalTTcache(char *fname, char *key)
+{
+    TT_TABLE *TTtables = (TT_TABLE *)NULL;
+    int ind, ret;
+    if (access(fname, R_OK))
+        return (TT_TABLE *)NULL;
+    TTtables = (TT_TABLE *)calloc(numLocalPhaseTT, sizeof(TT_TABLE));
+    if (TTtables == NULL)
+        return (TT_TABLE *)NULL;
+    for (ind = 0; ind < numLocalPhaseTT; ind++) {
+        strcpy(TTtables[ind].phase, LocalPhaseTT[ind]);
+        TTtables[ind].isbounce = isLocalTTbounce(LocalPhaseTT[ind]);
+    }
+    if ((ret = MapTTbinary(fname, key, TTtables, numLocalPhaseTT,
+                           LocalPhaseTT)) != 0) {
+        if (ret == 1) FreeLocalTTtables(TTtables);
+        else          Free(TTtables);
+        return (TT_TABLE *)NULL;
+    }
+    for (ind = 0; ind < numLocalPhaseTT; ind++) {
+        TTtables[ind].delidx = BuildRunIndex(TTtables[ind].ndel,
+                                             TTtables[ind].deltas);
+        TTtables[ind].depidx = BuildRunIndex(TTtables[ind].ndep,
+                                             TTtables[ind].depths);
+    }
+    return TTtables;
+}
+
+/*
+ *  Title:
+ *     WriteLocalTTcache
+ *  Desc:
+ *     Stores a set of local TT tables in the local TT cache.
+ *     WriteTTbinary writes the file under a temporary name and renames
+ *     it, so concurrent runs never map a partial file.
+ *  Input Arguments:
+ *     fname    - pathname of the cached binary TT file
+ *     key      - local TT cache key
+ *     TTtables - local TT tables
+ *  Called by:
+ *     GenerateLocalTTtables
+ *  Calls:
+ *     WriteTTbinary
+ */
+static void WriteLocalTTcache(char *fname, char *key, TT_TABLE *TTtables)
+{
+    if (WriteTTbinary(fname, key, TTtables, numLocalPhaseTT)) {
+        fprintf(logfp, "WriteLocalTTcache: cannot store %s\n", fname);
+        return;
+    }
+    if (verbose)
+        fprintf(logfp, "Local TT tables stored in %s\n", fname);
+}
+
 /*
  *  Title:
  *     GenerateLocalTT
@@ -573,6 +824,9 @@ static double DirectPhase(int n, double *v, double *vsq, double *thk, int iq,
             x = 0.5 * (xa + xb);
             u = x / sqrt(dq *dq + x * x);
             usq = u * u;
+            del = x;
+            for (i = 0; i < iq; i++)
+                del += thk[i] * u / sqrt(vsq[iq] / vsq[i] - usq);
             break;
         }
         x = xa + (delta - dela) * (xb - xa) / (delb - dela);
@@ -638,6 +892,11 @@ static int RefractedPhase(int n, double *v, double *vsq, double *thk, int iq,
     double didq, tinq, tmin, sqt;
     CriticalDistanceTTIntercept(n, v, vsq, thk, iq, tid, did);
     tmin = 999999.;
+/*
+ *  no head waves from the event layer and above
+ */
+    for (m = 0; m <= iq && m < n; m++)
+        tref[m] = 999999.;
     for (m = iq + 1; m < n; m++) {
         tref[m] = 999999.;
         if (tid[m] < 999999.) {
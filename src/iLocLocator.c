@@ -29,10 +29,10 @@
  */
 #include "iLoc.h"
 
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 #ifdef PGSQL
 extern PGconn *conn;                       /* PostgreSQL database connection */
 #endif
@@ -43,14 +43,13 @@ extern MYSQL *mysql;                            /* MySQL database connection */
 extern dpiConn *conn;                          /* Oracle database connection */
 extern dpiContext *gContext;
 #endif
-extern struct timeval t0;
+extern THREADLOCAL struct timeval t0;
 extern int MinIterations;                        /* min number of iterations */
 extern int MaxIterations;                        /* max number of iterations */
 extern int MinNdefPhases;                            /* min number of phases */
 extern double DefaultDepth;         /* used if seed hypocentre depth is NULL */
-extern double Moho;                                            /* Moho depth */
-extern double Conrad;                                        /* Conrad depth */
-extern int DoCorrelatedErrors;              /* account for correlated errors */
+extern THREADLOCAL double Moho;                                /* Moho depth */
+extern THREADLOCAL double Conrad;                            /* Conrad depth */
 extern int AllowDamping;                 /* allow damping in LSQR iterations */
 extern int UpdateDB;                             /* write result to database */
 extern char InputDB[VALLEN];       /* read data from this DB account, if any */
@@ -59,24 +58,29 @@ extern char ISFOutputFile[FILENAMELEN];               /* output ISF filename */
 extern double MaxHypocenterDepth;                    /* max hypocenter depth */
 extern double MaxShallowDepthError;      /* max error for crustal free-depth */
 extern double MaxDeepDepthError;            /* max error for deep free-depth */
-extern int DoGridSearch;         /* perform grid search for initial location */
 extern int WriteNAResultsToFile;                    /* write results to file */
-extern double NAsearchRadius;       /* search radius around preferred origin */
+extern THREADLOCAL double NAsearchRadius;                /* NA search radius */
 extern double NAsearchDepth;    /* search radius (km) around preferred depth */
-extern double NAsearchOT;           /* search radius (s) around preferred OT */
+extern THREADLOCAL double NAsearchOT;                     /* NA OT range (s) */
 extern double NAlpNorm;                /* p-value for norm to compute misfit */
 extern int NAiterMax;                            /* max number of iterations */
 extern int NAinitialSample;                        /* size of initial sample */
 extern int NAnextSample;                       /* size of subsequent samples */
 extern int NAcells;                       /* number of cells to be resampled */
-extern long iseed;                                     /* random number seed */
+extern THREADLOCAL long iseed;                         /* random number seed */
 extern char InAgency[VALLEN];                     /* author for input assocs */
-extern int UseLocalTT;                           /* use local TT predictions */
+extern THREADLOCAL int UseLocalTT;               /* use local TT predictions */
 extern double MaxLocalTTDelta;           /* use local TT up to this distance */
 extern char LocalVmodelFile[FILENAMELEN];       /* pathname for local vmodel */
-extern double PrevLat;                                 /* previous epicentre */
-extern double PrevLon;                                 /* previous epicentre */
+extern THREADLOCAL double PrevLat;                     /* previous epicentre */
+extern THREADLOCAL double PrevLon;                     /* previous epicentre */
 extern int UpdateLocalTT;                         /* static/dynamic local TT */
+extern int UseTTcache;             /* memoize TT predictions within an event */
+extern double TTcacheTolerance;     /* hypocentre tolerance of TT cache [km] */
+extern THREADLOCAL TT_CACHE *TTcache;      /* TT cache of the calling thread */
+extern int UseCorrectionCache;     /* cache station/bounce corrections [0/1] */
+extern double BounceTolerance;        /* bounce point move to recompute [km] */
+extern THREADLOCAL CORR_STATS CorrStats;        /* correction cache counters */
 extern int MinNetmagSta;                 /* min number of stamags for netmag */
 extern int MagnitudesOnly;                      /* calculate magnitudes only */
 
@@ -93,6 +97,7 @@ extern int MagnitudesOnly;                      /* calculate magnitudes only */
 
 /*
  * Local functions
+ *    LocateWithContext
  *    GetNdef
  *    GetResiduals
  *    BuildGd
@@ -102,13 +107,15 @@ extern int MagnitudesOnly;                      /* calculate magnitudes only */
  *    ConvergenceTest
  *    WxG
  */
+static int LocateWithContext(ILOC_CONTEXT *ctx, int isf, int db,
+        int *total, int *fail, int *opt, EVREC *e, HYPREC h[], SOLREC *s,
+        PHAREC p[], FILE *isfout, char *magbloc);
 static int GetNdef(int numPhase, PHAREC p[], int nsta, STAREC stalist[],
         double *toffset);
-static int GetResiduals(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, short int **topo,
-        int iszderiv, int *has_depdpres, int *ndef, int *ischanged, int iter,
-        int ispchange, int prevndef, int *nunp, char **phundef, double **dcov,
-        double **w, int is2nderiv);
+static int GetResiduals(ILOC_CONTEXT *ctx, SOLREC *sp, READING *rdindx,
+        PHAREC p[], int iszderiv, int *has_depdpres, int *ndef, int *ischanged,
+        int iter, int ispchange, int prevndef, int *nunp, char **phundef,
+        double **dcov, double **w, int is2nderiv);
 static double BuildGd(int ndef, SOLREC *sp, PHAREC p[], int fixdepthfornow,
         double **g, double *d);
 static int ProjectGd(int ndef, int m, double **g, double *d, double **w,
@@ -156,7 +163,13 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
  *           calculates residuals for all reported phases
  *        reports results
  *
+ *     The locator context is bound to the calling thread for the duration
+ *        of the location, and the resulting event-level state (errorcode,
+ *        PrevLat/PrevLon, regenerated local TT tables, ...) is stored back
+ *        in the context.
+ *
  *  Input arguments:
+ *     ctx       - pointer to locator context (configuration and aux data)
  *     isf       - ISF text file input?
  *     db        - database connection
  *                    0=none, 1=ISCPG, 2=SC3PG, 3=IDCPG, 4=SC3MYSQL, 5=IDCORA
@@ -164,21 +177,10 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
  *     h         - array of hypocentres
  *     s         - pointer to current solution
  *     p         - array of phase structures
- *     ismbQ     - use mb magnitude attenuation table? (0/1)
- *     mbQ       - pointer to mb Q(d,h) table
- *     ec        - pointer to ellipticity correction coefficient structure
- *     TTtables  - array of travel-time tables
- *     LocalTTtables - pointer to local travel-time tables
- *     variogram - pointer to generic variogram model
- *     gres      - grid spacing in default depth grid
- *     ngrid     - number of grid points in default depth grid
- *     DepthGrid - pointer to default depth grid (lat, lon, depth)
- *     fe        - pointer to FE structure
- *     GrnDepth  - pointer to geographic region default depths
- *     topo      - ETOPO bathymetry/elevation matrix
  *     isfout    - file pointer to ISF output file
  *     magbloc   - reported magnitudes from ISF input file
  *  Output arguments:
+ *     ctx       - pointer to locator context
  *     e         - pointer to event info
  *     s         - pointer to current solution
  *     p         - array of phase structures
@@ -188,7 +190,75 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
  *  Return:
  *     0/1 on success/error
  *  Called by:
- *     main
+ *     main, BatchWorker
+ *  Calls:
+ *     SetContext, LocateWithContext, GetContext, AllocateTTcache,
+ *     FreeTTcache, ResetCorrectionCache
+ */
+int Locator(ILOC_CONTEXT *ctx, int isf, int db, int *total, int *fail,
+        int *opt, EVREC *e, HYPREC h[], SOLREC *s, PHAREC p[], FILE *isfout,
+        char *magbloc)
+{
+    int ret;
+    SetContext(ctx);
+/*
+ *  per-event TT prediction cache
+ */
+    TTcache = (TT_CACHE *)NULL;
+    if (UseTTcache)
+        TTcache = AllocateTTcache(e->numPhase, TTcacheTolerance);
+/*
+ *  per-event station and bounce point correction cache
+ */
+    if (UseCorrectionCache)
+        ResetCorrectionCache(e->numPhase, p);
+    ret = LocateWithContext(ctx, isf, db, total, fail, opt, e, h, s, p,
+                            isfout, magbloc);
+    if (TTcache != NULL) {
+        if (verbose) {
+            fprintf(logfp, "TT cache (tol %.3f km): %ld lookups, %ld hits ",
+                    TTcache->tol, TTcache->nlookup, TTcache->nhit);
+            fprintf(logfp, "(%.1f%%), %ld evictions\n",
+                    TTcache->nlookup ?
+                    100. * TTcache->nhit / TTcache->nlookup : 0.,
+                    TTcache->nevict);
+        }
+        ctx->TTcacheLookups += TTcache->nlookup;
+        ctx->TTcacheHits += TTcache->nhit;
+        FreeTTcache(TTcache);
+        TTcache = (TT_CACHE *)NULL;
+    }
+    if (UseCorrectionCache) {
+        if (verbose) {
+            fprintf(logfp, "Correction cache: elevation %ld cached, ",
+                    CorrStats.nelev);
+            fprintf(logfp, "%ld calculated; bounce (tol %.3f km) ",
+                    CorrStats.nelevcalc, BounceTolerance);
+            fprintf(logfp, "%ld skipped, %ld recomputed\n",
+                    CorrStats.nbounce, CorrStats.nbouncecalc);
+        }
+        ctx->CorrStats.nelev += CorrStats.nelev;
+        ctx->CorrStats.nelevcalc += CorrStats.nelevcalc;
+        ctx->CorrStats.nbounce += CorrStats.nbounce;
+        ctx->CorrStats.nbouncecalc += CorrStats.nbouncecalc;
+    }
+    GetContext(ctx);
+    return ret;
+}
+
+/*
+ *  Title:
+ *     LocateWithContext
+ *  Synopsis:
+ *     Locates an event with the locator context bound to the calling thread.
+ *  Input Arguments:
+ *     see Locator
+ *  Output Arguments:
+ *     see Locator
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     Locator
  *  Calls:
  *     gettimeofday, InitializeEvent, PrintHypocenter, Synthetic,
  *     InitialHypocenter, EpochToHuman, GetStalist, GetDistanceMatrix,
@@ -199,13 +269,12 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
  *     RemovePFAKE, LocationQuality, NetworkMagnitudes, GregionNumber,
  *     PrintPhases, PrintSolution, ResidualsForFixedHypocenter,
  *     WriteEventToSC3database, WriteEventToISCdatabase, WriteISF,
- *     RemoveISCHypocenter, ReplaceISCPrime, ReplaceISCAssociation, DistAzimuth
+ *     RemoveISCHypocenter, ReplaceISCPrime, ReplaceISCAssociation, DistAzimuth,
+ *     DeferISFOutput
  */
- int Locator(int isf, int db, int *total, int *fail, int *opt,
-        EVREC *e, HYPREC h[], SOLREC *s, PHAREC p[], int ismbQ, MAGQ *mbQ,
-        EC_COEF *ec, TT_TABLE *TTtables, TT_TABLE *LocalTTtables[],
-        VARIOGRAM *variogram, double gres, int ngrid, double **DepthGrid,
-        FE *fe, double *GrnDepth, short int **topo, FILE *isfout, char *magbloc)
+static int LocateWithContext(ILOC_CONTEXT *ctx, int isf, int db,
+        int *total, int *fail, int *opt, EVREC *e, HYPREC h[], SOLREC *s,
+        PHAREC p[], FILE *isfout, char *magbloc)
 {
     HYPREC starthyp;                                   /* median hypocenter */
     SOLREC grds;                                         /* solution record */
@@ -218,7 +287,17 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
     STAREC *stalist = (STAREC *)NULL;                /* unique station list */
     STAORDER *staorder = (STAORDER *)NULL;              /* NN station order */
     READING *rdindx = (READING *)NULL;                          /* Readings */
-    TT_TABLE *LocalTTtable = *LocalTTtables;
+    TT_TABLE *TTtables = ctx->TTtables;        /* global travel-time tables */
+    TT_TABLE *LocalTTtable = ctx->LocalTTtables; /* local travel-time tables */
+    EC_COEF *ec = ctx->ec;           /* ellipticity correction coefficients */
+    MAGQ *mbQ = ctx->mbQ;                     /* magnitude attenuation table */
+    FE *fe = ctx->fe;             /* Flinn-Engdahl geographic region numbers */
+    double **DepthGrid = ctx->DepthGrid;              /* default depth grid */
+    double *GrnDepth = ctx->GrnDepth;               /* default depths by grn */
+    ETOPO *topo = ctx->topo;                  /* ETOPO bathymetry/elevation */
+    double gres = ctx->gres;                      /* default depth grid res */
+    int ngrid = ctx->ngrid;                 /* number of default depth grid */
+    int ismbQ = ctx->ismbQ;                  /* apply magnitude attenuation? */
 #ifdef PGSQL
     PGresult *res_set = (PGresult *)NULL;
 #endif
@@ -227,14 +306,15 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
     const char *query = "set transaction name 'IDCDB'";
 #endif
     HYPREC temp;
+    TT_CACHE *ttcache = (TT_CACHE *)NULL;  /* TT cache, suspended during NA */
     char timestr[25], gregname[255];
     char filename[FILENAMELEN];
-    int iszderiv = 0, firstpass = 1, DoGridSearch_cf = DoGridSearch;
+    int iszderiv = 0, firstpass = 1, nafail = 0;
     int option = 0, grn = 0, i, isgridsearch, istimefix;
     int hasDepthResolution = 0, has_depdpres = 0, isdefdep = 0;
     int nsta = 0, ndef = 0, ntimedef = 0, is2nderiv = 1;
     double mediandepth, medianot, medianlat, medianlon, epidist, x, y;
-    isgridsearch = DoGridSearch;
+    isgridsearch = ctx->DoGridSearch;
     s->hypid = 0;
 /*
  *
@@ -280,7 +360,7 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
         fprintf(logfp, "Calculate residuals for fixed hypocentre\n");
         s->numUnknowns = 0;
         s->hypofix = 1;
-        Synthetic(e, &h[0], s, rdindx, p, ec, TTtables, LocalTTtables,
+        Synthetic(e, &h[0], s, rdindx, p, ec, TTtables, &ctx->LocalTTtables,
                   topo, db, isf);
 /*
  *      Magnitudes
@@ -327,17 +407,19 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
             s->timfix = 1;
             s->epifix = 1;
             s->depfix = 1;
-            i = s->hypid;
-            if (i == 0) s->hypid = *total;
-            if (*total == 0) {
+            if (DeferISFOutput(s, stamag, rdmag, grn) == 0) {
+                i = s->hypid;
+                if (i == 0) s->hypid = *total;
+                if (*total == 0) {
 /*
- *              Write event header
+ *                  Write event header
  */
-                fprintf(isfout, "BEGIN IMS2.0\n");
-                fprintf(isfout, "DATA_TYPE BULLETIN IMS1.0:short with ISF2.1 extensions\n");
+                    fprintf(isfout, "BEGIN IMS2.0\n");
+                    fprintf(isfout, "DATA_TYPE BULLETIN IMS1.0:short with ISF2.1 extensions\n");
+                }
+                WriteISF(isfout, e, s, h, p, stamag, rdmag, grn, magbloc);
+                s->hypid = i;
             }
-            WriteISF(isfout, e, s, h, p, stamag, rdmag, grn, magbloc);
-            s->hypid = i;
         }
         Free(rdmag[0]);
         Free(rdmag);
@@ -355,7 +437,7 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
         fprintf(logfp, "Calculate magnitudes for the preferred hypocentre\n");
         s->numUnknowns = 0;
         ResidualsForFixedHypocenter(e, &h[0], s, rdindx, p, ec,
-                                    TTtables, LocalTTtables, topo);
+                                    TTtables, &ctx->LocalTTtables, topo);
 /*
  *      Magnitudes
  */
@@ -525,17 +607,19 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
  *      Write event to ISF2 file if required.
  */
         if (ISFOutputFile[0]) {
-            i = s->hypid;
-            if (i == 0) s->hypid = *total;
-            if (*total == 1) {
+            if (DeferISFOutput(s, stamag, rdmag, grn) == 0) {
+                i = s->hypid;
+                if (i == 0) s->hypid = *total;
+                if (*total == 1) {
 /*
- *              Write event header
+ *                  Write event header
  */
-                fprintf(isfout, "BEGIN IMS2.0\n");
-                fprintf(isfout, "DATA_TYPE BULLETIN IMS1.0:short with ISF2.1 extensions\n");
+                    fprintf(isfout, "BEGIN IMS2.0\n");
+                    fprintf(isfout, "DATA_TYPE BULLETIN IMS1.0:short with ISF2.1 extensions\n");
+                }
+                WriteISF(isfout, e, s, h, p, stamag, rdmag, grn, magbloc);
+                s->hypid = i;
             }
-            WriteISF(isfout, e, s, h, p, stamag, rdmag, grn, magbloc);
-            s->hypid = i;
         }
         Free(rdmag[0]);
         Free(rdmag);
@@ -573,7 +657,7 @@ static int ConvergenceTest(int iter, int m, int *nds, double *sol,
 /*
  *  correlated errors
  */
-    if (DoCorrelatedErrors) {
+    if (ctx->DoCorrelatedErrors) {
         if ((staorder = (STAORDER *)calloc(nsta, sizeof(STAORDER))) == NULL) {
             fprintf(logfp, "ABORT: staorder: cannot allocate memory\n");
             fprintf(errfp, "staorder: cannot allocate memory\n");
@@ -750,7 +834,7 @@ again:
                     fprintf(logfp, "Cannot generate local TT tables!\n");
                     UseLocalTT = 0;
                 }
-                *LocalTTtables = LocalTTtable;
+                ctx->LocalTTtables = LocalTTtable;
             }
         }
 /*
@@ -765,7 +849,7 @@ again:
 /*
  *      deal with duplicate picks
  */
-        if (DuplicatePhases(s, p, ec, TTtables, LocalTTtable, topo))
+        if (DuplicatePhases(ctx, s, p))
             continue;
 /*
  *
@@ -781,7 +865,7 @@ again:
 /*
  *          set up search space for NA
  */
-            if (SetNASearchSpace(&grds, &nasp)) {
+            if (SetNASearchSpace(ctx, &grds, &nasp)) {
                 fprintf(logfp, "    WARNING: SetNASearchSpace failed!\n");
             }
             else {
@@ -790,9 +874,12 @@ again:
  */
                 if (WriteNAResultsToFile)
                     sprintf(filename, "%d.%d.gsres", e->evid, option);
-                if (NASearch(nsta, &grds, p, TTtables, LocalTTtable, ec,
-                              topo, stalist, distmatrix, variogram, staorder,
-                              &nasp, filename, is2nderiv)) {
+                ttcache = TTcache;
+                TTcache = (TT_CACHE *)NULL;
+                nafail = NASearch(ctx, nsta, &grds, p, stalist, distmatrix,
+                                  staorder, &nasp, filename, is2nderiv);
+                TTcache = ttcache;
+                if (nafail) {
                     fprintf(logfp, "    WARNING: NASearch failed!\n");
                     memmove(&grds, s, sizeof(SOLREC));
                 }
@@ -830,12 +917,12 @@ again:
                             fprintf(logfp, "Cannot generate local TT tables!\n");
                             UseLocalTT = 0;
                         }
-                        *LocalTTtables = LocalTTtable;
+                        ctx->LocalTTtables = LocalTTtable;
                     }
                     GetDeltaAzimuth(s, p, 0);
                     ReIdentifyPhases(s, rdindx, p, ec, TTtables, LocalTTtable,
                                      topo, is2nderiv);
-                    DuplicatePhases(s, p, ec, TTtables, LocalTTtable, topo);
+                    DuplicatePhases(ctx, s, p);
                 }
                 fprintf(logfp, "NA (%.4f) done\n", secs(&t0));
             }
@@ -927,9 +1014,8 @@ again:
  *
  */
         fprintf(logfp, "Event location\n");
-        if (LocateEvent(option, nsta, has_depdpres, s, rdindx, p, ec,
-                        TTtables, LocalTTtable, stalist, distmatrix,
-                        variogram, staorder, topo, is2nderiv)) {
+        if (LocateEvent(ctx, option, nsta, has_depdpres, s, rdindx, p,
+                        stalist, distmatrix, staorder, is2nderiv)) {
 /*
  *          divergent solution
  */
@@ -988,14 +1074,13 @@ again:
 /*
  *  End of option loop
  */
-    DoGridSearch = DoGridSearch_cf;
     if (verbose)
         fprintf(logfp, "End of option loop (%.4f)\n", secs(&t0));
 /*
  *  Free memory
  */
     Free(stalist);
-    if (DoCorrelatedErrors) {
+    if (ctx->DoCorrelatedErrors) {
         FreeFloatMatrix(distmatrix);
         Free(staorder);
     }
@@ -1281,17 +1366,19 @@ again:
  *      Write event to ISF2 file if required.
  */
         if (ISFOutputFile[0]) {
-            i = s->hypid;
-            if (i == 0) s->hypid = *total;
-            if (*total == 1) {
+            if (DeferISFOutput(s, stamag, rdmag, grn) == 0) {
+                i = s->hypid;
+                if (i == 0) s->hypid = *total;
+                if (*total == 1) {
 /*
- *              Write event header
+ *                  Write event header
  */
-                fprintf(isfout, "BEGIN IMS2.0\n");
-                fprintf(isfout, "DATA_TYPE BULLETIN IMS1.0:short with ISF2.1 extensions\n");
+                    fprintf(isfout, "BEGIN IMS2.0\n");
+                    fprintf(isfout, "DATA_TYPE BULLETIN IMS1.0:short with ISF2.1 extensions\n");
+                }
+                WriteISF(isfout, e, s, h, p, stamag, rdmag, grn, magbloc);
+                s->hypid = i;
             }
-            WriteISF(isfout, e, s, h, p, stamag, rdmag, grn, magbloc);
-            s->hypid = i;
         }
         Free(rdmag[0]);
         Free(rdmag);
@@ -1348,7 +1435,7 @@ again:
  */
         fprintf(logfp, "Calculate residuals w.r.t. previous preferred origin\n");
         ResidualsForFixedHypocenter(e, &h[0], s, rdindx, p, ec,
-                                    TTtables, LocalTTtables, topo);
+                                    TTtables, &ctx->LocalTTtables, topo);
         PrintPhases(s->numPhase, p);
         Free(rdindx);
         fprintf(logfp, "FAILURE\n");
@@ -1427,7 +1514,7 @@ again:
  */
 void Synthetic(EVREC *ep, HYPREC *hp, SOLREC *sp, READING *rdindx, PHAREC p[],
                EC_COEF *ec, TT_TABLE *TTtables, TT_TABLE *LocalTTtables[],
-               short int **topo, int db, int isf)
+               ETOPO *topo, int db, int isf)
 {
 /*
  *  Set solution to favourite hypocenter and calculate residuals
@@ -1486,7 +1573,7 @@ void Synthetic(EVREC *ep, HYPREC *hp, SOLREC *sp, READING *rdindx, PHAREC p[],
  */
 void ResidualsForFixedHypocenter(EVREC *ep, HYPREC *hp, SOLREC *sp,
         READING *rdindx, PHAREC p[], EC_COEF *ec, TT_TABLE *TTtables,
-        TT_TABLE *LocalTTtables[], short int **topo)
+        TT_TABLE *LocalTTtables[], ETOPO *topo)
 {
     TT_TABLE *LocalTTtable = *LocalTTtables;
     int is2nderiv = 0;
@@ -1587,6 +1674,7 @@ void ResidualsForFixedHypocenter(EVREC *ep, HYPREC *hp, SOLREC *sp,
  *            renamed or defining phases were made non-defining during an
  *            iteration.
  *  Input arguments:
+ *     ctx          - pointer to locator context
  *     option       - locator option
  *                    option 0 = free depth
  *                    option 1 = depth fixed to default regional depth
@@ -1599,17 +1687,9 @@ void ResidualsForFixedHypocenter(EVREC *ep, HYPREC *hp, SOLREC *sp,
  *     sp           - pointer to current solution
  *     rdindx       - array of reading structures
  *     p            - array of phase structures
- *     ec           - pointer to ellipticity correction coefficient structure
- *     TTtables     - pointer to travel-time tables
- *     LocalTTtables - pointer to local travel-time tables
  *     stalist      - array of starec structures
  *     distmatrix   - station separation matrix
- *     variogramp   - pointer to generic variogram model
  *     staorder     - array of staorder structures (nearest-neighbour order)
- *     gres         - grid spacing in default depth grid
- *     ngrid        - number of grid points in default depth grid
- *     DepthGrid    - pointer to default depth grid (lat, lon, depth)
- *     topo         - ETOPO bathymetry/elevation matrix
  *  Output arguments:
  *     sp           - pointer to current solution.
  *     p            - array of phase structures
@@ -1626,12 +1706,15 @@ void ResidualsForFixedHypocenter(EVREC *ep, HYPREC *hp, SOLREC *sp,
  *     ConvergenceTest, PointAtDeltaAzimuth, PrintSolution, PrintDefiningPhases,
  *     SortPhasesFromDatabase, SVDModelCovarianceMatrix, Uncertainties
  */
-int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
-        READING *rdindx, PHAREC p[], EC_COEF *ec, TT_TABLE *TTtables,
-        TT_TABLE *LocalTTtable, STAREC stalist[], double **distmatrix,
-        VARIOGRAM *variogramp, STAORDER staorder[], short int **topo,
-        int is2nderiv)
+int LocateEvent(ILOC_CONTEXT *ctx, int option, int nsta, int has_depdpres,
+        SOLREC *sp, READING *rdindx, PHAREC p[], STAREC stalist[],
+        double **distmatrix, STAORDER staorder[], int is2nderiv)
 {
+    EC_COEF *ec = ctx->ec;
+    TT_TABLE *TTtables = ctx->TTtables;
+    TT_TABLE *LocalTTtable = ctx->LocalTTtables;
+    VARIOGRAM *variogramp = ctx->variogram;
+    ETOPO *topo = ctx->topo;
     int i, j, k, m, iter, iserr = 0, nds[3], isconv = 0, isdiv = 0;
     int iszderiv = 0, fixdepthfornow = 0, nairquakes = 0, ndeepquakes = 0;
     int prank = 0, dpok = 0, ndef = 0, nd = 0, nr = 0, nunp = 0;
@@ -1708,7 +1791,7 @@ int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
  *  reorder phaserecs by staorder, rdid, time so that covariance matrices
  *  for various phases will become block-diagonal
  */
-    if (DoCorrelatedErrors) {
+    if (ctx->DoCorrelatedErrors) {
         SortPhasesForNA(sp->numPhase, nsta, p, stalist, staorder);
         Readings(sp->numPhase, sp->nreading, p, rdindx);
         dpok = DepthPhaseCheck(sp, rdindx, p, 0);
@@ -1800,12 +1883,12 @@ int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
             }
             ispchange = ReIdentifyPhases(sp, rdindx, p, ec, TTtables,
                                          LocalTTtable, topo, is2nderiv);
-            DuplicatePhases(sp, p, ec, TTtables, LocalTTtable, topo);
+            DuplicatePhases(ctx, sp, p);
         }
 /*
  *      get residuals w.r.t. current solution
  */
-        if (GetResiduals(sp, rdindx, p, ec, TTtables, LocalTTtable, topo,
+        if (GetResiduals(ctx, sp, rdindx, p,
                          iszderiv, &dpok, &ndef, &ischanged, iter, ispchange,
                          nd, &nunp, phundef, dcov, w, is2nderiv))
             break;
@@ -1837,7 +1920,7 @@ int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
 /*
  *          account for correlated error structure
  */
-            if (DoCorrelatedErrors) {
+            if (ctx->DoCorrelatedErrors) {
 /*
  *              construct data covariance matrix
  */
@@ -1871,7 +1954,7 @@ int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
                 if ((d = (double *)calloc(nd, sizeof(double))) == NULL)
                     break;
             }
-            if (DoCorrelatedErrors) {
+            if (ctx->DoCorrelatedErrors) {
 /*
  *              recalculate the data covariance and projection matrices
  */
@@ -1902,7 +1985,7 @@ int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
  */
             isconv = 0;
             nd = ndef;
-            if (DoCorrelatedErrors) {
+            if (ctx->DoCorrelatedErrors) {
                 if (verbose) {
                     fprintf(logfp, "    Changes in defining phasenames, ");
                     fprintf(logfp, "recalculating projection matrix\n");
@@ -1945,7 +2028,7 @@ int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
  *      build G matrix and d vector
  */
         urms = BuildGd(nd, sp, p, fixdepthfornow, g, d);
-        if (DoCorrelatedErrors) {
+        if (ctx->DoCorrelatedErrors) {
 /*
  *          project Gm = d into eigensystem
  */
@@ -2230,7 +2313,7 @@ int LocateEvent(int option, int nsta, int has_depdpres, SOLREC *sp,
 /*
  *  free memory allocated to various arrays
  */
-    if (DoCorrelatedErrors) {
+    if (ctx->DoCorrelatedErrors) {
         FreeFloatMatrix(w);
         FreeFloatMatrix(dcov);
     }
@@ -2494,11 +2577,9 @@ void FreePhaseList(int nphases, PHASELIST plist[])
  *         deletes corresponding row and column in the data covariance and
  *         projection matrices.
  *  Input Arguments:
+ *     ctx       - pointer to locator context
  *     sp        - pointer to current solution
  *     p[]       - array of phase structures
- *     ec        - pointer to ellipticity correction coefficient structure
- *     TTtables - pointer to travel-time tables
- *     topo      - ETOPO bathymetry/elevation matrix
  *     iszderiv  - calculate dtdh [0/1]?
  *     iter      - iteration number
  *     ispchange - change in phase names?
@@ -2520,11 +2601,10 @@ void FreePhaseList(int nphases, PHASELIST plist[])
  *  Calls:
  *     DepthPhaseCheck, TravelTimeResiduals
  */
-static int GetResiduals(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, short int **topo,
-        int iszderiv, int *has_depdpres, int *ndef, int *ischanged, int iter,
-        int ispchange, int prevndef, int *nunp, char **phundef, double **dcov,
-        double **w, int is2nderiv)
+static int GetResiduals(ILOC_CONTEXT *ctx, SOLREC *sp, READING *rdindx,
+        PHAREC p[], int iszderiv, int *has_depdpres, int *ndef, int *ischanged,
+        int iter, int ispchange, int prevndef, int *nunp, char **phundef,
+        double **dcov, double **w, int is2nderiv)
 {
     int i, j, k = 0, m = 0, kp = 0, nd = 0, nund = 0, isdiff = 0, isfound = 0;
     extern double SigmaThreshold;                        /* from config file */
@@ -2537,8 +2617,8 @@ static int GetResiduals(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
 /*
  *  set ttime, residual, dtdh, and dtdd for defining phases
  */
-    if (TravelTimeResiduals(sp, p, "use", ec, TTtables, LocalTTtable, topo,
-                            iszderiv, is2nderiv))
+    if (TravelTimeResiduals(sp, p, "use", ctx->ec, ctx->TTtables,
+                            ctx->LocalTTtables, ctx->topo, iszderiv, is2nderiv))
         return 1;
 /*
  *  see if set of time defining phases has changed
@@ -2563,7 +2643,7 @@ static int GetResiduals(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
 /*
  *          delete corresponding row and column in dcov and w
  */
-            if (iter && !ispchange && DoCorrelatedErrors) {
+            if (iter && !ispchange && ctx->DoCorrelatedErrors) {
                 isfound = 0;
                 for (j = 0; j < kp; j++)
                     if (streq(phundef[j], p[i].phase)) isfound = 1;
@@ -2611,7 +2691,7 @@ static int GetResiduals(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
 /*
  *          delete corresponding row and column in dcov and w
  */
-            if (iter && !ispchange && DoCorrelatedErrors) {
+            if (iter && !ispchange && ctx->DoCorrelatedErrors) {
                 isfound = 0;
                 for (j = 0; j < kp; j++)
                     if (streq(phundef[j], p[i].phase)) isfound = 1;
@@ -2659,7 +2739,7 @@ static int GetResiduals(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
 /*
  *          delete corresponding row and column in dcov and w
  */
-            if (iter && !ispchange && DoCorrelatedErrors) {
+            if (iter && !ispchange && ctx->DoCorrelatedErrors) {
                 isfound = 0;
                 for (j = 0; j < kp; j++)
                     if (streq(phundef[j], p[i].phase)) isfound = 1;
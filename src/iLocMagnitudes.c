@@ -28,14 +28,12 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;   /* verbose level */
-extern FILE *logfp;
+extern THREADLOCAL int verbose;                              /* verbose level */
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 extern int numAgencies;
 extern char agencies[MAXBUF][AGLEN];
-extern char PhaseWithoutResidual[MAXNUMPHA][PHALEN];      /* from model file */
-extern int PhaseWithoutResidualNum;       /* number of 'non-residual' phases */
 extern double MagMaxTimeResidual;  /* max allowable time residual for stamag */
 /*
  * Functions:
@@ -492,10 +490,8 @@ static double GetStationmb(int start, int n, PHAREC p[], int mtypeid,
 /*
  *      Only consider phases with acceptable time residuals (if any)
  */
-        for (j = 0; j < PhaseWithoutResidualNum; j++)
-            if (streq(p[i].phase, PhaseWithoutResidual[j]))
-                break;
-        if (j == PhaseWithoutResidualNum && fabs(p[i].timeres) > MagMaxTimeResidual)
+        if (!isNoResidualPhase(p[i].phase) &&
+            fabs(p[i].timeres) > MagMaxTimeResidual)
             continue;
 /*
  *      Loop over amplitudes
@@ -741,10 +737,8 @@ static double GetStationmB(int start, int n, PHAREC p[], int mtypeid,
 /*
  *      Only consider phases with acceptable time residuals (if any)
  */
-        for (j = 0; j < PhaseWithoutResidualNum; j++)
-            if (streq(p[i].phase, PhaseWithoutResidual[j]))
-                break;
-        if (j == PhaseWithoutResidualNum && fabs(p[i].timeres) > MagMaxTimeResidual)
+        if (!isNoResidualPhase(p[i].phase) &&
+            fabs(p[i].timeres) > MagMaxTimeResidual)
             continue;
 /*
  *      Loop over amplitudes
@@ -1273,10 +1267,8 @@ static double GetStationML(int start, int n, PHAREC p[], int mtypeid)
 /*
  *      Only consider phases with acceptable time residuals (if any)
  */
-        for (j = 0; j < PhaseWithoutResidualNum; j++)
-            if (streq(p[i].phase, PhaseWithoutResidual[j]))
-                break;
-        if (j == PhaseWithoutResidualNum && fabs(p[i].timeres) > MagMaxTimeResidual)
+        if (!isNoResidualPhase(p[i].phase) &&
+            fabs(p[i].timeres) > MagMaxTimeResidual)
             continue;
 /*
  *      Loop over amplitudes
@@ -70,6 +70,13 @@
  *          or (number of defining PcP, ScS >= MinCorePhases and
  *              number of agencies reporting core reflections >= MindDepthPhaseAgencies)
  *     mb, mB, MS and ML determination from reported amplitudes
+ *     multi-threaded event-level batch processing of ISF input files
+ *         (--threads N)
+ *     libiloc shared library with a per-event C API for embedding iLoc
+ *         in real-time pipelines (iloc_init, iloc_locate, iloc_free)
+ *     persistent daemon mode (iLoc serve) that keeps the aux data in memory
+ *         and locates ISF events sent over a Unix-domain socket
+ *     prefork worker pool for database-driven processing (--workers N)
  *     supports Gutenberg-Richter, Veith-Clawson, and Murphy-Barker magnitude
  *         attenuation curves
  *
@@ -140,11 +147,18 @@
  *         ZipKML                  - zip KML output file(s) and remove kml
  *     Travel time table [ak135|iasp91]
  *         TTimeTable = ak135 - travel time table name
+ *         LazyTTtables = 0   - read TT tables on first use?
+ *         UseTTcache = 0     - memoize TT predictions within an event?
+ *         TTcacheTolerance = 0 - hypocentre tolerance of TT cache [km]
+ *         UseCorrectionCache = 0 - cache station/bounce corrections?
+ *         BounceTolerance = 0 - bounce point move to recompute [km]
  *     ETOPO parameters
  *         EtopoFile = etopo5_bed_g_i2.bin - ETOPO file name
  *         EtopoNlon = 4321                - ETOPO longitude samples
  *         EtopoNlat = 2161                - ETOPO latitude samples
  *         EtopoRes = 0.0833333            - ETOPO resolution
+ *         EtopoTileCache = 0              - ETOPO tiles kept per thread
+ *         EtopoCellCache = 0              - memoize bounce-point cells?
  *     Depth resolution
  *         MinDepthPhases = 3  - min number of depth phases for depth-phase depth
  *         MindDepthPhaseAgencies = 1 - min number of depth-phase agencies
@@ -180,6 +194,15 @@
  *         NAinitialSample = 1500  - size of initial sample
  *         NAnextSample = 150   - size of subsequent samples
  *         NAcells = 25         - number of cells to be resampled
+ *         NAthreads = 1        - threads evaluating the NA samples
+ *         NAttGrid = 0         - interpolate TT from a grid in NA?
+ *         NAttGridDelta = 0.5  - NA TT grid delta spacing [deg]
+ *         NAttGridDepth = 10   - NA TT grid depth spacing [km]
+ *         NAmisfitTol = 0      - min relative misfit improvement per iter
+ *         NAstallIter = 2      - stop after this many stalled iterations
+ *         NAcellTol = 0        - min spread of the best cells
+ *         NAmaxTime = 0        - wall-clock budget for NA [s]
+ *         NAspatialIndex = 0   - kd-tree for NA Voronoi resampling?
  *         iseed = 5590         - random number seed
  *     Magnitude calculations
  *         mbQtable = GR       - magnitude correction table [GR,VC,MB,none]
@@ -202,6 +225,8 @@
  *         UseRSTTPgLg = 1  - use RSTT Pg/Lg predictions?
  *     Local velocity model
  *         MaxLocalTTDelta = 3. - use local TT up to this distance
+ *         LocalTTthreads = 1   - threads generating the local TT tables
+ *         LocalTTcacheDir =    - directory of cached local TT tables
  *         LocalTTfromRSTT = 0  - get local TT from RSTT model at epicentre
  *         LocalVmodelFile =    - pathname for local velocity model (non-RSTT)
  *
@@ -290,8 +315,8 @@
  * Global variables for entries from the model file
  *
  */
-double Moho;                                                /* depth of Moho */
-double Conrad;                                            /* depth of Conrad */
+THREADLOCAL double Moho;                                    /* depth of Moho */
+THREADLOCAL double Conrad;                                /* depth of Conrad */
 double MaxHypocenterDepth;                           /* max hypocenter depth */
 double PSurfVel;                    /* Pg velocity for elevation corrections */
 double SSurfVel;                    /* Sg velocity for elevation corrections */
@@ -350,7 +375,7 @@ char OutputDB[VALLEN];           /* write results to this DB account, if any */
 char DBuser[VALLEN];                                        /* database user */
 char DBpasswd[VALLEN];                                  /* database password */
 char DBname[VALLEN];                                        /* database host */
-int verbose;                                              /* verbosity level */
+THREADLOCAL int verbose;                                  /* verbosity level */
 /*
  * iteration control
  */
@@ -358,7 +383,7 @@ int MinIterations;                               /* min number of iterations */
 int MaxIterations;                               /* max number of iterations */
 int MinNdefPhases;                                   /* min number of phases */
 double SigmaThreshold;                    /* to exclude phases from solution */
-int DoCorrelatedErrors;                     /* account for correlated errors */
+THREADLOCAL int DoCorrelatedErrors;         /* account for correlated errors */
 int AllowDamping;                        /* allow damping in LSQR iterations */
 double ConfidenceLevel;                /* confidence level for uncertainties */
 int DoNotRenamePhase;                            /* do not reidentify phases */
@@ -406,17 +431,29 @@ int CalculatemB ;                                 /* calculate broadband mB? */
 /*
  * NA search parameters
  */
-int DoGridSearch;                /* perform grid search for initial location */
+THREADLOCAL int DoGridSearch;    /* perform grid search for initial location */
 int WriteNAResultsToFile;                           /* write results to file */
-double NAsearchRadius;              /* search radius around preferred origin */
+THREADLOCAL double NAsearchRadius;  /* search radius around preferred origin */
 double NAsearchDepth;           /* search radius (km) around preferred depth */
-double NAsearchOT;                  /* search radius (s) around preferred OT */
+THREADLOCAL double NAsearchOT;      /* search radius (s) around preferred OT */
 double NAlpNorm;                       /* p-value for norm to compute misfit */
-int NAiterMax;                                   /* max number of iterations */
-int NAinitialSample;                               /* size of initial sample */
-int NAnextSample;                              /* size of subsequent samples */
-int NAcells;                              /* number of cells to be resampled */
-long iseed;                                            /* random number seed */
+int NAiterMax;                                  /* max number of iterations */
+int NAinitialSample;                              /* size of initial sample */
+int NAnextSample;                             /* size of subsequent samples */
+int NAcells;                             /* number of cells to be resampled */
+int NAthreads;                         /* threads evaluating the NA samples */
+int NAttGrid;                          /* interpolate TT from a grid in NA? */
+double NAttGridDelta;                     /* NA TT grid delta spacing [deg] */
+double NAttGridDepth;                      /* NA TT grid depth spacing [km] */
+double NAmisfitTol;              /* min relative improvement of best misfit */
+int NAstallIter;                 /* stop after this many stalled iterations */
+double NAcellTol;                  /* min spread of the best cells to go on */
+double NAmaxTime;                           /* wall-clock budget for NA [s] */
+int NAspatialIndex;               /* kd-tree for the NA Voronoi resampling? */
+THREADLOCAL TT_GRID *TTgrid;          /* TT grid used by the calling thread */
+THREADLOCAL long TTgridInterp;      /* TT values interpolated from the grid */
+THREADLOCAL long TTgridExact;   /* TT table evaluations instead of the grid */
+THREADLOCAL long iseed;                               /* random number seed */
 /*
  * agencies whose hypocenters not to be used in setting initial hypocentre
  */
@@ -429,15 +466,26 @@ char EtopoFile[FILENAMELEN];                      /* filename for ETOPO file */
 int EtopoNlon;                       /* number of longitude samples in ETOPO */
 int EtopoNlat;                        /* number of latitude samples in ETOPO */
 double EtopoRes;                                        /* cellsize in ETOPO */
+int EtopoTileCache;              /* tiled ETOPO tiles kept per thread [0-64] */
+int EtopoCellCache;                /* memoize bounce-point ETOPO cells [0/1] */
 /*
  * TT
  */
 char TTimeTable[VALLEN];                    /* global travel time table name */
 char LocalVmodelFile[FILENAMELEN];      /* pathname for local velocity model */
-int UseLocalTT;                                  /* use local TT predictions */
+THREADLOCAL int UseLocalTT;                      /* use local TT predictions */
 double MaxLocalTTDelta;                  /* use local TT up to this distance */
+char LocalTTcacheDir[FILENAMELEN];    /* directory of cached local TT tables */
+int LocalTTthreads;                /* threads generating the local TT tables */
+int LazyTTtables;                       /* read TT tables on first use [0/1] */
+int UseTTcache;                    /* memoize TT predictions within an event */
+double TTcacheTolerance;            /* hypocentre tolerance of TT cache [km] */
+THREADLOCAL TT_CACHE *TTcache;        /* TT cache used by the calling thread */
+int UseCorrectionCache;            /* cache station/bounce corrections [0/1] */
+double BounceTolerance;               /* bounce point move to recompute [km] */
+THREADLOCAL CORR_STATS CorrStats;               /* correction cache counters */
 double DefaultDepth;                /* used if seed hypocentre depth is NULL */
-double PrevLat, PrevLon;                   /* epicentre of previous solution */
+THREADLOCAL double PrevLat, PrevLon;       /* epicentre of previous solution */
 int UpdateLocalTT;                                /* static/dynamic local TT */
 /*
  * RSTT parameters
@@ -446,13 +494,14 @@ char RSTTmodel[FILENAMELEN];                                   /* RSTT model */
 int UseRSTTPnSn;                               /* use RSTT Pn/Sn predictions */
 int UseRSTTPgLg;                               /* use RSTT Pg/Lg predictions */
 int UseRSTT;                                         /* use RSTT predictions */
+pthread_mutex_t RSTTmutex = PTHREAD_MUTEX_INITIALIZER;  /* serializes RSTT */
 // int LocalTTfromRSTT;                             /* local TT from RSTT model */
 /*
  *
  * file and database pointers
  *
  */
-FILE *logfp = (FILE *)NULL;                      /* file pointer to log file */
+THREADLOCAL FILE *logfp = (FILE *)NULL;          /* file pointer to log file */
 FILE *errfp = (FILE *)NULL;                    /* file pointer to error file */
 #ifdef PGSQL
 PGconn *conn = NULL;                       /* PostgreSQL database connection */
@@ -464,7 +513,7 @@ MYSQL *mysql = NULL;                           /* MySQL database connection */
 dpiConn *conn = NULL;                          /* Oracle database connection */
 dpiContext *gContext = NULL;
 #endif
-struct timeval t0;
+THREADLOCAL struct timeval t0;
 /*
  * station list from ISF file
  */
@@ -488,7 +537,7 @@ char LocalPhaseTT[MAXLOCALTTPHA][PHALEN] = {
 /*
  * Error codes
  */
-int errorcode;
+THREADLOCAL int errorcode;
 char *errorcodes[] = {
     "unknown error, please consult log file",
     "memory allocation error",
@@ -505,6 +554,7 @@ char *errorcodes[] = {
 };
 
 
+#ifndef ILOCLIB
 /*
  *
  * Local functions
@@ -538,19 +588,26 @@ int main(int argc, char *argv[])
     PHAREC *p = (PHAREC *)NULL;                             /* phase records */
     TT_TABLE *TTtables = (TT_TABLE *)NULL;      /* global travel-time tables */
     TT_TABLE *LocalTTtables = (TT_TABLE *)NULL;  /* local travel-time tables */
+    ILOC_CONTEXT ctx;                                     /* locator context */
     EC_COEF *ec = (EC_COEF *)NULL;    /* ellipticity correction coefficients */
     VARIOGRAM variogram;                          /* generic variogram model */
     MAGQ mbQ;                                 /* magnitude attenuation table */
     FE fe;                        /* Flinn-Engdahl geographic region numbers */
     double **DepthGrid = (double **)NULL;              /* default depth grid */
     double *GrnDepth = (double *)NULL;              /* default depths by grn */
-    short int **topo = (short int **)NULL;     /* ETOPO bathymetry/elevation */
+    ETOPO *topo = (ETOPO *)NULL;              /* ETOPO bathymetry/elevation */
     int total = 0, fail = 0, opt[7];                 /* counters for results */
     int ismbQ = 0;                           /* apply magnitude attenuation? */
     int isf = 0;                                     /* ISF text file choice */
     int db = 0;                                           /* database choice */
     int isbull = 0;                       /* KML bulletin file to be created */
     int ngrid = 0, i, j;
+    int nthreads = 1;                          /* number of locator threads */
+    int serve = 0;                                       /* iLoc serve mode */
+    int maxchild = 0;               /* max concurrent iLoc serve requests */
+    int nworkers = 1;                         /* number of prefork workers */
+    int supervisor = 0;                      /* supervisor of prefork pool? */
+    char sockpath[FILENAMELEN];               /* socket path for iLoc serve */
     int numECPhases = 0;
     double gres = 1.;
     double d = DEG_TO_RAD * MAX_RSTT_DIST;   /* max RSTT distance in radians */
@@ -583,6 +640,7 @@ int main(int argc, char *argv[])
     strcpy(KMLEventFile, "");
     strcpy(KMLBulletinFile, "");
     strcpy(vfile_cf, "");
+    strcpy(sockpath, ILOC_SOCKET);
     for (i = 0; i < 7; i++) opt[i] = 0;
     gettimeofday(&t00, NULL);
     gettimeofday(&t0, NULL);
@@ -654,6 +712,13 @@ int main(int argc, char *argv[])
  */
         isf = 3;
     }
+    else if (streq(argv[1], "serve")) {
+/*
+ *      daemon mode: ISF events are read from a Unix-domain socket
+ */
+        serve = 1;
+        isf = 1;
+    }
     else {
 /*
  *      invalid argument, abort!
@@ -663,6 +728,58 @@ int main(int argc, char *argv[])
         fprintf(stderr, "EVENT %.6f\n\n", secs(&t0));
         exit(1);
     }
+/*
+ *  optional arguments
+ */
+    for (i = 2; i < argc; i++) {
+        if (streq(argv[i], "--threads") && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+            if (nthreads < 1) nthreads = 1;
+        }
+        else if (streq(argv[i], "--workers") && i + 1 < argc) {
+            nworkers = atoi(argv[++i]);
+            if (nworkers < 1) nworkers = 1;
+        }
+        else if (serve && streq(argv[i], "--socket") && i + 1 < argc) {
+            strcpy(sockpath, argv[++i]);
+        }
+        else if (serve && streq(argv[i], "--children") && i + 1 < argc) {
+            maxchild = atoi(argv[++i]);
+        }
+        else if (serve && streq(argv[i], "--format") && i + 1 < argc) {
+            i++;
+            if      (streq(argv[i], "isf2.1")) isf = 1;
+            else if (streq(argv[i], "isf2.0")) isf = 2;
+            else if (streq(argv[i], "ims"))    isf = 3;
+            else {
+                PrintHelp();
+                fprintf(stderr, "ABORT: Invalid format! (%s)\n", argv[i]);
+                fprintf(stderr, "EVENT %.6f\n\n", secs(&t0));
+                exit(1);
+            }
+        }
+        else {
+            PrintHelp();
+            fprintf(stderr, "ABORT: Invalid argument! (%s)\n", argv[i]);
+            fprintf(stderr, "EVENT %.6f\n\n", secs(&t0));
+            exit(1);
+        }
+    }
+#ifdef GCD
+/*
+ *  GCD blocks share the process-wide event-level state
+ */
+    if (nthreads > 1) {
+        fprintf(stderr, "WARNING: --threads is not supported with GCD, ");
+        fprintf(stderr, "events are processed serially\n");
+        nthreads = 1;
+    }
+#endif
+    if (isf && nworkers > 1) {
+        fprintf(stderr, "WARNING: --workers requires database input, ");
+        fprintf(stderr, "use --threads for ISF input\n");
+        nworkers = 1;
+    }
     strcpy(instructfile, "stdin");
     instructfp = stdin;
 /*
@@ -740,6 +857,21 @@ int main(int argc, char *argv[])
         fprintf(errfp, "main: cannot allocate memory\n");
         exit(1);
     }
+/*
+ *
+ *  iLoc serve: the instructions come with the requests;
+ *      only the station list is read here
+ *
+ */
+    if (serve) {
+        if (isf == 2) j = ReadStafileForISF2(&StationList);
+        else          j = ReadStafileForISF(&StationList);
+        if (j) {
+            fprintf(logfp, "EVENT %.6f\n\n", secs(&t0));
+            Free(instruction);
+            exit(1);
+        }
+    }
 /*
  *
  *  ISF input file
@@ -747,7 +879,7 @@ int main(int argc, char *argv[])
  *      can run without instruction file
  *
  */
-    if (isf) {
+    else if (isf) {
         e.evid = 0;
         e.EventID[0] = '\0';
         e.DepthAgency[0] = '\0';
@@ -907,29 +1039,67 @@ int main(int argc, char *argv[])
         strcpy(buffer, "NATUTAL_NEIGHBOR");
         slbm_shell_setInterpolatorType(buffer);
     }
+/*
+ *
+ *  Locator context: aux data shared by the events
+ *
+ */
+    InitContext(&ctx);
+    ctx.ismbQ = ismbQ;
+    ctx.mbQ = &mbQ;
+    ctx.ec = ec;
+    ctx.numECPhases = numECPhases;
+    ctx.TTtables = TTtables;
+    ctx.LocalTTtables = LocalTTtables;
+    ctx.variogram = &variogram;
+    ctx.gres = gres;
+    ctx.ngrid = ngrid;
+    ctx.DepthGrid = DepthGrid;
+    ctx.fe = &fe;
+    ctx.GrnDepth = GrnDepth;
+    ctx.topo = topo;
+/*
+ *
+ *  iLoc serve: locate the events sent by the clients until stopped
+ *
+ */
+    if (serve) {
+        ServeLocator(sockpath, isf, nthreads, maxchild, auxdir, homedir,
+                     StationList, &ctx);
+        Free(StationList);
+    }
 /*
  *
  *  Read data from ISF input file
  *
  */
-    if (isf) {
+    else if (isf) {
+/*
+ *      Multi-threaded batch mode: events are located in parallel and
+ *      written out in the original order
+ */
+        if (nthreads > 1) {
+            BatchLocator(nthreads, isf, isfin, isfout, kml, isbull, &e,
+                         StationList, &ctx, &total, &fail, opt);
+        }
 /*
  *      Event loop: Read next event from ISF file
  */
-        while (!ReadISF(isfin, isf, &e, &h, &p, StationList, magbloc)) {
+        else while (!ReadISF(isfin, isf, &e, &h, &p, StationList, magbloc)) {
             if (verbose) fprintf(logfp, "    Locator (%.4f)\n", secs(&t0));
 /*
  *          locate event
  */
-            if (Locator(isf, db, &total, &fail, opt, &e, h, &s, p,
-                         ismbQ, &mbQ, ec, TTtables, &LocalTTtables,
-                         &variogram, gres, ngrid, DepthGrid, &fe, GrnDepth,
-                         topo, isfout, magbloc)) {
+            GetContext(&ctx);
+            ctx.LocalTTtables = LocalTTtables;
+            if (Locator(&ctx, isf, db, &total, &fail, opt, &e, h, &s, p,
+                        isfout, magbloc)) {
                 fprintf(logfp, "CAUTION: No solution found due to %s\n",
                         errorcodes[errorcode]);
                 fprintf(errfp, "CAUTION: No solution found due to %s\n",
                         errorcodes[errorcode]);
             }
+            LocalTTtables = ctx.LocalTTtables;
             fprintf(logfp, "EVENT %.6f %s %d\n", secs(&t0), e.EventID, s.numPhase);
             if (KMLBulletinFile[0])
                 WriteKML(kml, e.EventID, e.numHypo, e.numSta, &s, h, p, isbull);
@@ -975,6 +1145,21 @@ int main(int argc, char *argv[])
  *      Read data from database
  *
  */
+/*
+ *      Prefork worker pool: the workers inherit the aux data copy-on-write
+ *      and open their own DB connection; the supervisor feeds them the
+ *      instruction lines and aggregates the counters
+ */
+        if (nworkers > 1) {
+            if (KMLBulletinFile[0]) {
+                fprintf(errfp, "WARNING: no KML bulletin file with --workers\n");
+                strcpy(KMLBulletinFile, "");
+            }
+            supervisor = PreforkWorkers(nworkers, instructfp,
+                                        &total, &fail, opt);
+            if (supervisor)
+                goto abort;
+        }
         if (verbose)
             fprintf(logfp, "    establish DB connection\n");
 #ifdef PGSQL
@@ -1047,7 +1232,7 @@ int main(int argc, char *argv[])
  *      Event loop: get next event instruction line
  */
         e.evid = 0;
-        while ((nb = getline(&line, &nbytes, instructfp)) > 0) {
+        while ((nb = GetInstructionLine(&line, &nbytes, instructfp)) > 0) {
             if ((j = nb - 2) >= 0) {
                 if (line[j] == '\r') line[j] = '\n';   /* replace CR with LF */
             }
@@ -1257,15 +1442,16 @@ int main(int argc, char *argv[])
 /*
  *          locate event
  */
-            if (Locator(isf, db, &total, &fail, opt, &e, h, &s, p,
-                        ismbQ, &mbQ, ec, TTtables, &LocalTTtables,
-                        &variogram, gres, ngrid, DepthGrid, &fe, GrnDepth,
-                        topo, isfout, magbloc)) {
+            GetContext(&ctx);
+            ctx.LocalTTtables = LocalTTtables;
+            if (Locator(&ctx, isf, db, &total, &fail, opt, &e, h, &s, p,
+                        isfout, magbloc)) {
                 fprintf(logfp, "CAUTION: No solution found due to %s\n",
                         errorcodes[errorcode]);
                 fprintf(errfp, "CAUTION: No solution found due to %s\n",
                         errorcodes[errorcode]);
             }
+            LocalTTtables = ctx.LocalTTtables;
             PrevLat = s.lat;
             PrevLon = s.lon;
             fprintf(logfp, "EVENT %.6f %s %d\n", secs(&t0), e.EventID, s.numPhase);
@@ -1334,7 +1520,7 @@ abort:
 /*
  *  disconnect from database
  */
-    if (db) {
+    if (db && !supervisor) {
 #ifdef PGSQL
         if (db == 1 || db == 2 || db == 3)
             PgsqlDisconnect();
@@ -1353,7 +1539,8 @@ abort:
  */
     FreeFlinnEngdahl(&fe);
     FreeFloatMatrix(DepthGrid);
-    FreeShortMatrix(topo);
+    FreeEtopo(topo);
+    FreeEtopoTiles();
     Free(GrnDepth);
 /*
  *  free travel-time tables
@@ -1386,12 +1573,14 @@ abort:
         slbm_shell_delete();
     }
 /*
- *  report on totals
+ *  report on totals; prefork workers report to their supervisor
  */
-    fprintf(logfp, "\nTotals: option 0: %d 1: %d 2: %d 3: %d 4: %d 5: %d 6: %d",
-            opt[0], opt[1], opt[2], opt[3], opt[4], opt[5], opt[6]);
-    fprintf(logfp, " converged: %d failed: %d time %.2f\n",
-            total, fail, secs(&t00));
+    if (!ReportToSupervisor(total, fail, opt)) {
+        fprintf(logfp, "\nTotals: option 0: %d 1: %d 2: %d 3: %d 4: %d 5: %d 6: %d",
+                opt[0], opt[1], opt[2], opt[3], opt[4], opt[5], opt[6]);
+        fprintf(logfp, " converged: %d failed: %d time %.2f\n",
+                total, fail, secs(&t00));
+    }
 /*
  *  Close output files, if any.
  */
@@ -1501,7 +1690,11 @@ static void PrintHelp()
 {
     printf("Usage:\n");
     printf("echo \"<instructions>\" | iLoc [isf2.1|isf2.0|ims|isc|seiscomp|idc|niab] > logfile\n");
-    printf("iLoc [isf2.1|isf2.0|ims|isc|seiscomp|idc|niab] < instructionfile > logfile\n\n");
+    printf("iLoc [isf2.1|isf2.0|ims|isc|seiscomp|idc|niab] < instructionfile > logfile\n");
+    printf("iLoc [isf2.1|isf2.0|ims] --threads N < instructionfile > logfile\n");
+    printf("iLoc [isc|seiscomp|idc|niab] --workers N < instructionfile > logfile\n");
+    printf("iLoc serve [--socket path] [--format isf2.1|isf2.0|ims] [--threads N]\n");
+    printf("           [--children M] > logfile\n\n");
     printf("where:\n");
     printf("    isf2.1   indicates ISC ISF2.1 input file\n");
     printf("    isf2.0   indicates ISF2.0 input file\n");
@@ -1510,6 +1703,16 @@ static void PrintHelp()
     printf("    seiscomp indicates SeisComp MySQL database schema I/O\n");
     printf("    idc      indicates IDC Oracle database schema I/O\n");
     printf("    niab     indicates IDC NDC-in-a-box PostgreSQL database schema I/O\n");
+    printf("    --threads N  locate the events of an ISF input file in N threads\n");
+    printf("    --workers N  process the instruction lines in N forked workers,\n");
+    printf("                 each with its own database connection\n");
+    printf("    serve    daemon mode; keeps the aux data in memory and serves\n");
+    printf("             requests on a Unix-domain socket (default %s)\n", ILOC_SOCKET);
+    printf("             request: instruction line + ISF events, then EOF\n");
+    printf("             reply: ISF bulletin of the located events or an\n");
+    printf("                    ERROR line if the request cannot be served\n");
+    printf("             --children M  serve at most M requests at a time\n");
+    printf("                           (default: number of CPUs)\n");
     printf("Examples:\n");
     printf("echo \"bud2016aceb UpdateDB=0 depth=10\" | iloc seiscomp\n");
     printf("echo \"ISFInputFile=Namibia.isf StationFile=./Namibia_isc_stalist\" | iloc ims\n");
@@ -1566,3 +1769,4 @@ static void PrintHelp()
 //    printf("    LocalTTfromRSTT    - get local TT from RSTT model at epicentre\n");
     printf("    LocalVmodelFile    - pathname for local velocity model (non-RSTT)\n");
 }
+#endif  /* ILOCLIB */
@@ -30,8 +30,8 @@
 #ifdef MYSQLDB
 
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
 
 extern MYSQL *mysql;
@@ -29,25 +29,31 @@
  */
 #include "iLoc.h"
 
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 extern double MaxHypocenterDepth;
-extern int DoCorrelatedErrors;
-extern struct timeval t0;
-extern double NAsearchRadius;       /* search radius around preferred origin */
+extern THREADLOCAL struct timeval t0;
 extern double NAsearchDepth;    /* search radius (km) around preferred depth */
-extern double NAsearchOT;           /* search radius (s) around preferred OT */
 extern double NAlpNorm;                /* p-value for norm to compute misfit */
-extern int NAiterMax;                            /* max number of iterations */
-extern int NAinitialSample;                        /* size of initial sample */
-extern int NAnextSample;                       /* size of subsequent samples */
-extern int NAcells;                       /* number of cells to be resampled */
-extern long iseed;                                     /* random number seed */
+extern int NAiterMax;                           /* max number of iterations */
+extern int NAinitialSample;                       /* size of initial sample */
+extern int NAnextSample;                      /* size of subsequent samples */
+extern int NAcells;                      /* number of cells to be resampled */
+extern int NAthreads;                  /* threads evaluating the NA samples */
+extern int NAttGrid;                   /* interpolate TT from a grid in NA? */
+extern double NAttGridDelta;              /* NA TT grid delta spacing [deg] */
+extern double NAttGridDepth;               /* NA TT grid depth spacing [km] */
+extern THREADLOCAL TT_GRID *TTgrid;   /* TT grid used by the calling thread */
+extern THREADLOCAL long TTgridInterp;   /* TT values interpolated from grid */
+extern THREADLOCAL long TTgridExact;     /* TT table values instead of grid */
+extern double NAmisfitTol;       /* min relative improvement of best misfit */
+extern int NAstallIter;          /* stop after this many stalled iterations */
+extern double NAcellTol;           /* min spread of the best cells to go on */
+extern double NAmaxTime;                    /* wall-clock budget for NA [s] */
+extern int NAspatialIndex;        /* kd-tree for the NA Voronoi resampling? */
 extern int WriteNAResultsToFile;
-extern char PhaseWithoutResidual[MAXNUMPHA][PHALEN];   /* no-residual phases */
-extern int PhaseWithoutResidualNum;          /* number of no-residual phases */
 extern double SigmaThreshold;
 
 /*
@@ -65,6 +71,13 @@ extern double SigmaThreshold;
  *    NNcalc_dlist
  *    NNupdate_dlist
  *    NNaxis_intersect
+ *    na_kd_alloc
+ *    na_kd_free
+ *    na_kd_insert
+ *    na_kd_nearest
+ *    na_kd_nearest_r
+ *    na_kd_range_r
+ *    na_kd_axis_intersect
  *    na_misfits
  *    na_deviate
  *    findnearest
@@ -83,12 +96,159 @@ extern double SigmaThreshold;
  *    WriteNAModels
  *    NAForwardProblem
  *    dosamples
+ *    NASampleWorker
+ *    NASampleThread
+ *    na_alloc_work
+ *    na_free_work
+ *    na_phases_alloc
+ *    na_phases_free
+ *    na_phases_restore
+ *    na_wcache_lookup
+ *    na_wcache_store
+ *    na_converged
  */
-static int na_initialize(NASPACE *nasp, double *xcur, SOBOL *sas);
+
+/*
+ *  defining phase signature of a phase record
+ *     the data covariance and projection matrices depend on the phase
+ *     record only through these fields
+ */
+typedef struct NASignature {
+    char phase[PHALEN];                      /* phase mapped to IASPEI code */
+    int defs;                          /* timedef | azimdef<<1 | slowdef<<2 */
+    double deltim;                   /* a priori time measurement error [s] */
+    double delaz;               /* a priori azimuth measurement error [deg] */
+    double delslo;           /* a priori slowness measurement error [s/deg] */
+    double rsttTotalErr;    /* RSTT path-dependent (model + pick) error [s] */
+} NASIG;
+/*
+ *  projection matrix cache entry
+ */
+typedef struct NAWcacheEntry {
+    unsigned long hash;                            /* hash of the signature */
+    unsigned long lastuse;                           /* for LRU replacement */
+    int ndef;                                    /* number of defining data */
+    int prank;                                       /* effective rank of W */
+    NASIG *sig;                            /* defining phase signature (np) */
+    double **w;                          /* projection matrix (ndef x ndef) */
+} NAWCACHE;
+
+/*
+ *  initial state of the phase record fields a sample may read before it
+ *  writes them, kept as arrays built once per NASearch call and shared
+ *  read-only by the sample workers; the rest of PHAREC is either never
+ *  touched by the phase identification routines or is always set before
+ *  it is used, so it is left as it is in the scratch copies
+ */
+typedef struct NAPhases {
+    int *staind;                    /* station index in stalist, -1 if none */
+    char (*phase)[PHALEN];                   /* phase mapped to IASPEI code */
+    int *phcode;                                              /* phase code */
+    char (*prevphase)[PHALEN];             /* phase from previous iteration */
+    int *phase_fixed;             /* 1 to stop iscloc reidentifying a phase */
+    double *time;                                 /* arrival epoch time [s] */
+    double *ttime;                      /* travel time with corrections [s] */
+    double *dtdd;                            /* horizontal slowness [s/deg] */
+    double *dtdh;                               /* vertical slowness [s/km] */
+    double *bpdel;               /* depth phase bounce point distance [deg] */
+    char (*vmod)[6];                              /* travel time table type */
+    double *deltim;                  /* a priori time measurement error [s] */
+    double *delaz;              /* a priori azimuth measurement error [deg] */
+    double *delslo;          /* a priori slowness measurement error [s/deg] */
+    double *dupsigma;           /* extra variance factor for duplicates [s] */
+    char (*elevphase)[PHALEN];           /* phase of cached elevation terms */
+    double *elevvel;                      /* cached surface velocity [km/s] */
+    double *elevfactor;                  /* cached StaElev / (1000 elevvel) */
+    int *bpset;                  /* 1 if a bounce point elevation is cached */
+    double *bplat;                    /* cached bounce point latitude [deg] */
+    double *bplon;                   /* cached bounce point longitude [deg] */
+    double *bpelev;                   /* cached bounce point elevation [km] */
+} NAPHASES;
+
+/*
+ *  NA forward problem workspace, allocated once per NASearch call
+ *     The scratch copy of phase records is copied in full once; for each
+ *     sample only the fields held in NAPHASES are restored from the
+ *     shared arrays. The data covariance and projection matrices only
+ *     grow, so a thread allocates them a few times per NASearch call.
+ */
+typedef struct NAWorkspace {
+    PHAREC *pset;                          /* scratch copy of phase records */
+    NAPHASES *ph;                  /* shared initial state of phase records */
+    double *d;                                     /* (projected) residuals */
+    double *temp;                                             /* work array */
+    double **w;                                        /* projection matrix */
+    int wsize;                                  /* allocated dimension of w */
+    double **dcov;                                /* data covariance matrix */
+    int dcovsize;                            /* allocated dimension of dcov */
+    NASIG *sig;                     /* defining phase signature of a sample */
+    unsigned long hash;                            /* hash of the signature */
+    unsigned long nuse;                           /* projection matrix uses */
+    int nproj;                            /* projection matrices calculated */
+    NAWCACHE wcache[NA_WCACHE];                  /* projection matrix cache */
+    long ninterp;                       /* TT values interpolated from grid */
+    long nexact;                         /* TT table values instead of grid */
+} NAWORK;
+
+
+/*
+ *  NA sample evaluation shared by the sample worker threads
+ */
+typedef struct NASampleJob {
+    ILOC_CONTEXT *ctx;                                /* NA locator context */
+    int ithread;                                            /* thread index */
+    int nthreads;                                      /* number of threads */
+    int ns;                                      /* number of samples to do */
+    int ntot;                                /* number of collected samples */
+    double **na_models;                                        /* NA models */
+    double *misfit;                                       /* sample misfits */
+    NASPACE *nasp;                                  /* NA search parameters */
+    int np;                                    /* number of defining phases */
+    int nsta;                                         /* number of stations */
+    SOLREC *sp;                                      /* pointer to solution */
+    READING *rdindx;                                            /* readings */
+    NAWORK work;                               /* forward problem workspace */
+    TT_GRID *ttgrid;                                /* shared TT grid, if any */
+    STAREC *stalist;                                        /* station list */
+    double **distmatrix;                       /* station separation matrix */
+    FILE *fp;                   /* grid search results (single thread only) */
+    int is2nderiv;                         /* calculate second derivatives? */
+} NASAMPLEJOB;
+
+/*
+ *  kd-tree over the NA models in scaled co-ordinates
+ *     Each node is a model; the split dimension of a node is its depth
+ *     modulo nd. Models are inserted in sample order, so the tree always
+ *     holds the first n models.
+ */
+typedef struct NAKdTree {
+    int nd;                                   /* number of model parameters */
+    int n;                                      /* number of models in tree */
+    int root;                                     /* root node, -1 if empty */
+    int *left;                          /* left child (smaller coord) or -1 */
+    int *right;                         /* right child (larger coord) or -1 */
+} NAKDTREE;
+
+/*
+ *  kd-tree query for the Voronoi cell boundaries along a 1D axis
+ */
+typedef struct NAKdQuery {
+    double *x;                                             /* point on axis */
+    int id;                                      /* dimension defining axis */
+    int nodex;                                 /* node whose cell is sought */
+    double x0;                                         /* nodex on the axis */
+    double dp0;                     /* square distance of nodex to the axis */
+    double xmin, xmax;                                        /* axis range */
+    double lo, hi;                           /* cell boundaries on the axis */
+    double bmin[NA_MAXND], bmax[NA_MAXND];                     /* query box */
+} NAKDQUERY;
+
+static int na_initialize(NASPACE *nasp, double *xcur, SOBOL *sas,
+        unsigned long seed);
 static int na_initial_sample(double *na_models[], NASPACE *nasp, SOBOL *sas);
 static int na_sample(double *na_models[], NASPACE *nasp, int ntot,
         int *mfitord, double *xcur, int *restartNA, int nclean, double *dlist,
-        SOBOL *sas, int *nupd);
+        int *nlist, NAKDTREE *kdtree, SOBOL *sas, int *nupd);
 static int na_restart(double *na_models[], int nd, int ind, double *x);
 static int NNcalc_dlist(int dim, double *dlist, double *na_models[], int nd,
         int ntot, double *x);
@@ -96,6 +256,17 @@ static int NNupdate_dlist(int idnext, int id, double *dlist,
         double *na_models[], int ntot, double *x);
 static void NNaxis_intersect(int id, double *dlist, double *na_models[],
         int ntot, int nodex, NASPACE *nasp, double *x1, double *x2);
+static int na_kd_alloc(NAKDTREE *kd, int ntotal, int nd);
+static void na_kd_free(NAKDTREE *kd);
+static void na_kd_insert(NAKDTREE *kd, double *na_models[], int i);
+static int na_kd_nearest(NAKDTREE *kd, double *na_models[], double *x,
+        int exclude, double *dmin);
+static void na_kd_nearest_r(NAKDTREE *kd, double *na_models[], int node,
+        int depth, double *x, int exclude, int *best, double *dmin);
+static void na_kd_range_r(NAKDTREE *kd, double *na_models[], int node,
+        int depth, NAKDQUERY *q);
+static int na_kd_axis_intersect(NAKDTREE *kd, int id, double *na_models[],
+        double *x, NASPACE *nasp, double *x1, double *x2);
 static void na_misfits(double *misfit, int nsample, int ntot, double *mfitmin,
         double *mfitminc, double *mfitmean, int *mopt, double *work, int *ind,
         int *iwork, int *mfitord);
@@ -114,16 +285,29 @@ static unsigned long lranq1(unsigned long seed);
 static double dranq1(unsigned long seed);
 static double ranfib(int init, unsigned long seed);
 static void WriteNAModels(double *na_models[], NASPACE *nasp, double *misfit);
-static double dosamples(int i, int ntot, double *na_model, NASPACE *nasp,
-        int np, int nsta, SOLREC *sp, READING *rdindx, PHAREC *pgs,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, EC_COEF *ec,
-        short int **topo, STAREC stalist[], double **distmatrix,
-        VARIOGRAM *variogramp, FILE *fp, int is2nderiv);
-static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
-        SOLREC *sp, READING *rdindx, PHAREC pgs[], TT_TABLE *TTtables,
-        TT_TABLE *LocalTTtable, EC_COEF *ec, short int **topo, STAREC stalist[],
-        double **distmatrix, VARIOGRAM *variogramp, char *buf, int is2nderiv,
-        int isprint);
+static double dosamples(ILOC_CONTEXT *ctx, int i, int ntot, double *na_model,
+        NASPACE *nasp, int np, int nsta, SOLREC *sp, READING *rdindx,
+        NAWORK *work, STAREC stalist[], double **distmatrix,
+        FILE *fp, int is2nderiv);
+static void *NASampleWorker(void *arg);
+static void *NASampleThread(void *arg);
+static int na_alloc_work(NAWORK *work, int np, PHAREC pgs[], NAPHASES *ph);
+static void na_free_work(NAWORK *work);
+static int na_phases_alloc(NAPHASES *ph, int np, PHAREC pgs[], int nsta,
+        STAREC stalist[]);
+static void na_phases_free(NAPHASES *ph);
+static void na_phases_restore(NAPHASES *ph, int np, PHAREC p[]);
+static NAWCACHE *na_wcache_lookup(NAWORK *work, int np, int ndef,
+        PHAREC pgs[]);
+static void na_wcache_store(NAWORK *work, int np, int ndef, int prank,
+        double **w);
+static int na_converged(double mfitprev, double mfitmin, int *nstall,
+        double *na_models[], int *mfitord, NASPACE *nasp,
+        struct timeval *tna, char *reason);
+static double NAForwardProblem(ILOC_CONTEXT *ctx, int nsta, NASPACE *nasp,
+        double *model, SOLREC *sp, READING *rdindx, PHAREC pgs[],
+        NAWORK *work, STAREC stalist[], double **distmatrix, char *buf,
+        int is2nderiv, int isprint);
 
 /*
  *  Title:
@@ -131,7 +315,10 @@ static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
  *  Synopsis:
  *     Sets NA search limits around initial hypocentre. By default, it
  *     searches in 4D, regardless whether there is depth resolution.
+ *     The search radii are taken from the locator context and tightened
+ *     for anthropogenic events.
  *  Input Arguments:
+ *     ctx  - pointer to locator context
  *     sp   - pointer to current solution
  *  Output Arguments:
  *     nasp - NA search parameter structure
@@ -140,9 +327,11 @@ static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
  *  Called by:
  *     Locator
  */
-int SetNASearchSpace(SOLREC *sp, NASPACE *nasp)
+int SetNASearchSpace(ILOC_CONTEXT *ctx, SOLREC *sp, NASPACE *nasp)
 {
     int i;
+    nasp->epirange = ctx->NAsearchRadius;
+    nasp->otrange = ctx->NAsearchOT;
     nasp->lat = sp->lat;
     nasp->lon = sp->lon;
     nasp->ot = sp->time;
@@ -154,8 +343,8 @@ int SetNASearchSpace(SOLREC *sp, NASPACE *nasp)
  *  tighten search space for anthropogenic events
  */
     if (sp->FixedDepthType == 4) {
-        if (NAsearchOT > 20.) NAsearchOT = 20.;
-        if (NAsearchRadius > 2.) NAsearchRadius = 2.;
+        if (nasp->otrange > 20.) nasp->otrange = 20.;
+        if (nasp->epirange > 2.) nasp->epirange = 2.;
     }
 /*
  *  search space dimensions
@@ -174,7 +363,7 @@ int SetNASearchSpace(SOLREC *sp, NASPACE *nasp)
  */
     if (!nasp->epifix) {
         nasp->range[i][0] = 0.;
-        nasp->range[i][1] = NAsearchRadius;
+        nasp->range[i][1] = nasp->epirange;
         i++;
         nasp->range[i][0] = 0.;
         nasp->range[i][1] = 360.;
@@ -184,8 +373,8 @@ int SetNASearchSpace(SOLREC *sp, NASPACE *nasp)
  *  search range for origin time
  */
     if (!nasp->otfix) {
-        nasp->range[i][0] = sp->time - NAsearchOT;
-        nasp->range[i][1] = sp->time + NAsearchOT;
+        nasp->range[i][0] = sp->time - nasp->otrange;
+        nasp->range[i][1] = sp->time + nasp->otrange;
         i++;
     }
 /*
@@ -252,16 +441,18 @@ int SetNASearchSpace(SOLREC *sp, NASPACE *nasp)
  *        searches in 4D (lat, lon, OT, depth) by default
  *        reidentifies phases w.r.t. each trial hypocentre
  *        accounting for correlated errors may be turned off for speed
+ *     The search runs in its own copy of the locator context, so that
+ *        temporarily disabling correlated errors does not leak out. The
+ *        samples are evaluated under a silent copy of it, bound to the
+ *        evaluating thread by NASampleWorker; the verbose level of the
+ *        calling thread is left alone.
  *  Input Arguments:
+ *     ctx        - pointer to locator context
  *     nsta       - number of stations
  *     sp         - pointer to current solution
  *     p          - array of phase structures
- *     TTtables  - pointer to travel-time tables
- *     ec         - pointer to ellipticity correction coefficient structure
- *     topo       - ETOPO bathymetry/elevation matrix
  *     stalist    - array of starec structures
  *     distmatrix - station separation matrix
- *     variogramp - pointer to generic variogram model
  *     staorder   - array of staorder structures (nearest-neighbour order)
  *     nasp       - NA search parameter structure
  *     filename   - pathname for grid search results
@@ -273,22 +464,28 @@ int SetNASearchSpace(SOLREC *sp, NASPACE *nasp)
  *  Called by:
  *     Locator
  *  Calls:
- *     AllocateFloatMatrix, Free, FreeFloatMatrix, GetDataCovarianceMatrix,
- *     GetdUGapSgap, ProjectionMatrix, SortPhasesForNA, EpochToHuman,
+ *     GetContext, AllocateFloatMatrix, Free, FreeFloatMatrix,
+ *     GetDataCovarianceMatrix, GetdUGapSgap, ProjectionMatrix, SortPhasesForNA, EpochToHuman,
  *     PrintSolution, PrintDefiningPhases, na_initialize, na_initial_sample,
  *     na_sample, transform2raw, NAForwardProblem, na_misfits, tolatlon,
- *     WriteNAModels, do_samples
+ *     WriteNAModels, NASampleWorker, NASampleThread, na_converged,
+ *     na_kd_alloc, na_kd_free, na_alloc_work, na_free_work,
+ *     na_phases_alloc, na_phases_free
  */
-int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
-        TT_TABLE *LocalTTtable, EC_COEF *ec, short int **topo, STAREC stalist[],
-        double **distmatrix, VARIOGRAM *variogramp, STAORDER staorder[],
+int NASearch(ILOC_CONTEXT *ctx, int nsta, SOLREC *sp, PHAREC p[],
+        STAREC stalist[], double **distmatrix, STAORDER staorder[],
         NASPACE *nasp, char *filename, int is2nderiv)
 {
+    ILOC_CONTEXT nactx;                            /* NA locator context */
+    ILOC_CONTEXT smpctx;                 /* silent context for the samples */
     FILE *fp = (FILE *)NULL;
     PHAREC *pgs = (PHAREC *)NULL;          /* phase records for grid search */
     READING *rdindx = (READING *)NULL;                          /* readings */
     double *misfit = (double *)NULL;
-    double mfitmin = 0., mfitmean = 0., mfitminc = 0.;
+    double mfitmin = 0., mfitmean = 0., mfitminc = 0., mfitexact = 0.;
+    double mfitprev = 0.;
+    struct timeval tna;
+    long ninterp = 0, nexact = 0;
     double du = 1., gap = 360., sgap = 360., dummy = 0.;
     double *esaz = (double *)NULL;
     double **na_models = (double **)NULL;
@@ -298,15 +495,21 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
     int *iwork_NA1 = (int *)NULL;
     int *iwork_NA2 = (int *)NULL;
     int *mfitord = (int *)NULL;
-    int ntotal = 0, nsamp = 0, nclean = 500;
+    int ntotal = 0, nsamp = 0, nclean = 500, nlist = 0;
     int restartNA = 1, mopt = 0, prev_rdid = -1;
     int ntot = 0, ncald = 0, nupd = 0, nc = 0, nu = 0, ksta = 0;
     int iter = 0, i, j, k, ns = 0, nd = 0, np = 0, nrd = 0, prank = 0;
-    int DoCorrelatedErrors_cf;
-    int verbose_cf = verbose;
-    char timestr[25], buf[64];
+    int nthreads = 1, nw = 0, nstall = 0;
+    NASAMPLEJOB *jobs = (NASAMPLEJOB *)NULL;
+    pthread_t *workers = (pthread_t *)NULL;
+    NAPHASES naph;                  /* initial state of the phase records */
+    TT_GRID *ttgrid = (TT_GRID *)NULL;           /* shared TT grid, if any */
+    NAKDTREE kd;
+    unsigned long seed = labs(ctx->iseed);
+    char timestr[25], buf[64], reason[80];
     char prevsta[STALEN];
     SOBOL sas;
+    gettimeofday(&tna, NULL);
     ntotal = NAinitialSample + 1 + NAnextSample * NAiterMax;
     nsamp = max(NAnextSample, NAinitialSample + 1);
     nd = nasp->nd;
@@ -314,7 +517,6 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
 /*
  *  sanity checks
  */
-    if (iseed < 0) iseed = -iseed;
     if (nd > NA_MAXND) {
         fprintf(errfp, "NA: model parameters %d > %d!\n", nd, NA_MAXND);
         fprintf(logfp, "NA: model parameters %d > %d!\n", nd, NA_MAXND);
@@ -336,11 +538,7 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
 /*
  *      skip phases that don't get residuals (amplitudes etc)
  */
-        for (j = 0; j < PhaseWithoutResidualNum; j++) {
-            if (streq(p[i].phase, PhaseWithoutResidual[j]))
-                break;
-        }
-        if (j != PhaseWithoutResidualNum)
+        if (isNoResidualPhase(p[i].phase))
             continue;
         p[i].timedef = 1;
         if (streq(p[i].phase, "I") ||
@@ -395,10 +593,17 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
  */
     du = GetdUGapSgap(ksta, esaz, &gap, &sgap);
     Free(esaz);
-    DoCorrelatedErrors_cf = DoCorrelatedErrors;
+/*
+ *  NA locator context
+ *      the event-level state in ctx is a snapshot taken on entry to
+ *      Locator; refresh it from the calling thread (errorcode, PrevLat,
+ *      PrevLon, UseLocalTT, ...) before it is bound to the sample workers
+ */
+    memmove(&nactx, ctx, sizeof(ILOC_CONTEXT));
+    GetContext(&nactx);
     if (np > 30 && du < 0.7)
-        DoCorrelatedErrors = 0;
-    if (DoCorrelatedErrors) {
+        nactx.DoCorrelatedErrors = 0;
+    if (nactx.DoCorrelatedErrors) {
 /*
  *      reorder phaserecs by staorder, rdid, time so that covariance matrices
  *      for various phases will become block-diagonal
@@ -418,18 +623,73 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
     iwork_NA2 = (int *)calloc(ntotal, sizeof(int));
     mfitord = (int *)calloc(ntotal, sizeof(int));
     na_models = AllocateFloatMatrix(ntotal, NA_MAXND);
-    if ((dlist = (double *)calloc(ntotal, sizeof(double))) == NULL) {
+    memset(&kd, 0, sizeof(NAKDTREE));
+    memset(&naph, 0, sizeof(NAPHASES));
+    if ((dlist = (double *)calloc(ntotal, sizeof(double))) == NULL ||
+        (NAspatialIndex && na_kd_alloc(&kd, ntotal, nd))) {
+        fprintf(errfp, "NASearch: cannot allocate memory!\n");
+        fprintf(logfp, "NASearch: cannot allocate memory!\n");
+        Free(pgs);
+        Free(iwork_NA1); Free(iwork_NA2); Free(work_NA2);
+        Free(misfit); Free(mfitord);
+        FreeLongMatrix(sas.iv);
+        Free(sas.pol); Free(sas.mdeg);
+        FreeFloatMatrix(na_models);
+        Free(rdindx); Free(dlist); na_kd_free(&kd);
+        errorcode = 1;
+        return 1;
+    }
+/*
+ *  the fresh dlist holds no distances yet
+ */
+    nlist = 0;
+/*
+ *  sample workers with their own scratch copy of the phase records;
+ *  the initial state of the phase records and the TT grid are shared;
+ *  the NA results file is written in sample order by a single thread;
+ *  the travel-time routines are silenced through the sample context
+ */
+    memmove(&smpctx, &nactx, sizeof(ILOC_CONTEXT));
+    smpctx.verbose = 0;
+    if (!WriteNAResultsToFile)
+        nthreads = max(1, min(NAthreads, NAinitialSample + 1));
+    if (NAttGrid)
+        ttgrid = AllocateTTgrid(NAttGridDelta, NAttGridDepth);
+    jobs = (NASAMPLEJOB *)calloc(nthreads, sizeof(NASAMPLEJOB));
+    workers = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    for (k = 0; jobs && k < nthreads; k++) {
+        if (na_alloc_work(&jobs[k].work, np, pgs, &naph))
+            break;
+        jobs[k].ttgrid = ttgrid;
+        jobs[k].ctx = &smpctx;
+        jobs[k].ithread = k;
+        jobs[k].nthreads = nthreads;
+        jobs[k].na_models = na_models;
+        jobs[k].misfit = misfit;
+        jobs[k].nasp = nasp;
+        jobs[k].np = np;
+        jobs[k].nsta = nsta;
+        jobs[k].sp = sp;
+        jobs[k].rdindx = rdindx;
+        jobs[k].stalist = stalist;
+        jobs[k].distmatrix = distmatrix;
+        jobs[k].fp = fp;
+        jobs[k].is2nderiv = is2nderiv;
+    }
+    if (workers == NULL || jobs == NULL || k < nthreads ||
+        na_phases_alloc(&naph, np, pgs, nsta, stalist)) {
         fprintf(errfp, "NASearch: cannot allocate memory!\n");
         fprintf(logfp, "NASearch: cannot allocate memory!\n");
+        for (k = 0; jobs && k < nthreads; k++) na_free_work(&jobs[k].work);
+        Free(jobs); Free(workers); na_phases_free(&naph); FreeTTgrid(ttgrid);
         Free(pgs);
         Free(iwork_NA1); Free(iwork_NA2); Free(work_NA2);
         Free(misfit); Free(mfitord);
         FreeLongMatrix(sas.iv);
         Free(sas.pol); Free(sas.mdeg);
         FreeFloatMatrix(na_models);
-        Free(rdindx);
+        Free(rdindx); Free(dlist); na_kd_free(&kd);
         errorcode = 1;
-        DoCorrelatedErrors = DoCorrelatedErrors_cf;
         return 1;
     }
     mfitmin = 1e6;
@@ -449,10 +709,15 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
         fprintf(logfp, "      Sample size = %d\n", NAnextSample);
         fprintf(logfp, "      Number of iterations = %d\n", NAiterMax);
         fprintf(logfp, "      Number of cells resampled = %d\n", NAcells);
-        fprintf(logfp, "      Random seed value = %ld\n", iseed);
+        if (NAspatialIndex)
+            fprintf(logfp, "      Voronoi cells found with a kd-tree\n");
+        if (nthreads > 1)
+            fprintf(logfp, "      Samples evaluated by %d threads\n",
+                    nthreads);
+        fprintf(logfp, "      Random seed value = %lu\n", seed);
         fprintf(logfp, "      SAS Quasi-random sequence used\n");
         fprintf(logfp, "      Starting models generated randomly\n");
-        if (DoCorrelatedErrors != DoCorrelatedErrors_cf) {
+        if (nactx.DoCorrelatedErrors != ctx->DoCorrelatedErrors) {
             fprintf(logfp, "      Temporarily disabled correlated errors");
             fprintf(logfp, " (np = %d > 30 && dU = %4.2f < 0.7)\n", np, du);
         }
@@ -460,23 +725,24 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
 /*
  *  initialize NA routines
  */
-    if (na_initialize(nasp, xcur, &sas)) {
+    if (na_initialize(nasp, xcur, &sas, seed)) {
+        for (k = 0; k < nthreads; k++) na_free_work(&jobs[k].work);
+        Free(jobs); Free(workers); na_phases_free(&naph); FreeTTgrid(ttgrid);
         Free(pgs);
         Free(iwork_NA1); Free(iwork_NA2); Free(work_NA2);
         Free(misfit); Free(mfitord);
         FreeLongMatrix(sas.iv);
         Free(sas.pol); Free(sas.mdeg);
         FreeFloatMatrix(na_models);
-        Free(rdindx); Free(dlist);
-        DoCorrelatedErrors = DoCorrelatedErrors_cf;
+        Free(rdindx); Free(dlist); na_kd_free(&kd);
         return 1;
     }
     if (WriteNAResultsToFile) {
 /*
  *      print search limits and starting point to file
  */
-        fprintf(fp, "# epifix = %d epirange = %.2f\n", nasp->epifix, NAsearchRadius);
-        fprintf(fp, "# ot_fix = %d ot_range = %.2f\n", nasp->otfix, NAsearchOT);
+        fprintf(fp, "# epifix = %d epirange = %.2f\n", nasp->epifix, nasp->epirange);
+        fprintf(fp, "# ot_fix = %d ot_range = %.2f\n", nasp->otfix, nasp->otrange);
         fprintf(fp, "# depfix = %d deprange = %.2f\n", nasp->depfix, NAsearchDepth);
         fprintf(fp, "# %8.4f %9.4f %15.3f %8.4f\n",
                      nasp->lat, nasp->lon, nasp->ot, nasp->depth);
@@ -493,8 +759,9 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
 /*
  *          generate new sample with nearest neighbour resampling
  */
-            nc = na_sample(na_models, nasp, ntot, mfitord,
-                           xcur, &restartNA, nclean, dlist, &sas, &nu);
+            nc = na_sample(na_models, nasp, ntot, mfitord, xcur, &restartNA,
+                           nclean, dlist, &nlist, NAspatialIndex ? &kd : NULL,
+                           &sas, &nu);
             ncald += nc;
             nupd += nu;
             ns = NAnextSample;
@@ -507,19 +774,30 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
         }
 /*
  *      calculate model misfits
+ *          with several threads each thread takes every nthreads-th sample
+ *          and stores its misfit by sample index, so the misfits do not
+ *          depend on the thread scheduling
  */
-        verbose = 0;
-        for (i = 0; i < ns; i++) {
-            misfit[ntot + i] = dosamples((int)i, ntot, na_models[ntot + i],
-                                    nasp, np, nsta, sp, rdindx, pgs,
-                                    TTtables, LocalTTtable, ec, topo,
-                                    stalist, distmatrix, variogramp, fp,
-                                    is2nderiv);
+        for (k = 0; k < nthreads; k++) {
+            jobs[k].ns = ns;
+            jobs[k].ntot = ntot;
         }
-        verbose = verbose_cf;
+        for (nw = 0; nthreads > 1 && nw < nthreads; nw++) {
+            if (pthread_create(&workers[nw], NULL, NASampleThread,
+                               &jobs[nw]))
+                break;
+        }
+/*
+ *      the calling thread picks up the share of threads not started
+ */
+        for (k = nw; k < nthreads; k++)
+            NASampleWorker(&jobs[k]);
+        for (k = 0; k < nw; k++)
+            pthread_join(workers[k], NULL);
 /*
  *      misfit statistics
  */
+        mfitprev = mfitmin;
         na_misfits(misfit, ns, ntot, &mfitmin, &mfitminc, &mfitmean, &mopt,
                    work_NA2, iwork_NA1, iwork_NA2, mfitord);
 /*
@@ -585,15 +863,39 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
                 fprintf(logfp, "%7.3f ", model_opt[k]);
             fprintf(logfp, "\n");
         }
+/*
+ *      adaptive termination
+ */
+        if (iter && iter < NAiterMax &&
+            na_converged(mfitprev, mfitmin, &nstall, na_models, mfitord,
+                         nasp, &tna, reason)) {
+            if (verbose)
+                fprintf(logfp, "    NA stopped after iteration %d: %s\n",
+                        iter, reason);
+            if (WriteNAResultsToFile)
+                fprintf(fp, "# stopped after iteration %d: %s\n",
+                        iter, reason);
+            break;
+        }
     }
     if (WriteNAResultsToFile) fclose(fp);
     if (verbose) {
         fprintf(logfp, "  NA summary\n");
         fprintf(logfp, "    Total number of samples = %d\n", ntot);
-        fprintf(logfp, "    Total number of full dlist evaluations = %d\n",
-                ncald);
-        fprintf(logfp, "    Total number of partial dlist updates = %d\n",
-                nupd);
+        if (NAspatialIndex)
+            fprintf(logfp, "    Total number of kd-tree cell searches = %d\n",
+                    ncald);
+        else {
+            fprintf(logfp, "    Total number of full dlist evaluations = %d\n",
+                    ncald);
+            fprintf(logfp, "    Total number of partial dlist updates = %d\n",
+                    nupd);
+        }
+        if (nactx.DoCorrelatedErrors) {
+            for (nw = 0, k = 0; k < nthreads; k++)
+                nw += jobs[k].work.nproj;
+            fprintf(logfp, "    Projection matrices calculated = %d\n", nw);
+        }
         fprintf(logfp, "    Lowest misfit found = %.4f\n", mfitmin);
     }
     if (mfitmin < 999) {
@@ -628,9 +930,26 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
 /*
  *      save best model in SOLREC and PHAREC
  */
-        NAForwardProblem(nsta, nasp, model_opt, sp, rdindx, pgs,
-                TTtables, LocalTTtable, ec, topo,
-                stalist, distmatrix, variogramp, buf, is2nderiv, 1);
+        mfitexact = NAForwardProblem(&nactx, nsta, nasp, model_opt, sp,
+                        rdindx, pgs, &jobs[0].work, stalist, distmatrix, buf,
+                        is2nderiv, 1);
+        if (ttgrid) {
+/*
+ *          the best model is always recalculated with exact predictions;
+ *          report the misfit error introduced by the TT grid
+ */
+            for (k = 0; k < nthreads; k++) {
+                ninterp += jobs[k].work.ninterp;
+                nexact += jobs[k].work.nexact;
+            }
+            fprintf(logfp, "    TT grid (%.3f deg x %.2f km): ",
+                    NAttGridDelta, NAttGridDepth);
+            fprintf(logfp, "%ld nodes, %ld interpolated, %ld exact\n",
+                    ttgrid->nnodes, ninterp, nexact);
+            fprintf(logfp, "    TT grid misfit error at best model = %.4f ",
+                    misfit[mopt] - mfitexact);
+            fprintf(logfp, "(grid %.4f exact %.4f)\n", misfit[mopt], mfitexact);
+        }
         if (verbose > 2) {
             PrintSolution(sp, 0);
             PrintDefiningPhases(np, pgs);
@@ -644,13 +963,14 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
 /*
  *  free memory
  */
+    for (k = 0; k < nthreads; k++) na_free_work(&jobs[k].work);
+    Free(jobs); Free(workers); na_phases_free(&naph); FreeTTgrid(ttgrid);
     FreeFloatMatrix(na_models);
     Free(iwork_NA1); Free(iwork_NA2); Free(work_NA2);
     Free(misfit); Free(mfitord);
     FreeLongMatrix(sas.iv);
     Free(sas.pol); Free(sas.mdeg);
-    Free(rdindx); Free(pgs); Free(dlist);
-    DoCorrelatedErrors = DoCorrelatedErrors_cf;
+    Free(rdindx); Free(pgs); Free(dlist); na_kd_free(&kd);
     na_sobol(sas.n, &dummy, 1, 2, &sas);
     return j;
 }
@@ -664,6 +984,7 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
  *     Forward modeling uses all defining phases and
  *        accounts for correlated errors.
  *  Input Arguments:
+ *     ctx        - pointer to NA locator context
  *     i          - sample index
  *     ntot       - number of collected samples
  *     na_model   - sample model
@@ -672,46 +993,36 @@ int NASearch(int nsta, SOLREC *sp, PHAREC p[], TT_TABLE *TTtables,
  *     nsta       - number of stations
  *     sp         - pointer to current solution
  *     rdindx     - array of reading structures
- *     pgs        - array of phase structures
- *     TTtables  - pointer to travel-time tables
- *     ec         - pointer to ellipticity correction coefficient structure
- *     topo       - ETOPO bathymetry/elevation matrix
+ *     work       - pointer to NA workspace
  *     stalist    - array of starec structures
  *     distmatrix - station separation matrix
- *     variogramp - pointer to generic variogram model
  *     fp         - file pointer to grid search results
  *  Return:
  *     misfit    - Lp-norm misfit of the sample model
  *  Called by:
- *     NASearch
+ *     NASampleWorker
  *  Calls:
- *     NAForwardProblem, tolatlon, transform2raw, Free
+ *     na_phases_restore, NAForwardProblem, tolatlon, transform2raw
  */
-static double dosamples(int i, int ntot, double *na_model, NASPACE *nasp,
-        int np, int nsta, SOLREC *sp, READING *rdindx, PHAREC *pgs,
-        TT_TABLE *TTtables, TT_TABLE *LocalTTtable, EC_COEF *ec,
-        short int **topo, STAREC stalist[], double **distmatrix,
-        VARIOGRAM *variogramp, FILE *fp, int is2nderiv)
+static double dosamples(ILOC_CONTEXT *ctx, int i, int ntot, double *na_model,
+        NASPACE *nasp, int np, int nsta, SOLREC *sp, READING *rdindx,
+        NAWORK *work, STAREC stalist[], double **distmatrix,
+        FILE *fp, int is2nderiv)
 {
     SOLREC s;                                           /* solution record */
-    PHAREC *pset = (PHAREC *)NULL;        /* phase records for grid search */
     double model_raw[NA_MAXND];
     double misfit = 9999.;
     char buf[64];
     int j, k;
     j = ntot + i;
-    if ((pset = (PHAREC *)calloc(np, sizeof(PHAREC))) == NULL) {
-        fprintf(errfp, "dosamples: cannot allocate memory!\n");
-        fprintf(logfp, "dosamples: cannot allocate memory!\n");
-        return misfit;
-    }
 /*
- *  make a copy of defining phases and the solution
- *  in order to not to interfere with phase identifications
+ *  restore the initial state of the scratch copy of defining phases and
+ *  make a copy of the solution in order to not to interfere with phase
+ *  identifications; the correction cache fields are restored too, so that
+ *  the misfit of a sample does not depend on the samples the same thread
+ *  has evaluated before
  */
-    for (k = 0; k < np; k++) {
-        memmove(&pset[k], &pgs[k], sizeof(PHAREC));
-    }
+    na_phases_restore(work->ph, np, work->pset);
     memmove(&s, sp, sizeof(SOLREC));
 /*
  *  calculate misfit value for each model
@@ -719,9 +1030,9 @@ static double dosamples(int i, int ntot, double *na_model, NASPACE *nasp,
     transform2raw(na_model, nasp, model_raw);
     if (!nasp->epifix)
         tolatlon(model_raw, nasp);
-    misfit = NAForwardProblem(nsta, nasp, model_raw, &s, rdindx, pset,
-                     TTtables, LocalTTtable, ec, topo, stalist, distmatrix,
-                     variogramp, buf, is2nderiv, 0);
+    misfit = NAForwardProblem(ctx, nsta, nasp, model_raw, &s, rdindx,
+                              work->pset, work, stalist, distmatrix, buf,
+                              is2nderiv, 0);
     if (WriteNAResultsToFile) {
 /*
  *      print results to file
@@ -744,50 +1055,423 @@ static double dosamples(int i, int ntot, double *na_model, NASPACE *nasp,
         else              fprintf(fp, "%8.4f ", model_raw[k]);
         fprintf(fp, "%10.4f %s\n", misfit, buf);
     }
-    Free(pset);
     return misfit;
 }
 
+/*
+ *  Title:
+ *     NASampleWorker
+ *  Synopsis:
+ *     Thread function evaluating every nthreads-th sample model of an
+ *     NA iteration. The silent NA sample context is bound to the thread;
+ *     the event-level state of the thread is restored on return so that
+ *     the function may also run in the calling thread.
+ *  Input Arguments:
+ *     arg - pointer to NASAMPLEJOB structure
+ *  Return:
+ *     NULL
+ *  Called by:
+ *     NASearch, NASampleThread
+ *  Calls:
+ *     GetContext, SetContext, dosamples
+ */
+static void *NASampleWorker(void *arg)
+{
+    NASAMPLEJOB *job = (NASAMPLEJOB *)arg;
+    ILOC_CONTEXT caller;
+    TT_GRID *ttgrid = TTgrid;
+    long ninterp = TTgridInterp, nexact = TTgridExact;
+    int i, j;
+    GetContext(&caller);
+    SetContext(job->ctx);
+    TTgrid = job->ttgrid;
+    for (i = job->ithread; i < job->ns; i += job->nthreads) {
+        j = job->ntot + i;
+        job->misfit[j] = dosamples(job->ctx, i, job->ntot, job->na_models[j],
+                                   job->nasp, job->np, job->nsta, job->sp,
+                                   job->rdindx, &job->work,
+                                   job->stalist, job->distmatrix,
+                                   job->fp, job->is2nderiv);
+    }
+    SetContext(&caller);
+    TTgrid = ttgrid;
+    job->work.ninterp += TTgridInterp - ninterp;
+    job->work.nexact += TTgridExact - nexact;
+    return NULL;
+}
+
+/*
+ *  Title:
+ *     NASampleThread
+ *  Synopsis:
+ *     Thread function of the NA sample threads. Runs NASampleWorker and
+ *     unmaps the ETOPO tiles mapped by the thread before it exits.
+ *  Input Arguments:
+ *     arg - pointer to NASAMPLEJOB structure
+ *  Return:
+ *     NULL
+ *  Called by:
+ *     NASearch
+ *  Calls:
+ *     NASampleWorker, FreeEtopoTiles
+ */
+static void *NASampleThread(void *arg)
+{
+    NASampleWorker(arg);
+    FreeEtopoTiles();
+    return NULL;
+}
+
+/*
+ *  Title:
+ *     na_alloc_work
+ *  Synopsis:
+ *     Allocates an NA forward problem workspace and initializes the
+ *     scratch copy of phase records. The data covariance and projection
+ *     matrices are allocated on demand by NAForwardProblem.
+ *  Input Arguments:
+ *     np   - number of defining phases
+ *     pgs  - array of phase structures
+ *     ph   - pointer to the shared initial state of phase records
+ *  Output Arguments:
+ *     work - pointer to NA workspace
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     NASearch
+ */
+static int na_alloc_work(NAWORK *work, int np, PHAREC pgs[], NAPHASES *ph)
+{
+    memset(work, 0, sizeof(NAWORK));
+    work->pset = (PHAREC *)calloc(np, sizeof(PHAREC));
+    work->d = (double *)calloc(3 * np, sizeof(double));
+    work->sig = (NASIG *)calloc(np, sizeof(NASIG));
+    if ((work->temp = (double *)calloc(3 * np, sizeof(double))) == NULL ||
+        work->pset == NULL || work->d == NULL || work->sig == NULL) {
+        na_free_work(work);
+        return 1;
+    }
+    memcpy(work->pset, pgs, np * sizeof(PHAREC));
+    work->ph = ph;
+    return 0;
+}
+
+/*
+ *  Title:
+ *     na_free_work
+ *  Synopsis:
+ *     Frees an NA forward problem workspace.
+ *  Input Arguments:
+ *     work - pointer to NA workspace
+ *  Called by:
+ *     NASearch, na_alloc_work
+ *  Calls:
+ *     Free, FreeFloatMatrix
+ */
+static void na_free_work(NAWORK *work)
+{
+    int i;
+    for (i = 0; i < NA_WCACHE; i++) {
+        Free(work->wcache[i].sig);
+        FreeFloatMatrix(work->wcache[i].w);
+    }
+    Free(work->pset);
+    Free(work->d);
+    Free(work->temp);
+    Free(work->sig);
+    FreeFloatMatrix(work->w);
+    FreeFloatMatrix(work->dcov);
+    memset(work, 0, sizeof(NAWORK));
+}
+
+/*
+ *  Title:
+ *     na_phases_alloc
+ *  Synopsis:
+ *     Saves the initial state of the phase record fields that the sample
+ *     pipeline may read before it writes them, and the station index of
+ *     each phase for the data covariance matrix.
+ *  Input Arguments:
+ *     np        - number of defining phases
+ *     pgs       - array of phase structures
+ *     nsta      - number of distinct stations
+ *     stalist[] - array of starec structures
+ *  Output Arguments:
+ *     ph        - pointer to NAPHASES structure
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     NASearch
+ *  Calls:
+ *     GetStationIndex, na_phases_free
+ */
+static int na_phases_alloc(NAPHASES *ph, int np, PHAREC pgs[], int nsta,
+        STAREC stalist[])
+{
+    int k;
+    memset(ph, 0, sizeof(NAPHASES));
+    ph->staind = (int *)calloc(4 * np, sizeof(int));
+    ph->phase = (char (*)[PHALEN])calloc(3 * np, PHALEN);
+    ph->vmod = (char (*)[6])calloc(np, 6);
+    if ((ph->time = (double *)calloc(14 * np, sizeof(double))) == NULL ||
+        ph->staind == NULL || ph->phase == NULL || ph->vmod == NULL) {
+        na_phases_free(ph);
+        return 1;
+    }
+    ph->phcode = ph->staind + np;
+    ph->phase_fixed = ph->phcode + np;
+    ph->bpset = ph->phase_fixed + np;
+    ph->prevphase = ph->phase + np;
+    ph->elevphase = ph->prevphase + np;
+    ph->ttime = ph->time + np;
+    ph->dtdd = ph->ttime + np;
+    ph->dtdh = ph->dtdd + np;
+    ph->bpdel = ph->dtdh + np;
+    ph->deltim = ph->bpdel + np;
+    ph->delaz = ph->deltim + np;
+    ph->delslo = ph->delaz + np;
+    ph->dupsigma = ph->delslo + np;
+    ph->elevvel = ph->dupsigma + np;
+    ph->elevfactor = ph->elevvel + np;
+    ph->bplat = ph->elevfactor + np;
+    ph->bplon = ph->bplat + np;
+    ph->bpelev = ph->bplon + np;
+    for (k = 0; k < np; k++) {
+        ph->staind[k] = GetStationIndex(nsta, stalist, pgs[k].prista);
+        strcpy(ph->phase[k], pgs[k].phase);
+        ph->phcode[k] = pgs[k].phcode;
+        strcpy(ph->prevphase[k], pgs[k].prevphase);
+        ph->phase_fixed[k] = pgs[k].phase_fixed;
+        ph->time[k] = pgs[k].time;
+        ph->ttime[k] = pgs[k].ttime;
+        ph->dtdd[k] = pgs[k].dtdd;
+        ph->dtdh[k] = pgs[k].dtdh;
+        ph->bpdel[k] = pgs[k].bpdel;
+        strcpy(ph->vmod[k], pgs[k].vmod);
+        ph->deltim[k] = pgs[k].deltim;
+        ph->delaz[k] = pgs[k].delaz;
+        ph->delslo[k] = pgs[k].delslo;
+        ph->dupsigma[k] = pgs[k].dupsigma;
+        strcpy(ph->elevphase[k], pgs[k].elevphase);
+        ph->elevvel[k] = pgs[k].elevvel;
+        ph->elevfactor[k] = pgs[k].elevfactor;
+        ph->bpset[k] = pgs[k].bpset;
+        ph->bplat[k] = pgs[k].bplat;
+        ph->bplon[k] = pgs[k].bplon;
+        ph->bpelev[k] = pgs[k].bpelev;
+    }
+    return 0;
+}
+
+/*
+ *  Title:
+ *     na_phases_free
+ *  Synopsis:
+ *     Frees the arrays of an NAPHASES structure.
+ *  Input Arguments:
+ *     ph - pointer to NAPHASES structure
+ *  Called by:
+ *     NASearch, na_phases_alloc
+ *  Calls:
+ *     Free
+ */
+static void na_phases_free(NAPHASES *ph)
+{
+    Free(ph->staind);
+    Free(ph->phase);
+    Free(ph->vmod);
+    Free(ph->time);
+    memset(ph, 0, sizeof(NAPHASES));
+}
+
+/*
+ *  Title:
+ *     na_phases_restore
+ *  Synopsis:
+ *     Restores the initial state of the scratch copy of phase records.
+ *  Input Arguments:
+ *     ph - pointer to NAPHASES structure
+ *     np - number of defining phases
+ *  Output Arguments:
+ *     p  - array of phase structures
+ *  Called by:
+ *     dosamples
+ */
+static void na_phases_restore(NAPHASES *ph, int np, PHAREC p[])
+{
+    int k;
+    for (k = 0; k < np; k++) {
+        strcpy(p[k].phase, ph->phase[k]);
+        p[k].phcode = ph->phcode[k];
+        strcpy(p[k].prevphase, ph->prevphase[k]);
+        p[k].phase_fixed = ph->phase_fixed[k];
+        p[k].time = ph->time[k];
+        p[k].ttime = ph->ttime[k];
+        p[k].dtdd = ph->dtdd[k];
+        p[k].dtdh = ph->dtdh[k];
+        p[k].bpdel = ph->bpdel[k];
+        strcpy(p[k].vmod, ph->vmod[k]);
+        p[k].deltim = ph->deltim[k];
+        p[k].delaz = ph->delaz[k];
+        p[k].delslo = ph->delslo[k];
+        p[k].dupsigma = ph->dupsigma[k];
+        strcpy(p[k].elevphase, ph->elevphase[k]);
+        p[k].elevvel = ph->elevvel[k];
+        p[k].elevfactor = ph->elevfactor[k];
+        p[k].bpset = ph->bpset[k];
+        p[k].bplat = ph->bplat[k];
+        p[k].bplon = ph->bplon[k];
+        p[k].bpelev = ph->bpelev[k];
+    }
+}
+
+/*
+ *  Title:
+ *     na_wcache_lookup
+ *  Synopsis:
+ *     Builds the defining phase signature of the current sample and
+ *     returns the cached projection matrix of an earlier sample with
+ *     the same signature. The signatures are compared in full, so a
+ *     cache hit gives exactly the projection matrix that
+ *     GetDataCovarianceMatrix and ProjectionMatrix would produce.
+ *  Input Arguments:
+ *     work - pointer to NA workspace
+ *     np   - number of phases
+ *     ndef - number of defining data
+ *     pgs  - array of phase structures
+ *  Return:
+ *     pointer to cache entry or NULL if not found
+ *  Called by:
+ *     NAForwardProblem
+ */
+static NAWCACHE *na_wcache_lookup(NAWORK *work, int np, int ndef,
+        PHAREC pgs[])
+{
+    unsigned char *b = (unsigned char *)work->sig;
+    unsigned long h = 2166136261UL;
+    size_t i, n = np * sizeof(NASIG);
+    int k;
+/*
+ *  signature; zero the padding so that signatures compare bytewise
+ */
+    memset(work->sig, 0, n);
+    for (k = 0; k < np; k++) {
+        strcpy(work->sig[k].phase, pgs[k].phase);
+        work->sig[k].defs = pgs[k].timedef | (pgs[k].azimdef << 1) |
+                            (pgs[k].slowdef << 2);
+        work->sig[k].deltim = pgs[k].deltim;
+        work->sig[k].delaz = pgs[k].delaz;
+        work->sig[k].delslo = pgs[k].delslo;
+        work->sig[k].rsttTotalErr = pgs[k].rsttTotalErr;
+    }
+/*
+ *  FNV-1a hash
+ */
+    for (i = 0; i < n; i++) {
+        h ^= b[i];
+        h *= 16777619UL;
+    }
+    work->hash = h;
+    work->nuse++;
+    for (k = 0; k < NA_WCACHE; k++) {
+        if (work->wcache[k].w == NULL || work->wcache[k].hash != h ||
+            work->wcache[k].ndef != ndef)
+            continue;
+        if (memcmp(work->wcache[k].sig, work->sig, n) == 0) {
+            work->wcache[k].lastuse = work->nuse;
+            return &work->wcache[k];
+        }
+    }
+    return (NAWCACHE *)NULL;
+}
+
+/*
+ *  Title:
+ *     na_wcache_store
+ *  Synopsis:
+ *     Saves the projection matrix of the signature built by the last
+ *     na_wcache_lookup call, replacing the least recently used entry.
+ *     Projection matrices larger than NA_WCACHEDEF are not cached.
+ *  Input Arguments:
+ *     work  - pointer to NA workspace
+ *     np    - number of phases
+ *     ndef  - number of defining data
+ *     prank - effective rank of the projection matrix
+ *     w     - projection matrix
+ *  Called by:
+ *     NAForwardProblem
+ *  Calls:
+ *     AllocateFloatMatrix, FreeFloatMatrix
+ */
+static void na_wcache_store(NAWORK *work, int np, int ndef, int prank,
+        double **w)
+{
+    NAWCACHE *wc = &work->wcache[0];
+    int i, k;
+    if (ndef > NA_WCACHEDEF)
+        return;
+    for (k = 0; k < NA_WCACHE; k++) {
+        if (work->wcache[k].w == NULL) {
+            wc = &work->wcache[k];
+            break;
+        }
+        if (work->wcache[k].lastuse < wc->lastuse)
+            wc = &work->wcache[k];
+    }
+    if (wc->sig == NULL &&
+        (wc->sig = (NASIG *)calloc(np, sizeof(NASIG))) == NULL)
+        return;
+    if (wc->w == NULL || wc->ndef != ndef) {
+        FreeFloatMatrix(wc->w);
+        if ((wc->w = AllocateFloatMatrix(ndef, ndef)) == NULL)
+            return;
+    }
+    memcpy(wc->sig, work->sig, np * sizeof(NASIG));
+    for (i = 0; i < ndef; i++)
+        memcpy(wc->w[i], w[i], ndef * sizeof(double));
+    wc->hash = work->hash;
+    wc->lastuse = work->nuse;
+    wc->ndef = ndef;
+    wc->prank = prank;
+}
+
 /*
  *  Title:
  *     NAForwardProblem
  *  Synopsis:
  *     returns misfit value (defined by lpnorm) for a given model
  *  Input Arguments:
+ *     ctx        - pointer to NA locator context
  *     nsta       - number of stations
  *     nasp       - NA search parameter structure
  *     model      - sample model
  *     sp         - pointer to current solution
  *     rdindx     - array of reading structures
  *     pgs        - array of phase structures
- *     TTtables  - pointer to travel-time tables
- *     ec         - pointer to ellipticity correction coefficient structure
- *     topo       - ETOPO bathymetry/elevation matrix
+ *     work       - pointer to NA workspace
  *     stalist    - array of starec structures
  *     distmatrix - station separation matrix
- *     variogramp - pointer to generic variogram model
  *  Return:
  *     misfit    - Lp-norm misfit of the sample model
  *  Called by:
- *     NASearch, do_samples
+ *     NASearch, dosamples
  *  Calls:
  *     GetDeltaAzimuth, ReIdentifyPhases, DuplicatePhases,
- *     GetDataCovarianceMatrix, AllocateFloatMatrix, FreeFloatMatrix,
- *     GetTravelTimePrediction, Free
- */
-static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
-        SOLREC *sp, READING *rdindx, PHAREC pgs[], TT_TABLE *TTtables,
-        TT_TABLE *LocalTTtable, EC_COEF *ec, short int **topo, STAREC stalist[],
-        double **distmatrix, VARIOGRAM *variogramp, char *buf, int is2nderiv,
-        int isprint)
+ *     FillDataCovarianceMatrix, ProjectionMatrix, AllocateFloatMatrix,
+ *     FreeFloatMatrix
+ */
+static double NAForwardProblem(ILOC_CONTEXT *ctx, int nsta, NASPACE *nasp,
+        double *model, SOLREC *sp, READING *rdindx, PHAREC pgs[],
+        NAWORK *work, STAREC stalist[], double **distmatrix, char *buf,
+        int is2nderiv, int isprint)
 {
     double z = 0., totnp = 0.;
     double misfit = 9999., sum = 0., norm = 0., penal = 0.;
     int i, k, prank = 0, ndef = 0, np = 0;
-    double **dcov = (double **)NULL;
     double **w = (double **)NULL;
-    double *d = (double *)NULL;
-    double *temp = (double *)NULL;
+    NAWCACHE *wc = (NAWCACHE *)NULL;
+    double *d = work->d;
+    double *temp = work->temp;
 /*
  *  current hypocenter
  */
@@ -806,8 +1490,9 @@ static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
     np = sp->numPhase;
     totnp = 2. * (double)np;
     GetDeltaAzimuth(sp, pgs, 0);
-    ReIdentifyPhases(sp, rdindx, pgs, ec, TTtables, LocalTTtable, topo, is2nderiv);
-    DuplicatePhases(sp, pgs, ec, TTtables, LocalTTtable, topo);
+    ReIdentifyPhases(sp, rdindx, pgs, ctx->ec, ctx->TTtables,
+                     ctx->LocalTTtables, ctx->topo, is2nderiv);
+    DuplicatePhases(ctx, sp, pgs);
     ndef = 0;
     for (i = 0; i < np; i++) {
         if (pgs[i].timedef) ndef++;
@@ -818,44 +1503,60 @@ static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
     sprintf(buf, "%10.4f %10.4f %4d %4d %4d", misfit, misfit, np, ndef, prank);
     if (ndef < nasp->nd)
         return misfit;
-    d = (double *)calloc(ndef, sizeof(double));
-    if ((temp = (double *)calloc(ndef, sizeof(double))) == NULL) {
-        Free(d);
-        return misfit;
-    }
 /*
  *  correlated errors
  */
-    if (DoCorrelatedErrors) {
+    if (ctx->DoCorrelatedErrors) {
 /*
- *      construct data covariance matrix
+ *      samples with the same defining phase signature share W;
+ *      the final model is always recalculated as the covariance matrix
+ *      indices are set in the phase records
  */
-        if ((dcov = GetDataCovarianceMatrix(nsta, np, ndef, pgs,
-                         stalist, distmatrix, variogramp)) == NULL) {
-            Free(d); Free(temp);
-            return misfit;
+        if (!isprint)
+            wc = na_wcache_lookup(work, np, ndef, pgs);
+        if (wc) {
+            w = wc->w;
+            prank = wc->prank;
         }
+        else {
 /*
- *      projection matrix
+ *          construct data covariance matrix; like the projection matrix
+ *          the workspace matrix only grows
  */
-        if ((w = AllocateFloatMatrix(ndef, ndef)) == NULL) {
-            FreeFloatMatrix(dcov);
-            Free(d); Free(temp);
-            return misfit;
-        }
-        if (ProjectionMatrix(np, pgs, ndef, 95., dcov, w,
-                              &prank, 0, (char **)NULL, 1)) {
-            FreeFloatMatrix(dcov);
-            FreeFloatMatrix(w);
-            Free(d); Free(temp);
-            return misfit;
-        }
-        if (prank < nasp->nd) {
-            FreeFloatMatrix(dcov);
-            FreeFloatMatrix(w);
-            Free(d); Free(temp);
+            if (ndef > work->dcovsize) {
+                FreeFloatMatrix(work->dcov);
+                work->dcovsize = 0;
+                if ((work->dcov = AllocateFloatMatrix(ndef, ndef)) == NULL)
+                    return misfit;
+                work->dcovsize = ndef;
+            }
+            if (FillDataCovarianceMatrix(nsta, np, ndef, pgs, stalist,
+                                         work->ph->staind, distmatrix,
+                                         ctx->variogram, work->dcov))
+                return misfit;
+/*
+ *          projection matrix; the Wmatrix blocks expect zeros outside
+ *          the phase blocks
+ */
+            if (ndef > work->wsize) {
+                FreeFloatMatrix(work->w);
+                work->wsize = 0;
+                if ((work->w = AllocateFloatMatrix(ndef, ndef)) == NULL)
+                    return misfit;
+                work->wsize = ndef;
+            }
+            w = work->w;
+            for (i = 0; i < ndef; i++)
+                memset(w[i], 0, ndef * sizeof(double));
+            if (ProjectionMatrix(np, pgs, ndef, 95., work->dcov, w,
+                                  &prank, 0, (char **)NULL, 1))
+                return misfit;
+            work->nproj++;
+            if (!isprint)
+                na_wcache_store(work, np, ndef, prank, w);
+        }
+        if (prank < nasp->nd)
             return misfit;
-        }
     }
 /*
  *  loop over phases
@@ -890,7 +1591,7 @@ static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
             k++;
         }
     }
-    if (DoCorrelatedErrors) {
+    if (ctx->DoCorrelatedErrors) {
 /*
  *      project residuals
  */
@@ -955,10 +1656,6 @@ static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
     penal = 4.0 * (totnp - (double)ndef) / totnp;
     misfit = norm + penal;
     sprintf(buf, "%10.4f %10.4f %4d %4d %4d", norm, penal, (int)totnp, ndef, prank);
-    FreeFloatMatrix(dcov);
-    FreeFloatMatrix(w);
-    Free(d);
-    Free(temp);
     return misfit;
 }
 
@@ -967,7 +1664,8 @@ static double NAForwardProblem(int nsta, NASPACE *nasp, double *model,
  *  na_initialize - performs minor initialization tasks for NA algorithm
  *
  */
-static int na_initialize(NASPACE *nasp, double *xcur, SOBOL *sas)
+static int na_initialize(NASPACE *nasp, double *xcur, SOBOL *sas,
+        unsigned long seed)
 {
     double rval[2], dummy = 0.;
     int nd = nasp->nd, i;
@@ -978,7 +1676,7 @@ static int na_initialize(NASPACE *nasp, double *xcur, SOBOL *sas)
 /*
  *  initialize pseudo-random number generator
  */
-    ranfib(1, iseed);
+    ranfib(1, seed);
 /*
  *  generate coefficients for quasi-random multidimensional SAS sequence
  */
@@ -1133,9 +1831,10 @@ static int na_initial_sample(double *na_models[], NASPACE *nasp, SOBOL *sas)
  */
 static int na_sample(double *na_models[], NASPACE *nasp, int ntot,
                      int *mfitord, double *xcur, int *restartNA, int nclean,
-                     double *dlist, SOBOL *sas, int *nu)
+                     double *dlist, int *nlist, NAKDTREE *kdtree, SOBOL *sas,
+                     int *nu)
 {
-    static int id = 0, ic = 0;
+    static THREADLOCAL int id = 0, ic = 0;
     int idnext = 0, cell = 0, icount = 0, nc = 0, nup = 0;
     int nrem = 0, nsampercell = 0, i, j, is = 0, iw = 0, resetlist = 0;
     int ind_cell = 0, ind_nextcell = 0, ind_lastcell = 0, mopt = 0;
@@ -1149,12 +1848,23 @@ static int na_sample(double *na_models[], NASPACE *nasp, int ntot,
     idnext = irandomvalue(0, nd - 1);
     ic++;
     if (!(ic % nclean)) resetlist = 1;
+/*
+ *  dlist does not hold the models of the previous iteration yet
+ */
+    if (ntot != *nlist) resetlist = 1;
     mopt = mfitord[cell];
     ind_nextcell = mopt;
     ind_lastcell = 0;
     nrem = NAnextSample % NAcells;
     if (nrem == 0) nsampercell = NAnextSample / NAcells;
     else           nsampercell = 1 + NAnextSample / NAcells;
+/*
+ *  add the models of the previous iteration to the kd-tree
+ */
+    if (kdtree) {
+        while (kdtree->n < ntot)
+            na_kd_insert(kdtree, na_models, kdtree->n);
+    }
 /*
  *  loop over samples
  */
@@ -1171,11 +1881,26 @@ static int na_sample(double *na_models[], NASPACE *nasp, int ntot,
             resetlist = 1;
         }
         for (iw = 0; iw < nd; iw++) {
+/*
+ *          nodex and its Voronoi cell on the new axis from the kd-tree
+ */
+            if (kdtree) {
+                nodex = na_kd_axis_intersect(kdtree, idnext, na_models,
+                                             xcur, nasp, &x1, &x2);
+                nc++;
+                if (verbose > 4) {
+                    nnode = findnearest(xcur, na_models, ntot, nd);
+                    if (nnode != nodex)
+                        fprintf(logfp, "                kd-tree node %d "
+                                "!= linear scan node %d\n", nodex, nnode);
+                }
+            }
 /*
  *          reset dlist and nodex for new axis
  */
-            if (resetlist) {
+            else if (resetlist) {
                 nodex = NNcalc_dlist(idnext, dlist, na_models, nd, ntot, xcur);
+                *nlist = ntot;
                 nc++;
                 resetlist = 0;
             }
@@ -1191,7 +1916,9 @@ static int na_sample(double *na_models[], NASPACE *nasp, int ntot,
 /*
  *          calculate intersection of current Voronoi cell with current 1D axis
  */
-            NNaxis_intersect(id, dlist, na_models, ntot, nodex, nasp, &x1, &x2);
+            if (!kdtree)
+                NNaxis_intersect(id, dlist, na_models, ntot, nodex, nasp,
+                                 &x1, &x2);
 /*
  *          generate new node in Voronoi cell of input point
  */
@@ -1401,6 +2128,325 @@ static void NNaxis_intersect(int id, double *dlist, double *na_models[],
     *x2 = hi;
 }
 
+/*
+ *  Title:
+ *     na_kd_alloc
+ *  Synopsis:
+ *     Allocates an empty kd-tree for ntotal NA models.
+ *  Input Arguments:
+ *     ntotal - max number of models
+ *     nd     - number of model parameters
+ *  Output Arguments:
+ *     kd     - kd-tree
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     NASearch
+ */
+static int na_kd_alloc(NAKDTREE *kd, int ntotal, int nd)
+{
+    kd->nd = nd;
+    kd->n = 0;
+    kd->root = -1;
+    kd->left = (int *)calloc(ntotal, sizeof(int));
+    if ((kd->right = (int *)calloc(ntotal, sizeof(int))) == NULL ||
+        kd->left == NULL) {
+        Free(kd->left);
+        kd->left = kd->right = (int *)NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Title:
+ *     na_kd_free
+ *  Synopsis:
+ *     Frees the kd-tree arrays.
+ *  Input Arguments:
+ *     kd - kd-tree
+ *  Called by:
+ *     NASearch
+ */
+static void na_kd_free(NAKDTREE *kd)
+{
+    Free(kd->left);
+    Free(kd->right);
+    kd->left = kd->right = (int *)NULL;
+    kd->n = 0;
+    kd->root = -1;
+}
+
+/*
+ *  Title:
+ *     na_kd_insert
+ *  Synopsis:
+ *     Inserts model i into the kd-tree. Models are inserted in sample
+ *     order, i.e. i is the number of models already in the tree.
+ *  Input Arguments:
+ *     kd        - kd-tree
+ *     na_models - models in scaled co-ordinates
+ *     i         - model index
+ *  Called by:
+ *     na_sample
+ */
+static void na_kd_insert(NAKDTREE *kd, double *na_models[], int i)
+{
+    int node, k, depth = 0;
+    kd->left[i] = kd->right[i] = -1;
+    kd->n++;
+    if (kd->root < 0) {
+        kd->root = i;
+        return;
+    }
+    node = kd->root;
+    for (;;) {
+        k = depth % kd->nd;
+        if (na_models[i][k] < na_models[node][k]) {
+            if (kd->left[node] < 0) {
+                kd->left[node] = i;
+                return;
+            }
+            node = kd->left[node];
+        }
+        else {
+            if (kd->right[node] < 0) {
+                kd->right[node] = i;
+                return;
+            }
+            node = kd->right[node];
+        }
+        depth++;
+    }
+}
+
+/*
+ *  Title:
+ *     na_kd_nearest
+ *  Synopsis:
+ *     Finds the model nearest to x. Ties are resolved in favour of the
+ *     lower model index, as in findnearest.
+ *  Input Arguments:
+ *     kd        - kd-tree
+ *     na_models - models in scaled co-ordinates
+ *     x         - point
+ *     exclude   - model to ignore, -1 if none
+ *  Output Arguments:
+ *     dmin      - square distance of the nearest model to x
+ *  Return:
+ *     index of the nearest model, -1 if the tree is empty
+ *  Called by:
+ *     na_kd_axis_intersect
+ *  Calls:
+ *     na_kd_nearest_r
+ */
+static int na_kd_nearest(NAKDTREE *kd, double *na_models[], double *x,
+                         int exclude, double *dmin)
+{
+    int best = -1;
+    *dmin = 1e30;
+    na_kd_nearest_r(kd, na_models, kd->root, 0, x, exclude, &best, dmin);
+    return best;
+}
+
+/*
+ *  Title:
+ *     na_kd_nearest_r
+ *  Synopsis:
+ *     Recursive nearest neighbour search in the subtree of node. The far
+ *     side of a split is only visited if it may hold a model closer than
+ *     the best one found so far.
+ *  Input Arguments:
+ *     kd        - kd-tree
+ *     na_models - models in scaled co-ordinates
+ *     node      - root of the subtree
+ *     depth     - depth of node
+ *     x         - point
+ *     exclude   - model to ignore, -1 if none
+ *  Output Arguments:
+ *     best      - index of the nearest model so far
+ *     dmin      - square distance of the nearest model so far
+ *  Called by:
+ *     na_kd_nearest, na_kd_nearest_r
+ *  Calls:
+ *     na_kd_nearest_r
+ */
+static void na_kd_nearest_r(NAKDTREE *kd, double *na_models[], int node,
+                            int depth, double *x, int exclude, int *best,
+                            double *dmin)
+{
+    int j, k;
+    double dsum = 0., d = 0.;
+    if (node < 0) return;
+    if (node != exclude) {
+        for (j = 0; j < kd->nd; j++) {
+            d = x[j] - na_models[node][j];
+            dsum += d * d;
+        }
+        if (dsum < *dmin || (dsum == *dmin && node < *best)) {
+            *dmin = dsum;
+            *best = node;
+        }
+    }
+    k = depth % kd->nd;
+    d = x[k] - na_models[node][k];
+    if (d < 0.) {
+        na_kd_nearest_r(kd, na_models, kd->left[node], depth + 1, x,
+                        exclude, best, dmin);
+        if (d * d <= *dmin)
+            na_kd_nearest_r(kd, na_models, kd->right[node], depth + 1, x,
+                            exclude, best, dmin);
+    }
+    else {
+        na_kd_nearest_r(kd, na_models, kd->right[node], depth + 1, x,
+                        exclude, best, dmin);
+        if (d * d <= *dmin)
+            na_kd_nearest_r(kd, na_models, kd->left[node], depth + 1, x,
+                            exclude, best, dmin);
+    }
+}
+
+/*
+ *  Title:
+ *     na_kd_range_r
+ *  Synopsis:
+ *     Visits the models of the subtree of node that fall in the query
+ *     box and updates the Voronoi cell boundaries of q->nodex on the
+ *     1D axis with them, using the same formula as NNaxis_intersect.
+ *  Input Arguments:
+ *     kd        - kd-tree
+ *     na_models - models in scaled co-ordinates
+ *     node      - root of the subtree
+ *     depth     - depth of node
+ *     q         - query
+ *  Output Arguments:
+ *     q         - query with updated lo, hi
+ *  Called by:
+ *     na_kd_axis_intersect, na_kd_range_r
+ *  Calls:
+ *     na_kd_range_r
+ */
+static void na_kd_range_r(NAKDTREE *kd, double *na_models[], int node,
+                          int depth, NAKDQUERY *q)
+{
+    int j, k, inbox = 1;
+    double *m, xc = 0., dpc = 0., dx = 0., xi = 0., d = 0.;
+    if (node < 0) return;
+    m = na_models[node];
+    for (j = 0; j < kd->nd; j++) {
+        if (m[j] < q->bmin[j] || m[j] > q->bmax[j]) {
+            inbox = 0;
+            break;
+        }
+    }
+    if (inbox && node != q->nodex) {
+        for (j = 0; j < kd->nd; j++) {
+            if (j == q->id) continue;
+            d = q->x[j] - m[j];
+            dpc += d * d;
+        }
+        xc = m[q->id];
+        dx = q->x0 - xc;
+        if (fabs(dx) > DEPSILON) {
+            xi = 0.5 * (q->x0 + xc + (q->dp0 - dpc) / dx);
+            if (q->xmin < xi && xi < q->xmax) {
+                if (xi > q->lo && q->x0 > xc)
+                    q->lo = xi;
+                if (xi < q->hi && q->x0 < xc)
+                    q->hi = xi;
+            }
+        }
+    }
+    k = depth % kd->nd;
+    if (q->bmin[k] < m[k])
+        na_kd_range_r(kd, na_models, kd->left[node], depth + 1, q);
+    if (q->bmax[k] >= m[k])
+        na_kd_range_r(kd, na_models, kd->right[node], depth + 1, q);
+}
+
+/*
+ *  Title:
+ *     na_kd_axis_intersect
+ *  Synopsis:
+ *     kd-tree version of NNcalc_dlist/NNupdate_dlist and NNaxis_intersect.
+ *     Finds the model nodex nearest to x and the intersections of its
+ *     Voronoi cell with the 1D axis through x along dimension id.
+ *
+ *     A model can only move a cell boundary inward if it is equidistant
+ *     with nodex from a point of the current segment [lo, hi] of the
+ *     axis, so it must lie within R of the segment, where R is the
+ *     largest distance of nodex from the segment ends. The models in a
+ *     small box around x are visited first to obtain a tight segment,
+ *     then the models in the box of half-width R around the segment.
+ *     The result is the same as that of the exhaustive search, but only
+ *     the models in the neighbourhood of the cell are visited.
+ *  Input Arguments:
+ *     kd        - kd-tree
+ *     id        - dimension index (defines axis)
+ *     na_models - models in scaled co-ordinates
+ *     x         - point on axis
+ *     nasp      - NA search parameter structure
+ *  Output Arguments:
+ *     x1        - intersection of first Voronoi boundary
+ *     x2        - intersection of second Voronoi boundary
+ *  Return:
+ *     nodex - index of the model nearest to x
+ *  Called by:
+ *     na_sample
+ *  Calls:
+ *     na_kd_nearest, na_kd_range_r
+ */
+static int na_kd_axis_intersect(NAKDTREE *kd, int id, double *na_models[],
+                                double *x, NASPACE *nasp,
+                                double *x1, double *x2)
+{
+    NAKDQUERY q;
+    int j, nodex;
+    double dx = 0., dnn = 0., h = 0., r = 0., d = 0.;
+    nodex = na_kd_nearest(kd, na_models, x, -1, &dx);
+    q.x = x;
+    q.id = id;
+    q.nodex = nodex;
+    q.x0 = na_models[nodex][id];
+    q.dp0 = 0.;
+    for (j = 0; j < kd->nd; j++) {
+        if (j == id) continue;
+        d = x[j] - na_models[nodex][j];
+        q.dp0 += d * d;
+    }
+    q.lo = q.xmin = nasp->ranget[id][0];
+    q.hi = q.xmax = nasp->ranget[id][1];
+/*
+ *  first pass: models around x, including the nearest neighbour of nodex
+ */
+    if (na_kd_nearest(kd, na_models, na_models[nodex], nodex, &dnn) >= 0) {
+        h = Sqrt(dx) + Sqrt(dnn);
+        for (j = 0; j < kd->nd; j++) {
+            q.bmin[j] = x[j] - h;
+            q.bmax[j] = x[j] + h;
+        }
+        na_kd_range_r(kd, na_models, kd->root, 0, &q);
+    }
+/*
+ *  second pass: models that may still cut the segment [lo, hi]
+ */
+    d = q.lo - q.x0;
+    r = q.dp0 + d * d;
+    d = q.hi - q.x0;
+    if (q.dp0 + d * d > r) r = q.dp0 + d * d;
+    r = Sqrt(r) * (1. + 1.e-6) + DEPSILON;
+    for (j = 0; j < kd->nd; j++) {
+        q.bmin[j] = x[j] - r;
+        q.bmax[j] = x[j] + r;
+    }
+    q.bmin[id] = q.lo - r;
+    q.bmax[id] = q.hi + r;
+    na_kd_range_r(kd, na_models, kd->root, 0, &q);
+    *x1 = q.lo;
+    *x2 = q.hi;
+    return nodex;
+}
+
 /*
  *
  *   NA_deviate - generates a random deviate according to
@@ -1495,6 +2541,88 @@ static void na_misfits(double *misfit, int ns, int ntot, double *mfitmin,
     }
 }
 
+/*
+ *  Title:
+ *     na_converged
+ *  Synopsis:
+ *     Adaptive termination criteria for the NA search. The search stops
+ *     if any of the enabled criteria is met:
+ *        NAmisfitTol > 0: the relative improvement of the best misfit
+ *           was less than NAmisfitTol in NAstallIter consecutive iterations;
+ *        NAcellTol > 0: the RMS distance of the NAcells best models from
+ *           the best model, in units of the search ranges, is less than
+ *           NAcellTol, i.e. the resampled Voronoi cells have shrunk;
+ *        NAmaxTime > 0: the NA search took longer than NAmaxTime seconds.
+ *  Input Arguments:
+ *     mfitprev  - lowest misfit before the current iteration
+ *     mfitmin   - lowest misfit after the current iteration
+ *     na_models - models in scaled co-ordinates
+ *     mfitord   - indices of the NAcells best models, best first
+ *     nasp      - NA search parameter structure
+ *     tna       - start time of the NA search
+ *  Output Arguments:
+ *     nstall    - number of consecutive stalled iterations
+ *     reason    - criterion that fired
+ *  Return:
+ *     1 if the search should stop, 0 otherwise
+ *  Called by:
+ *     NASearch
+ *  Calls:
+ *     secs
+ */
+static int na_converged(double mfitprev, double mfitmin, int *nstall,
+        double *na_models[], int *mfitord, NASPACE *nasp,
+        struct timeval *tna, char *reason)
+{
+    double improvement = 0., spread = 0., x = 0., dt = 0.;
+    int i, k, nd = nasp->nd;
+/*
+ *  relative misfit improvement
+ */
+    if (NAmisfitTol > 0.) {
+        if (mfitprev > 0.)
+            improvement = (mfitprev - mfitmin) / mfitprev;
+        else
+            improvement = 1.;
+        if (improvement < NAmisfitTol) (*nstall)++;
+        else                           *nstall = 0;
+        if (*nstall >= max(1, NAstallIter)) {
+            sprintf(reason, "misfit improvement %.4f < %.4f in %d iterations",
+                    improvement, NAmisfitTol, *nstall);
+            return 1;
+        }
+    }
+/*
+ *  Voronoi cell shrinkage: spread of the best cells around the best model
+ */
+    if (NAcellTol > 0. && NAcells > 1) {
+        spread = 0.;
+        for (i = 1; i < NAcells; i++) {
+            for (k = 0; k < nd; k++) {
+                x = (na_models[mfitord[i]][k] - na_models[mfitord[0]][k]) /
+                    (nasp->ranget[k][1] - nasp->ranget[k][0]);
+                spread += x * x;
+            }
+        }
+        spread = sqrt(spread / (double)(NAcells - 1));
+        if (spread < NAcellTol) {
+            sprintf(reason, "cell spread %.4f < %.4f", spread, NAcellTol);
+            return 1;
+        }
+    }
+/*
+ *  wall-clock budget
+ */
+    if (NAmaxTime > 0.) {
+        dt = secs(tna);
+        if (dt > NAmaxTime) {
+            sprintf(reason, "time %.2f s > %.2f s", dt, NAmaxTime);
+            return 1;
+        }
+    }
+    return 0;
+}
+
 /*
  *
  * transform2raw - transforms model from scaled to raw units.
@@ -1916,8 +3044,8 @@ static int na_sobol(int n, double *x, int mode, int init, SOBOL *sas)
 {
     int j, k, m;
     unsigned long i, im, ipp;
-    static double fac;
-    static unsigned long in, *inn, *ix;
+    static THREADLOCAL double fac;
+    static THREADLOCAL unsigned long in, *inn, *ix;
 
     if (init == 1) {
 /*
@@ -2027,12 +3155,12 @@ static void sobseq(int n, double *x)
     int j, k, m;
     unsigned long i, im, ipp;
     static int mdeg[MAXDIM] = { 1, 2, 3, 3, 4, 4 };
-    static unsigned long in;
-    static unsigned long ix[MAXDIM], *iu[NA_MAXBIT];
+    static THREADLOCAL unsigned long in;
+    static THREADLOCAL unsigned long ix[MAXDIM], *iu[NA_MAXBIT];
     static unsigned long ip[MAXDIM] = { 0, 1, 1, 2, 1, 4 };
-    static unsigned long iv[MAXDIM*NA_MAXBIT] =
+    static THREADLOCAL unsigned long iv[MAXDIM*NA_MAXBIT] =
         { 1,1,1,1,1,1,3,1,3,3,1,1,5,7,7,3,3,5,15,11,5,15,13,9 };
-    static double fac;
+    static THREADLOCAL double fac;
 /*
  *  initialize
  */
@@ -2085,8 +3213,8 @@ static void sobseq(int n, double *x)
  */
 static double ranfib(int init, unsigned long seed)
 {
-    static int inext, inextp;
-    static double dtab[55];
+    static THREADLOCAL int inext, inextp;
+    static THREADLOCAL double dtab[55];
     int k;
     double d = 0.;
     if (init) {
@@ -2117,7 +3245,7 @@ static double dranq1(unsigned long seed)
 
 static unsigned long lranq1(unsigned long seed)
 {
-    static unsigned long v = 1L;
+    static THREADLOCAL unsigned long v = 1L;
 /*
  *  initialize random number generator
  */
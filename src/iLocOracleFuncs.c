@@ -30,8 +30,8 @@
 #ifdef ORASQL
 
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
 extern dpiConn *conn;                          /* Oracle database connection */
 extern dpiContext *gContext;
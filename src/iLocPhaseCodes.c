@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "iLoc.h"
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
+extern int numPhaseTT;                                   /* number of phases */
+extern char PhaseTT[MAXTTPHA][PHALEN];                         /* phase list */
+extern int numLocalPhaseTT;                        /* number of local phases */
+extern char LocalPhaseTT[MAXLOCALTTPHA][PHALEN];         /* local phase list */
+extern char PhaseWithoutResidual[MAXNUMPHA][PHALEN];   /* no-residual phases */
+extern int PhaseWithoutResidualNum;          /* number of no-residual phases */
+extern char MBPhase[MAXNUMPHA][PHALEN];   /* phases used in mb determination */
+extern int numMBPhase;                               /* number of mb phases */
+extern char MSPhase[MAXNUMPHA][PHALEN];   /* phases used in MS determination */
+extern int numMSPhase;                               /* number of Ms phases */
+extern char MLPhase[MAXNUMPHA][PHALEN];   /* phases used in ML determination */
+extern int numMLPhase;                               /* number of ML phases */
+extern char AllowablePhases[MAXTTPHA][PHALEN];           /* allowable phases */
+extern int numAllowablePhases;                /* number of allowable phases */
+extern char firstPphase[MAXTTPHA][PHALEN];        /* first-arriving P phases */
+extern int numFirstPphase;             /* number of first-arriving P phases */
+extern char firstSphase[MAXTTPHA][PHALEN];        /* first-arriving S phases */
+extern int numFirstSphase;             /* number of first-arriving S phases */
+extern char firstPoptional[MAXTTPHA][PHALEN];     /* optional first P phases */
+extern int numFirstPoptional;          /* number of optional first P phases */
+extern char firstSoptional[MAXTTPHA][PHALEN];     /* optional first S phases */
+extern int numFirstSoptional;          /* number of optional first S phases */
+extern PHASEWEIGHT PhaseWeight[MAXNUMPHA];       /* prior measurement errors */
+extern int numPhaseWeight;                /* number of phases in PhaseWeight */
+
+/*
+ * Phase dictionary
+ *     open addressing hash table of interned phase names; it is built once
+ *     by InitPhaseCodes after the auxiliary data files are read and it is
+ *     read-only afterwards, so it can be shared by concurrent events
+ */
+#define PHASEHASHSIZE (2 * MAXPHASECODE)           /* hash table size, 2^n */
+static PHASEPROP PhaseProps[MAXPHASECODE];            /* phase properties */
+static int numPhaseCodes = 0;                /* number of interned phases */
+static int PhaseHash[PHASEHASHSIZE];          /* phase code + 1, 0 if empty */
+
+/*
+ * Functions:
+ *    InitPhaseCodes
+ *    PhaseCode
+ *    GetPhaseProperties
+ *    GetPhaseType
+ *    isNoResidualPhase
+ */
+
+/*
+ * Local functions:
+ *    PhaseHashValue
+ *    InternPhase
+ *    InternPhaseList
+ *    PhaseListIndex
+ *    PhaseTypeFromName
+ */
+static unsigned int PhaseHashValue(char *phase);
+static int InternPhase(char *phase);
+static void InternPhaseList(int n, char list[][PHALEN]);
+static int PhaseListIndex(char *phase, int n, char list[][PHALEN]);
+static void PhaseTypeFromName(char *phase, int *isP, int *isS, int *isdepth);
+
+/*
+ *  Title:
+ *     InitPhaseCodes
+ *  Synopsis:
+ *     Interns the phase names of the TT tables and the phase configuration
+ *     lists into small integer codes and precomputes their properties.
+ *     The properties are obtained from the very same phase lists that the
+ *     string based lookups used, so code based lookups return identical
+ *     results. Phase names that are not interned are unknown to all lists.
+ *     The phases of the PhaseWeight table are interned too, so every
+ *     defining phase has a phase code.
+ *  Called by:
+ *     ReadAuxDataFiles
+ *  Calls:
+ *     InternPhase, InternPhaseList, PhaseListIndex, ECPhaseIndex,
+ *     PhaseTypeFromName
+ */
+void InitPhaseCodes(void)
+{
+    int i, k0, k1, k2;
+    PHASEPROP *pp;
+    numPhaseCodes = 0;
+    for (i = 0; i < PHASEHASHSIZE; i++)
+        PhaseHash[i] = 0;
+/*
+ *  intern phase names
+ */
+    InternPhaseList(numPhaseTT, PhaseTT);
+    InternPhaseList(numLocalPhaseTT, LocalPhaseTT);
+    InternPhase("Lg");
+    InternPhaseList(PhaseWithoutResidualNum, PhaseWithoutResidual);
+    InternPhaseList(numAllowablePhases, AllowablePhases);
+    InternPhaseList(numFirstPphase, firstPphase);
+    InternPhaseList(numFirstSphase, firstSphase);
+    InternPhaseList(numFirstPoptional, firstPoptional);
+    InternPhaseList(numFirstSoptional, firstSoptional);
+    InternPhaseList(numMBPhase, MBPhase);
+    InternPhaseList(numMSPhase, MSPhase);
+    InternPhaseList(numMLPhase, MLPhase);
+    for (i = 0; i < numPhaseWeight; i++)
+        InternPhase(PhaseWeight[i].phase);
+/*
+ *  phase properties
+ */
+    for (i = 0; i < numPhaseCodes; i++) {
+        pp = &PhaseProps[i];
+        pp->ttindex = PhaseListIndex(pp->phase, numPhaseTT, PhaseTT);
+        pp->localttindex = PhaseListIndex(pp->phase, numLocalPhaseTT,
+                                          LocalPhaseTT);
+        if (pp->localttindex < 0 && streq(pp->phase, "Lg"))
+            pp->localttindex = 22;
+/*
+ *      the EC index of a few phases depends on delta (100 and 165 degrees)
+ */
+        k0 = ECPhaseIndex(pp->phase, 50.);
+        k1 = ECPhaseIndex(pp->phase, 120.);
+        k2 = ECPhaseIndex(pp->phase, 170.);
+        pp->ecindex = (k0 == k1 && k1 == k2) ? k0 : -2;
+        pp->noresidual = PhaseListIndex(pp->phase, PhaseWithoutResidualNum,
+                                        PhaseWithoutResidual) >= 0;
+        pp->firstP = PhaseListIndex(pp->phase, numFirstPphase,
+                                    firstPphase) >= 0;
+        pp->firstPoptional = PhaseListIndex(pp->phase, numFirstPoptional,
+                                            firstPoptional) >= 0;
+        pp->firstS = PhaseListIndex(pp->phase, numFirstSphase,
+                                    firstSphase) >= 0;
+        pp->firstSoptional = PhaseListIndex(pp->phase, numFirstSoptional,
+                                            firstSoptional) >= 0;
+        PhaseTypeFromName(pp->phase, &pp->isP, &pp->isS, &pp->isDepthPhase);
+    }
+    if (verbose > 2)
+        fprintf(logfp, "    InitPhaseCodes: %d phases interned\n",
+                numPhaseCodes);
+}
+
+/*
+ *  Title:
+ *     PhaseCode
+ *  Synopsis:
+ *     Returns the integer code of an interned phase name.
+ *  Input Arguments:
+ *     phase - phase
+ *  Return:
+ *     phase code or -1 if the phase name is not interned
+ *  Called by:
+ *     GetPhaseProperties, IdentifyPhases, ReIdentifyPhases,
+ *     SameArrivalTime, IdentifyPFAKE, RemovePFAKE,
+ *     ResidualsForReportedPhases, TTcacheKey
+ *  Calls:
+ *     PhaseHashValue
+ */
+int PhaseCode(char *phase)
+{
+    unsigned int h;
+    int k;
+    h = PhaseHashValue(phase) & (PHASEHASHSIZE - 1);
+    while ((k = PhaseHash[h]) != 0) {
+        if (streq(phase, PhaseProps[k-1].phase))
+            return k - 1;
+        h = (h + 1) & (PHASEHASHSIZE - 1);
+    }
+    return -1;
+}
+
+/*
+ *  Title:
+ *     GetPhaseProperties
+ *  Synopsis:
+ *     Returns the precomputed properties of a phase.
+ *  Input Arguments:
+ *     phase - phase
+ *  Return:
+ *     pointer to phase properties or NULL if the phase name is not interned
+ *  Called by:
+ *     GetPhaseIndex, GetLocalPhaseIndex, GetEllipticityCorrection,
+ *     isNoResidualPhase, isFirstP, isFirstS
+ *  Calls:
+ *     PhaseCode
+ */
+PHASEPROP *GetPhaseProperties(char *phase)
+{
+    int k;
+    if ((k = PhaseCode(phase)) < 0)
+        return (PHASEPROP *)NULL;
+    return &PhaseProps[k];
+}
+
+/*
+ *  Title:
+ *     GetPhaseType
+ *  Synopsis:
+ *     Returns the type flags of the phase of a phase record. The flags of
+ *     interned phases are looked up by the phase code set at phase
+ *     identification; phases unknown to the dictionary are typed by name.
+ *  Input Arguments:
+ *     pp      - pointer to phase structure
+ *  Output Arguments:
+ *     isP     - P-type phase, including depth phases (pP, pwP, sP)
+ *     isS     - S-type phase, including Lg and depth phases (pS, sS)
+ *     isdepth - depth phase
+ *  Called by:
+ *     IdentifyPhases, ReIdentifyPhases, PhaseIdentification
+ *  Calls:
+ *     PhaseTypeFromName
+ */
+void GetPhaseType(PHAREC *pp, int *isP, int *isS, int *isdepth)
+{
+    PHASEPROP *prop;
+    if (pp->phcode < 0 || pp->phcode >= numPhaseCodes) {
+        PhaseTypeFromName(pp->phase, isP, isS, isdepth);
+        return;
+    }
+    prop = &PhaseProps[pp->phcode];
+    *isP = prop->isP;
+    *isS = prop->isS;
+    *isdepth = prop->isDepthPhase;
+}
+
+/*
+ *  Title:
+ *     isNoResidualPhase
+ *  Synopsis:
+ *     Finds if a phase is in the list of phases without residuals.
+ *  Input Arguments:
+ *     phase - phase
+ *  Return:
+ *     1 if found, 0 otherwise
+ *  Called by:
+ *     PhaseIdentification, NASearch, GetTTResidual, GetStationmb,
+ *     GetStationmB, GetStationML
+ *  Calls:
+ *     GetPhaseProperties
+ */
+int isNoResidualPhase(char *phase)
+{
+    PHASEPROP *pp = GetPhaseProperties(phase);
+    return (pp == NULL) ? 0 : pp->noresidual;
+}
+
+/*
+ *  Title:
+ *     PhaseHashValue
+ *  Synopsis:
+ *     FNV-1a hash of a phase name.
+ *  Input Arguments:
+ *     phase - phase
+ *  Return:
+ *     hash value
+ *  Called by:
+ *     PhaseCode, InternPhase
+ */
+static unsigned int PhaseHashValue(char *phase)
+{
+    unsigned int h = 2166136261u;
+    unsigned char *s = (unsigned char *)phase;
+    while (*s) {
+        h ^= *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ *  Title:
+ *     InternPhase
+ *  Synopsis:
+ *     Adds a phase name to the phase dictionary if it is not there yet.
+ *  Input Arguments:
+ *     phase - phase
+ *  Return:
+ *     phase code or -1 if the name is empty or the dictionary is full
+ *  Called by:
+ *     InitPhaseCodes, InternPhaseList
+ *  Calls:
+ *     PhaseCode, PhaseHashValue
+ */
+static int InternPhase(char *phase)
+{
+    unsigned int h;
+    int k;
+    if (phase[0] == '\0') return -1;
+    if ((k = PhaseCode(phase)) >= 0) return k;
+    if (numPhaseCodes == MAXPHASECODE) {
+        fprintf(logfp, "InternPhase: too many phase names, %s ignored\n",
+                phase);
+        return -1;
+    }
+    k = numPhaseCodes++;
+    strncpy(PhaseProps[k].phase, phase, PHALEN - 1);
+    PhaseProps[k].phase[PHALEN - 1] = '\0';
+    h = PhaseHashValue(PhaseProps[k].phase) & (PHASEHASHSIZE - 1);
+    while (PhaseHash[h])
+        h = (h + 1) & (PHASEHASHSIZE - 1);
+    PhaseHash[h] = k + 1;
+    return k;
+}
+
+/*
+ *  Title:
+ *     InternPhaseList
+ *  Synopsis:
+ *     Adds a list of phase names to the phase dictionary.
+ *  Input Arguments:
+ *     n    - number of phases
+ *     list - phase list
+ *  Called by:
+ *     InitPhaseCodes
+ *  Calls:
+ *     InternPhase
+ */
+static void InternPhaseList(int n, char list[][PHALEN])
+{
+    int i;
+    for (i = 0; i < n; i++)
+        InternPhase(list[i]);
+}
+
+/*
+ *  Title:
+ *     PhaseListIndex
+ *  Synopsis:
+ *     Returns the index of the first occurrence of a phase in a phase list.
+ *  Input Arguments:
+ *     phase - phase
+ *     n     - number of phases
+ *     list  - phase list
+ *  Return:
+ *     index or -1 if not found
+ *  Called by:
+ *     InitPhaseCodes
+ */
+static int PhaseListIndex(char *phase, int n, char list[][PHALEN])
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (streq(phase, list[i])) return i;
+    }
+    return -1;
+}
+
+/*
+ *  Title:
+ *     PhaseTypeFromName
+ *  Synopsis:
+ *     Types a phase by its name. The phase type is determined by the first
+ *     leg of the phase id; for depth phases (lower case first leg) it is
+ *     determined by the second letter.
+ *  Input Arguments:
+ *     phase   - phase
+ *  Output Arguments:
+ *     isP     - P-type phase [0/1]
+ *     isS     - S-type phase [0/1]
+ *     isdepth - depth phase [0/1]
+ *  Called by:
+ *     InitPhaseCodes, GetPhaseType
+ */
+static void PhaseTypeFromName(char *phase, int *isP, int *isS, int *isdepth)
+{
+    *isdepth = islower(phase[0]) ? 1 : 0;
+    if (*isdepth) {
+        *isP = (phase[1] == 'P' || phase[1] == 'w');
+        *isS = (phase[1] == 'S');
+    }
+    else {
+        *isP = (phase[0] == 'P');
+        *isS = (phase[0] == 'S' || streq(phase, "Lg"));
+    }
+}
@@ -28,10 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 extern PHASEMAP PhaseMap[MAXPHACODES];   /* reported phase to IASPEI mapping */
 extern int numPhaseMap;                      /* number of phases in PhaseMap */
 extern char AllowablePhases[MAXTTPHA][PHALEN];           /* allowable phases */
@@ -46,11 +46,9 @@ extern char firstSoptional[MAXTTPHA][PHALEN];     /* optional first S phases */
 extern int numFirstSoptional;           /* number of optional first S phases */
 extern PHASEWEIGHT PhaseWeight[MAXNUMPHA];          /* prior time measerrors */
 extern int numPhaseWeight;                /* number of phases in PhaseWeight */
-extern char PhaseWithoutResidual[MAXNUMPHA][PHALEN];   /* no-residual phases */
-extern int PhaseWithoutResidualNum;          /* number of no-residual phases */
 extern double SigmaThreshold;             /* to exclude phases from solution */
-extern int DoCorrelatedErrors;              /* account for correlated errors */
 extern int UseRSTT;                                  /* use RSTT predictions */
+extern pthread_mutex_t RSTTmutex;                  /* serializes RSTT calls */
 extern int DoNotRenamePhase;                     /* do not reidentify phases */
 extern double mbMinPeriod;                  /* min period for calculating mb */
 extern double mbMaxPeriod;                  /* max period for calculating mb */
@@ -79,16 +77,15 @@ extern int MinNdefPhases;                            /* min number of phases */
  */
 static void PhaseIdentification(SOLREC *sp, READING *rdindx, PHAREC p[],
         EC_COEF *ec, TT_TABLE *tt_tables, TT_TABLE *localtt_tables,
-        short int **topo);
+        ETOPO *topo);
 static int isFirstP(char *phase, char *mappedphase);
 static int isFirstS(char *phase, char *mappedphase);
 static void GetPriorMeasurementError(PHAREC *pp);
-static void SameStation(int samesta[], int n, SOLREC *sp, PHAREC p[],
-        EC_COEF *ec, TT_TABLE *tt_tables, TT_TABLE *localtt_tables,
-        short int **topo);
+static void SameStation(ILOC_CONTEXT *ctx, int samesta[], int n, SOLREC *sp,
+        PHAREC p[]);
 static void SameArrivalTime(int sametime[], int n, SOLREC *sp, PHAREC p[],
         EC_COEF *ec, TT_TABLE *tt_tables, TT_TABLE *localtt_tables,
-        short int **topo);
+        ETOPO *topo);
 
 /*
  *  Title:
@@ -118,13 +115,14 @@ static void SameArrivalTime(int sametime[], int n, SOLREC *sp, PHAREC p[],
  *  Called by:
  *     Locator, ResidualsForFixedHypocenter
  *  Calls:
- *     PhaseIdentification, GetPriorMeasurementError
+ *     PhaseIdentification, GetPriorMeasurementError, PhaseCode,
+ *     GetPhaseType
  */
 int IdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, short int **topo,
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo,
         int *is2nderiv)
 {
-    int i, j, n = 0, np;
+    int i, j, n = 0, np, isP = 0, isS = 0, isdepth = 0;
     sp->ntimedef = sp->nazimdef = sp->nslowdef = 0;
 /*
  *  map phases to IASPEI phase names
@@ -144,8 +142,10 @@ int IdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
 /*
  *      continue if phase name is fixed by analysts
  */
-        if (p[i].phase_fixed)
+        if (p[i].phase_fixed) {
+            p[i].phcode = PhaseCode(p[i].phase);
             continue;
+        }
 /*
  *      initialize phase name
  */
@@ -173,6 +173,7 @@ int IdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
                 break;
             }
         }
+        p[i].phcode = PhaseCode(p[i].phase);
     }
 /*
  *  identify first arriving P and S in a reading
@@ -180,16 +181,15 @@ int IdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
     for (i = 0; i < sp->nreading; i++) {
         np = rdindx[i].start + rdindx[i].npha;
         for (j = rdindx[i].start; j < np; j++) {
-            if (p[j].phase[0] == 'P' ||
-                (islower(p[j].phase[0]) &&
-                 (p[j].phase[1] == 'P' || p[j].phase[1] == 'w'))) {
+            GetPhaseType(&p[j], &isP, &isS, &isdepth);
+            if (isP) {
                 p[j].firstP = 1;
                 break;
             }
         }
         for (j = rdindx[i].start; j < np; j++) {
-            if (p[j].phase[0] == 'S' || streq(p[j].phase, "Lg") ||
-                (islower(p[j].phase[0]) && p[j].phase[1] == 'S')) {
+            GetPhaseType(&p[j], &isP, &isS, &isdepth);
+            if (isS) {
                 p[j].firstS = 1;
                 break;
             }
@@ -205,12 +205,16 @@ int IdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
 /*
  *  clear current GreatCircle object and the pool of CrustalProfile objects
  */
-    if (UseRSTT)
-         slbm_shell_clear();
+    if (UseRSTT) {
+        pthread_mutex_lock(&RSTTmutex);
+        slbm_shell_clear();
+        pthread_mutex_unlock(&RSTTmutex);
+    }
 /*
- *  set timedef flags and get prior measurement errors
+ *  set phase codes and timedef flags and get prior measurement errors
  */
     for (i = 0; i < sp->numPhase; i++) {
+        p[i].phcode = PhaseCode(p[i].phase);
         if (streq(p[i].phase, "")) {
 /*
  *          unidentified phases are made non-defining
@@ -277,13 +281,14 @@ int IdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
  *  Called by:
  *     Locator, LocateEvent
  *  Calls:
- *     PhaseIdentification, GetPriorMeasurementError
+ *     PhaseIdentification, GetPriorMeasurementError, PhaseCode,
+ *     GetPhaseType
  */
 int ReIdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, short int **topo,
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo,
         int is2nderiv)
 {
-    int i, j, np, isphasechange = 0;
+    int i, j, np, isphasechange = 0, isP = 0, isS = 0, isdepth = 0;
     for (i = 0; i < sp->numPhase; i++)
         p[i].firstP = p[i].firstS = p[i].duplicate = 0;
 /*
@@ -292,16 +297,15 @@ int ReIdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
     for (i = 0; i < sp->nreading; i++) {
         np = rdindx[i].start + rdindx[i].npha;
         for (j = rdindx[i].start; j < np; j++) {
-            if (p[j].phase[0] == 'P' ||
-                (islower(p[j].phase[0]) &&
-                 (p[j].phase[1] == 'P' || p[j].phase[1] == 'w'))) {
+            GetPhaseType(&p[j], &isP, &isS, &isdepth);
+            if (isP) {
                 p[j].firstP = 1;
                 break;
             }
         }
         for (j = rdindx[i].start; j < np; j++) {
-            if (p[j].phase[0] == 'S' || streq(p[j].phase, "Lg") ||
-                (islower(p[j].phase[0]) && p[j].phase[1] == 'S')) {
+            GetPhaseType(&p[j], &isP, &isS, &isdepth);
+            if (isS) {
                 p[j].firstS = 1;
                 break;
             }
@@ -317,12 +321,16 @@ int ReIdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
 /*
  *  clear current GreatCircle object and the pool of CrustalProfile objects
  */
-    if (UseRSTT)
+    if (UseRSTT) {
+        pthread_mutex_lock(&RSTTmutex);
         slbm_shell_clear();
+        pthread_mutex_unlock(&RSTTmutex);
+    }
 /*
- *  set timedef flags and get prior measurement errors
+ *  set phase codes and timedef flags and get prior measurement errors
  */
     for (i = 0; i < sp->numPhase; i++) {
+        p[i].phcode = PhaseCode(p[i].phase);
         if (streq(p[i].phase, "")) {
 /*
  *          unidentified phases are made non-defining
@@ -424,17 +432,17 @@ int ReIdentifyPhases(SOLREC *sp, READING *rdindx, PHAREC p[], EC_COEF *ec,
  *  Called by:
  *     IdentifyPhases, ReIdentifyPhases
  *  Calls:
- *     GetTravelTimePrediction, isFirstP, isFirstS
+ *     GetTravelTimePrediction, GetPhaseType, isFirstP, isFirstS
  */
 static void PhaseIdentification(SOLREC *sp, READING *rdindx, PHAREC p[],
         EC_COEF *ec, TT_TABLE *tt_tables, TT_TABLE *localtt_tables,
-        short int **topo)
+        ETOPO *topo)
 {
     double resid, bigres = 60., min_resid, dtdd = NULLVAL;
     double rstterr = 0., pickerr = 0.;
     double ttime = NULLVAL, pPttime = NULLVAL, d2tdd = 0., d2tdh = 0.;
     char candidate_phase[PHALEN], mappedphase[PHALEN], phase[PHALEN];
-    int isS = 0, isP = 0, isI = 0, isH = 0, iss = 0, isp = 0;
+    int isS = 0, isP = 0, isI = 0, isH = 0, iss = 0, isp = 0, isdepth = 0;
     int ptype = 0, stype = 0, ttype = 0;
     int j, k, m, n, ii, isseen = 0, npha = 0;
 /*
@@ -448,27 +456,20 @@ static void PhaseIdentification(SOLREC *sp, READING *rdindx, PHAREC p[],
 /*
  *      skip phases that don't get residuals (amplitudes etc)
  */
-        for (j = 0; j < PhaseWithoutResidualNum; j++) {
-            if (streq(p[k].phase, PhaseWithoutResidual[j]))
-                break;
-        }
-        if (j != PhaseWithoutResidualNum)
+        if (isNoResidualPhase(p[k].phase))
             continue;
         min_resid = bigres + 10.;
         resid = NULLVAL;
 /*
- *      phase type is determined by the first leg of the phase id
- */
-        isS = isP = isI = iss = isp = ptype = stype = 0;
-        if (p[k].phase[0] == 'P') isP = 1;
-        if (p[k].phase[0] == 'S' || streq(p[k].phase, "Lg")) isS = 1;
-/*
+ *      phase type is determined by the first leg of the phase id;
  *      for depth phases phase type is determined by the second letter
  */
-        if (islower(p[k].phase[0])) {
-            if (p[k].phase[1] == 'P' || p[k].phase[1] == 'w') isp = 1;
-            if (p[k].phase[1] == 'S') iss = 1;
-        }
+        isS = isP = isI = iss = isp = ptype = stype = 0;
+        GetPhaseType(&p[k], &ptype, &stype, &isdepth);
+        isP = ptype && !isdepth;
+        isS = stype && !isdepth;
+        isp = ptype && isdepth;
+        iss = stype && isdepth;
 /*
  *      Infrasound phases
  */
@@ -547,14 +548,10 @@ static void PhaseIdentification(SOLREC *sp, READING *rdindx, PHAREC p[],
  *                  otherwise use previous phase
  */
                     else {
-                        for (j = 0; j < PhaseWithoutResidualNum; j++) {
-                            if (streq(p[k-1].phase, PhaseWithoutResidual[j]))
-                                break;
-                        }
 /*
  *                      if it is a no-residual phase, leave it alone
  */
-                        if (j != PhaseWithoutResidualNum)
+                        if (isNoResidualPhase(p[k-1].phase))
                             continue;
                         strcpy(p[k].phase, p[k-1].phase);
                         p[k].ttime = p[k-1].ttime;
@@ -794,24 +791,20 @@ static void PhaseIdentification(SOLREC *sp, READING *rdindx, PHAREC p[],
  */
 static int isFirstP(char *phase, char *mappedphase)
 {
-    int j;
+    PHASEPROP *pp = GetPhaseProperties(phase);
+    if (pp == NULL)
+        return 0;
 /*
  *  see if phase is in the list of allowable first-arriving P phases
  */
-    for (j = 0; j < numFirstPphase; j++) {
-        if (streq(phase, firstPphase[j]))
-            return 1;
-    }
+    if (pp->firstP)
+        return 1;
 /*
  *  not in the list of allowable first-arriving P phases;
  *  see if it is in the optional list
  */
-    if (j == numFirstPphase && streq(mappedphase, phase)) {
-        for (j = 0; j < numFirstPoptional; j++) {
-            if (streq(phase, firstPoptional[j]))
-                return 1;
-        }
-    }
+    if (pp->firstPoptional && streq(mappedphase, phase))
+        return 1;
     return 0;
 }
 
@@ -834,24 +827,20 @@ static int isFirstP(char *phase, char *mappedphase)
  */
 static int isFirstS(char *phase, char *mappedphase)
 {
-    int j;
+    PHASEPROP *pp = GetPhaseProperties(phase);
+    if (pp == NULL)
+        return 0;
 /*
  *  see if phase is in the list of allowable first-arriving S phases
  */
-    for (j = 0; j < numFirstSphase; j++) {
-        if (streq(phase, firstSphase[j]))
-            return 1;
-    }
+    if (pp->firstS)
+        return 1;
 /*
  *  not in the list of allowable first-arriving S phases;
  *  see if it is in the optional list
  */
-    if (j == numFirstSphase && streq(mappedphase, phase)) {
-        for (j = 0; j < numFirstSoptional; j++) {
-            if (streq(phase, firstSoptional[j]))
-                return 1;
-        }
-    }
+    if (pp->firstSoptional && streq(mappedphase, phase))
+        return 1;
     return 0;
 }
 
@@ -1001,23 +990,19 @@ static void GetPriorMeasurementError(PHAREC *pp)
  *        to the null space.
  *     Collects indices of time-defining phases at a site and calls SameStation.
  *  Input Arguments:
+ *     ctx       - pointer to locator context
  *     sp        - pointer to current solution
  *     p         - array of phase structures
- *     ec        - pointer to ellipticity correction coefficient structure
- *     tt_tables - pointer to travel-time tables
- *     localtt_tables - pointer to local travel-time tables, if any
- *     topo      - ETOPO bathymetry/elevation matrix
  *  Output Arguments:
  *     p         - array of phase structures
  *  Return:
  *     0/1 on success/error
  *  Called by:
- *     Locator
+ *     Locator, LocateEvent, NAForwardProblem
  *  Calls:
  *     SameStation, PrintPhases
  */
-int DuplicatePhases(SOLREC *sp, PHAREC p[], EC_COEF *ec,
-        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, short int **topo)
+int DuplicatePhases(ILOC_CONTEXT *ctx, SOLREC *sp, PHAREC p[])
 {
     int samesta[MAXPHAINREADING];
     int i, j, k;
@@ -1059,7 +1044,7 @@ int DuplicatePhases(SOLREC *sp, PHAREC p[], EC_COEF *ec,
  *      look for duplicates
  */
         if (j > 1)
-            SameStation(samesta, j, sp, p, ec, tt_tables, localtt_tables, topo);
+            SameStation(ctx, samesta, j, sp, p);
     }
     return 0;
 }
@@ -1072,14 +1057,11 @@ int DuplicatePhases(SOLREC *sp, PHAREC p[], EC_COEF *ec,
  *        time (within 0.1s tolerance) and calls SameArrivalTime.
  *     Downweights duplicates if accounting for correlated errors is turned off.
  *  Input Arguments:
+ *     ctx       - pointer to locator context
  *     samesta   - array of defining phase indices for a single site
  *     n         - size of samesta array
  *     sp        - pointer to current solution
  *     p         - array of phase structures
- *     ec        - pointer to ellipticity correction coefficient structure
- *     tt_tables - pointer to travel-time tables
- *     localtt_tables - pointer to local travel-time tables, if any
- *     topo      - ETOPO bathymetry/elevation matrix
  *  Output Arguments:
  *     p         - array of phase structures
  *  Called by:
@@ -1087,9 +1069,8 @@ int DuplicatePhases(SOLREC *sp, PHAREC p[], EC_COEF *ec,
  *  Calls:
  *     SameArrivalTime
  */
-static void SameStation(int samesta[], int n, SOLREC *sp, PHAREC p[],
-        EC_COEF *ec, TT_TABLE *tt_tables, TT_TABLE *localtt_tables,
-        short int **topo)
+static void SameStation(ILOC_CONTEXT *ctx, int samesta[], int n, SOLREC *sp,
+        PHAREC p[])
 {
     int sametime[MAXPHAINREADING];
     int samepha[MAXPHAINREADING];
@@ -1116,13 +1097,13 @@ static void SameStation(int samesta[], int n, SOLREC *sp, PHAREC p[],
 /*
  *          deal with the duplicates
  */
-            SameArrivalTime(sametime, j, sp, p, ec, tt_tables, localtt_tables,
-                            topo);
+            SameArrivalTime(sametime, j, sp, p, ctx->ec, ctx->TTtables,
+                            ctx->LocalTTtables, ctx->topo);
     }
 /*
  *  if correlated errors are to be accounted for, we are done here
  */
-    if (DoCorrelatedErrors)
+    if (ctx->DoCorrelatedErrors)
        return;
 
     for (i = 0; i < n; i++) done[i] = 0;
@@ -1176,7 +1157,7 @@ static void SameStation(int samesta[], int n, SOLREC *sp, PHAREC p[],
  */
 static void SameArrivalTime(int sametime[], int n, SOLREC *sp, PHAREC p[],
         EC_COEF *ec, TT_TABLE *tt_tables, TT_TABLE *localtt_tables,
-        short int **topo)
+        ETOPO *topo)
 {
     int match, number_of_codes, min_resid_index, i, j;
     int phacode[MAXPHAINREADING];
@@ -1250,8 +1231,10 @@ static void SameArrivalTime(int sametime[], int n, SOLREC *sp, PHAREC p[],
  *  set phase codes to the one with the smallest residual
  */
     strcpy(temp_phase, p[min_resid_index].phase);
-    for (i = 0; i < n; i++)
+    for (i = 0; i < n; i++) {
         strcpy(p[sametime[i]].phase, temp_phase);
+        p[sametime[i]].phcode = p[min_resid_index].phcode;
+    }
     return;
 }
 
@@ -1279,10 +1262,10 @@ static void SameArrivalTime(int sametime[], int n, SOLREC *sp, PHAREC p[],
  *  Called by:
  *     Locator, ResidualsForFixedHypocenter
  *  Calls:
- *     GetTravelTimePrediction
+ *     GetTravelTimePrediction, PhaseCode
  */
 void IdentifyPFAKE(SOLREC *sp, PHAREC p[], EC_COEF *ec, TT_TABLE *tt_tables,
-        TT_TABLE *localtt_tables, short int **topo)
+        TT_TABLE *localtt_tables, ETOPO *topo)
 {
     int i, j;
     double resid, bigres = 100., min_resid, ttime = NULLVAL;
@@ -1333,6 +1316,7 @@ void IdentifyPFAKE(SOLREC *sp, PHAREC p[], EC_COEF *ec, TT_TABLE *tt_tables,
                 p[i].timeres = min_resid;
                 p[i].ttime = ttime;
             }
+            p[i].phcode = PhaseCode(p[i].phase);
         }
     }
 }
@@ -1354,8 +1338,10 @@ void RemovePFAKE(SOLREC *sp, PHAREC p[])
 {
     int i;
     for (i = 0; i < sp->numPhase; i++) {
-        if (streq(p[i].ReportedPhase, "PFAKE"))
+        if (streq(p[i].ReportedPhase, "PFAKE")) {
             strcpy(p[i].phase, "");
+            p[i].phcode = -1;
+        }
     }
 }
 
@@ -1382,10 +1368,10 @@ void RemovePFAKE(SOLREC *sp, PHAREC p[])
  *  Called by:
  *     GetTTResidual
  *  Calls:
- *     GetTravelTimePrediction
+ *     GetTravelTimePrediction, PhaseCode
  */
 void ResidualsForReportedPhases(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
-        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, short int **topo)
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo)
 {
     int j;
 /*
@@ -1422,6 +1408,7 @@ void ResidualsForReportedPhases(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
         strcpy(pp->phase, "");
         pp->ttime = pp->timeres = NULLVAL;
     }
+    pp->phcode = PhaseCode(pp->phase);
 }
 
 /*  EOF  */
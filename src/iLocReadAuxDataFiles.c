@@ -28,10 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 
 /*
  * Functions:
@@ -77,16 +77,17 @@ static int ReadIASPEIPhaseMap(char *filename);
  *  Called by:
  *     main
  *  Calls:
- *     ReadGlobal1DModelPhaseList, ReadIASPEIPhaseMap, ReadEtopo1,
- *     ReadFlinnEngdahl, ReadDefaultDepthGregion, ReadDefaultDepthGrid,
+ *     ReadGlobal1DModelPhaseList, ReadIASPEIPhaseMap, InitPhaseCodes,
+ *     ReadEtopo1, ReadFlinnEngdahl, ReadDefaultDepthGregion,
+ *     ReadDefaultDepthGrid,
  *     ReadEllipticityCorrectionTable, ReadTTtables,
  *     ReadMagnitudeQ, ReadVariogram, FreeFlinnEngdahl,
  *     FreeEllipticityCorrectionTable, FreeTTtables, Free, FreeFloatMatrix,
- *     FreeShortMatrix
+ *     FreeEtopo
  */
 int ReadAuxDataFiles(char *auxdir, int *ismbQ, MAGQ *mbQp, FE *fep,
         double **GrnDepth, double *gres, int *ngrid, double ***DepthGrid,
-        short int ***topo, int *numECPhases, EC_COEF *ec[],
+        ETOPO **topo, int *numECPhases, EC_COEF *ec[],
         TT_TABLE *TTtables[], VARIOGRAM *variogramp)
 {
     extern char EtopoFile[FILENAMELEN];           /* filename for ETOPO file */
@@ -124,6 +125,10 @@ int ReadAuxDataFiles(char *auxdir, int *ismbQ, MAGQ *mbQp, FE *fep,
     fprintf(logfp, "    IASPEIPhaseMap: %s\n", filename);
     if (ReadIASPEIPhaseMap(filename))
         return 1;
+/*
+ *  Intern phase names into integer codes
+ */
+    InitPhaseCodes();
 /*
  *  Read Flinn-Engdahl region numbers and default depth files
  *  from auxdir/FlinnEngdahl directory
@@ -225,7 +230,7 @@ int ReadAuxDataFiles(char *auxdir, int *ismbQ, MAGQ *mbQp, FE *fep,
             if (*ec != NULL) FreeEllipticityCorrectionTable(*ec, *numECPhases);
             FreeFlinnEngdahl(fep); Free(gd);
             FreeFloatMatrix(*DepthGrid);
-            FreeShortMatrix(*topo);
+            FreeEtopo(*topo);
             return 1;
         }
         if (strstr(mbQtable, "GR")) *ismbQ = 1;
@@ -243,7 +248,7 @@ int ReadAuxDataFiles(char *auxdir, int *ismbQ, MAGQ *mbQp, FE *fep,
         if (*ec != NULL) FreeEllipticityCorrectionTable(*ec, *numECPhases);
         FreeFlinnEngdahl(fep); Free(gd);
         FreeFloatMatrix(*DepthGrid);
-        FreeShortMatrix(*topo);
+        FreeEtopo(*topo);
         if (*ismbQ) {
             Free(mbQp->deltas);
             Free(mbQp->depths);
@@ -272,8 +277,8 @@ int ReadAuxDataFiles(char *auxdir, int *ismbQ, MAGQ *mbQp, FE *fep,
  */
 static int ReadGlobal1DModelPhaseList(char *filename)
 {
-    extern double Moho;                                     /* depth of Moho */
-    extern double Conrad;                                 /* depth of Conrad */
+    extern THREADLOCAL double Moho;                         /* depth of Moho */
+    extern THREADLOCAL double Conrad;                     /* depth of Conrad */
     extern double MaxHypocenterDepth;                /* max hypocenter depth */
     extern double PSurfVel;         /* Pg velocity for elevation corrections */
     extern double SSurfVel;         /* Sg velocity for elevation corrections */
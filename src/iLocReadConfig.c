@@ -28,10 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 
 /*
  * Functions:
@@ -90,8 +90,15 @@ int ReadConfigFile(char *auxdir, char *homedir)
     extern char TTimeTable[VALLEN];                /* travel time table name */
     extern char LocalVmodelFile[FILENAMELEN];   /* pathname for local vmodel */
     extern double DefaultDepth;     /* used if seed hypocentre depth is NULL */
-    extern int UseLocalTT;                       /* use local TT predictions */
+    extern THREADLOCAL int UseLocalTT;           /* use local TT predictions */
     extern double MaxLocalTTDelta;       /* use local TT up to this distance */
+    extern char LocalTTcacheDir[FILENAMELEN];    /* local TT cache directory */
+    extern int LocalTTthreads;         /* threads generating local TT tables */
+    extern int LazyTTtables;                  /* read TT tables on first use */
+    extern int UseTTcache;         /* memoize TT predictions within an event */
+    extern double TTcacheTolerance;  /* hypocentre tolerance of TT cache [km] */
+    extern int UseCorrectionCache;       /* cache station/bounce corrections */
+    extern double BounceTolerance;    /* bounce point move to recompute [km] */
 //    extern int LocalTTfromRSTT;                  /* local TT from RSTT model */
     extern int UpdateLocalTT;                     /* static/dynamic local TT */
 /*
@@ -101,6 +108,8 @@ int ReadConfigFile(char *auxdir, char *homedir)
     extern int EtopoNlon;            /* number of longitude samples in ETOPO */
     extern int EtopoNlat;             /* number of latitude samples in ETOPO */
     extern double EtopoRes;                             /* cellsize in ETOPO */
+    extern int EtopoTileCache;          /* tiled ETOPO tiles kept per thread */
+    extern int EtopoCellCache;           /* memoize bounce-point ETOPO cells */
 /*
  *  iteration control
  */
@@ -108,7 +117,7 @@ int ReadConfigFile(char *auxdir, char *homedir)
     extern int MaxIterations;                    /* max number of iterations */
     extern int MinNdefPhases;                        /* min number of phases */
     extern double SigmaThreshold;         /* to exclude phases from solution */
-    extern int DoCorrelatedErrors;          /* account for correlated errors */
+    extern THREADLOCAL int DoCorrelatedErrors;          /* correlated errors */
     extern int AllowDamping;             /* allow damping in LSQR iterations */
     extern double ConfidenceLevel;     /* confidence level for uncertainties */
 /*
@@ -154,16 +163,25 @@ int ReadConfigFile(char *auxdir, char *homedir)
 /*
  *  NA grid search parameters
  */
-    extern int DoGridSearch;     /* perform grid search for initial location */
-    extern double NAsearchRadius;   /* search radius around preferred origin */
+    extern THREADLOCAL int DoGridSearch;                 /* initial NA search */
+    extern THREADLOCAL double NAsearchRadius;            /* NA search radius */
     extern double NAsearchDepth;/* search radius (km) around preferred depth */
-    extern double NAsearchOT;       /* search radius (s) around preferred OT */
+    extern THREADLOCAL double NAsearchOT;                 /* NA OT range (s) */
     extern double NAlpNorm;            /* p-value for norm to compute misfit */
     extern int NAiterMax;                        /* max number of iterations */
     extern int NAinitialSample;                    /* size of initial sample */
     extern int NAnextSample;                   /* size of subsequent samples */
-    extern int NAcells;                   /* number of cells to be resampled */
-    extern long iseed;                                 /* random number seed */
+    extern int NAcells;                  /* number of cells to be resampled */
+    extern int NAthreads;              /* threads evaluating the NA samples */
+    extern int NAttGrid;               /* interpolate TT from a grid in NA? */
+    extern double NAttGridDelta;          /* NA TT grid delta spacing [deg] */
+    extern double NAttGridDepth;           /* NA TT grid depth spacing [km] */
+    extern double NAmisfitTol;   /* min relative improvement of best misfit */
+    extern int NAstallIter;      /* stop after this many stalled iterations */
+    extern double NAcellTol;       /* min spread of the best cells to go on */
+    extern double NAmaxTime;                /* wall-clock budget for NA [s] */
+    extern int NAspatialIndex;    /* kd-tree for the NA Voronoi resampling? */
+    extern THREADLOCAL long iseed;                    /* random number seed */
 /*
  *  agencies whose hypocenters not to be used in setting initial hypocentre
  */
@@ -192,12 +210,19 @@ int ReadConfigFile(char *auxdir, char *homedir)
     strcpy(OutAgency, "ILOC");
     strcpy(InAgency, "ISC");
     strcpy(TTimeTable, "ak135");
+    LazyTTtables = 0;
+    UseTTcache = 0;
+    TTcacheTolerance = 0.;
+    UseCorrectionCache = 0;
+    BounceTolerance = 0.;
     strcpy(EtopoFile, "etopo5_bed_g_i2.bin");
     strcpy(mbQtable, "GR");
     strcpy(KMLBulletinFile, "");
     EtopoNlon = 4321;
     EtopoNlat = 2161;
     EtopoRes = 0.0833333;
+    EtopoTileCache = 0;
+    EtopoCellCache = 0;
     DefaultDepth = 0.;
     MinNdefPhases = 4;
     ConfidenceLevel = 90.;
@@ -231,6 +256,15 @@ int ReadConfigFile(char *auxdir, char *homedir)
     NAinitialSample = 1000;
     NAnextSample = 100;
     NAcells = 20;
+    NAthreads = 1;
+    NAttGrid = 0;
+    NAttGridDelta = 0.5;
+    NAttGridDepth = 10.;
+    NAmisfitTol = 0.;
+    NAstallIter = 2;
+    NAcellTol = 0.;
+    NAmaxTime = 0.;
+    NAspatialIndex = 0;
     iseed = 5590L;
     CalculatemB = 0;
     CalculateML = 0;
@@ -254,6 +288,8 @@ int ReadConfigFile(char *auxdir, char *homedir)
     UseRSTTPnSn = 1;
 //    LocalTTfromRSTT = 0;
     MaxLocalTTDelta = 3.;
+    LocalTTthreads = 1;
+    strcpy(LocalTTcacheDir, "");
     strcpy(LocalVmodelFile, "");
     strcpy(DBuser, "sysop");
     strcpy(DBpasswd, "sysop");
@@ -341,6 +377,12 @@ int ReadConfigFile(char *auxdir, char *homedir)
  *      TT
  */
         else if (streq(par, "TTimeTable"))       strcpy(TTimeTable, value);
+        else if (streq(par, "LazyTTtables"))     LazyTTtables = atoi(value);
+        else if (streq(par, "UseTTcache"))       UseTTcache = atoi(value);
+        else if (streq(par, "TTcacheTolerance")) TTcacheTolerance = atof(value);
+        else if (streq(par, "UseCorrectionCache"))
+            UseCorrectionCache = atoi(value);
+        else if (streq(par, "BounceTolerance"))  BounceTolerance = atof(value);
         else if (streq(par, "LocalVmodelFile")) {
             if (strncmp(value, "~/", 2) == 0)
                 sprintf(LocalVmodelFile, "%s/%s", homedir, value);
@@ -351,6 +393,13 @@ int ReadConfigFile(char *auxdir, char *homedir)
         }
 //        else if (streq(par, "LocalTTfromRSTT"))  LocalTTfromRSTT = atoi(value);
         else if (streq(par, "MaxLocalTTDelta"))  MaxLocalTTDelta = atof(value);
+        else if (streq(par, "LocalTTthreads"))   LocalTTthreads = atoi(value);
+        else if (streq(par, "LocalTTcacheDir")) {
+            if (strncmp(value, "~/", 2) == 0)
+                sprintf(LocalTTcacheDir, "%s/%s", homedir, value + 2);
+            else
+                strcpy(LocalTTcacheDir, value);
+        }
 /*
  *      ETOPO
  */
@@ -358,6 +407,8 @@ int ReadConfigFile(char *auxdir, char *homedir)
         else if (streq(par, "EtopoNlon"))        EtopoNlon = atoi(value);
         else if (streq(par, "EtopoNlat"))        EtopoNlat = atoi(value);
         else if (streq(par, "EtopoRes"))         EtopoRes = atof(value);
+        else if (streq(par, "EtopoTileCache"))   EtopoTileCache = atoi(value);
+        else if (streq(par, "EtopoCellCache"))   EtopoCellCache = atoi(value);
 /*
  *      depth control
  */
@@ -405,6 +456,15 @@ int ReadConfigFile(char *auxdir, char *homedir)
         else if (streq(par, "NAinitialSample"))  NAinitialSample = atoi(value);
         else if (streq(par, "NAnextSample"))     NAnextSample = atoi(value);
         else if (streq(par, "NAcells"))          NAcells = atoi(value);
+        else if (streq(par, "NAthreads"))        NAthreads = atoi(value);
+        else if (streq(par, "NAttGrid"))         NAttGrid = atoi(value);
+        else if (streq(par, "NAttGridDelta"))    NAttGridDelta = atof(value);
+        else if (streq(par, "NAttGridDepth"))    NAttGridDepth = atof(value);
+        else if (streq(par, "NAmisfitTol"))      NAmisfitTol = atof(value);
+        else if (streq(par, "NAstallIter"))      NAstallIter = atoi(value);
+        else if (streq(par, "NAcellTol"))        NAcellTol = atof(value);
+        else if (streq(par, "NAmaxTime"))        NAmaxTime = atof(value);
+        else if (streq(par, "NAspatialIndex"))   NAspatialIndex = atoi(value);
         else if (streq(par, "iseed"))            iseed = atol(value);
 /*
  *      agencies whose hypocenters not to be used in setting the initial hypo
@@ -536,12 +596,12 @@ int ReadConfigFile(char *auxdir, char *homedir)
 int ReadInstructionFile(char *instruction, EVREC *ep, int isf, char *auxdir,
         char *homedir)
 {
-    extern int DoCorrelatedErrors;          /* account for correlated errors */
-    extern int DoGridSearch;           /* perform NA search for initial hypo */
+    extern THREADLOCAL int DoCorrelatedErrors;          /* correlated errors */
+    extern THREADLOCAL int DoGridSearch;                /* initial NA search */
     extern int ZipKML;                    /* zip KMLEventFile and remove kml */
-    extern double NAsearchRadius;   /* search radius around preferred origin */
+    extern THREADLOCAL double NAsearchRadius;            /* NA search radius */
     extern double NAsearchDepth;/* search radius (km) around preferred depth */
-    extern double NAsearchOT;       /* search radius (s) around preferred OT */
+    extern THREADLOCAL double NAsearchOT;                 /* NA OT range (s) */
     extern int NAiterMax;                        /* max number of iterations */
     extern int NAinitialSample;                    /* size of initial sample */
     extern int NAnextSample;                   /* size of subsequent samples */
@@ -554,7 +614,7 @@ int ReadInstructionFile(char *instruction, EVREC *ep, int isf, char *auxdir,
     extern double MaxSPDistDeg;                   /* max S-P distance (degs) */
     extern int MinSPpairs;                  /* min number of S-P phase pairs */
     extern int MinCorePhases;   /* min number of core reflections ([PS]c[PS] */
-    extern long iseed;
+    extern THREADLOCAL long iseed;
     extern double MSPeriodRange;   /* MSH period tolerance around MSZ period */
     extern int MinNetmagSta;             /* min number of stamags for netmag */
     extern double MagMaxTimeResidual;    /* max allowable timeres for stamag */
@@ -574,7 +634,7 @@ int ReadInstructionFile(char *instruction, EVREC *ep, int isf, char *auxdir,
 //    extern int LocalTTfromRSTT;                  /* local TT from RSTT model */
     extern char LocalVmodelFile[FILENAMELEN];   /* pathname for local vmodel */
     extern double DefaultDepth;     /* used if seed hypocentre depth is NULL */
-    extern int UseLocalTT;                       /* use local TT predictions */
+    extern THREADLOCAL int UseLocalTT;           /* use local TT predictions */
     extern double MaxLocalTTDelta;       /* use local TT up to this distance */
     extern int UpdateLocalTT;                     /* static/dynamic local TT */
     extern int DoNotRenamePhase;                 /* do not reidentify phases */
@@ -31,13 +31,13 @@
 #ifdef PGSQL
 
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 extern int numAgencies;
 extern char agencies[MAXBUF][AGLEN];
-extern struct timeval t0;
+extern THREADLOCAL struct timeval t0;
 extern char OutAgency[VALLEN];      /* author for new hypocentres and assocs */
 extern char InAgency[VALLEN];                     /* author for input assocs */
 extern PGconn *conn;
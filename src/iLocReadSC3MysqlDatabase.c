@@ -31,13 +31,13 @@
 #ifdef MYSQLDB
 
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 extern int numAgencies;
 extern char agencies[MAXBUF][AGLEN];
-extern struct timeval t0;
+extern THREADLOCAL struct timeval t0;
 extern char InputDB[VALLEN];       /* read data from this DB account, if any */
 extern char OutputDB[VALLEN];    /* write results to this DB account, if any */
 extern char NextidDB[VALLEN];               /* get new ids from this account */
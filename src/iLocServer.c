@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "iLoc.h"
+
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
+extern FILE *errfp;
+extern THREADLOCAL int errorcode;
+extern THREADLOCAL struct timeval t0;
+extern THREADLOCAL double PrevLat;                      /* previous epicentre */
+extern THREADLOCAL double PrevLon;                      /* previous epicentre */
+extern THREADLOCAL int UseLocalTT;                /* use local TT predictions */
+extern char *errorcodes[];
+extern int MindDepthPhaseAgencies;      /* min agencies for depth resolution */
+extern char StationFile[FILENAMELEN];            /* station coordinates file */
+extern char ISFInputFile[FILENAMELEN];                 /* input ISF filename */
+extern char ISFOutputFile[FILENAMELEN];               /* output ISF filename */
+extern char KMLEventFile[FILENAMELEN];                 /* KML event filename */
+extern char KMLBulletinFile[FILENAMELEN];     /* output KML bulletin filename */
+extern char LocalVmodelFile[FILENAMELEN];       /* pathname for local vmodel */
+extern char RSTTmodel[FILENAMELEN];                  /* pathname for RSTT model */
+extern int UseRSTT;                                  /* use RSTT predictions */
+
+/*
+ * Functions:
+ *    ServeLocator
+ */
+
+/*
+ * Local functions
+ *    ServeConnection
+ *    ServeSignal
+ */
+static int ServeConnection(int fd, int isf, int nthreads, char *auxdir,
+        char *homedir, STAREC stalist[], ILOC_CONTEXT *ctx);
+static void ServeSignal(int sig);
+
+static volatile sig_atomic_t ServeStop = 0;       /* SIGINT/SIGTERM received */
+
+/*
+ *  Title:
+ *     ServeLocator
+ *  Synopsis:
+ *     Persistent daemon mode (iLoc serve).
+ *     The config file, aux data files, TT tables, station list and the RSTT
+ *        model are loaded once by main; ServeLocator then listens on a
+ *        Unix-domain socket and locates the events sent by the clients.
+ *     Protocol (one request per connection):
+ *        client sends an instruction line followed by ISF event blocks,
+ *           then shuts down its write side (EOF);
+ *        server streams back the ISF bulletin of the located events as
+ *           they are done, then closes the connection;
+ *        a request that cannot be served gets a single "ERROR: ..." line.
+ *     Each connection is served by a forked child that inherits the aux
+ *        data copy-on-write, so that the config overrides in the instruction
+ *        line do not leak into subsequent requests. At most maxchild
+ *        requests are served at the same time; further connections wait
+ *        until a child exits.
+ *     The server runs until it receives SIGINT or SIGTERM, then waits for
+ *        the requests in flight.
+ *  Input Arguments:
+ *     sockpath  - pathname of the Unix-domain socket
+ *     isf       - ISF text file format (1: ISF2.1, 2: ISF2.0, 3: IMS)
+ *     nthreads  - number of locator threads per request
+ *     maxchild  - max number of requests served at the same time
+ *                 (0: number of online CPUs)
+ *     auxdir    - pathname for the auxiliary data files directory
+ *     homedir   - home directory
+ *     stalist   - array of starec structures
+ *     ctx       - pointer to locator context (aux data)
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     main
+ *  Calls:
+ *     ServeConnection, ServeSignal
+ */
+int ServeLocator(char *sockpath, int isf, int nthreads, int maxchild,
+                 char *auxdir, char *homedir, STAREC stalist[],
+                 ILOC_CONTEXT *ctx)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    int sock, fd, nconn = 0, nchild = 0;
+    pid_t pid;
+    if (maxchild < 1)
+        maxchild = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(errfp, "ServeLocator: socket path is too long: %s\n", sockpath);
+        errorcode = 1;
+        return 1;
+    }
+/*
+ *  stop on SIGINT/SIGTERM; children are reaped in the accept loop;
+ *  a client hanging up should not kill the server
+ */
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = ServeSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+/*
+ *  create and bind Unix-domain socket
+ */
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(errfp, "ServeLocator: cannot create socket: %s\n",
+                strerror(errno));
+        errorcode = 1;
+        return 1;
+    }
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath);
+    unlink(sockpath);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) ||
+        listen(sock, SOMAXCONN)) {
+        fprintf(errfp, "ServeLocator: cannot listen on %s: %s\n",
+                sockpath, strerror(errno));
+        close(sock);
+        errorcode = 1;
+        return 1;
+    }
+    fprintf(logfp, "iLoc serve: listening on %s, max requests: %d ",
+            sockpath, maxchild);
+    fprintf(logfp, "(%.2f)\n", secs(&t0));
+    fflush(logfp);
+/*
+ *  accept loop
+ */
+    while (!ServeStop) {
+        if ((fd = accept(sock, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(errfp, "ServeLocator: accept failed: %s\n",
+                    strerror(errno));
+            break;
+        }
+        nconn++;
+/*
+ *      reap finished children; wait for one if the limit is reached
+ */
+        while (nchild > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+            nchild--;
+        while (nchild >= maxchild && !ServeStop) {
+            if (waitpid(-1, NULL, 0) > 0)
+                nchild--;
+            else if (errno != EINTR)
+                nchild = 0;
+        }
+        if (ServeStop) {
+            close(fd);
+            break;
+        }
+/*
+ *      do not let the children inherit unflushed output
+ */
+        fflush(NULL);
+        if ((pid = fork()) < 0) {
+            fprintf(errfp, "ServeLocator: cannot fork: %s\n", strerror(errno));
+            close(fd);
+            continue;
+        }
+        if (pid == 0) {
+/*
+ *          child: serve the request and exit
+ */
+            close(sock);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            exit(ServeConnection(fd, isf, nthreads, auxdir, homedir,
+                                 stalist, ctx));
+        }
+        nchild++;
+        if (verbose)
+            fprintf(logfp, "iLoc serve: request %d served by pid %d\n",
+                    nconn, (int)pid);
+        close(fd);
+    }
+    close(sock);
+    unlink(sockpath);
+/*
+ *  let the requests in flight finish
+ */
+    while (nchild > 0) {
+        if (waitpid(-1, NULL, 0) > 0 || errno != EINTR)
+            nchild--;
+    }
+    fprintf(logfp, "iLoc serve: stopped after %d requests\n", nconn);
+    return 0;
+}
+
+/*
+ *  Title:
+ *     ServeConnection
+ *  Synopsis:
+ *     Serves a single client request in a forked child.
+ *     Reads the instruction line, then locates the events read from the
+ *     socket and writes their ISF bulletin back to the socket.
+ *     ReadISF needs a seekable stream, so the ISF events of the request
+ *     are buffered in memory first.
+ *     The instruction may only ask for aux data the server can provide:
+ *        local TT tables are generated for a local velocity model other
+ *        than the one loaded at startup; a request that needs RSTT when
+ *        SLBM was not loaded at startup, or another RSTT model, is
+ *        rejected with an error reply.
+ *  Input Arguments:
+ *     fd        - connected socket
+ *     isf       - ISF text file format (1: ISF2.1, 2: ISF2.0, 3: IMS)
+ *     nthreads  - number of locator threads
+ *     auxdir    - pathname for the auxiliary data files directory
+ *     homedir   - home directory
+ *     stalist   - array of starec structures
+ *     ctx       - pointer to locator context (aux data)
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     ServeLocator
+ *  Calls:
+ *     DropSpace, ReadInstructionFile, ReadStafileForISF, ReadStafileForISF2,
+ *     GenerateLocalTTtables, ReadISF, BatchLocator, GetContext, Locator, Free
+ */
+static int ServeConnection(int fd, int isf, int nthreads, char *auxdir,
+        char *homedir, STAREC stalist[], ILOC_CONTEXT *ctx)
+{
+    FILE *sockin = NULL, *isfin = NULL, *isfout = NULL, *buf = NULL;
+    EVREC e;                                                 /* event record */
+    SOLREC s;                                             /* solution record */
+    HYPREC *h = (HYPREC *)NULL;                        /* hypocenter records */
+    PHAREC *p = (PHAREC *)NULL;                             /* phase records */
+    STAREC *reread = (STAREC *)NULL;            /* station list from request */
+    char *line = NULL, *instruction = NULL, *isfbuf = NULL;
+    char stafile[FILENAMELEN], vfile_cf[FILENAMELEN];
+    char rsttmodel_cf[FILENAMELEN], reject[FILENAMELEN+40];
+    char magbloc[100*LINLEN];
+    ssize_t nb = (ssize_t)0;
+    size_t nbytes = 0, isflen = 0;
+    int total = 0, fail = 0, opt[7] = {0, 0, 0, 0, 0, 0, 0};
+    int depfix_cf = 0, surfix_cf = 0, hypofix_cf = 0, otfix_cf = 0;
+    int rstt_cf = UseRSTT;                    /* SLBM loaded at startup? */
+    double startdepth_cf, startot_cf;
+    int j, ret = 1;
+    gettimeofday(&t0, NULL);
+    if ((sockin = fdopen(fd, "r")) == NULL ||
+        (isfout = fdopen(dup(fd), "w")) == NULL) {
+        fprintf(errfp, "ServeConnection: cannot open socket streams\n");
+        if (sockin) fclose(sockin);
+        else close(fd);
+        return 1;
+    }
+    if ((instruction = (char *)calloc(LINLEN, sizeof(char))) == NULL) {
+        fprintf(errfp, "ServeConnection: cannot allocate memory\n");
+        goto done;
+    }
+/*
+ *  read instruction line
+ */
+    e.evid = 0;
+    e.EventID[0] = '\0';
+    e.DepthAgency[0] = '\0';
+    e.EpicenterAgency[0] = '\0';
+    e.OTAgency[0]     = '\0';
+    e.HypocenterAgency[0]     = '\0';
+    e.StartDepth = e.StartOT = NULLVAL;
+    e.StartLat = e.StartLon = NULLVAL;
+    e.FixDepthToZero = e.FixedHypocenter = 0;
+    e.FixedOT = e.FixedDepth = 0;
+    e.FixDepthToUser = e.FixedEpicenter = 0;
+    e.FixDepthToDefault = 0;
+    strcpy(stafile, StationFile);
+    strcpy(vfile_cf, LocalVmodelFile);
+    strcpy(rsttmodel_cf, RSTTmodel);
+    strcpy(ISFInputFile, "socket");    /* the events come with the request */
+    if ((nb = getline(&line, &nbytes, sockin)) <= 0) {
+        fprintf(errfp, "No instructions are given!\n");
+        goto done;
+    }
+    if ((j = nb - 2) >= 0) {
+        if (line[j] == '\r') line[j] = '\n';   /* replace CR with LF */
+    }
+    DropSpace(line, instruction);
+    fprintf(logfp, "Instruction: %s", instruction);
+    if (ReadInstructionFile(instruction, &e, isf, auxdir, homedir)) {
+        fprintf(isfout, "ERROR: bad instruction line\n");
+        goto done;
+    }
+/*
+ *  RSTT predictions need the model SLBM has loaded at startup
+ */
+    if (UseRSTT && (!rstt_cf || strcmp(RSTTmodel, rsttmodel_cf))) {
+        if (rstt_cf)
+            sprintf(reject, "RSTT model %s is not loaded", RSTTmodel);
+        else
+            strcpy(reject, "RSTT is not enabled in this server");
+        fprintf(errfp, "ServeConnection: %s\n", reject);
+        fprintf(logfp, "ServeConnection: %s\n", reject);
+        fprintf(isfout, "ERROR: %s\n", reject);
+        goto done;
+    }
+/*
+ *  generate static local TT tables for another local velocity model
+ */
+    if (UseLocalTT && (strcmp(LocalVmodelFile, vfile_cf) ||
+                       ctx->LocalTTtables == NULL)) {
+        fprintf(logfp, "    read local velocity model: %s\n",
+                LocalVmodelFile);
+        if ((ctx->LocalTTtables = GenerateLocalTTtables(LocalVmodelFile,
+                                                        0., 0.)) == NULL) {
+            fprintf(errfp, "Cannot generate static local TT tables!\n");
+            fprintf(logfp, "Cannot generate static local TT tables!\n");
+            UseLocalTT = 0;
+        }
+    }
+    depfix_cf = e.FixedDepth;
+    surfix_cf = e.FixDepthToZero;
+    hypofix_cf = e.FixedHypocenter;
+    otfix_cf = e.FixedOT;
+    startdepth_cf = e.StartDepth;
+    startot_cf = e.StartOT;
+    MindDepthPhaseAgencies = 1; /* No agency info exists in an ISF file! */
+/*
+ *  results go back to the client; no KML output in serve mode
+ */
+    strcpy(ISFOutputFile, "socket");
+    strcpy(KMLEventFile, "");
+    strcpy(KMLBulletinFile, "");
+/*
+ *  station file overridden by the instruction
+ */
+    if (strcmp(stafile, StationFile)) {
+        if (isf == 2) j = ReadStafileForISF2(&reread);
+        else          j = ReadStafileForISF(&reread);
+        if (j) goto done;
+        stalist = reread;
+    }
+/*
+ *  buffer the ISF events of the request
+ */
+    if ((buf = open_memstream(&isfbuf, &isflen)) == NULL) {
+        fprintf(errfp, "ServeConnection: cannot allocate memory\n");
+        goto done;
+    }
+    while ((nb = getline(&line, &nbytes, sockin)) > 0)
+        fwrite(line, 1, nb, buf);
+    fclose(buf);
+    if (isflen == 0 || (isfin = fmemopen(isfbuf, isflen, "r")) == NULL) {
+        fprintf(errfp, "ServeConnection: no ISF events in request\n");
+        goto done;
+    }
+/*
+ *  event-level configuration as set by the instruction
+ */
+    GetContext(ctx);
+    if (nthreads > 1) {
+        BatchLocator(nthreads, isf, isfin, isfout, NULL, 0, &e,
+                     stalist, ctx, &total, &fail, opt);
+    }
+    else while (!ReadISF(isfin, isf, &e, &h, &p, stalist, magbloc)) {
+/*
+ *      locate event
+ */
+        GetContext(ctx);
+        if (Locator(ctx, isf, 0, &total, &fail, opt, &e, h, &s, p,
+                    isfout, magbloc)) {
+            fprintf(logfp, "CAUTION: No solution found due to %s\n",
+                    errorcodes[errorcode]);
+            fprintf(errfp, "CAUTION: No solution found due to %s\n",
+                    errorcodes[errorcode]);
+        }
+        fflush(isfout);
+        fprintf(logfp, "EVENT %.6f %s %d\n", secs(&t0), e.EventID, s.numPhase);
+        Free(h); Free(p);
+        fprintf(logfp, "\n\n");
+        e.StartDepth = startdepth_cf;
+        e.StartOT = startot_cf;
+        e.FixedDepth = depfix_cf;
+        e.FixDepthToZero = surfix_cf;
+        e.FixedHypocenter = hypofix_cf;
+        e.FixedOT = otfix_cf;
+        PrevLat = s.lat;
+        PrevLon = s.lon;
+    }
+    fprintf(logfp, "Totals: option 0: %d 1: %d 2: %d 3: %d 4: %d 5: %d 6: %d",
+            opt[0], opt[1], opt[2], opt[3], opt[4], opt[5], opt[6]);
+    fprintf(logfp, " converged: %d failed: %d time %.2f\n",
+            total, fail, secs(&t0));
+    ret = 0;
+done:
+/*
+ *  read what is left of a rejected request, so that the client gets
+ *  the error reply instead of a connection reset
+ */
+    fflush(isfout);
+    while (getline(&line, &nbytes, sockin) > 0)
+        ;
+    Free(line);
+    Free(instruction);
+    Free(reread);
+    if (isfin) fclose(isfin);
+    Free(isfbuf);
+    fclose(sockin);
+    fclose(isfout);
+    fflush(logfp);
+    return ret;
+}
+
+/*
+ *  Title:
+ *     ServeSignal
+ *  Synopsis:
+ *     Signal handler; asks the accept loop to stop.
+ *  Input Arguments:
+ *     sig - signal number
+ *  Called by:
+ *     ServeLocator
+ */
+static void ServeSignal(int sig)
+{
+    ServeStop = sig;
+}
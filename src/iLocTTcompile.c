@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * iLocTTcompile
+ *    Compiles the text TT tables of a 1D model into a binary TT file.
+ *    ReadTTtables maps the binary file (<model>.ttb) when it is present in
+ *    the model directory, which saves parsing the text tables and
+ *    computing their bicubic patches at every start-up.
+ *
+ *    The binary file is in native byte order; rerun iLocTTcompile after
+ *    changing the text tables or moving the auxdata to another platform.
+ *
+ * Usage:
+ *    iLocTTcompile modeldir model
+ *       modeldir - directory of the TT tables, e.g. $ILOCROOT/auxdata/ak135
+ *       model    - TT model name, e.g. ak135
+ *    writes modeldir/model.ttb
+ */
+#include "iLoc.h"
+extern THREADLOCAL FILE *logfp;
+extern FILE *errfp;
+
+/*
+ * Local functions
+ */
+static int ComparePhases(const void *a, const void *b);
+
+/*
+ *
+ * main body
+ *
+ */
+int main(int argc, char *argv[])
+{
+    DIR *dp;
+    struct dirent *de;
+    TT_TABLE *tt_tables = (TT_TABLE *)NULL, *tp;
+    char fname[FILENAMELEN], *phase, *s;
+    int ntab = 0, maxtab = 0, n, k, i, ret = 0;
+    logfp = stderr;
+    errfp = stderr;
+    if (argc != 3) {
+        fprintf(stderr, "Usage: iLocTTcompile modeldir model\n");
+        fprintf(stderr, "    writes modeldir/model.ttb\n");
+        return 1;
+    }
+    if ((dp = opendir(argv[1])) == NULL) {
+        fprintf(stderr, "iLocTTcompile: cannot open %s\n", argv[1]);
+        return 1;
+    }
+/*
+ *  collect the TT table files: model.phase.tab and model.littlephase.tab
+ */
+    n = strlen(argv[2]);
+    while ((de = readdir(dp)) != NULL) {
+        if (strncmp(de->d_name, argv[2], n) || de->d_name[n] != '.')
+            continue;
+        phase = de->d_name + n + 1;
+        if ((s = strrchr(phase, '.')) == NULL || strcmp(s, ".tab"))
+            continue;
+        if (ntab == maxtab) {
+            maxtab += 64;
+            tp = (TT_TABLE *)realloc(tt_tables, maxtab * sizeof(TT_TABLE));
+            if (tp == NULL) {
+                fprintf(stderr, "iLocTTcompile: cannot allocate memory\n");
+                closedir(dp);
+                return 1;
+            }
+            tt_tables = tp;
+        }
+        tp = &tt_tables[ntab];
+        memset(tp, 0, sizeof(TT_TABLE));
+        if (strncmp(phase, "little", 6) == 0) {
+            tp->isbounce = 1;
+            phase += 6;
+        }
+        k = s - phase;
+        if (k < 1 || k >= PHALEN) {
+            fprintf(stderr, "iLocTTcompile: skipping %s\n", de->d_name);
+            continue;
+        }
+        strncpy(tp->phase, phase, k);
+        tp->phase[k] = '\0';
+        ntab++;
+    }
+    closedir(dp);
+    if (ntab == 0) {
+        fprintf(stderr, "iLocTTcompile: no %s TT tables in %s\n",
+                argv[2], argv[1]);
+        return 1;
+    }
+    qsort(tt_tables, ntab, sizeof(TT_TABLE), ComparePhases);
+/*
+ *  read the TT tables and compute their bicubic patches
+ */
+    for (i = 0; i < ntab; i++) {
+        tp = &tt_tables[i];
+        if (tp->isbounce)
+            sprintf(fname, "%s/%s.little%s.tab", argv[1], argv[2], tp->phase);
+        else
+            sprintf(fname, "%s/%s.%s.tab", argv[1], argv[2], tp->phase);
+        if ((ret = ReadTTtableFile(fname, tp)) != 0) {
+            fprintf(stderr, "iLocTTcompile: cannot read %s\n", fname);
+            return 1;
+        }
+        if (BicubicTTpatches(tp))
+            return 1;
+        fprintf(stderr, "    %-8s %4d x %3d  %6d patches\n",
+                tp->phase, tp->ndel, tp->ndep, tp->npatch);
+    }
+/*
+ *  write binary TT file
+ */
+    sprintf(fname, "%s/%s.ttb", argv[1], argv[2]);
+    if (WriteTTbinary(fname, argv[2], tt_tables, ntab))
+        return 1;
+    fprintf(stderr, "iLocTTcompile: %d TT tables written to %s\n",
+            ntab, fname);
+    return 0;
+}
+
+/*
+ *  Title:
+ *     ComparePhases
+ *  Synopsis:
+ *     compares two TT tables by phase name
+ *  Input Arguments:
+ *     a, b - pointers to TT_TABLE structures
+ *  Return:
+ *     -1 if a < b, 0 if a = b, 1 if a > b
+ *  Called by:
+ *     main
+ */
+static int ComparePhases(const void *a, const void *b)
+{
+    return strcmp(((TT_TABLE *)a)->phase, ((TT_TABLE *)b)->phase);
+}
@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "iLoc.h"
+
+extern THREADLOCAL FILE *logfp;
+extern FILE *errfp;
+extern THREADLOCAL int errorcode;
+extern char *errorcodes[];
+extern int UpdateLocalTT;                         /* static/dynamic local TT */
+extern char LocalVmodelFile[FILENAMELEN];       /* pathname for local vmodel */
+extern char ISFOutputFile[FILENAMELEN];               /* output ISF filename */
+extern char KMLBulletinFile[FILENAMELEN];     /* output KML bulletin filename */
+
+/*
+ * Functions:
+ *    BatchLocator
+ *    DeferISFOutput
+ */
+
+/*
+ * Local functions
+ *    BatchWorker
+ *    BatchWriter
+ */
+static void *BatchWorker(void *arg);
+static void *BatchWriter(void *arg);
+
+/*
+ *  job status in the batch queue
+ */
+#define JOB_EMPTY    0                                 /* free queue slot */
+#define JOB_READ     1                        /* event read from ISF input */
+#define JOB_BUSY     2                           /* event is being located */
+#define JOB_DONE     3                           /* event ready for output */
+
+/*
+ *
+ * Batch job: one event travelling from the reader to the writer
+ *
+ */
+typedef struct batchjob {
+    int status;                                             /* job status */
+    EVREC e;                                                /* event record */
+    SOLREC s;                                            /* solution record */
+    HYPREC *h;                                        /* hypocenter records */
+    PHAREC *p;                                             /* phase records */
+    char *magbloc;                      /* reported magnitudes from ISF file */
+    int isisf;                            /* ISF output left to the writer? */
+    STAMAG **stamag;                /* station magnitudes for the ISF output */
+    STAMAG **rdmag;                 /* reading magnitudes for the ISF output */
+    int grn;                                 /* geographic region number */
+    FILE *log;                                /* log of the event (memory) */
+    char *logbuf;                                             /* log buffer */
+    size_t loglen;                                 /* length of log buffer */
+    int total;                                        /* converged counter */
+    int fail;                                            /* failed counter */
+    int opt[7];                                   /* locator option counter */
+} BATCHJOB;
+
+/*
+ *
+ * Batch queue shared by the reader, the locator workers and the writer
+ *
+ */
+typedef struct batch {
+    pthread_mutex_t lock;                          /* protects the counters */
+    pthread_cond_t canread;                    /* a queue slot became free */
+    pthread_cond_t canlocate;                 /* an event has been read in */
+    pthread_cond_t canwrite;                  /* an event has been located */
+    int nslots;                                  /* number of queue slots */
+    BATCHJOB *jobs;                                         /* queue slots */
+    int nread;                                    /* number of events read */
+    int nlocate;                    /* number of events taken by the workers */
+    int nwritten;                              /* number of events written */
+    int eof;                                    /* end of ISF input reached */
+    ILOC_CONTEXT ctx;            /* context template for the workers */
+    FILE *logfp;                                          /* actual log file */
+    FILE *isfout;                                  /* actual ISF output file */
+    FILE *kml;                                   /* actual KML bulletin file */
+    int isbull;                                    /* KML bulletin file? */
+    int *total;                                       /* converged counter */
+    int *fail;                                           /* failed counter */
+    int *opt;                                     /* locator option counter */
+    int isf;                                          /* ISF text file choice */
+} BATCH;
+
+/*
+ *  batch queue and job of the calling locator worker (NULL if serial)
+ */
+static THREADLOCAL BATCH *CurrentBatch = (BATCH *)NULL;
+static THREADLOCAL BATCHJOB *CurrentJob = (BATCHJOB *)NULL;
+
+/*
+ *  Title:
+ *     BatchLocator
+ *  Synopsis:
+ *     Multi-threaded event-level batch processing of an ISF bulletin.
+ *        The calling thread reads the events from the ISF input file and
+ *           feeds them into a bounded queue;
+ *        nthreads locator workers take the events from the queue and
+ *           locate them, each with its own locator context;
+ *        the writer thread emits the log, ISF and KML output of the events
+ *           in the original event order, and numbers the solutions as the
+ *           serial event loop does.
+ *     Every event starts from the instruction-level defaults in ep (the
+ *        *_cf overrides), as in the serial event loop.
+ *     The travel-time tables and other aux data in ctx are shared
+ *        read-only.
+ *  Input Arguments:
+ *     nthreads  - number of locator workers
+ *     isf       - ISF text file choice
+ *     isfin     - file pointer to ISF input file
+ *     isfout    - file pointer to ISF output file
+ *     kml       - file pointer to KML bulletin file
+ *     isbull    - KML bulletin file?
+ *     ep        - pointer to event info template (from instructions)
+ *     stalist   - station list from ISF station file
+ *     ctx       - pointer to locator context template
+ *  Output Arguments:
+ *     total     - number of successful locations
+ *     fail      - number of failed locations
+ *     opt       - locator option counter
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     main
+ *  Calls:
+ *     ReadISF, BatchWorker, BatchWriter, Free
+ */
+int BatchLocator(int nthreads, int isf, FILE *isfin, FILE *isfout, FILE *kml,
+        int isbull, EVREC *ep, STAREC stalist[], ILOC_CONTEXT *ctx,
+        int *total, int *fail, int *opt)
+{
+    BATCH batch;
+    BATCHJOB *job = (BATCHJOB *)NULL;
+    pthread_t *workers = (pthread_t *)NULL;
+    pthread_t writer;
+    FILE *reallogfp = logfp;
+    int i, nw = 0;
+/*
+ *  initialize batch queue
+ */
+    batch.nslots = 4 * nthreads;
+    batch.nread = batch.nlocate = batch.nwritten = batch.eof = 0;
+    batch.logfp = logfp;
+    batch.isfout = isfout;
+    batch.kml = kml;
+    batch.isbull = isbull;
+    batch.total = total;
+    batch.fail = fail;
+    batch.opt = opt;
+    batch.isf = isf;
+    memmove(&batch.ctx, ctx, sizeof(ILOC_CONTEXT));
+    workers = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if ((batch.jobs = (BATCHJOB *)calloc(batch.nslots,
+                                         sizeof(BATCHJOB))) == NULL) {
+        fprintf(errfp, "BatchLocator: cannot allocate memory!\n");
+        fprintf(logfp, "BatchLocator: cannot allocate memory!\n");
+        Free(workers);
+        errorcode = 1;
+        return 1;
+    }
+    for (i = 0; i < batch.nslots; i++) {
+        if ((batch.jobs[i].magbloc = (char *)calloc(100 * LINLEN,
+                                                    sizeof(char))) == NULL) {
+            fprintf(errfp, "BatchLocator: cannot allocate memory!\n");
+            fprintf(logfp, "BatchLocator: cannot allocate memory!\n");
+            for (i--; i >= 0; i--) Free(batch.jobs[i].magbloc);
+            Free(batch.jobs);
+            Free(workers);
+            errorcode = 1;
+            return 1;
+        }
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.canread, NULL);
+    pthread_cond_init(&batch.canlocate, NULL);
+    pthread_cond_init(&batch.canwrite, NULL);
+    fprintf(logfp, "BatchLocator: %d locator threads, %d queue slots\n",
+            nthreads, batch.nslots);
+/*
+ *  start locator workers and the writer
+ */
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&workers[i], NULL, BatchWorker, &batch)) {
+            fprintf(errfp, "BatchLocator: cannot create thread %d!\n", i);
+            fprintf(logfp, "BatchLocator: cannot create thread %d!\n", i);
+            break;
+        }
+        nw++;
+    }
+    if (nw == 0 || pthread_create(&writer, NULL, BatchWriter, &batch)) {
+        fprintf(errfp, "BatchLocator: cannot start batch processing!\n");
+        fprintf(logfp, "BatchLocator: cannot start batch processing!\n");
+        pthread_mutex_lock(&batch.lock);
+        batch.eof = 1;
+        pthread_cond_broadcast(&batch.canlocate);
+        pthread_mutex_unlock(&batch.lock);
+        for (i = 0; i < nw; i++) pthread_join(workers[i], NULL);
+        for (i = 0; i < batch.nslots; i++) Free(batch.jobs[i].magbloc);
+        Free(batch.jobs);
+        Free(workers);
+        return 1;
+    }
+/*
+ *  reader: read next event from ISF file into a free queue slot
+ */
+    while (1) {
+        pthread_mutex_lock(&batch.lock);
+        while (batch.nread - batch.nwritten >= batch.nslots)
+            pthread_cond_wait(&batch.canread, &batch.lock);
+        job = &batch.jobs[batch.nread % batch.nslots];
+        pthread_mutex_unlock(&batch.lock);
+/*
+ *      event log is collected in memory
+ */
+        job->logbuf = (char *)NULL;
+        job->loglen = 0;
+        if ((job->log = open_memstream(&job->logbuf, &job->loglen)) == NULL) {
+            fprintf(errfp, "BatchLocator: cannot open log buffer!\n");
+            fprintf(reallogfp, "BatchLocator: cannot open log buffer!\n");
+            break;
+        }
+/*
+ *      start from the instruction-level defaults
+ */
+        memmove(&job->e, ep, sizeof(EVREC));
+        job->h = (HYPREC *)NULL;
+        job->p = (PHAREC *)NULL;
+        logfp = job->log;
+        if (ReadISF(isfin, isf, &job->e, &job->h, &job->p, stalist,
+                    job->magbloc)) {
+            logfp = reallogfp;
+            fclose(job->log);
+            if (job->logbuf && job->loglen)
+                fwrite(job->logbuf, 1, job->loglen, reallogfp);
+            Free(job->logbuf);
+            break;
+        }
+        logfp = reallogfp;
+/*
+ *      hand over the event to the locator workers
+ */
+        pthread_mutex_lock(&batch.lock);
+        job->status = JOB_READ;
+        batch.nread++;
+        pthread_cond_signal(&batch.canlocate);
+        pthread_mutex_unlock(&batch.lock);
+    }
+/*
+ *  end of ISF input: wait for the workers and the writer to finish
+ */
+    pthread_mutex_lock(&batch.lock);
+    batch.eof = 1;
+    pthread_cond_broadcast(&batch.canlocate);
+    pthread_cond_broadcast(&batch.canwrite);
+    pthread_mutex_unlock(&batch.lock);
+    for (i = 0; i < nw; i++) pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+    logfp = reallogfp;
+/*
+ *  free memory
+ */
+    pthread_cond_destroy(&batch.canwrite);
+    pthread_cond_destroy(&batch.canlocate);
+    pthread_cond_destroy(&batch.canread);
+    pthread_mutex_destroy(&batch.lock);
+    for (i = 0; i < batch.nslots; i++) Free(batch.jobs[i].magbloc);
+    Free(batch.jobs);
+    Free(workers);
+    return 0;
+}
+
+/*
+ *  Title:
+ *     BatchWorker
+ *  Synopsis:
+ *     Locator worker thread in multi-threaded batch mode.
+ *     Takes the next event from the batch queue and locates it.
+ *     The log of the event is written to a memory buffer that is flushed
+ *        by the writer in event order; the ISF output of the event is left
+ *        to the writer (see DeferISFOutput).
+ *     Each worker has its own locator context; if local TT tables are
+ *        regenerated on the fly (UpdateLocalTT), each worker keeps its
+ *        own copy of the local TT tables too.
+ *  Input Arguments:
+ *     arg - pointer to BATCH structure
+ *  Called by:
+ *     BatchLocator
+ *  Calls:
+ *     SetContext, GenerateLocalTTtables, Locator, FreeLocalTTtables,
+ *     FreeEtopoTiles
+ */
+static void *BatchWorker(void *arg)
+{
+    BATCH *bp = (BATCH *)arg;
+    BATCHJOB *job = (BATCHJOB *)NULL;
+    ILOC_CONTEXT ctx;
+    int i;
+    memmove(&ctx, &bp->ctx, sizeof(ILOC_CONTEXT));
+    SetContext(&ctx);
+    CurrentBatch = bp;
+/*
+ *  own copy of local TT tables as Locator may regenerate them
+ */
+    if (ctx.UseLocalTT && UpdateLocalTT) {
+        if ((ctx.LocalTTtables = GenerateLocalTTtables(LocalVmodelFile,
+                                          ctx.PrevLat, ctx.PrevLon)) == NULL)
+            ctx.UseLocalTT = 0;
+    }
+    pthread_mutex_lock(&bp->lock);
+    while (1) {
+        while (bp->nlocate >= bp->nread && !bp->eof)
+            pthread_cond_wait(&bp->canlocate, &bp->lock);
+        if (bp->nlocate >= bp->nread)
+            break;
+        job = &bp->jobs[bp->nlocate % bp->nslots];
+        job->status = JOB_BUSY;
+        bp->nlocate++;
+        CurrentJob = job;
+        pthread_mutex_unlock(&bp->lock);
+/*
+ *      locate event
+ *          the counters only count this event; the writer adds them up
+ */
+        ctx.logfp = job->log;
+        ctx.errorcode = 0;
+        job->isisf = 0;
+        job->total = job->fail = 0;
+        for (i = 0; i < 7; i++) job->opt[i] = 0;
+        if (ctx.verbose)
+            fprintf(ctx.logfp, "    Locator (%.4f)\n", secs(&ctx.t0));
+        if (Locator(&ctx, bp->isf, 0, &job->total, &job->fail, job->opt,
+                    &job->e, job->h, &job->s, job->p, (FILE *)NULL,
+                    job->magbloc)) {
+            fprintf(ctx.logfp, "CAUTION: No solution found due to %s\n",
+                    errorcodes[ctx.errorcode]);
+            fprintf(errfp, "CAUTION: No solution found due to %s\n",
+                    errorcodes[ctx.errorcode]);
+        }
+        fprintf(ctx.logfp, "EVENT %.6f %s %d\n", secs(&ctx.t0),
+                job->e.EventID, job->s.numPhase);
+        ctx.PrevLat = job->s.lat;
+        ctx.PrevLon = job->s.lon;
+/*
+ *      hand over the event to the writer
+ */
+        pthread_mutex_lock(&bp->lock);
+        CurrentJob = (BATCHJOB *)NULL;
+        job->status = JOB_DONE;
+        pthread_cond_broadcast(&bp->canwrite);
+    }
+    pthread_mutex_unlock(&bp->lock);
+    CurrentBatch = (BATCH *)NULL;
+    if (ctx.LocalTTtables != bp->ctx.LocalTTtables && ctx.LocalTTtables)
+        FreeLocalTTtables(ctx.LocalTTtables);
+    FreeEtopoTiles();
+    return NULL;
+}
+
+/*
+ *  Title:
+ *     BatchWriter
+ *  Synopsis:
+ *     Writer thread in multi-threaded batch mode.
+ *     Waits for the located events in the original event order and
+ *        writes their log, ISF and KML output; updates the counters.
+ *     The solutions are numbered here, from the converged counter of the
+ *        events written so far, exactly as Locator numbers them in the
+ *        serial event loop.
+ *  Input Arguments:
+ *     arg - pointer to BATCH structure
+ *  Called by:
+ *     BatchLocator
+ *  Calls:
+ *     SetContext, WriteISF, WriteKML, Free
+ */
+static void *BatchWriter(void *arg)
+{
+    BATCH *bp = (BATCH *)arg;
+    BATCHJOB *job = (BATCHJOB *)NULL;
+    int i, hypid;
+    SetContext(&bp->ctx);
+    pthread_mutex_lock(&bp->lock);
+    while (1) {
+        job = &bp->jobs[bp->nwritten % bp->nslots];
+        while (!(bp->nwritten < bp->nread && job->status == JOB_DONE) &&
+               !(bp->eof && bp->nwritten >= bp->nread))
+            pthread_cond_wait(&bp->canwrite, &bp->lock);
+        if (bp->nwritten >= bp->nread)
+            break;
+        pthread_mutex_unlock(&bp->lock);
+/*
+ *      event log
+ */
+        fclose(job->log);
+        if (job->loglen)
+            fwrite(job->logbuf, 1, job->loglen, bp->logfp);
+        Free(job->logbuf);
+/*
+ *      ISF output
+ *          *bp->total counts the converged events written so far, and
+ *          job->total is 1 if this event converged (0 for a fixed
+ *          hypocentre), as the serial counter at the time of writing
+ */
+        if (job->isisf) {
+            hypid = job->s.hypid;
+            if (hypid == 0) job->s.hypid = *bp->total + job->total;
+            if (*bp->total == 0) {
+/*
+ *              Write event header
+ */
+                fprintf(bp->isfout, "BEGIN IMS2.0\n");
+                fprintf(bp->isfout, "DATA_TYPE BULLETIN IMS1.0:short with ISF2.1 extensions\n");
+            }
+            WriteISF(bp->isfout, &job->e, &job->s, job->h, job->p,
+                     job->stamag, job->rdmag, job->grn, job->magbloc);
+            fflush(bp->isfout);
+            job->s.hypid = hypid;
+            Free(job->rdmag[0]); Free(job->rdmag);
+            Free(job->stamag[0]); Free(job->stamag);
+        }
+/*
+ *      KML output
+ */
+        if (KMLBulletinFile[0])
+            WriteKML(bp->kml, job->e.EventID, job->e.numHypo, job->e.numSta,
+                     &job->s, job->h, job->p, bp->isbull);
+        Free(job->h); Free(job->p);
+        fprintf(bp->logfp, "\n\n");
+/*
+ *      update counters and release queue slot
+ */
+        pthread_mutex_lock(&bp->lock);
+        *bp->total += job->total;
+        *bp->fail += job->fail;
+        for (i = 0; i < 7; i++) bp->opt[i] += job->opt[i];
+        job->status = JOB_EMPTY;
+        bp->nwritten++;
+        pthread_cond_broadcast(&bp->canread);
+    }
+    pthread_mutex_unlock(&bp->lock);
+    return NULL;
+}
+
+/*
+ *  Title:
+ *     DeferISFOutput
+ *  Synopsis:
+ *     Leaves the ISF output of an event to the writer in multi-threaded
+ *        batch mode, so that the solutions are numbered in event order
+ *        without the locator workers waiting for each other.
+ *     The writer formats the event from the event, solution, hypocentre
+ *        and phase records of the batch job; a copy of the station and
+ *        reading magnitudes is kept here as Locator frees them.
+ *     Does nothing in serial mode.
+ *  Input Arguments:
+ *     s      - pointer to solution record
+ *     stamag - array of station magnitude structures
+ *     rdmag  - array of reading magnitude structures
+ *     grn    - geographic region number
+ *  Return:
+ *     1 if the ISF output is deferred to the writer, 0 otherwise
+ *  Called by:
+ *     Locator
+ */
+int DeferISFOutput(SOLREC *s, STAMAG **stamag, STAMAG **rdmag, int grn)
+{
+    BATCHJOB *job = CurrentJob;
+    size_t n = MAXMAG * s->nreading;
+    int i;
+    if (CurrentBatch == NULL || job == NULL)
+        return 0;
+    job->stamag = (STAMAG **)calloc(MAXMAG, sizeof(STAMAG *));
+    job->rdmag = (STAMAG **)calloc(MAXMAG, sizeof(STAMAG *));
+    if (job->stamag == NULL || job->rdmag == NULL ||
+        (job->stamag[0] = (STAMAG *)calloc(n, sizeof(STAMAG))) == NULL ||
+        (job->rdmag[0] = (STAMAG *)calloc(n, sizeof(STAMAG))) == NULL) {
+        fprintf(errfp, "DeferISFOutput: cannot allocate memory!\n");
+        fprintf(logfp, "DeferISFOutput: cannot allocate memory!\n");
+        if (job->stamag) Free(job->stamag[0]);
+        Free(job->stamag);
+        Free(job->rdmag);
+        return 1;
+    }
+    memcpy(job->stamag[0], stamag[0], n * sizeof(STAMAG));
+    memcpy(job->rdmag[0], rdmag[0], n * sizeof(STAMAG));
+    for (i = 1; i < MAXMAG; i++) {
+        job->stamag[i] = job->stamag[i - 1] + s->nreading;
+        job->rdmag[i] = job->rdmag[i - 1] + s->nreading;
+    }
+    job->grn = grn;
+    job->isisf = 1;
+    return 1;
+}
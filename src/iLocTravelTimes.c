@@ -28,10 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "iLoc.h"
-extern int verbose;
-extern FILE *logfp;
+extern THREADLOCAL int verbose;
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
+extern THREADLOCAL int errorcode;
 extern int numPhaseTT;                                   /* number of phases */
 extern char PhaseTT[MAXTTPHA][PHALEN];                         /* phase list */
 extern int numLocalPhaseTT;                        /* number of local phases */
@@ -40,62 +40,162 @@ extern char TTimeTable[];                                      /* model name */
 extern double PSurfVel;             /* Pg velocity for elevation corrections */
 extern double SSurfVel;             /* Sg velocity for elevation corrections */
 extern double MaxHypocenterDepth;    /* max hypocenter depth from model file */
-extern char PhaseWithoutResidual[MAXNUMPHA][PHALEN];      /* from model file */
-extern int PhaseWithoutResidualNum;       /* number of 'non-residual' phases */
 extern int EtopoNlon;                /* number of longitude samples in ETOPO */
 extern int EtopoNlat;                 /* number of latitude samples in ETOPO */
 extern double EtopoRes;                                 /* cellsize in ETOPO */
 extern int UseRSTTPnSn;                       /* use RSTT Pn/Sn predictions? */
 extern int UseRSTTPgLg;                       /* use RSTT Pg/Lg predictions? */
 extern int UseRSTT;                                 /* use RSTT predictions? */
-extern int UseLocalTT;                           /* use local TT predictions */
+extern pthread_mutex_t RSTTmutex;                  /* serializes RSTT calls */
+extern THREADLOCAL int UseLocalTT;               /* use local TT predictions */
 extern double MaxLocalTTDelta;           /* use local TT up to this distance */
+extern THREADLOCAL TT_GRID *TTgrid;          /* NA travel-time grid, if any */
+extern THREADLOCAL long TTgridInterp;   /* TT values interpolated from grid */
+extern THREADLOCAL long TTgridExact;     /* TT table values instead of grid */
+extern THREADLOCAL TT_CACHE *TTcache;      /* per-event TT prediction cache */
+extern int LazyTTtables;               /* read TT tables on first use [0/1] */
+extern int UseCorrectionCache;     /* cache station/bounce corrections [0/1] */
+extern double BounceTolerance;        /* bounce point move to recompute [km] */
+extern THREADLOCAL CORR_STATS CorrStats;        /* correction cache counters */
+
+/*
+ * TT table directory and lock for reading TT tables on first use
+ */
+static char TTdirname[FILENAMELEN];
+static pthread_mutex_t TTloadMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * ellipticity corrections calculated for the phases by TravelTimeResiduals;
+ * NULLVAL entries are calculated by TravelTimeCorrections
+ */
+static THREADLOCAL PHAREC *ECphases = (PHAREC *)NULL;
+static THREADLOCAL double *ECcorr = (double *)NULL;
+static THREADLOCAL int ECnum = 0;
 
 /*
  * Functions:
  *    ReadTTtables
+ *    ReadTTtableFile
+ *    WriteTTbinary
+ *    MapTTbinary
+ *    TTBchecksum
  *    FreeTTtables
  *    FreeLocalTTtables
- *    ReadEtopo1
  *    GetPhaseIndex
+ *    GetTTtableIndex
+ *    LoadTTtable
  *    GetLocalPhaseIndex
  *    GetTravelTimePrediction
  *    GetTravelTimeTableValue
  *    TravelTimeResiduals
  *    GetEtopoCorrection
+ *    AllocateTTgrid
+ *    FreeTTgrid
+ *    AllocateTTcache
+ *    ResetTTcache
+ *    FreeTTcache
+ *    ResetCorrectionCache
+ *    BicubicTTpatches
  */
 
 /*
  * Local functions:
- *    GetEtopoElevation
+ *    ReadPhaseTTtable
+ *    MapTTrows
+ *    TTBentryCheck
+ *    TTBspan
+ *    TTBwrite
  *    TravelTimeCorrections
  *    GetBounceCorrection
+ *    GetTopographyCorrection
+ *    BounceCellMoved
  *    GetElevationCorrection
  *    GetLastLag
  *    GetGeoidCorrection
  *    HeightAboveMeanSphere
  *    GetTTResidual
  *    isRSTT
- */
-static double GetEtopoElevation(double lat, double lon, short int **topo);
+ *    GetTTgridValue
+ *    GetTTgridNode
+ *    TTsampleWindow
+ *    TTdeltaCubics
+ *    TTdepthPatch
+ *    SplinePiece
+ *    CubicPowerCoeffs
+ *    BicubicValue
+ *    TTsecondDeltaDerivative
+ *    TTtableBracket
+ *    TTtableValue
+ *    PredictTravelTime
+ *    TTcacheKey
+ *    TTcacheLookup
+ */
+static int ReadPhaseTTtable(TT_TABLE *tt_tablep);
+static double **MapTTrows(char *map, long long offset, int ndel, int ndep);
+static int TTBentryCheck(TTB_ENTRY *ep, char *map, size_t size);
+static int TTBspan(long long offset, long long n, long long width,
+        size_t size);
+static int TTBwrite(FILE *fp, char *buf, size_t len, unsigned long long *hash);
 static void TravelTimeCorrections(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
-        short int **topo);
-static double GetBounceCorrection(SOLREC *sp, PHAREC *pp, short int **topo,
+        ETOPO *topo);
+static double GetBounceCorrection(SOLREC *sp, PHAREC *pp, ETOPO *topo,
+        double *tcorw);
+static double GetTopographyCorrection(int ips, double rayp, double delr,
         double *tcorw);
+static int BounceCellMoved(PHAREC *pp, double bplat, double bplon);
 static double GetElevationCorrection(PHAREC *pp);
 static int GetLastLag(char phase[]);
 static double GetGeoidCorrection(double lat, PHAREC *pp);
 static double HeightAboveMeanSphere(double lat);
 static double GetTTResidual(PHAREC *pp, int all, SOLREC *sp, EC_COEF *ec,
-        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, short int **topo,
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo,
         int iszderiv, int is2nderiv);
 static int isRSTT(PHAREC *pp, double depth);
+static int PredictTravelTime(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo,
+        int iszderiv, int isfirst, int is2nderiv);
+static int TTcacheKey(TT_CACHE *ttcache, SOLREC *sp, PHAREC *pp,
+        int iszderiv, int isfirst, int is2nderiv, TT_CACHE_ENTRY *key);
+static TT_CACHE_ENTRY *TTcacheLookup(TT_CACHE *ttcache, TT_CACHE_ENTRY *key,
+        int *ishit);
+static double GetTTgridValue(TT_GRID *ttgrid, int itab, TT_TABLE *tt_tablep,
+        double depth, double delta, int iszderiv, double *dtdd, double *dtdh,
+        double *bpdel, int is2nderiv, double *d2tdd, double *d2tdh);
+static double *GetTTgridNode(TT_GRID *ttgrid, int itab, TT_TABLE *tt_tablep,
+        int i, int j);
+static void TTsampleWindow(int n, int nsamp, int i, int *lo, int *hi);
+static void TTdeltaCubics(TT_TABLE *tt_tablep, int i, double *ucol,
+        int *uvalid);
+static void TTdepthPatch(TT_TABLE *tt_tablep, int j, double *ucol,
+        int *uvalid, double *c);
+static double SplinePiece(double xp, double *x, double *y, double *d2y,
+        int klo, int khi);
+static void CubicPowerCoeffs(double *f, double *c);
+static double BicubicValue(double *c, double u, double v);
+static double TTsecondDeltaDerivative(TT_TABLE *tt_tablep, double delta,
+        int ilo, int ihi, int jlo, int jhi);
+static void TTtableBracket(TT_TABLE *tt_tablep, double depth, double delta,
+        int *idel, int *jdep, int *ilo, int *ihi, int *jlo, int *jhi,
+        int *exactdelta, int *exactdepth);
+ALWAYSINLINE double TTtableValue(TT_TABLE *tt_tablep, double depth,
+        double delta, int iszderiv, int is2nderiv, int isdepthphase,
+        double *dtdd, double *dtdh, double *bpdel, double *d2tdd,
+        double *d2tdh);
 
 /*
  *  Title:
  *     ReadTTtables
  *  Synopsis:
  *     Read travel-time tables from files in dirname.
+ *     If dirname holds a valid binary TT file (<model>.ttb, written by
+ *     iLocTTcompile), the tables and their bicubic patches are mapped
+ *     from it; otherwise they are read from the text TT table files.
+ *     If LazyTTtables is set, only the composite first-arriving P and S
+ *     tables are read here; the text TT table of any other phase is read
+ *     by LoadTTtable when it is first used, and the checksum of the
+ *     binary TT file is not verified so that its pages are only faulted
+ *     in for the tables actually used.
+ *     The text TT tables are interpolated with the splines on the fly.
  *  Input Arguments:
  *     dirname - directory pathname for TT tables
  *  Return:
@@ -103,14 +203,13 @@ static int isRSTT(PHAREC *pp, double depth);
  *  Called by:
  *     ReadAuxDataFiles
  *  Calls:
- *     SkipComments, FreeTTtables, AllocateFloatMatrix
+ *     MapTTbinary, ReadPhaseTTtable, FreeTTtables, BuildRunIndex
  */
 TT_TABLE *ReadTTtables(char *dirname)
 {
-    FILE *fp;
     TT_TABLE *tt_tables = (TT_TABLE *)NULL;
-    char fname[MAXBUF], buf[LINLEN], *s;
-    int ndists = 0, ndepths = 0, i, j, k, m, ind = 0, isdepthphase = 0;
+    char fname[MAXBUF];
+    int ind = 0, isdepthphase = 0, ret = 0, ismapped = 0;
 /*
  *  memory allocation
  */
@@ -122,13 +221,10 @@ TT_TABLE *ReadTTtables(char *dirname)
         return (TT_TABLE *) NULL;
     }
 /*
- *  read TT table files
+ *  initialize tt_tables
  *      numPhaseTT and PhaseTT are specified in iloc.h and iloc_main.c
  */
     for (ind = 0; ind < numPhaseTT; ind++) {
-/*
- *      initialize tt_tables for this phase
- */
         isdepthphase = 0;
         if (PhaseTT[ind][0] == 'p' || PhaseTT[ind][0] == 's')
             isdepthphase = 1;
@@ -142,417 +238,952 @@ TT_TABLE *ReadTTtables(char *dirname)
         tt_tables[ind].dtdd = (double **)NULL;
         tt_tables[ind].dtdh = (double **)NULL;
         tt_tables[ind].bpdel = (double **)NULL;
+        tt_tables[ind].cell = (int *)NULL;
+        tt_tables[ind].patch = (double *)NULL;
+        tt_tables[ind].npatch = 0;
+        tt_tables[ind].delidx = (RUNINDEX *)NULL;
+        tt_tables[ind].depidx = (RUNINDEX *)NULL;
+        tt_tables[ind].map = (char *)NULL;
+        tt_tables[ind].mapsize = 0;
+        tt_tables[ind].pending = 0;
+    }
+    strcpy(TTdirname, dirname);
 /*
- *      open TT table file for this phase
+ *  binary TT file
  */
-        if (isdepthphase)
-            sprintf(fname, "%s/%s.little%s.tab",
-                    dirname, TTimeTable, PhaseTT[ind]);
-        else
-            sprintf(fname, "%s/%s.%s.tab",
-                    dirname, TTimeTable, PhaseTT[ind]);
-        if ((fp = fopen(fname, "r")) == NULL) {
-            if (verbose > 3)
-                fprintf(errfp, "ReadTTtables: cannot open %s\n", fname);
+    sprintf(fname, "%s/%s.ttb", dirname, TTimeTable);
+    if ((ret = MapTTbinary(fname, TTimeTable, tt_tables, numPhaseTT,
+                           PhaseTT)) == 1) {
+        FreeTTtables(tt_tables);
+        errorcode = 1;
+        return (TT_TABLE *) NULL;
+    }
+/*
+ *  read TT table files
+ */
+    ismapped = (ret == 0);
+    for (ind = 0; !ismapped && ind < numPhaseTT; ind++) {
+/*
+ *      first-arriving P and S tables are always read
+ */
+        if (LazyTTtables && ind > 1) {
+            tt_tables[ind].pending = 1;
+            continue;
+        }
+        if ((ret = ReadPhaseTTtable(&tt_tables[ind])) == 2) {
             errorcode = 2;
             continue;
         }
-/*
- *      number of distance and depth samples
- */
-        fgets(buf, LINLEN, fp);
-        SkipComments(buf, fp);
-        sscanf(buf, "%d%d", &ndists, &ndepths);
-        tt_tables[ind].ndel = ndists;
-        tt_tables[ind].ndep = ndepths;
-/*
- *      memory allocations
- */
-        tt_tables[ind].deltas = (double *)calloc(ndists, sizeof(double));
-        tt_tables[ind].depths = (double *)calloc(ndepths, sizeof(double));
-        if (isdepthphase)
-            tt_tables[ind].bpdel = AllocateFloatMatrix(ndists, ndepths);
-        tt_tables[ind].tt = AllocateFloatMatrix(ndists, ndepths);
-        tt_tables[ind].dtdd = AllocateFloatMatrix(ndists, ndepths);
-        if ((tt_tables[ind].dtdh = AllocateFloatMatrix(ndists, ndepths)) == NULL) {
+        if (ret) {
             FreeTTtables(tt_tables);
-            fclose(fp);
             errorcode = 1;
             return (TT_TABLE *) NULL;
         }
+    }
 /*
- *      delta samples (broken into lines of 25 values)
+ *  run indices for bracketing
  */
-        m = ceil((double)ndists / 25.);
-        for (i = 0, k = 0; k < m - 1; k++) {
-            SkipComments(buf, fp);
-            s = strtok(buf, " ");
-            tt_tables[ind].deltas[i++] = atof(s);
-            for (j = 1; j < 25; j++) {
-                s = strtok(NULL, " ");
-                tt_tables[ind].deltas[i++] = atof(s);
-            }
+    for (ind = 0; ind < numPhaseTT; ind++) {
+        if (tt_tables[ind].pending) continue;
+        tt_tables[ind].delidx = BuildRunIndex(tt_tables[ind].ndel,
+                                              tt_tables[ind].deltas);
+        tt_tables[ind].depidx = BuildRunIndex(tt_tables[ind].ndep,
+                                              tt_tables[ind].depths);
+    }
+    return tt_tables;
+}
+
+/*
+ *  Title:
+ *     ReadPhaseTTtable
+ *  Synopsis:
+ *     Reads the text TT table file of a phase from the TT table directory.
+ *     The bicubic patches are not calculated; precomputing them for all
+ *     tables costs more memory and startup time than the faster lookups
+ *     save in a typical run. Binary TT files carry the patches precomputed
+ *     by iLocTTcompile.
+ *  Input Arguments:
+ *     tt_tablep - TT table structure for phase
+ *  Output Arguments:
+ *     tt_tablep - TT table structure with the tables set
+ *  Return:
+ *     0/1/2 on success/memory error/cannot open file
+ *  Called by:
+ *     ReadTTtables, LoadTTtable
+ *  Calls:
+ *     ReadTTtableFile
+ */
+static int ReadPhaseTTtable(TT_TABLE *tt_tablep)
+{
+    char fname[MAXBUF];
+    int ret = 0;
+    if (tt_tablep->isbounce)
+        sprintf(fname, "%s/%s.little%s.tab",
+                TTdirname, TTimeTable, tt_tablep->phase);
+    else
+        sprintf(fname, "%s/%s.%s.tab",
+                TTdirname, TTimeTable, tt_tablep->phase);
+    if ((ret = ReadTTtableFile(fname, tt_tablep)) == 2) {
+        if (verbose > 3)
+            fprintf(errfp, "ReadTTtables: cannot open %s\n", fname);
+        return 2;
+    }
+    if (ret)
+        return 1;
+    return 0;
+}
+
+/*
+ *  Title:
+ *     LoadTTtable
+ *  Synopsis:
+ *     Reads a TT table deferred by ReadTTtables (LazyTTtables) when it
+ *     is first used. Tables that are already read, mapped from a binary
+ *     TT file or generated as local TT tables are left untouched.
+ *     The table is read once; concurrent callers wait for the reader.
+ *     A phase without a TT table file keeps an empty table.
+ *  Input Arguments:
+ *     tt_tablep - TT table structure for phase
+ *  Output Arguments:
+ *     tt_tablep - TT table structure with the tables set
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     GetTTtableIndex, PredictTravelTime
+ *  Calls:
+ *     ReadPhaseTTtable, BuildRunIndex, FreeFloatMatrix, Free
+ */
+int LoadTTtable(TT_TABLE *tt_tablep)
+{
+    int ret = 0;
+    if (!__atomic_load_n(&tt_tablep->pending, __ATOMIC_ACQUIRE))
+        return 0;
+    pthread_mutex_lock(&TTloadMutex);
+    if (tt_tablep->pending) {
+        if ((ret = ReadPhaseTTtable(tt_tablep)) == 2)
+            ret = 0;
+        else if (ret) {
+/*
+ *          memory error: leave an empty table behind
+ */
+            FreeFloatMatrix(tt_tablep->dtdh);
+            FreeFloatMatrix(tt_tablep->dtdd);
+            FreeFloatMatrix(tt_tablep->tt);
+            FreeFloatMatrix(tt_tablep->bpdel);
+            Free(tt_tablep->cell);
+            Free(tt_tablep->patch);
+            Free(tt_tablep->depths);
+            Free(tt_tablep->deltas);
+            tt_tablep->ndel = tt_tablep->ndep = tt_tablep->npatch = 0;
+            tt_tablep->deltas = tt_tablep->depths = (double *)NULL;
+            tt_tablep->tt = tt_tablep->dtdd = (double **)NULL;
+            tt_tablep->dtdh = tt_tablep->bpdel = (double **)NULL;
+            tt_tablep->cell = (int *)NULL;
+            tt_tablep->patch = (double *)NULL;
         }
-        if (i < ndists) {
-            SkipComments(buf, fp);
-            s = strtok(buf, " ");
-            tt_tables[ind].deltas[i++] = atof(s);
-            for (j = i; j < ndists; j++) {
-                s = strtok(NULL, " ");
-                tt_tables[ind].deltas[j] = atof(s);
-            }
+        else {
+            tt_tablep->delidx = BuildRunIndex(tt_tablep->ndel,
+                                              tt_tablep->deltas);
+            tt_tablep->depidx = BuildRunIndex(tt_tablep->ndep,
+                                              tt_tablep->depths);
+        }
+        __atomic_store_n(&tt_tablep->pending, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&TTloadMutex);
+    if (ret) {
+        fprintf(logfp, "LoadTTtable: cannot read %s TT table\n",
+                tt_tablep->phase);
+        fprintf(errfp, "LoadTTtable: cannot read %s TT table\n",
+                tt_tablep->phase);
+        errorcode = 1;
+    }
+    return ret;
+}
+
+/*
+ *  Title:
+ *     ReadTTtableFile
+ *  Synopsis:
+ *     Reads a text TT table file of a phase.
+ *     The phase and isbounce members of tt_tablep must be set; the bpdel
+ *     table is only read for bounce phases.
+ *  Input Arguments:
+ *     fname     - pathname of TT table file
+ *     tt_tablep - TT table structure for phase
+ *  Output Arguments:
+ *     tt_tablep - TT table structure with the tables set
+ *  Return:
+ *     0/1/2 on success/memory error/cannot open file
+ *  Called by:
+ *     ReadPhaseTTtable, iLocTTcompile
+ *  Calls:
+ *     SkipComments, AllocateFloatMatrix
+ */
+int ReadTTtableFile(char *fname, TT_TABLE *tt_tablep)
+{
+    FILE *fp;
+    char buf[LINLEN], *s;
+    int ndists = 0, ndepths = 0, i, j, k, m;
+    if ((fp = fopen(fname, "r")) == NULL)
+        return 2;
+/*
+ *  number of distance and depth samples
+ */
+    fgets(buf, LINLEN, fp);
+    SkipComments(buf, fp);
+    sscanf(buf, "%d%d", &ndists, &ndepths);
+    tt_tablep->ndel = ndists;
+    tt_tablep->ndep = ndepths;
+/*
+ *  memory allocations
+ */
+    tt_tablep->deltas = (double *)calloc(ndists, sizeof(double));
+    tt_tablep->depths = (double *)calloc(ndepths, sizeof(double));
+    if (tt_tablep->isbounce)
+        tt_tablep->bpdel = AllocateFloatMatrix(ndists, ndepths);
+    tt_tablep->tt = AllocateFloatMatrix(ndists, ndepths);
+    tt_tablep->dtdd = AllocateFloatMatrix(ndists, ndepths);
+    if ((tt_tablep->dtdh = AllocateFloatMatrix(ndists, ndepths)) == NULL) {
+        fclose(fp);
+        return 1;
+    }
+/*
+ *  delta samples (broken into lines of 25 values)
+ */
+    m = ceil((double)ndists / 25.);
+    for (i = 0, k = 0; k < m - 1; k++) {
+        SkipComments(buf, fp);
+        s = strtok(buf, " ");
+        tt_tablep->deltas[i++] = atof(s);
+        for (j = 1; j < 25; j++) {
+            s = strtok(NULL, " ");
+            tt_tablep->deltas[i++] = atof(s);
+        }
+    }
+    if (i < ndists) {
+        SkipComments(buf, fp);
+        s = strtok(buf, " ");
+        tt_tablep->deltas[i++] = atof(s);
+        for (j = i; j < ndists; j++) {
+            s = strtok(NULL, " ");
+            tt_tablep->deltas[j] = atof(s);
         }
+    }
+/*
+ *  depth samples
+ */
+    SkipComments(buf, fp);
+    s = strtok(buf, " ");
+    tt_tablep->depths[0] = atof(s);
+    for (i = 1; i < ndepths; i++) {
+        s = strtok(NULL, " ");
+        tt_tablep->depths[i] = atof(s);
+    }
 /*
- *      depth samples
+ *  travel-times (ndists rows, ndepths columns)
  */
+    for (i = 0; i < ndists; i++) {
         SkipComments(buf, fp);
         s = strtok(buf, " ");
-        tt_tables[ind].depths[0] = atof(s);
-        for (i = 1; i < ndepths; i++) {
+        tt_tablep->tt[i][0] = atof(s);
+        for (j = 1; j < ndepths; j++) {
             s = strtok(NULL, " ");
-            tt_tables[ind].depths[i] = atof(s);
+            tt_tablep->tt[i][j] = atof(s);
         }
+    }
 /*
- *      travel-times (ndists rows, ndepths columns)
+ *  dtdd (horizontal slowness)
  */
-        for (i = 0; i < ndists; i++) {
-            SkipComments(buf, fp);
-            s = strtok(buf, " ");
-            tt_tables[ind].tt[i][0] = atof(s);
-            for (j = 1; j < ndepths; j++) {
-                s = strtok(NULL, " ");
-                tt_tables[ind].tt[i][j] = atof(s);
-            }
+    for (i = 0; i < ndists; i++) {
+        SkipComments(buf, fp);
+        s = strtok(buf, " ");
+        tt_tablep->dtdd[i][0] = atof(s);
+        for (j = 1; j < ndepths; j++) {
+            s = strtok(NULL, " ");
+            tt_tablep->dtdd[i][j] = atof(s);
         }
+    }
 /*
- *      dtdd (horizontal slowness)
+ *  dtdh (vertical slowness)
  */
-        for (i = 0; i < ndists; i++) {
-            SkipComments(buf, fp);
-            s = strtok(buf, " ");
-            tt_tables[ind].dtdd[i][0] = atof(s);
-            for (j = 1; j < ndepths; j++) {
-                s = strtok(NULL, " ");
-                tt_tables[ind].dtdd[i][j] = atof(s);
-            }
+    for (i = 0; i < ndists; i++) {
+        SkipComments(buf, fp);
+        s = strtok(buf, " ");
+        tt_tablep->dtdh[i][0] = atof(s);
+        for (j = 1; j < ndepths; j++) {
+            s = strtok(NULL, " ");
+            tt_tablep->dtdh[i][j] = atof(s);
         }
+    }
 /*
- *      dtdh (vertical slowness)
+ *  depth phase bounce point distances
  */
+    if (tt_tablep->isbounce) {
         for (i = 0; i < ndists; i++) {
             SkipComments(buf, fp);
             s = strtok(buf, " ");
-            tt_tables[ind].dtdh[i][0] = atof(s);
+            tt_tablep->bpdel[i][0] = atof(s);
             for (j = 1; j < ndepths; j++) {
                 s = strtok(NULL, " ");
-                tt_tables[ind].dtdh[i][j] = atof(s);
-            }
-        }
-/*
- *      depth phase bounce point distances
- */
-        if (isdepthphase) {
-            for (i = 0; i < ndists; i++) {
-                SkipComments(buf, fp);
-                s = strtok(buf, " ");
-                tt_tables[ind].bpdel[i][0] = atof(s);
-                for (j = 1; j < ndepths; j++) {
-                    s = strtok(NULL, " ");
-                    tt_tables[ind].bpdel[i][j] = atof(s);
-                }
+                tt_tablep->bpdel[i][j] = atof(s);
             }
         }
-        fclose(fp);
     }
-    return tt_tables;
+    fclose(fp);
+    return 0;
 }
 
 /*
  *  Title:
- *     FreeTTtables
+ *     MapTTbinary
  *  Synopsis:
- *     Frees memory allocated to TT_TABLE structure
+ *     Maps a binary TT file and points the TT tables of the phases in
+ *     the phase list into the mapping. Only the row pointers of the tables
+ *     are allocated; the samples and the bicubic patches are shared with
+ *     the page cache.
+ *     The file is rejected if its header, model name, size or checksum do
+ *     not match; the checksum is not verified if LazyTTtables is set.
+ *     The directory is always checked, so that every array of a table
+ *     lies within the mapping even if the checksum is not verified.
+ *     Phases without a table in the file are left empty, like phases
+ *     without a text TT table file.
  *  Input Arguments:
- *     tt_tables - TT table structure
+ *     fname     - pathname of binary TT file
+ *     model     - TT model name expected in the header
+ *     tt_tables - initialized TT table structures
+ *     ntab      - number of TT tables
+ *     phases    - phase of each TT table
+ *  Output Arguments:
+ *     tt_tables - TT table structures pointing into the mapping
+ *  Return:
+ *     0/1/2 on success/memory error/no valid binary TT file
  *  Called by:
- *     ReadAuxDataFiles, ReadTTtables, main
+ *     ReadTTtables, GenerateLocalTTtables
  *  Calls:
- *     FreeFloatMatrix
+ *     TTBchecksum, TTBentryCheck, MapTTrows, Free
  */
-void FreeTTtables(TT_TABLE *tt_tables)
+int MapTTbinary(char *fname, char *model, TT_TABLE *tt_tables, int ntab,
+        char phases[][PHALEN])
 {
-    int i, ndists = 0;
-    for (i = 0; i < numPhaseTT; i++) {
-        if ((ndists = tt_tables[i].ndel) == 0) continue;
-        FreeFloatMatrix(tt_tables[i].dtdh);
-        FreeFloatMatrix(tt_tables[i].dtdd);
-        FreeFloatMatrix(tt_tables[i].tt);
-        if (PhaseTT[i][0] == 'p' || PhaseTT[i][0] == 's')
-            FreeFloatMatrix(tt_tables[i].bpdel);
-        Free(tt_tables[i].depths);
-        Free(tt_tables[i].deltas);
+    TTB_HEADER *hp = (TTB_HEADER *)NULL;
+    TTB_ENTRY *ep = (TTB_ENTRY *)NULL;
+    struct stat st;
+    char *map = (char *)NULL;
+    size_t size = 0;
+    int fd, ind, k;
+    if ((fd = open(fname, O_RDONLY)) < 0)
+        return 2;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(TTB_HEADER)) {
+        close(fd);
+        return 2;
     }
-    Free(tt_tables);
+    size = (size_t)st.st_size;
+    map = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 2;
+/*
+ *  check header
+ */
+    hp = (TTB_HEADER *)map;
+    if (strcmp(hp->magic, TTB_MAGIC) || hp->version != TTB_VERSION ||
+        hp->byteorder != TTB_BYTEORDER ||
+        hp->entrysize != (int)sizeof(TTB_ENTRY) ||
+        hp->size != (long long)size || size % 8 || hp->nphase < 0 ||
+        strcmp(hp->model, model) ||
+        size < sizeof(TTB_HEADER) + hp->nphase * sizeof(TTB_ENTRY) ||
+        (!LazyTTtables && TTBchecksum(map + sizeof(TTB_HEADER), size - sizeof(TTB_HEADER),
+                    0) != hp->checksum)) {
+        fprintf(logfp, "MapTTbinary: invalid %s\n", fname);
+        munmap(map, size);
+        return 2;
+    }
+/*
+ *  check the directory
+ */
+    ep = (TTB_ENTRY *)(map + sizeof(TTB_HEADER));
+    for (k = 0; k < hp->nphase; k++)
+        if (TTBentryCheck(&ep[k], map, size)) break;
+    if (k < hp->nphase) {
+        fprintf(logfp, "MapTTbinary: invalid %s table in %s\n",
+                ep[k].phase, fname);
+        munmap(map, size);
+        return 2;
+    }
+/*
+ *  point the TT tables into the mapping
+ */
+    for (ind = 0; ind < ntab; ind++) {
+        tt_tables[ind].map = map;
+        tt_tables[ind].mapsize = size;
+        for (k = 0; k < hp->nphase; k++)
+            if (streq(ep[k].phase, phases[ind])) break;
+        if (k == hp->nphase) {
+            if (verbose > 3)
+                fprintf(errfp, "MapTTbinary: no %s table in %s\n",
+                        phases[ind], fname);
+            errorcode = 2;
+            continue;
+        }
+        if (ep[k].isbounce != tt_tables[ind].isbounce) break;
+        if (ep[k].ndel == 0) continue;
+        tt_tables[ind].ndel = ep[k].ndel;
+        tt_tables[ind].ndep = ep[k].ndep;
+        tt_tables[ind].npatch = ep[k].npatch;
+        tt_tables[ind].deltas = (double *)(map + ep[k].deltas);
+        tt_tables[ind].depths = (double *)(map + ep[k].depths);
+        tt_tables[ind].tt = MapTTrows(map, ep[k].tt, ep[k].ndel, ep[k].ndep);
+        tt_tables[ind].dtdd = MapTTrows(map, ep[k].dtdd,
+                                        ep[k].ndel, ep[k].ndep);
+        tt_tables[ind].dtdh = MapTTrows(map, ep[k].dtdh,
+                                        ep[k].ndel, ep[k].ndep);
+        if (ep[k].isbounce)
+            tt_tables[ind].bpdel = MapTTrows(map, ep[k].bpdel,
+                                             ep[k].ndel, ep[k].ndep);
+        if (ep[k].cell)
+            tt_tables[ind].cell = (int *)(map + ep[k].cell);
+        if (ep[k].patch)
+            tt_tables[ind].patch = (double *)(map + ep[k].patch);
+        if (tt_tables[ind].tt == NULL || tt_tables[ind].dtdd == NULL ||
+            tt_tables[ind].dtdh == NULL ||
+            (ep[k].isbounce && tt_tables[ind].bpdel == NULL)) {
+            fprintf(logfp, "MapTTbinary: cannot allocate memory\n");
+            fprintf(errfp, "MapTTbinary: cannot allocate memory\n");
+            return 1;
+        }
+    }
+    if (ind == ntab)
+        return 0;
+/*
+ *  inconsistent table: undo the mapping and let the caller fall back
+ */
+    fprintf(logfp, "MapTTbinary: invalid %s\n", fname);
+    for (ind = 0; ind < ntab; ind++) {
+        Free(tt_tables[ind].tt);
+        Free(tt_tables[ind].dtdd);
+        Free(tt_tables[ind].dtdh);
+        Free(tt_tables[ind].bpdel);
+        tt_tables[ind].ndel = tt_tables[ind].ndep = tt_tables[ind].npatch = 0;
+        tt_tables[ind].deltas = tt_tables[ind].depths = (double *)NULL;
+        tt_tables[ind].tt = tt_tables[ind].dtdd = (double **)NULL;
+        tt_tables[ind].dtdh = tt_tables[ind].bpdel = (double **)NULL;
+        tt_tables[ind].cell = (int *)NULL;
+        tt_tables[ind].patch = (double *)NULL;
+        tt_tables[ind].map = (char *)NULL;
+        tt_tables[ind].mapsize = 0;
+    }
+    munmap(map, size);
+    return 2;
 }
 
 /*
  *  Title:
- *     FreeLocalTTtables
+ *     MapTTrows
  *  Synopsis:
- *     Frees memory allocated to local TT_TABLE structure
+ *     Allocates the row pointers of an ndel x ndep table stored row-wise
+ *     at offset in a binary TT file mapping.
  *  Input Arguments:
- *     tt_tables - TT table structure
+ *     map    - binary TT file mapping
+ *     offset - byte offset of the table
+ *     ndel   - number of rows
+ *     ndep   - number of columns
+ *  Return:
+ *     row pointers or NULL on error
  *  Called by:
- *     ReadAuxDataFiles, ReadTTtables, main
- *  Calls:
- *     FreeFloatMatrix
+ *     MapTTbinary
  */
-void FreeLocalTTtables(TT_TABLE *tt_tables)
+static double **MapTTrows(char *map, long long offset, int ndel, int ndep)
 {
-    int i, ndists = 0;
-    for (i = 0; i < numLocalPhaseTT; i++) {
-        if ((ndists = tt_tables[i].ndel) == 0) continue;
-        FreeFloatMatrix(tt_tables[i].dtdh);
-        FreeFloatMatrix(tt_tables[i].dtdd);
-        FreeFloatMatrix(tt_tables[i].tt);
-        if (tt_tables[i].isbounce)
-            FreeFloatMatrix(tt_tables[i].bpdel);
-        Free(tt_tables[i].depths);
-        Free(tt_tables[i].deltas);
-    }
-    Free(tt_tables);
+    double **rows = (double **)NULL;
+    double *tab = (double *)(map + offset);
+    int i;
+    if ((rows = (double **)calloc(ndel, sizeof(double *))) == NULL)
+        return (double **)NULL;
+    for (i = 0; i < ndel; i++)
+        rows[i] = tab + i * ndep;
+    return rows;
 }
 
 /*
  *  Title:
- *      ReadEtopo1
+ *     TTBentryCheck
  *  Synopsis:
- *      Reads ETOPO1 topography file and store it in global short int topo
- *      array
- *      ETOPO1:
- *         etopo1_bed_g_i2.bin
- *         Amante, C. and B. W. Eakins,
- *           ETOPO1 1 Arc-Minute Global Relief Model: Procedures, Data Sources
- *           and Analysis.
- *           NOAA Technical Memorandum NESDIS NGDC-24, 19 pp, March 2009.
- *         NCOLS         21601
- *         NROWS         10801
- *         XLLCENTER     -180.000000
- *         YLLCENTER     -90.000000
- *         CELLSIZE      0.01666666667
- *         NODATA_VALUE  -32768
- *         BYTEORDER     LSBFIRST
- *         NUMBERTYPE    2_BYTE_INTEGER
- *         ZUNITS        METERS
- *         MIN_VALUE     -10898
- *         MAX_VALUE     8271
- *         1'x1' resolution, 21601 lons, 10801 lats
- *      Resampled ETOPO1 versions:
- *         etopo2_bed_g_i2.bin
- *           grdfilter -I2m etopo1_bed.grd -Fg10 -D4 -Getopo2_bed.grd
- *             Gridline node registration used
- *             x_min: -180 x_max: 180 x_inc: 0.0333333 name: nx: 10801
- *             y_min: -90 y_max: 90 y_inc: 0.0333333 name: ny: 5401
- *             z_min: -10648.7 z_max: 7399.13 name: m
- *             scale_factor: 1 add_offset: 0
- *         etopo5_bed_g_i2.bin
- *           grdfilter -I5m etopo1_bed.grd -Fg15 -D4 -Getopo5_bed.grd
- *             Gridline node registration used
- *             x_min: -180 x_max: 180 x_inc: 0.0833333 nx: 4321
- *             y_min: -90 y_max: 90 y_inc: 0.0833333 ny: 2161
- *             z_min: -10515.5 z_max: 6917.75 name: m
- *             scale_factor: 1 add_offset: 0
- *  ETOPO parameters are specified in config.txt file:
- *     EtopoFile - pathname for ETOPO file
- *     EtopoNlon - number of longitude samples in ETOPO
- *     EtopoNlat - number of latitude samples in ETOPO
- *     EtopoRes  - cellsize in ETOPO
+ *     Checks a directory entry of a binary TT file: the dimensions must be
+ *     positive, every array of the table must lie within the mapping, and
+ *     every patch index of the cell array must point to a patch.
  *  Input Arguments:
- *     filename - filename pathname
+ *     ep   - pointer to directory entry
+ *     map  - binary TT file mapping
+ *     size - size of the mapping [bytes]
  *  Return:
- *     topo - ETOPO bathymetry/elevation matrix or NULL on error
+ *     0/1 on valid/invalid entry
  *  Called by:
- *     ReadAuxDataFiles
+ *     MapTTbinary
  *  Calls:
- *     AllocateShortMatrix, FreeShortMatrix
+ *     TTBspan
  */
-short int **ReadEtopo1(char *filename)
+static int TTBentryCheck(TTB_ENTRY *ep, char *map, size_t size)
 {
-    FILE *fp;
-    short int **topo = (short int **)NULL;
-    unsigned long n, m;
-/*
- *  open etopo file
- */
-    if ((fp = fopen(filename, "rb")) == NULL) {
-        fprintf(stderr, "Cannot open %s!\n", filename);
-        errorcode = 2;
-        return (short int **)NULL;
-    }
+    long long nd = 0, ncell = 0, i;
+    int *cell = (int *)NULL;
+    if (memchr(ep->phase, '\0', PHALEN) == NULL)
+        return 1;
+    if (ep->ndel == 0)
+        return 0;
 /*
- *  allocate memory
+ *  dimensions; the number of samples cannot exceed the file size
  */
-    if ((topo = AllocateShortMatrix(EtopoNlat, EtopoNlon)) == NULL)
-        return (short int **)NULL;
+    if (ep->ndel < 1 || ep->ndep < 1 || ep->npatch < 0 ||
+        ep->ndep > (long long)(size / 8) ||
+        ep->ndel > (long long)(size / 8) / ep->ndep)
+        return 1;
+    nd = (long long)ep->ndel * ep->ndep;
+    ncell = (long long)(ep->ndel - 1) * (ep->ndep - 1);
+/*
+ *  arrays
+ */
+    if (TTBspan(ep->deltas, ep->ndel, 8, size) ||
+        TTBspan(ep->depths, ep->ndep, 8, size) ||
+        TTBspan(ep->tt, nd, 8, size) ||
+        TTBspan(ep->dtdd, nd, 8, size) ||
+        TTBspan(ep->dtdh, nd, 8, size) ||
+        (ep->isbounce && TTBspan(ep->bpdel, nd, 8, size)) ||
+        (ep->cell && TTBspan(ep->cell, ncell, sizeof(int), size)) ||
+        (ep->patch && TTBspan(ep->patch, ep->npatch,
+                              8 * 16 * (3 + (ep->isbounce != 0)), size)))
+        return 1;
 /*
- *  read etopo file
+ *  patch indices (-1 if the cell has no patch)
  */
-    n = EtopoNlat * EtopoNlon;
-    if ((m = fread(topo[0], sizeof(short int), n, fp)) != n) {
-        fprintf(stderr, "Corrupted %s!\n", filename);
-        fclose(fp);
-        FreeShortMatrix(topo);
-        return (short int **)NULL;
+    if (ep->cell) {
+        cell = (int *)(map + ep->cell);
+        for (i = 0; i < ncell; i++)
+            if (cell[i] < -1 || cell[i] >= (ep->patch ? ep->npatch : 0))
+                return 1;
     }
-    fclose(fp);
-    return topo;
+    return 0;
 }
 
 /*
  *  Title:
- *      GetEtopoElevation
+ *     TTBspan
  *  Synopsis:
- *      Returns ETOPO1 topography in kilometers for a lat, lon pair.
- *  ETOPO parameters are specified in config.txt file:
- *     EtopoFile - pathname for ETOPO file
- *     EtopoNlon - number of longitude samples in ETOPO
- *     EtopoNlat - number of latitude samples in ETOPO
- *     EtopoRes  - cellsize in ETOPO
+ *     Checks that an array of a binary TT file lies within the mapping.
  *  Input Arguments:
- *      lat, lon - latitude, longitude in degrees
- *      topo     - ETOPO bathymetry/elevation matrix
- *  Returns:
- *      elevation above sea level [km]
- *      topography above sea level is taken positive,
- *                 below sea level negative.
+ *     offset - byte offset of the array
+ *     n      - number of elements
+ *     width  - size of an element [bytes]
+ *     size   - size of the mapping [bytes]
+ *  Return:
+ *     0/1 if the array is inside/outside the mapping
  *  Called by:
- *     GetEtopoCorrection
+ *     TTBentryCheck
  */
-static double GetEtopoElevation(double lat, double lon, short int **topo)
+static int TTBspan(long long offset, long long n, long long width,
+        size_t size)
 {
-    int i, j, m, k1, k2;
-    double a1, a2, lat2, lon2, lat1, lon1;
-    double top, topo1, topo2, topo3, topo4;
-/*
- *  bounding box
- */
-    i = (int)((lon + 180.) / EtopoRes);
-    j = (int)((90. - lat) / EtopoRes);
-    lon1 = (double)(i) * EtopoRes - 180.;
-    lat1 = 90. - (double)(j) * EtopoRes;
-    lon2 = (double)(i + 1) * EtopoRes - 180.;
-    lat2 = 90. - (double)(j + 1) * EtopoRes;
-    k1 = i;
-    k2 = i + 1;
-    m = j;
-    a1 = (lon2 - lon) / (lon2 - lon1);
-    a2 = (lat2 - lat) / (lat2 - lat1);
-/*
- *  take care of grid boundaries
- */
-    if (i < 0 || i > EtopoNlon - 2) {
-        k1 = EtopoNlon - 1;
-        k2 = 0;
-    }
-    if (j < 0) {
-        m = 0;
-        a2 = 0.;
-    }
-    if (j > EtopoNlat - 2) {
-        m = EtopoNlat - 2;
-        a2 = 1.;
-    }
-/*
- *  interpolate
- */
-    topo1 = (double)topo[m][k1];
-    topo2 = (double)topo[m+1][k1];
-    topo3 = (double)topo[m][k2];
-    topo4 = (double)topo[m+1][k2];
-    top = (1. - a1) * (1. - a2) * topo1 + a1 * (1. - a2) * topo3 +
-          (1. - a1) * a2 * topo2 + a1 * a2 * topo4;
-    return top / 1000.;
+    if (offset < (long long)sizeof(TTB_HEADER) || offset % 8 ||
+        offset > (long long)size || n < 0)
+        return 1;
+    if (n > ((long long)size - offset) / width)
+        return 1;
+    return 0;
 }
 
 /*
  *  Title:
- *     GetPhaseIndex
+ *     TTBchecksum
  *  Synopsis:
- *	   Returns index of tt_table struct array for a given phase
+ *     FNV-1a hash of a buffer of 8-byte words.
  *  Input Arguments:
- *     phase - phase
+ *     buf  - 8-byte aligned buffer
+ *     len  - length of buffer [bytes], multiple of 8
+ *     hash - hash of the preceding buffers or 0 for the first one
  *  Return:
- *     phase index or -1 on error
+ *     hash
  *  Called by:
- *     GetTravelTimePrediction, DepthPhaseStack
+ *     MapTTbinary, TTBwrite, GenerateLocalTTtables
  */
-int GetPhaseIndex(char *phase)
+unsigned long long TTBchecksum(char *buf, size_t len,
+        unsigned long long hash)
 {
-    int i;
-    for (i = 0; i < numPhaseTT; i++) {
-        if (streq(phase, PhaseTT[i])) return i;
+    unsigned long long *w = (unsigned long long *)buf;
+    size_t i, n = len / 8;
+    if (hash == 0) hash = 14695981039346656037ULL;
+    for (i = 0; i < n; i++) {
+        hash ^= w[i];
+        hash *= 1099511628211ULL;
     }
-    return -1;
+    return hash;
 }
 
 /*
  *  Title:
- *     GetLocalPhaseIndex
+ *     WriteTTbinary
  *  Synopsis:
- *	   Returns index of tt_table struct array for a given phase
+ *     Writes TT tables and their bicubic patches to a binary TT file.
+ *     The arrays of each table follow the header and the directory in the
+ *     order deltas, depths, tt, dtdd, dtdh, [bpdel], cell, patch; each one
+ *     starts at an 8-byte boundary. Tables with no samples are listed in
+ *     the directory with ndel = 0.
+ *     The file is written under a temporary name and renamed, so a run
+ *     mapping the file never sees a partial file, and a failed write
+ *     leaves an existing file intact.
  *  Input Arguments:
- *     phase - phase
+ *     fname     - pathname of binary TT file
+ *     model     - TT model name
+ *     tt_tables - TT table structures with bicubic patches
+ *     ntab      - number of TT tables
  *  Return:
- *     phase index or -1 on error
+ *     0/1 on success/error
  *  Called by:
- *     GetTravelTimePrediction, DepthPhaseStack
+ *     iLocTTcompile, GenerateLocalTTtables
+ *  Calls:
+ *     TTBwrite, TTBchecksum
  */
-int GetLocalPhaseIndex(char *phase)
+int WriteTTbinary(char *fname, char *model, TT_TABLE *tt_tables, int ntab)
 {
-    int i;
-    for (i = 0; i < numLocalPhaseTT; i++) {
-        if (streq(phase, LocalPhaseTT[i])) return i;
+    FILE *fp;
+    TTB_HEADER hdr;
+    TTB_ENTRY *ep = (TTB_ENTRY *)NULL;
+    TT_TABLE *tp;
+    char tmpname[FILENAMELEN + 80];
+    unsigned long long hash = 0;
+    long long offset = 0, n = 0;
+    int k, i, ret = 0, nd = 0, ncell = 0;
+    if ((ep = (TTB_ENTRY *)calloc(ntab, sizeof(TTB_ENTRY))) == NULL) {
+        fprintf(logfp, "WriteTTbinary: cannot allocate memory\n");
+        fprintf(errfp, "WriteTTbinary: cannot allocate memory\n");
+        return 1;
+    }
+/*
+ *  directory
+ */
+    offset = sizeof(TTB_HEADER) + ntab * sizeof(TTB_ENTRY);
+    for (k = 0; k < ntab; k++) {
+        tp = &tt_tables[k];
+        strcpy(ep[k].phase, tp->phase);
+        ep[k].isbounce = tp->isbounce;
+        if (tp->ndel == 0) continue;
+        ep[k].ndel = tp->ndel;
+        ep[k].ndep = tp->ndep;
+        ep[k].npatch = tp->npatch;
+        nd = tp->ndel * tp->ndep;
+        ep[k].deltas = offset;  offset += 8 * tp->ndel;
+        ep[k].depths = offset;  offset += 8 * tp->ndep;
+        ep[k].tt = offset;      offset += 8 * nd;
+        ep[k].dtdd = offset;    offset += 8 * nd;
+        ep[k].dtdh = offset;    offset += 8 * nd;
+        if (tp->isbounce) {
+            ep[k].bpdel = offset;
+            offset += 8 * nd;
+        }
+        if (tp->cell) {
+            ncell = (tp->ndel - 1) * (tp->ndep - 1);
+            ep[k].cell = offset;
+            offset += 8 * ((ncell * sizeof(int) + 7) / 8);
+        }
+        if (tp->patch) {
+            ep[k].patch = offset;
+            offset += 8 * tp->npatch * 16 * (3 + tp->isbounce);
+        }
+    }
+    memset(&hdr, 0, sizeof(TTB_HEADER));
+    strcpy(hdr.magic, TTB_MAGIC);
+    hdr.version = TTB_VERSION;
+    hdr.byteorder = TTB_BYTEORDER;
+    hdr.nphase = ntab;
+    hdr.entrysize = sizeof(TTB_ENTRY);
+    strncpy(hdr.model, model, 23);
+    hdr.size = offset;
+    sprintf(tmpname, "%s.%d.%lu.tmp", fname, (int)getpid(),
+            (unsigned long)pthread_self());
+    if ((fp = fopen(tmpname, "wb")) == NULL) {
+        fprintf(logfp, "WriteTTbinary: cannot open %s\n", tmpname);
+        fprintf(errfp, "WriteTTbinary: cannot open %s\n", tmpname);
+        Free(ep);
+        return 1;
+    }
+/*
+ *  header (rewritten with the checksum at the end), directory and tables
+ */
+    ret = (fwrite(&hdr, sizeof(TTB_HEADER), 1, fp) != 1);
+    ret |= TTBwrite(fp, (char *)ep, ntab * sizeof(TTB_ENTRY), &hash);
+    for (k = 0; k < ntab && !ret; k++) {
+        tp = &tt_tables[k];
+        if (tp->ndel == 0) continue;
+        ret |= TTBwrite(fp, (char *)tp->deltas, 8 * tp->ndel, &hash);
+        ret |= TTBwrite(fp, (char *)tp->depths, 8 * tp->ndep, &hash);
+        for (i = 0; i < tp->ndel; i++)
+            ret |= TTBwrite(fp, (char *)tp->tt[i], 8 * tp->ndep, &hash);
+        for (i = 0; i < tp->ndel; i++)
+            ret |= TTBwrite(fp, (char *)tp->dtdd[i], 8 * tp->ndep, &hash);
+        for (i = 0; i < tp->ndel; i++)
+            ret |= TTBwrite(fp, (char *)tp->dtdh[i], 8 * tp->ndep, &hash);
+        if (tp->isbounce) {
+            for (i = 0; i < tp->ndel; i++)
+                ret |= TTBwrite(fp, (char *)tp->bpdel[i], 8 * tp->ndep,
+                                &hash);
+        }
+        if (tp->cell) {
+            ncell = (tp->ndel - 1) * (tp->ndep - 1);
+            ret |= TTBwrite(fp, (char *)tp->cell, ncell * sizeof(int), &hash);
+        }
+        if (tp->patch) {
+            n = 8 * tp->npatch * 16 * (3 + tp->isbounce);
+            ret |= TTBwrite(fp, (char *)tp->patch, n, &hash);
+        }
+    }
+    hdr.checksum = hash;
+    if (!ret) {
+        rewind(fp);
+        ret = (fwrite(&hdr, sizeof(TTB_HEADER), 1, fp) != 1);
+    }
+    Free(ep);
+    if (fclose(fp) || ret || rename(tmpname, fname)) {
+        fprintf(logfp, "WriteTTbinary: cannot write %s\n", fname);
+        fprintf(errfp, "WriteTTbinary: cannot write %s\n", fname);
+        remove(tmpname);
+        return 1;
     }
-    if (streq(phase, "Lg")) return 22;
-    return -1;
+    return 0;
 }
 
 /*
  *  Title:
- *     GetTravelTimeTableValue
+ *     TTBwrite
  *  Synopsis:
- *	   Returns TT table values for a given phase, depth and delta.
- *     Bicubic spline interpolation is used to get interpolated values.
- *     Horizontal and vertical slownesses are calculated if requested.
- *     Horizontal and vertical second time derivatives, needed for defining
- *         slownesses, are calculated if requested.
- *     Bounce point distance is calculated for depth phases.
+ *     Writes a buffer to a binary TT file, zero-padded to a multiple of 8
+ *     bytes, and updates the checksum.
  *  Input Arguments:
- *     tt_tablep - TT table structure for phase
- *     depth     - depth
- *     delta     - delta
- *     iszderiv  - do we need dtdh [0/1]?
- *     is2nderiv - do we need d2tdd and d2tdh [0/1]?
+ *     fp   - file pointer
+ *     buf  - buffer
+ *     len  - length of buffer [bytes]
+ *     hash - checksum so far
  *  Output Arguments:
- *     dtdd  - interpolated dtdd (horizontal slowness, s/deg)
- *     dtdh  - interpolated dtdh (vertical slowness, s/km)
+ *     hash - updated checksum
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     WriteTTbinary
+ *  Calls:
+ *     TTBchecksum
+ */
+static int TTBwrite(FILE *fp, char *buf, size_t len, unsigned long long *hash)
+{
+    char pad[8];
+    size_t n = len - len % 8;
+    if (n) {
+        if (fwrite(buf, 1, n, fp) != n) return 1;
+        *hash = TTBchecksum(buf, n, *hash);
+    }
+    if (len % 8) {
+        memset(pad, 0, 8);
+        memcpy(pad, buf + n, len % 8);
+        if (fwrite(pad, 1, 8, fp) != 8) return 1;
+        *hash = TTBchecksum(pad, 8, *hash);
+    }
+    return 0;
+}
+
+/*
+ *  Title:
+ *     FreeTTtables
+ *  Synopsis:
+ *     Frees memory allocated to TT_TABLE structure
+ *  Input Arguments:
+ *     tt_tables - TT table structure
+ *  Called by:
+ *     ReadAuxDataFiles, ReadTTtables, main
+ *  Calls:
+ *     FreeFloatMatrix, FreeRunIndex, Free
+ */
+void FreeTTtables(TT_TABLE *tt_tables)
+{
+    int i, ndists = 0;
+/*
+ *  tables mapped from a binary TT file: only the row pointers are allocated
+ */
+    if (numPhaseTT && tt_tables[0].map) {
+        for (i = 0; i < numPhaseTT; i++) {
+            FreeRunIndex(tt_tables[i].delidx);
+            FreeRunIndex(tt_tables[i].depidx);
+            Free(tt_tables[i].dtdh);
+            Free(tt_tables[i].dtdd);
+            Free(tt_tables[i].tt);
+            Free(tt_tables[i].bpdel);
+        }
+        munmap(tt_tables[0].map, tt_tables[0].mapsize);
+        Free(tt_tables);
+        return;
+    }
+    for (i = 0; i < numPhaseTT; i++) {
+        if ((ndists = tt_tables[i].ndel) == 0) continue;
+        FreeRunIndex(tt_tables[i].delidx);
+        FreeRunIndex(tt_tables[i].depidx);
+        FreeFloatMatrix(tt_tables[i].dtdh);
+        FreeFloatMatrix(tt_tables[i].dtdd);
+        FreeFloatMatrix(tt_tables[i].tt);
+        if (PhaseTT[i][0] == 'p' || PhaseTT[i][0] == 's')
+            FreeFloatMatrix(tt_tables[i].bpdel);
+        Free(tt_tables[i].cell);
+        Free(tt_tables[i].patch);
+        Free(tt_tables[i].depths);
+        Free(tt_tables[i].deltas);
+    }
+    Free(tt_tables);
+}
+
+/*
+ *  Title:
+ *     FreeLocalTTtables
+ *  Synopsis:
+ *     Frees memory allocated to local TT_TABLE structure
+ *  Input Arguments:
+ *     tt_tables - TT table structure
+ *  Called by:
+ *     ReadAuxDataFiles, ReadTTtables, main
+ *  Calls:
+ *     FreeFloatMatrix, FreeRunIndex
+ */
+void FreeLocalTTtables(TT_TABLE *tt_tables)
+{
+    int i, ndists = 0;
+/*
+ *  tables mapped from the local TT cache: only the row pointers are allocated
+ */
+    if (numLocalPhaseTT && tt_tables[0].map) {
+        for (i = 0; i < numLocalPhaseTT; i++) {
+            FreeRunIndex(tt_tables[i].delidx);
+            FreeRunIndex(tt_tables[i].depidx);
+            Free(tt_tables[i].dtdh);
+            Free(tt_tables[i].dtdd);
+            Free(tt_tables[i].tt);
+            Free(tt_tables[i].bpdel);
+        }
+        munmap(tt_tables[0].map, tt_tables[0].mapsize);
+        Free(tt_tables);
+        return;
+    }
+    for (i = 0; i < numLocalPhaseTT; i++) {
+        if ((ndists = tt_tables[i].ndel) == 0) continue;
+        FreeRunIndex(tt_tables[i].delidx);
+        FreeRunIndex(tt_tables[i].depidx);
+        FreeFloatMatrix(tt_tables[i].dtdh);
+        FreeFloatMatrix(tt_tables[i].dtdd);
+        FreeFloatMatrix(tt_tables[i].tt);
+        if (tt_tables[i].isbounce)
+            FreeFloatMatrix(tt_tables[i].bpdel);
+        Free(tt_tables[i].cell);
+        Free(tt_tables[i].patch);
+        Free(tt_tables[i].depths);
+        Free(tt_tables[i].deltas);
+    }
+    Free(tt_tables);
+}
+
+/*
+ *  Title:
+ *     GetPhaseIndex
+ *  Synopsis:
+ *	   Returns index of tt_table struct array for a given phase
+ *  Input Arguments:
+ *     phase - phase
+ *  Return:
+ *     phase index or -1 on error
+ *  Called by:
+ *     PredictTravelTime, GetTTtableIndex
+ *  Calls:
+ *     GetPhaseProperties
+ */
+int GetPhaseIndex(char *phase)
+{
+    PHASEPROP *pp = GetPhaseProperties(phase);
+    return (pp == NULL) ? -1 : pp->ttindex;
+}
+
+/*
+ *  Title:
+ *     GetTTtableIndex
+ *  Synopsis:
+ *	   Returns index of tt_table struct array for a given phase and makes
+ *     sure that the TT table of the phase is read.
+ *  Input Arguments:
+ *     tt_tables - pointer to travel-time tables
+ *     phase     - phase
+ *  Return:
+ *     phase index or -1 on error
+ *  Called by:
+ *     DepthPhaseStack
+ *  Calls:
+ *     GetPhaseIndex, LoadTTtable
+ */
+int GetTTtableIndex(TT_TABLE *tt_tables, char *phase)
+{
+    int pind = GetPhaseIndex(phase);
+    if (pind < 0 || LoadTTtable(&tt_tables[pind]))
+        return -1;
+    return pind;
+}
+
+/*
+ *  Title:
+ *     GetLocalPhaseIndex
+ *  Synopsis:
+ *	   Returns index of tt_table struct array for a given phase
+ *  Input Arguments:
+ *     phase - phase
+ *  Return:
+ *     phase index or -1 on error
+ *  Called by:
+ *     GetTravelTimePrediction, GenerateLocalTTtables
+ *  Calls:
+ *     GetPhaseProperties
+ */
+int GetLocalPhaseIndex(char *phase)
+{
+    PHASEPROP *pp = GetPhaseProperties(phase);
+    return (pp == NULL) ? -1 : pp->localttindex;
+}
+
+/*
+ *  Title:
+ *     TTtableValue
+ *  Synopsis:
+ *     Generic body of GetTravelTimeTableValue.
+ *     It is always inlined into the specialisations generated by
+ *     TT_TABLE_VALUE_VARIANT, so the compiler sees iszderiv, is2nderiv
+ *     and isdepthphase as constants and drops the branches on them.
+ *  Input Arguments:
+ *     tt_tablep    - TT table structure for phase
+ *     depth        - depth
+ *     delta        - delta
+ *     iszderiv     - do we need dtdh [0/1]?
+ *     is2nderiv    - do we need d2tdd and d2tdh [0/1]?
+ *     isdepthphase - is the table of a depth phase [0/1]?
+ *  Output Arguments:
+ *     dtdd  - interpolated dtdd (horizontal slowness, s/deg)
+ *     dtdh  - interpolated dtdh (vertical slowness, s/km)
  *     bpdel - bounce point distance (deg) if depth phase
  *     d2tdd - interpolated second horizontal time derivative
  *     d2tdh - interpolated second vertical time derivative
  *  Return:
  *     TT table value for a phase at depth and delta or -1. on error
  *  Called by:
- *     GetTravelTimePrediction
+ *     TTtableValue specialisations
  *  Calls:
- *     FloatBracket, SplineCoeffs, SplineInterpolation
+ *     TTtableBracket, SplineCoeffs, SplineInterpolation, BicubicValue,
+ *     TTsecondDeltaDerivative
  */
-double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
-              int iszderiv, double *dtdd, double *dtdh, double *bpdel,
-              int is2nderiv, double *d2tdd, double *d2tdh)
+ALWAYSINLINE double TTtableValue(TT_TABLE *tt_tablep, double depth,
+        double delta, int iszderiv, int is2nderiv, int isdepthphase,
+        double *dtdd, double *dtdh, double *bpdel, double *d2tdd,
+        double *d2tdh)
 {
     int i, j, k, m, ilo, ihi, jlo, jhi, idel, jdep, ndep, ndel;
-    int exactdelta = 0, exactdepth = 0, isdepthphase = 0;
-    double ttim = -1., dydx = 0., d2ydx = 0.;
+    int exactdelta = 0, exactdepth = 0, nq = 0;
+    double ttim = -1., dydx = 0., d2ydx = 0., u = 0., v = 0., hv = 0.;
+    double *c = (double *)NULL;
     double  x[DELTA_SAMPLES],  z[DEPTH_SAMPLES], d2y[DELTA_SAMPLES];
     double tx[DELTA_SAMPLES], tz[DEPTH_SAMPLES];
     double dx[DELTA_SAMPLES], dz[DEPTH_SAMPLES];
@@ -560,7 +1191,6 @@ double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
     double px[DELTA_SAMPLES], pz[DEPTH_SAMPLES], tmp[DELTA_SAMPLES];
     ndep = tt_tablep->ndep;
     ndel = tt_tablep->ndel;
-    isdepthphase = tt_tablep->isbounce;
     *bpdel = 0.;
     *dtdd  = 0.;
     *dtdh  = 0.;
@@ -579,89 +1209,10 @@ double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
         return ttim;
     }
 /*
- *  delta range
+ *  delta and depth range
  */
-    FloatBracket(delta, ndel, tt_tablep->deltas, &ilo, &ihi);
-    if (fabs(delta - tt_tablep->deltas[ilo]) < DEPSILON) {
-        idel = ilo;
-        if (ilo > 0) ilo--;
-        ihi = ilo + DELTA_SAMPLES;
-        if (ihi > ndel - 1) {
-            ihi = ndel;
-            ilo = ihi - DELTA_SAMPLES;
-        }
-        exactdelta = 1;
-    }
-    else if (fabs(delta - tt_tablep->deltas[ihi]) < DEPSILON) {
-        idel = ihi;
-        if (ihi <= ndel - 1) ihi++;
-        ilo = ihi - DELTA_SAMPLES;
-        if (ilo < 0) {
-            ilo = 0;
-            ihi = ilo + DELTA_SAMPLES;
-        }
-        exactdelta = 1;
-    }
-    else if (ndel <= DELTA_SAMPLES) {
-        ilo = 0;
-        ihi = ndel;
-        idel = ilo;
-    }
-    else {
-        idel = ilo;
-        ilo = idel - DELTA_SAMPLES / 2 + 1;
-        ihi = idel + DELTA_SAMPLES / 2 + 1;
-        if (ilo < 0) {
-            ilo = 0;
-            ihi = ilo + DELTA_SAMPLES;
-        }
-        if (ihi > ndel - 1) {
-            ihi = ndel;
-            ilo = ihi - DELTA_SAMPLES;
-        }
-    }
-/*
- *  depth range
- */
-    FloatBracket(depth, ndep, tt_tablep->depths, &jlo, &jhi);
-    if (fabs(depth - tt_tablep->depths[jlo]) < DEPSILON) {
-        jdep = jlo;
-        if (jlo > 0) jlo--;
-        jhi = jlo + DEPTH_SAMPLES;
-        if (jhi > ndep - 1) {
-            jhi = ndep;
-            jlo = jhi - DEPTH_SAMPLES;
-        }
-        exactdepth = 1;
-    }
-    else if (fabs(depth - tt_tablep->depths[jhi]) < DEPSILON) {
-        jdep = jhi;
-        if (jhi <= ndep - 1) jhi++;
-        jlo = jhi - DEPTH_SAMPLES;
-        if (jlo < 0) {
-            jlo = 0;
-            jhi = jlo + DEPTH_SAMPLES;
-        }
-        exactdepth = 1;
-    }
-    else if (ndep <= DEPTH_SAMPLES) {
-        jlo = 0;
-        jhi = ndep;
-        jdep = jlo;
-    }
-    else {
-        jdep = jlo;
-        jlo = jdep - DEPTH_SAMPLES / 2 + 1;
-        jhi = jdep + DEPTH_SAMPLES / 2 + 1;
-        if (jlo < 0) {
-            jlo = 0;
-            jhi = jlo + DEPTH_SAMPLES;
-        }
-        if (jhi > ndep - 1) {
-            jhi = ndep;
-            jlo = jhi - DEPTH_SAMPLES;
-        }
-    }
+    TTtableBracket(tt_tablep, depth, delta, &idel, &jdep, &ilo, &ihi,
+                   &jlo, &jhi, &exactdelta, &exactdepth);
     if (exactdelta && exactdepth) {
         if (is2nderiv == 0) {
             ttim  = tt_tablep->tt[idel][jdep];
@@ -671,6 +1222,37 @@ double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
             return ttim;
         }
     }
+/*
+ *  inside a cell or on its lower depth node: evaluate its bicubic patch;
+ *  the depth window is the same as that of the cell, and the splines
+ *  interpolate the nodes, so the patch gives the same value
+ */
+    if (tt_tablep->cell && !exactdelta && exactdepth < 2 &&
+        jdep < ndep - 1) {
+        if ((k = tt_tablep->cell[idel * (ndep - 1) + jdep]) < 0)
+            return ttim;
+        nq = 3 + isdepthphase;
+        c = tt_tablep->patch + k * 16 * nq;
+        u = (delta - tt_tablep->deltas[idel]) /
+            (tt_tablep->deltas[idel+1] - tt_tablep->deltas[idel]);
+        hv = tt_tablep->depths[jdep+1] - tt_tablep->depths[jdep];
+        v = (depth - tt_tablep->depths[jdep]) / hv;
+        ttim = BicubicValue(c, u, v);
+        *dtdd = BicubicValue(c + 16, u, v);
+        if (iszderiv)     *dtdh = BicubicValue(c + 32, u, v);
+        if (isdepthphase) *bpdel = BicubicValue(c + 48, u, v);
+        if (is2nderiv) {
+/*
+ *          second derivative of the depth cubics
+ */
+            for (d2ydx = 0., i = 3; i >= 0; i--)
+                d2ydx = d2ydx * u + 6. * c[4*i+3] * v + 2. * c[4*i+2];
+            *d2tdh = d2ydx / (hv * hv);
+            *d2tdd = TTsecondDeltaDerivative(tt_tablep, delta,
+                                             ilo, ihi, jlo, jhi);
+        }
+        return ttim;
+    }
 /*
  *  bicubic spline interpolation
  */
@@ -744,39 +1326,526 @@ double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
         SplineCoeffs(k, z, hz, d2y, tmp);
         *dtdh = SplineInterpolation(depth, k, z, hz, d2y, 0, &dydx, &d2ydx);
     }
-   if (is2nderiv) {
+    if (is2nderiv)
+        *d2tdd = TTsecondDeltaDerivative(tt_tablep, delta,
+                                         ilo, ihi, jlo, jhi);
+    return ttim;
+}
+
+/*
+ *  Specialisations of TTtableValue for each combination of iszderiv,
+ *  is2nderiv and isdepthphase, indexed by iszderiv << 2 | is2nderiv << 1 |
+ *  isdepthphase
+ */
+#define TT_TABLE_VALUE_VARIANT(z, d, b)                                     \
+static double TTtableValue##z##d##b(TT_TABLE *tt_tablep, double depth,     \
+        double delta, double *dtdd, double *dtdh, double *bpdel,           \
+        double *d2tdd, double *d2tdh)                                      \
+{                                                                          \
+    return TTtableValue(tt_tablep, depth, delta, z, d, b,                  \
+                        dtdd, dtdh, bpdel, d2tdd, d2tdh);                  \
+}
+TT_TABLE_VALUE_VARIANT(0, 0, 0)
+TT_TABLE_VALUE_VARIANT(0, 0, 1)
+TT_TABLE_VALUE_VARIANT(0, 1, 0)
+TT_TABLE_VALUE_VARIANT(0, 1, 1)
+TT_TABLE_VALUE_VARIANT(1, 0, 0)
+TT_TABLE_VALUE_VARIANT(1, 0, 1)
+TT_TABLE_VALUE_VARIANT(1, 1, 0)
+TT_TABLE_VALUE_VARIANT(1, 1, 1)
+#undef TT_TABLE_VALUE_VARIANT
+
+static double (*const TTtableValueVariant[8])(TT_TABLE *, double, double,
+        double *, double *, double *, double *, double *) = {
+    TTtableValue000, TTtableValue001, TTtableValue010, TTtableValue011,
+    TTtableValue100, TTtableValue101, TTtableValue110, TTtableValue111
+};
+
+/*
+ *  Title:
+ *     GetTravelTimeTableValue
+ *  Synopsis:
+ *	   Returns TT table values for a given phase, depth and delta.
+ *     Bicubic spline interpolation is used to get interpolated values.
+ *     Inside a (delta, depth) cell the interpolant is a bicubic polynomial
+ *     precomputed by BicubicTTpatches; the splines are only evaluated on
+ *     the fly at the table nodes or if the table has no patches.
+ *     The work is done by the specialisation of TTtableValue for the
+ *     given iszderiv, is2nderiv and depth phase flag.
+ *     Horizontal and vertical slownesses are calculated if requested.
+ *     Horizontal and vertical second time derivatives, needed for defining
+ *         slownesses, are calculated if requested.
+ *     Bounce point distance is calculated for depth phases.
+ *  Input Arguments:
+ *     tt_tablep - TT table structure for phase
+ *     depth     - depth
+ *     delta     - delta
+ *     iszderiv  - do we need dtdh [0/1]?
+ *     is2nderiv - do we need d2tdd and d2tdh [0/1]?
+ *  Output Arguments:
+ *     dtdd  - interpolated dtdd (horizontal slowness, s/deg)
+ *     dtdh  - interpolated dtdh (vertical slowness, s/km)
+ *     bpdel - bounce point distance (deg) if depth phase
+ *     d2tdd - interpolated second horizontal time derivative
+ *     d2tdh - interpolated second vertical time derivative
+ *  Return:
+ *     TT table value for a phase at depth and delta or -1. on error
+ *  Called by:
+ *     GetTravelTimePrediction
+ *  Calls:
+ *     TTtableValue specialisations
+ */
+double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
+              int iszderiv, double *dtdd, double *dtdh, double *bpdel,
+              int is2nderiv, double *d2tdd, double *d2tdh)
+{
+    int k = (iszderiv != 0) << 2 | (is2nderiv != 0) << 1 |
+            (tt_tablep->isbounce != 0);
+    return TTtableValueVariant[k](tt_tablep, depth, delta,
+                                  dtdd, dtdh, bpdel, d2tdd, d2tdh);
+}
+
+/*
+ *  Title:
+ *     TTtableBracket
+ *  Synopsis:
+ *     Finds the table cell of depth and delta and the sample windows of the
+ *     spline interpolation around it. Depth and delta must be within the
+ *     table.
+ *  Input Arguments:
+ *     tt_tablep - TT table structure for phase
+ *     depth     - depth
+ *     delta     - delta
+ *  Output Arguments:
+ *     idel       - delta index of the cell or of the matching node
+ *     jdep       - depth index of the cell or of the matching node
+ *     ilo, ihi   - delta sample window
+ *     jlo, jhi   - depth sample window
+ *     exactdelta - 1 if delta is at a node, 0 otherwise
+ *     exactdepth - 1/2 if depth is at the lower/upper node of its
+ *                  bracket, 0 otherwise
+ *  Called by:
+ *     GetTravelTimeTableValue
+ *  Calls:
+ *     RunBracket, TTsampleWindow
+ */
+static void TTtableBracket(TT_TABLE *tt_tablep, double depth, double delta,
+        int *idel, int *jdep, int *ilo, int *ihi, int *jlo, int *jhi,
+        int *exactdelta, int *exactdepth)
+{
+    int ndel = tt_tablep->ndel, ndep = tt_tablep->ndep;
+    *exactdelta = *exactdepth = 0;
+/*
+ *  delta range
+ */
+    RunBracket(tt_tablep->delidx, delta, ndel, tt_tablep->deltas, ilo, ihi);
+    if (fabs(delta - tt_tablep->deltas[*ilo]) < DEPSILON) {
+        *idel = *ilo;
+        if (*ilo > 0) (*ilo)--;
+        *ihi = *ilo + DELTA_SAMPLES;
+        if (*ihi > ndel - 1) {
+            *ihi = ndel;
+            *ilo = *ihi - DELTA_SAMPLES;
+        }
+        *exactdelta = 1;
+    }
+    else if (fabs(delta - tt_tablep->deltas[*ihi]) < DEPSILON) {
+        *idel = *ihi;
+        if (*ihi <= ndel - 1) (*ihi)++;
+        *ilo = *ihi - DELTA_SAMPLES;
+        if (*ilo < 0) {
+            *ilo = 0;
+            *ihi = *ilo + DELTA_SAMPLES;
+        }
+        *exactdelta = 1;
+    }
+    else {
+        *idel = *ilo;
+        TTsampleWindow(ndel, DELTA_SAMPLES, *idel, ilo, ihi);
+    }
+/*
+ *  depth range
+ */
+    RunBracket(tt_tablep->depidx, depth, ndep, tt_tablep->depths, jlo, jhi);
+    if (fabs(depth - tt_tablep->depths[*jlo]) < DEPSILON) {
+        *jdep = *jlo;
+        if (*jlo > 0) (*jlo)--;
+        *jhi = *jlo + DEPTH_SAMPLES;
+        if (*jhi > ndep - 1) {
+            *jhi = ndep;
+            *jlo = *jhi - DEPTH_SAMPLES;
+        }
+        *exactdepth = 1;
+    }
+    else if (fabs(depth - tt_tablep->depths[*jhi]) < DEPSILON) {
+        *jdep = *jhi;
+        if (*jhi <= ndep - 1) (*jhi)++;
+        *jlo = *jhi - DEPTH_SAMPLES;
+        if (*jlo < 0) {
+            *jlo = 0;
+            *jhi = *jlo + DEPTH_SAMPLES;
+        }
+        *exactdepth = 2;
+    }
+    else {
+        *jdep = *jlo;
+        TTsampleWindow(ndep, DEPTH_SAMPLES, *jdep, jlo, jhi);
+    }
+}
+
 /*
- *      get d2t/dd2 from the transpose t matrix
+ *  Title:
+ *     TTsecondDeltaDerivative
+ *  Synopsis:
+ *     Returns d2t/dd2 from the transpose of the dtdd table: the rows of
+ *     the window are interpolated first, then the delta spline of the row
+ *     values is differentiated.
+ *  Input Arguments:
+ *     tt_tablep - TT table structure for phase
+ *     delta     - delta
+ *     ilo, ihi  - delta sample window
+ *     jlo, jhi  - depth sample window
+ *  Return:
+ *     d2tdd or 0 if it cannot be calculated
+ *  Called by:
+ *     GetTravelTimeTableValue
+ *  Calls:
+ *     SplineCoeffs, SplineInterpolation
  */
-        for (k = 0, i = ilo; i < ihi; i++) {
-            for (m = 0, j = jlo; j < jhi; j++) {
-                if (tt_tablep->tt[i][j] < 0)
-                    continue;
-                z[m] = tt_tablep->depths[j];
-                dz[m] = tt_tablep->dtdd[i][j];
-                m++;
-            }
-            if (m < MIN_SAMPLES)
+static double TTsecondDeltaDerivative(TT_TABLE *tt_tablep, double delta,
+                                      int ilo, int ihi, int jlo, int jhi)
+{
+    int i, j, k, m;
+    double dydx = 0., d2ydx = 0.;
+    double x[DELTA_SAMPLES], dx[DELTA_SAMPLES], d2y[DELTA_SAMPLES];
+    double z[DEPTH_SAMPLES], dz[DEPTH_SAMPLES], tmp[DELTA_SAMPLES];
+/*
+ *  get d2t/dd2 from the transpose t matrix
+ */
+    for (k = 0, i = ilo; i < ihi; i++) {
+        for (m = 0, j = jlo; j < jhi; j++) {
+            if (tt_tablep->tt[i][j] < 0)
                 continue;
+            z[m] = tt_tablep->depths[j];
+            dz[m] = tt_tablep->dtdd[i][j];
+            m++;
+        }
+        if (m < MIN_SAMPLES)
+            continue;
 /*
- *          spline interpolation in depth
+ *      spline interpolation in depth
  */
-            x[k] = tt_tablep->deltas[i];
-            SplineCoeffs(m, z, dz, d2y, tmp);
-            dx[k] = SplineInterpolation(delta, m, z, dz, d2y, 0, &dydx, &d2ydx);
-            k++;
+        x[k] = tt_tablep->deltas[i];
+        SplineCoeffs(m, z, dz, d2y, tmp);
+        dx[k] = SplineInterpolation(delta, m, z, dz, d2y, 0, &dydx, &d2ydx);
+        k++;
+    }
+    if (k < MIN_SAMPLES) return 0.;
+/*
+ *  Spline interpolation in delta
+ */
+    SplineCoeffs(k, x, dx, d2y, tmp);
+    SplineInterpolation(delta, k, x, dx, d2y, 1, &dydx, &d2ydx);
+    if (dydx > -999.)
+        return dydx;
+    return 0.;
+}
+
+/*
+ *  Title:
+ *     TTsampleWindow
+ *  Synopsis:
+ *     Returns the window of at most nsamp table samples used by the
+ *     spline interpolation between samples i and i + 1.
+ *  Input Arguments:
+ *     n     - number of samples
+ *     nsamp - max number of samples in the window
+ *     i     - index of the sample below the point
+ *  Output Arguments:
+ *     lo    - first sample of the window
+ *     hi    - last sample of the window + 1
+ *  Called by:
+ *     GetTravelTimeTableValue, BicubicTTpatches, TTdeltaCubics, TTdepthPatch
+ */
+static void TTsampleWindow(int n, int nsamp, int i, int *lo, int *hi)
+{
+    if (n <= nsamp) {
+        *lo = 0;
+        *hi = n;
+        return;
+    }
+    *lo = i - nsamp / 2 + 1;
+    *hi = i + nsamp / 2 + 1;
+    if (*lo < 0) {
+        *lo = 0;
+        *hi = *lo + nsamp;
+    }
+    if (*hi > n - 1) {
+        *hi = n;
+        *lo = *hi - nsamp;
+    }
+}
+
+/*
+ *  Title:
+ *     BicubicTTpatches
+ *  Synopsis:
+ *     Precomputes the bicubic patches of a TT table.
+ *     Between the table nodes GetTravelTimeTableValue interpolates with
+ *     natural splines in delta over a window of DELTA_SAMPLES samples,
+ *     followed by natural splines in depth over DEPTH_SAMPLES samples.
+ *     The windows and the spline pieces only depend on the cell, so the
+ *     interpolant is a bicubic polynomial inside each cell. Its
+ *     coefficients are stored for the cells with enough valid samples;
+ *     cells without a patch have no TT prediction.
+ *  Input Arguments:
+ *     tt_tablep - TT table structure for phase
+ *  Output Arguments:
+ *     tt_tablep - TT table structure with cell and patch set
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     ReadTTtables
+ *  Calls:
+ *     TTdeltaCubics, TTdepthPatch, TTsampleWindow
+ */
+int BicubicTTpatches(TT_TABLE *tt_tablep)
+{
+    int i, j, k, n, m, jlo, jhi, ndel, ndep, nq;
+    int *uvalid = (int *)NULL;
+    double *ucol = (double *)NULL;
+    ndel = tt_tablep->ndel;
+    ndep = tt_tablep->ndep;
+    if (ndel < 2 || ndep < 2)
+        return 0;
+    nq = 3 + tt_tablep->isbounce;
+    tt_tablep->cell = (int *)calloc((ndel - 1) * (ndep - 1), sizeof(int));
+    uvalid = (int *)calloc(ndep, sizeof(int));
+    if ((ucol = (double *)calloc(ndep * 16, sizeof(double))) == NULL ||
+        uvalid == NULL || tt_tablep->cell == NULL) {
+        fprintf(logfp, "BicubicTTpatches: cannot allocate memory\n");
+        fprintf(errfp, "BicubicTTpatches: cannot allocate memory\n");
+        Free(tt_tablep->cell);
+        tt_tablep->cell = (int *)NULL;
+        Free(uvalid); Free(ucol);
+        return 1;
+    }
+/*
+ *  cells with enough valid depth columns
+ */
+    for (n = 0, k = 0, i = 0; i < ndel - 1; i++) {
+        TTdeltaCubics(tt_tablep, i, (double *)NULL, uvalid);
+        for (j = 0; j < ndep - 1; j++, k++) {
+            TTsampleWindow(ndep, DEPTH_SAMPLES, j, &jlo, &jhi);
+            for (m = 0; jlo < jhi; jlo++)
+                m += uvalid[jlo];
+            tt_tablep->cell[k] = (m < MIN_SAMPLES) ? -1 : n++;
+        }
+    }
+    tt_tablep->npatch = n;
+    if (n) tt_tablep->patch = (double *)calloc(n * 16 * nq, sizeof(double));
+    if (n && tt_tablep->patch == NULL) {
+        fprintf(logfp, "BicubicTTpatches: cannot allocate memory\n");
+        fprintf(errfp, "BicubicTTpatches: cannot allocate memory\n");
+        Free(tt_tablep->cell);
+        tt_tablep->cell = (int *)NULL;
+        Free(uvalid); Free(ucol);
+        return 1;
+    }
+/*
+ *  patch coefficients
+ */
+    for (k = 0, i = 0; n && i < ndel - 1; i++) {
+        TTdeltaCubics(tt_tablep, i, ucol, uvalid);
+        for (j = 0; j < ndep - 1; j++, k++) {
+            if ((m = tt_tablep->cell[k]) >= 0)
+                TTdepthPatch(tt_tablep, j, ucol, uvalid,
+                             tt_tablep->patch + m * 16 * nq);
         }
-        if (k == 0) return ttim;
-        if (k < MIN_SAMPLES) return ttim;
+    }
+    Free(uvalid); Free(ucol);
+    return 0;
+}
+
 /*
- *      Spline interpolation in delta
+ *  Title:
+ *     TTdeltaCubics
+ *  Synopsis:
+ *     Calculates the delta splines of every depth column over the delta
+ *     window of the cells [i, i + 1]. Each spline is sampled at four points
+ *     of the cell and converted to a cubic in the normalized delta u.
+ *  Input Arguments:
+ *     tt_tablep - TT table structure for phase
+ *     i         - delta index of the cells
+ *  Output Arguments:
+ *     ucol      - u-cubics of tt, dtdd, dtdh [and bpdel] of each column,
+ *                 ucol[16 * j + 4 * q + a]; if NULL, only uvalid is set
+ *     uvalid    - 1 if column j has enough valid samples, 0 otherwise
+ *  Called by:
+ *     BicubicTTpatches
+ *  Calls:
+ *     TTsampleWindow, FloatBracket, SplineCoeffs, SplinePiece,
+ *     CubicPowerCoeffs
+ */
+static void TTdeltaCubics(TT_TABLE *tt_tablep, int i, double *ucol,
+                          int *uvalid)
+{
+    int ilo, ihi, ii, j, m, n, q, a, klo, khi, nq;
+    int idx[DELTA_SAMPLES];
+    double x[DELTA_SAMPLES], y[DELTA_SAMPLES], d2y[DELTA_SAMPLES];
+    double tmp[DELTA_SAMPLES], f[4];
+    double del0, hdel;
+    double **tab[4];
+    tab[0] = tt_tablep->tt;
+    tab[1] = tt_tablep->dtdd;
+    tab[2] = tt_tablep->dtdh;
+    tab[3] = tt_tablep->bpdel;
+    nq = 3 + tt_tablep->isbounce;
+    del0 = tt_tablep->deltas[i];
+    hdel = tt_tablep->deltas[i+1] - del0;
+    TTsampleWindow(tt_tablep->ndel, DELTA_SAMPLES, i, &ilo, &ihi);
+    for (j = 0; j < tt_tablep->ndep; j++) {
+        for (m = 0, ii = ilo; ii < ihi; ii++) {
+            if (tt_tablep->tt[ii][j] < 0) continue;
+            x[m] = tt_tablep->deltas[ii];
+            idx[m++] = ii;
+        }
+        uvalid[j] = (m < MIN_SAMPLES) ? 0 : 1;
+        if (ucol == NULL || uvalid[j] == 0) continue;
+        FloatBracket(del0 + 0.5 * hdel, m, x, &klo, &khi);
+        for (q = 0; q < nq; q++) {
+            for (n = 0; n < m; n++)
+                y[n] = tab[q][idx[n]][j];
+            SplineCoeffs(m, x, y, d2y, tmp);
+            for (a = 0; a < 4; a++)
+                f[a] = SplinePiece(del0 + a * hdel / 3., x, y, d2y, klo, khi);
+            CubicPowerCoeffs(f, ucol + 16 * j + 4 * q);
+        }
+    }
+}
+
+/*
+ *  Title:
+ *     TTdepthPatch
+ *  Synopsis:
+ *     Calculates the bicubic patch of the cell [i, i + 1] x [j, j + 1]
+ *     from the u-cubics of the depth columns in the depth window of the
+ *     cell. The depth splines are linear in the data, so the depth spline
+ *     of each u-cubic coefficient gives the coefficients of the bicubic.
+ *  Input Arguments:
+ *     tt_tablep - TT table structure for phase
+ *     j         - depth index of the cell
+ *     ucol      - u-cubics of the depth columns from TTdeltaCubics
+ *     uvalid    - valid depth columns from TTdeltaCubics
+ *  Output Arguments:
+ *     c         - patch coefficients of tt, dtdd, dtdh [and bpdel]
+ *  Called by:
+ *     BicubicTTpatches
+ *  Calls:
+ *     TTsampleWindow, FloatBracket, SplineCoeffs, SplinePiece,
+ *     CubicPowerCoeffs
+ */
+static void TTdepthPatch(TT_TABLE *tt_tablep, int j, double *ucol,
+                         int *uvalid, double *c)
+{
+    int jlo, jhi, jj, k, n, q, a, b, klo, khi, nq;
+    int idx[DEPTH_SAMPLES];
+    double z[DEPTH_SAMPLES], y[DEPTH_SAMPLES], d2y[DEPTH_SAMPLES];
+    double tmp[DEPTH_SAMPLES], f[4];
+    double dep0, hdep;
+    nq = 3 + tt_tablep->isbounce;
+    dep0 = tt_tablep->depths[j];
+    hdep = tt_tablep->depths[j+1] - dep0;
+    TTsampleWindow(tt_tablep->ndep, DEPTH_SAMPLES, j, &jlo, &jhi);
+    for (k = 0, jj = jlo; jj < jhi; jj++) {
+        if (!uvalid[jj]) continue;
+        z[k] = tt_tablep->depths[jj];
+        idx[k++] = jj;
+    }
+    FloatBracket(dep0 + 0.5 * hdep, k, z, &klo, &khi);
+    for (q = 0; q < nq; q++) {
+        for (a = 0; a < 4; a++) {
+            for (n = 0; n < k; n++)
+                y[n] = ucol[16 * idx[n] + 4 * q + a];
+            SplineCoeffs(k, z, y, d2y, tmp);
+            for (b = 0; b < 4; b++)
+                f[b] = SplinePiece(dep0 + b * hdep / 3., z, y, d2y, klo, khi);
+            CubicPowerCoeffs(f, c + 16 * q + 4 * a);
+        }
+    }
+}
+
+/*
+ *  Title:
+ *     SplinePiece
+ *  Synopsis:
+ *     Evaluates the natural spline piece between x[klo] and x[khi] at xp,
+ *     as SplineInterpolation does, without bracketing xp.
+ *  Input Arguments:
+ *     xp       - x point to be interpolated
+ *     x        - x array
+ *     y        - y array
+ *     d2y      - second derivatives of the natural spline
+ *     klo, khi - indices of the piece
+ *  Return:
+ *     interpolated function value
+ *  Called by:
+ *     TTdeltaCubics, TTdepthPatch
+ */
+static double SplinePiece(double xp, double *x, double *y, double *d2y,
+                          int klo, int khi)
+{
+    double h, a, b;
+    h = x[khi] - x[klo];
+    a = (x[khi] - xp) / h;
+    b = (xp - x[klo]) / h;
+    return a * y[klo] + b * y[khi] +
+           ((a * a * a - a) * d2y[klo] + (b * b * b - b) * d2y[khi]) *
+           h * h / 6.;
+}
+
+/*
+ *  Title:
+ *     CubicPowerCoeffs
+ *  Synopsis:
+ *     Converts the values of a cubic at t = 0, 1/3, 2/3, 1 to the
+ *     coefficients of 1, t, t^2, t^3.
+ *  Input Arguments:
+ *     f - cubic at t = 0, 1/3, 2/3, 1
+ *  Output Arguments:
+ *     c - power basis coefficients
+ *  Called by:
+ *     TTdeltaCubics, TTdepthPatch
+ */
+static void CubicPowerCoeffs(double *f, double *c)
+{
+    c[0] = f[0];
+    c[1] = (-11. * f[0] + 18. * f[1] - 9. * f[2] + 2. * f[3]) / 2.;
+    c[2] = 9. * (2. * f[0] - 5. * f[1] + 4. * f[2] - f[3]) / 2.;
+    c[3] = 9. * (-f[0] + 3. * f[1] - 3. * f[2] + f[3]) / 2.;
+}
+
+/*
+ *  Title:
+ *     BicubicValue
+ *  Synopsis:
+ *     Evaluates a bicubic patch at normalized cell co-ordinates (u, v).
+ *  Input Arguments:
+ *     c - patch coefficients, c[4 * a + b] multiplies u^a v^b
+ *     u - normalized delta
+ *     v - normalized depth
+ *  Return:
+ *     patch value
+ *  Called by:
+ *     GetTravelTimeTableValue
  */
-        SplineCoeffs(k, x, dx, d2y, tmp);
-        SplineInterpolation(delta, k, x, dx, d2y, 1, &dydx, &d2ydx);
-        if (dydx > -999.)
-            *d2tdd = dydx;
-    }
-    return ttim;
+static double BicubicValue(double *c, double u, double v)
+{
+    double p = 0.;
+    int a;
+    for (a = 3; a >= 0; a--)
+        p = p * u + ((c[4*a+3] * v + c[4*a+2]) * v + c[4*a+1]) * v + c[4*a];
+    return p;
 }
 
 
@@ -791,6 +1860,8 @@ double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
  *     If mode is et to 'all' it attempts to get time residuals for all
  *        associated phases (final call),
  *     otherwise considers only time-defining phases.
+ *     The ellipticity corrections of the phases are calculated in one pass
+ *        by GetEllipticityCorrections and used by TravelTimeCorrections.
  *  Input Arguments:
  *     sp        - pointer to current solution
  *     p         - array of phase structures
@@ -806,13 +1877,14 @@ double GetTravelTimeTableValue(TT_TABLE *tt_tablep, double depth, double delta,
  *  Called by:
  *     Locator, GetResiduals, ResidualsForFixedHypocenter
  *  Calls:
- *     GetTTResidual
+ *     GetEllipticityCorrections, GetTTResidual, Free
  */
 int TravelTimeResiduals(SOLREC *sp, PHAREC p[], char mode[4], EC_COEF *ec,
-        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, short int **topo,
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo,
         int iszderiv, int is2nderiv)
 {
     int i, all = 0;
+    double f = (1. - FLATTENING) * (1. - FLATTENING), ecolat = 0.;
     if (verbose > 4)
         fprintf(logfp, "TravelTimeResiduals: %s iszderiv=%d is2nderiv=%d\n",
                 mode, iszderiv, is2nderiv);
@@ -840,6 +1912,23 @@ int TravelTimeResiduals(SOLREC *sp, PHAREC p[], char mode[4], EC_COEF *ec,
                 sp->depth, MaxHypocenterDepth);
         return 1;
     }
+/*
+ *  ellipticity corrections for all phases
+ */
+    if (sp->lat != NULLVAL && sp->numPhase > 0) {
+        ECcorr = (double *)calloc(sp->numPhase, sizeof(double));
+        if (ECcorr == NULL) {
+            fprintf(logfp, "TravelTimeResiduals: cannot allocate memory\n");
+            fprintf(errfp, "TravelTimeResiduals: cannot allocate memory\n");
+            errorcode = 1;
+            return 1;
+        }
+        ecolat = PI2 - atan(f * tan(DEG_TO_RAD * sp->lat));
+        GetEllipticityCorrections(ec, ecolat, sp->depth, sp->numPhase, p,
+                                  ECcorr);
+        ECphases = p;
+        ECnum = sp->numPhase;
+    }
 /*
  *  calculate time residual for associated/defining phases
  */
@@ -870,11 +1959,18 @@ int TravelTimeResiduals(SOLREC *sp, PHAREC p[], char mode[4], EC_COEF *ec,
                             localtt_tables, topo, iszderiv, is2nderiv);
     }
 #endif
+    Free(ECcorr);
+    ECcorr = (double *)NULL;
+    ECphases = (PHAREC *)NULL;
+    ECnum = 0;
 /*
  *  clear current GreatCircle object and the pool of CrustalProfile objects
  */
-    if (UseRSTT)
+    if (UseRSTT) {
+        pthread_mutex_lock(&RSTTmutex);
         slbm_shell_clear();
+        pthread_mutex_unlock(&RSTTmutex);
+    }
     return 0;
 }
 
@@ -904,11 +2000,11 @@ int TravelTimeResiduals(SOLREC *sp, PHAREC p[], char mode[4], EC_COEF *ec,
  *     GetTravelTimePrediction, ResidualsForReportedPhases
  */
 static double GetTTResidual(PHAREC *pp, int all, SOLREC *sp, EC_COEF *ec,
-        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, short int **topo,
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo,
         int iszderiv, int is2nderiv)
 {
     double obtime = 0., resid = NULLVAL;
-    int j, isfirst = 0;
+    int isfirst = 0;
 /*
  *  azimuth residual
  */
@@ -935,17 +2031,17 @@ static double GetTTResidual(PHAREC *pp, int all, SOLREC *sp, EC_COEF *ec,
 /*
  *          check for phases that don't get residuals (amplitudes etc)
  */
-            for (j = 0; j < PhaseWithoutResidualNum; j++)
-                if (streq(pp->phase, PhaseWithoutResidual[j]))
-                    break;
-            if (j != PhaseWithoutResidualNum)
+            if (isNoResidualPhase(pp->phase))
                 return resid;
         }
         else {
 /*
  *          unidentified phase;
  *          try to get residual for the reported phase name
+ *          (its ellipticity correction is no longer valid)
  */
+            if (ECcorr && pp >= ECphases && pp < ECphases + ECnum)
+                ECcorr[pp - ECphases] = NULLVAL;
             ResidualsForReportedPhases(sp, pp, ec, tt_tables, localtt_tables,
                                        topo);
         }
@@ -980,8 +2076,10 @@ static double GetTTResidual(PHAREC *pp, int all, SOLREC *sp, EC_COEF *ec,
 /*
  *      no valid TT prediction
  */
-        if (all && !pp->phase_fixed)
+        if (all && !pp->phase_fixed) {
             strcpy(pp->phase, "");
+            pp->phcode = -1;
+        }
         pp->ttime = resid = NULLVAL;
         pp->dtdd = pp->dtdh = pp->d2tdd = pp->d2tdh = 0.;
     }
@@ -1013,6 +2111,76 @@ static double GetTTResidual(PHAREC *pp, int all, SOLREC *sp, EC_COEF *ec,
  *  Synopsis:
  *     Returns the travel-time prediction with elevation, ellipticity and
  *         optional bounce-point corrections for a phase.
+ *     If the calling thread has a TT cache (UseTTcache), predictions are
+ *         memoized on phase, station, hypocentre and flags, so that a
+ *         prediction repeated at the same hypocentre is not recalculated.
+ *         Unknown phases and invalid depths or distances are not cached.
+ *  Input Arguments:
+ *     see PredictTravelTime
+ *  Return:
+ *     0/1 on success/error
+ *  Called by:
+ *     TravelTimeResiduals, ResidualsForReportedPhases, PhaseIdentification,
+ *     SameArrivalTime, IdentifyPFAKE
+ *  Calls:
+ *     PredictTravelTime, TTcacheKey, TTcacheLookup
+ */
+int GetTravelTimePrediction(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo,
+        int iszderiv, int isfirst, int is2nderiv)
+{
+    TT_CACHE_ENTRY key, *cp = (TT_CACHE_ENTRY *)NULL;
+    int ret = 0, ishit = 0;
+    if (TTcache == NULL ||
+        TTcacheKey(TTcache, sp, pp, iszderiv, isfirst, is2nderiv, &key))
+        return PredictTravelTime(sp, pp, ec, tt_tables, localtt_tables, topo,
+                                 iszderiv, isfirst, is2nderiv);
+    cp = TTcacheLookup(TTcache, &key, &ishit);
+    if (ishit) {
+/*
+ *      restore the model predictions exactly as PredictTravelTime sets them
+ */
+        strcpy(pp->vmod, cp->vmod);
+        if (cp->ret)
+            return cp->ret;
+        pp->ttime = cp->ttime;
+        pp->dtdd = cp->dtdd;
+        if (iszderiv) pp->dtdh = cp->dtdh;
+        if (pp->phase[0] == 'p' || pp->phase[0] == 's') pp->bpdel = cp->bpdel;
+        if (is2nderiv) {
+            pp->d2tdd = cp->d2tdd;
+            pp->d2tdh = cp->d2tdh;
+        }
+        pp->rsttPickErr = cp->rsttPickErr;
+        pp->rsttTotalErr = cp->rsttTotalErr;
+        return 0;
+    }
+    ret = PredictTravelTime(sp, pp, ec, tt_tables, localtt_tables, topo,
+                            iszderiv, isfirst, is2nderiv);
+/*
+ *  store prediction
+ */
+    memcpy(cp, &key, sizeof(TT_CACHE_ENTRY));
+    cp->used = 1;
+    cp->ret = ret;
+    strcpy(cp->vmod, pp->vmod);
+    cp->ttime = pp->ttime;
+    cp->dtdd = pp->dtdd;
+    cp->dtdh = pp->dtdh;
+    cp->bpdel = pp->bpdel;
+    cp->d2tdd = pp->d2tdd;
+    cp->d2tdh = pp->d2tdh;
+    cp->rsttPickErr = pp->rsttPickErr;
+    cp->rsttTotalErr = pp->rsttTotalErr;
+    return ret;
+}
+
+/*
+ *  Title:
+ *     PredictTravelTime
+ *  Synopsis:
+ *     Returns the travel-time prediction with elevation, ellipticity and
+ *         optional bounce-point corrections for a phase.
  *     Horizontal and vertical slownesses are calculated if requested.
  *     The first two indices (0 and 1) in the TT table structures are
  *        reserved for the composite first-arriving P and S TT tables.
@@ -1039,17 +2207,16 @@ static double GetTTResidual(PHAREC *pp, int all, SOLREC *sp, EC_COEF *ec,
  *  Return:
  *     0/1 on success/error
  *  Called by:
- *     TravelTimeResiduals, ResidualsForReportedPhases, PhaseIdentification,
- *     SameArrivalTime, IdentifyPFAKE
+ *     GetTravelTimePrediction
  *  Calls:
- *     GetPhaseIndex, GetLocalPhaseIndex, GetTravelTimeTableValue,
- *     TravelTimeCorrections
+ *     GetPhaseIndex, GetLocalPhaseIndex, LoadTTtable,
+ *     GetTravelTimeTableValue, GetTTgridValue, TravelTimeCorrections
  */
-int GetTravelTimePrediction(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
-        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, short int **topo,
+static int PredictTravelTime(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
+        TT_TABLE *tt_tables, TT_TABLE *localtt_tables, ETOPO *topo,
         int iszderiv, int isfirst, int is2nderiv)
 {
-    int pind = 0, isdepthphase = 0, rstt_phase = 0;
+    int pind = 0, isdepthphase = 0, rstt_phase = 0, isgc = 0;
     double ttim = 0., dtdd = 0., dtdh = 0., bpdel = 0., d2tdd = 0., d2tdh = 0.;
     double dtdlat = 0., dtdlon = 0., mperr = 0., merr = 0., perr = 0.;
     double lat, lon, depth, slat, slon, elev;
@@ -1103,13 +2270,19 @@ int GetTravelTimePrediction(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
     isdepthphase = 0;
     if (pp->phase[0] == 'p' || pp->phase[0] == 's')
         isdepthphase = 1;
+/*
+ *  read a deferred global TT table on first use
+ */
+    if (!(UseLocalTT && pp->delta <= MaxLocalTTDelta) &&
+        LoadTTtable(&tt_tables[pind]))
+        return 1;
     if (UseLocalTT && pp->delta <= MaxLocalTTDelta) {
 /*
  *      use local travel-time tables
  */
         strcpy(pp->vmod, "local");
-        ttim = GetTravelTimeTableValue(&localtt_tables[pind], sp->depth,
-                    pp->delta, iszderiv, &dtdd, &dtdh, &bpdel,
+        ttim = GetTTgridValue(TTgrid, MAXTTPHA + pind, &localtt_tables[pind],
+                    sp->depth, pp->delta, iszderiv, &dtdd, &dtdh, &bpdel,
                     is2nderiv, &d2tdd, &d2tdh);
 /*
  *      couldn't get valid TT table value
@@ -1154,9 +2327,20 @@ int GetTravelTimePrediction(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
 /*
  *      decide if the phase belongs to RSTT domain
  */
-        if ((rstt_phase = isRSTT(pp, sp->depth)) == 0 ||
-            slbm_shell_createGreatCircle(phase, &lat, &lon, &depth,
-                                         &slat, &slon, &elev)) {
+        isgc = 0;
+        if ((rstt_phase = isRSTT(pp, sp->depth)) != 0) {
+/*
+ *          RSTT is not thread-safe: hold the lock until the predictions
+ *          are retrieved from the GreatCircle object
+ */
+            pthread_mutex_lock(&RSTTmutex);
+            if (slbm_shell_createGreatCircle(phase, &lat, &lon, &depth,
+                                             &slat, &slon, &elev))
+                pthread_mutex_unlock(&RSTTmutex);
+            else
+                isgc = 1;
+        }
+        if (!isgc) {
 /*
  *          not RSTT, use ak135
  */
@@ -1164,8 +2348,8 @@ int GetTravelTimePrediction(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
 /*
  *          get travel-time prediction from TT table
  */
-            ttim = GetTravelTimeTableValue(&tt_tables[pind], sp->depth,
-                        pp->delta, iszderiv, &dtdd, &dtdh, &bpdel,
+            ttim = GetTTgridValue(TTgrid, pind, &tt_tables[pind],
+                        sp->depth, pp->delta, iszderiv, &dtdd, &dtdh, &bpdel,
                         is2nderiv, &d2tdd, &d2tdh);
 /*
  *          couldn't get valid TT table value
@@ -1244,6 +2428,7 @@ int GetTravelTimePrediction(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
                 fprintf(logfp, "toterr=%.3f moderr=%.3f pickerr=%.3f duplicate=%d\n",
                         mperr, merr, perr, pp->duplicate);
             }
+            pthread_mutex_unlock(&RSTTmutex);
         }
     }
     else {
@@ -1251,8 +2436,8 @@ int GetTravelTimePrediction(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
  *      get travel-time table value from global tables
  */
         strcpy(pp->vmod, "ak135");
-        ttim = GetTravelTimeTableValue(&tt_tables[pind], sp->depth,
-                    pp->delta, iszderiv, &dtdd, &dtdh, &bpdel,
+        ttim = GetTTgridValue(TTgrid, pind, &tt_tables[pind],
+                    sp->depth, pp->delta, iszderiv, &dtdd, &dtdh, &bpdel,
                     is2nderiv, &d2tdd, &d2tdh);
 /*
  *      couldn't get valid TT table value
@@ -1376,6 +2561,8 @@ static int isRSTT(PHAREC *pp, double depth)
  *     Approximate geoid correction is calculated for Jeffreys-Bullen;
  *     otherwise the ak135 (Kennett and Gudmundsson, 1996) ellipticity
  *         correction is used.
+ *     The ellipticity correction calculated for the phase by
+ *        TravelTimeResiduals is used if there is one.
  *     Bounce point correction is applied for depth phases, and for pwP,
  *        water depth correction is also calculated.
  *  Input Arguments:
@@ -1389,12 +2576,13 @@ static int isRSTT(PHAREC *pp, double depth)
  *     GetEllipticityCorrection, GetElevationCorrection, GetBounceCorrection
  */
 static void TravelTimeCorrections(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
-                          short int **topo)
+                          ETOPO *topo)
 {
     double geoid_corr = 0., elev_corr = 0., ellip_corr = 0.;
     double bounce_corr = 0., water_corr = 0.;
     double f = (1. - FLATTENING) * (1. - FLATTENING);
     double ecolat = 0.;
+    int k = -1;
 /*
  *  ak135 ellipticity corrections (Kennett and Gudmundsson, 1996)
  */
@@ -1403,9 +2591,18 @@ static void TravelTimeCorrections(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
  *      ellipticity correction using Dziewonski and Gilbert (1976)
  *      formulation for ak135/iasp91
  */
-        ecolat = PI2 - atan(f * tan(DEG_TO_RAD * sp->lat));
-        ellip_corr = GetEllipticityCorrection(ec, pp->phase, ecolat, pp->delta,
-                                              sp->depth, pp->esaz);
+/*
+ *      use the correction calculated by TravelTimeResiduals, if any
+ */
+        if (ECcorr && pp >= ECphases && pp < ECphases + ECnum)
+            k = (int)(pp - ECphases);
+        if (k >= 0 && ECcorr[k] != NULLVAL)
+            ellip_corr = ECcorr[k];
+        else {
+            ecolat = PI2 - atan(f * tan(DEG_TO_RAD * sp->lat));
+            ellip_corr = GetEllipticityCorrection(ec, pp->phase, ecolat,
+                                        pp->delta, sp->depth, pp->esaz);
+        }
         pp->ttime += ellip_corr;
         if (verbose > 4)
             fprintf(logfp, "            %-6s ellip_corr=%.3f\n",
@@ -1458,13 +2655,15 @@ static void TravelTimeCorrections(SOLREC *sp, PHAREC *pp, EC_COEF *ec,
  *  Called by:
  *     TravelTimeCorrections
  *  Calls:
- *     PointAtDeltaAzimuth, GetEtopoCorrection
+ *     PointAtDeltaAzimuth, BounceCellMoved, GetEtopoElevation,
+ *     GetTopographyCorrection
  */
 static double GetBounceCorrection(SOLREC *sp, PHAREC *pp,
-                              short int **topo, double *tcorw)
+                              ETOPO *topo, double *tcorw)
 {
     int ips = 0;
     double tcor = 0., bp2 = 0., bpaz = 0., bplat = 0., bplon = 0.;
+    double delr = 0.;
     *tcorw = 0.;
 /*
  *  get geographic coordinates of bounce point
@@ -1483,10 +2682,64 @@ static double GetBounceCorrection(SOLREC *sp, PHAREC *pp,
     else if (strncmp(pp->phase, "sP", 2) == 0)  ips = 2;
     else if (strncmp(pp->phase, "sS", 2) == 0)  ips = 3;
     else                                        ips = 4;
-    tcor = GetEtopoCorrection(ips, bp2, bplat, bplon, topo, tcorw);
+/*
+ *  topography at the bounce point; the cached elevation is reused
+ *  unless the bounce point has moved more than BounceTolerance
+ */
+    if (UseCorrectionCache && !BounceCellMoved(pp, bplat, bplon)) {
+        delr = pp->bpelev;
+        CorrStats.nbounce++;
+    }
+    else {
+        delr = GetEtopoElevation(bplat, bplon, topo);
+        if (UseCorrectionCache) {
+            pp->bpset = 1;
+            pp->bplat = bplat;
+            pp->bplon = bplon;
+            pp->bpelev = delr;
+            CorrStats.nbouncecalc++;
+        }
+    }
+    tcor = GetTopographyCorrection(ips, bp2, delr, tcorw);
     return tcor;
 }
 
+/*
+ *  Title:
+ *     BounceCellMoved
+ *  Synopsis:
+ *     Tells whether a bounce point has moved away from the bounce point
+ *     whose elevation is cached in the phase record.
+ *     If BounceTolerance is 0 any change counts as a move; otherwise the
+ *     move is measured on a local flat-earth approximation, and the
+ *     cached point is kept as the anchor so that small moves do not
+ *     accumulate.
+ *  Input Arguments:
+ *     pp    - pointer to a phase structure.
+ *     bplat - latitude of surface reflection point
+ *     bplon - longitude of surface reflection point
+ *  Return:
+ *     1 if the bounce point has moved or no elevation is cached, 0 otherwise
+ *  Called by:
+ *     GetBounceCorrection
+ */
+static int BounceCellMoved(PHAREC *pp, double bplat, double bplon)
+{
+    double dlat = 0., dlon = 0.;
+    if (!pp->bpset)
+        return 1;
+    if (bplat == pp->bplat && bplon == pp->bplon)
+        return 0;
+    if (BounceTolerance <= 0.)
+        return 1;
+    dlat = (bplat - pp->bplat) * DEG2KM;
+    dlon = bplon - pp->bplon;
+    if (dlon > 180.)  dlon -= 360.;
+    if (dlon < -180.) dlon += 360.;
+    dlon *= DEG2KM * cos(DEG_TO_RAD * bplat);
+    return (dlat * dlat + dlon * dlon > BounceTolerance * BounceTolerance);
+}
+
 /*
  *  Title:
  *     GetEtopoCorrection
@@ -1506,21 +2759,47 @@ static double GetBounceCorrection(SOLREC *sp, PHAREC *pp,
  *  Return:
  *     tcorc - crust travel time correction (topography)
  *  Called by:
- *     GetBounceCorrection
+ *     PhaseTTh
  *  Calls:
- *     GetEtopoElevation
+ *     GetEtopoElevation, GetTopographyCorrection
  */
 double GetEtopoCorrection(int ips, double rayp, double bplat, double bplon,
-              short int **topo, double *tcorw)
+              ETOPO *topo, double *tcorw)
 {
-    double watervel = 1.5;                    /* P velocity in water [km/s] */
-    double delr = 0., term = 0., term1 = 0., term2 = 0.;
-    double bp2 = 0., tcorc = 0.;
-    *tcorw = 0.;
+    double delr = 0.;
 /*
  *  get topography/bathymetry elevation
  */
     delr = GetEtopoElevation(bplat, bplon, topo);
+    return GetTopographyCorrection(ips, rayp, delr, tcorw);
+}
+
+/*
+ *  Title:
+ *     GetTopographyCorrection
+ *  Synopsis:
+ *     Calculates bounce point correction for depth phases from the
+ *     topography/bathymetry elevation at the bounce point.
+ *     Calculates water depth correction for pwP if water column > 1.5 km.
+ *     Uses Bob Engdahl's topography equations.
+ *  Input Arguments:
+ *     ips   - 1 if pP* wave, 2 if sP* or pS* wave, 3 if sS* wave
+ *     rayp  - horizontal slowness [s/deg]
+ *     delr  - elevation at the surface reflection point [km]
+ *  Output Arguments:
+ *     tcorw - water travel time correction (water column)
+ *  Return:
+ *     tcorc - crust travel time correction (topography)
+ *  Called by:
+ *     GetEtopoCorrection, GetBounceCorrection
+ */
+static double GetTopographyCorrection(int ips, double rayp, double delr,
+        double *tcorw)
+{
+    double watervel = 1.5;                    /* P velocity in water [km/s] */
+    double term = 0., term1 = 0., term2 = 0.;
+    double bp2 = 0., tcorc = 0.;
+    *tcorw = 0.;
     if (fabs(delr) < DEPSILON) return tcorc;
     bp2 = fabs(rayp) * RAD_TO_DEG / EARTH_RADIUS;
     if (ips == 1) {
@@ -1568,6 +2847,11 @@ double GetEtopoCorrection(int ips, double rayp, double bplat, double bplon,
  *     GetElevationCorrection
  *  Synopsis:
  *     Calculates elevation correction for a station.
+ *     If UseCorrectionCache is set, the terms that depend only on the
+ *     station and the phase (surface velocity of the last leg and the
+ *     elevation factor) are cached in the phase record and recalculated
+ *     only when the phase is renamed; the slowness term is always
+ *     recalculated.
  *  Input Arguments:
  *     pp - pointer to phase structure.
  *  Return:
@@ -1579,22 +2863,41 @@ double GetEtopoCorrection(int ips, double rayp, double bplat, double bplon,
  */
 static double GetElevationCorrection(PHAREC *pp)
 {
-    double elev_corr = 0., surfvel = 0.;
+    double elev_corr = 0., surfvel = 0., elevfactor = 0.;
     int lastlag = 0;
 /*
  *  unknown station elevation
  */
     if (pp->StaElev == NULLVAL)
         return 0.;
+    if (UseCorrectionCache && pp->elevphase[0] &&
+        streq(pp->elevphase, pp->phase)) {
+        surfvel = pp->elevvel;
+        elevfactor = pp->elevfactor;
+        CorrStats.nelev++;
+    }
+    else {
+/*
+ *      find last lag of phase (P or S-type)
+ */
+        lastlag = GetLastLag(pp->phase);
+        if (lastlag == 1)                 /* last lag is P */
+            surfvel = PSurfVel;
+        else if (lastlag == 2)            /* last lag is S */
+            surfvel = SSurfVel;
+        if (surfvel > 0.)
+            elevfactor = pp->StaElev / (1000. * surfvel);
+        if (UseCorrectionCache) {
+            strcpy(pp->elevphase, pp->phase);
+            pp->elevvel = surfvel;
+            pp->elevfactor = elevfactor;
+            CorrStats.nelevcalc++;
+        }
+    }
 /*
- *  find last lag of phase (P or S-type)
+ *  invalid/unknown last lag
  */
-    lastlag = GetLastLag(pp->phase);
-    if (lastlag == 1)                 /* last lag is P */
-        surfvel = PSurfVel;
-    else if (lastlag == 2)            /* last lag is S */
-        surfvel = SSurfVel;
-    else                             /* invalid/unknown */
+    if (surfvel <= 0.)
         return 0.;
 /*
  *  elevation correction
@@ -1604,7 +2907,7 @@ static double GetElevationCorrection(PHAREC *pp)
     if (elev_corr > 1.)
         elev_corr = 1./ elev_corr;
     elev_corr  = Sqrt(1. - elev_corr);
-    elev_corr *= pp->StaElev / (1000. * surfvel);
+    elev_corr *= elevfactor;
     return elev_corr;
 }
 
@@ -1644,3 +2947,441 @@ static int GetLastLag(char phase[]) {
 
 /*  EOF  */
 
+/*
+ *  Title:
+ *     AllocateTTgrid
+ *  Synopsis:
+ *     Allocates an empty travel-time grid spanning 0-180 degrees in
+ *     delta and 0-MaxHypocenterDepth in depth. The grid nodes of a TT
+ *     table are calculated when first needed, so only the part of the
+ *     grid visited by a search is ever filled.
+ *  Input Arguments:
+ *     dres - delta grid spacing [deg]
+ *     zres - depth grid spacing [km]
+ *  Return:
+ *     pointer to TT_GRID structure or NULL on error
+ *  Called by:
+ *     NASearch
+ */
+TT_GRID *AllocateTTgrid(double dres, double zres)
+{
+    TT_GRID *ttgrid = (TT_GRID *)NULL;
+    if (dres < DEPSILON || zres < DEPSILON) {
+        fprintf(logfp, "AllocateTTgrid: invalid grid spacing %g %g\n",
+                dres, zres);
+        return (TT_GRID *)NULL;
+    }
+    if ((ttgrid = (TT_GRID *)calloc(1, sizeof(TT_GRID))) == NULL) {
+        fprintf(logfp, "AllocateTTgrid: cannot allocate memory\n");
+        fprintf(errfp, "AllocateTTgrid: cannot allocate memory\n");
+        errorcode = 1;
+        return (TT_GRID *)NULL;
+    }
+    ttgrid->dres = dres;
+    ttgrid->zres = zres;
+    ttgrid->ndel = (int)ceil(180. / dres) + 1;
+    ttgrid->ndep = (int)ceil(MaxHypocenterDepth / zres) + 1;
+    pthread_mutex_init(&ttgrid->lock, NULL);
+    return ttgrid;
+}
+
+/*
+ *  Title:
+ *     FreeTTgrid
+ *  Synopsis:
+ *     Frees memory allocated to a travel-time grid.
+ *  Input Arguments:
+ *     ttgrid - pointer to TT_GRID structure
+ *  Called by:
+ *     NASearch
+ *  Calls:
+ *     Free
+ */
+void FreeTTgrid(TT_GRID *ttgrid)
+{
+    int i, k;
+    if (ttgrid == NULL)
+        return;
+    for (k = 0; k < MAXTTPHA + MAXLOCALTTPHA; k++) {
+        if (ttgrid->col[k] == NULL) continue;
+        for (i = 0; i < ttgrid->ndel; i++)
+            Free(ttgrid->col[k][i]);
+        Free(ttgrid->col[k]);
+    }
+    pthread_mutex_destroy(&ttgrid->lock);
+    Free(ttgrid);
+}
+
+/*
+ *  Title:
+ *     AllocateTTcache
+ *  Synopsis:
+ *     Allocates an empty travel-time prediction cache for an event.
+ *     The hash table is sized to the number of phases; when a probe
+ *     sequence is full the home slot of the new prediction is overwritten.
+ *  Input Arguments:
+ *     numPhase - number of associated phases
+ *     tol      - hypocentre tolerance [km], 0 for exact match
+ *  Return:
+ *     pointer to TT_CACHE structure or NULL on error
+ *  Called by:
+ *     Locator
+ */
+TT_CACHE *AllocateTTcache(int numPhase, double tol)
+{
+    TT_CACHE *ttcache = (TT_CACHE *)NULL;
+    int size = 4096;
+    while (size < 32 * numPhase && size < (1 << 20))
+        size <<= 1;
+    if ((ttcache = (TT_CACHE *)calloc(1, sizeof(TT_CACHE))) == NULL) {
+        fprintf(logfp, "AllocateTTcache: cannot allocate memory\n");
+        fprintf(errfp, "AllocateTTcache: cannot allocate memory\n");
+        errorcode = 1;
+        return (TT_CACHE *)NULL;
+    }
+    if ((ttcache->entry = (TT_CACHE_ENTRY *)calloc(size,
+                                         sizeof(TT_CACHE_ENTRY))) == NULL) {
+        fprintf(logfp, "AllocateTTcache: cannot allocate memory\n");
+        fprintf(errfp, "AllocateTTcache: cannot allocate memory\n");
+        Free(ttcache);
+        errorcode = 1;
+        return (TT_CACHE *)NULL;
+    }
+    ttcache->size = size;
+    ttcache->tol = (tol > 0.) ? tol : 0.;
+    return ttcache;
+}
+
+/*
+ *  Title:
+ *     ResetTTcache
+ *  Synopsis:
+ *     Invalidates the predictions held in a travel-time cache, e.g. when
+ *     the local TT tables are regenerated. The counters are kept.
+ *  Input Arguments:
+ *     ttcache - pointer to TT_CACHE structure
+ *  Called by:
+ *     GenerateLocalTTtables
+ */
+void ResetTTcache(TT_CACHE *ttcache)
+{
+    int i;
+    if (ttcache == NULL)
+        return;
+    for (i = 0; i < ttcache->size; i++)
+        ttcache->entry[i].used = 0;
+}
+
+/*
+ *  Title:
+ *     FreeTTcache
+ *  Synopsis:
+ *     Frees memory allocated to a travel-time cache.
+ *  Input Arguments:
+ *     ttcache - pointer to TT_CACHE structure
+ *  Called by:
+ *     Locator
+ *  Calls:
+ *     Free
+ */
+void FreeTTcache(TT_CACHE *ttcache)
+{
+    if (ttcache == NULL)
+        return;
+    Free(ttcache->entry);
+    Free(ttcache);
+}
+
+/*
+ *  Title:
+ *     ResetCorrectionCache
+ *  Synopsis:
+ *     Clears the elevation and bounce point corrections cached in the
+ *     phase records of an event, and the correction cache counters of the
+ *     calling thread.
+ *  Input Arguments:
+ *     numPhase - number of associated phases
+ *     p        - array of phase structures
+ *  Output Arguments:
+ *     p        - array of phase structures
+ *  Called by:
+ *     Locator
+ */
+void ResetCorrectionCache(int numPhase, PHAREC p[])
+{
+    int i;
+    for (i = 0; i < numPhase; i++) {
+        p[i].elevphase[0] = '\0';
+        p[i].bpset = 0;
+    }
+    memset(&CorrStats, 0, sizeof(CORR_STATS));
+}
+
+/*
+ *  Title:
+ *     TTcacheKey
+ *  Synopsis:
+ *     Builds the cache key of a travel-time prediction.
+ *     With zero tolerance the hypocentre, delta and esaz are matched
+ *     exactly; otherwise the hypocentre is quantized to cells of tol km
+ *     (tol / DEG2KM degrees in latitude and longitude), and delta and esaz,
+ *     being functions of the hypocentre and station, are left out.
+ *  Input Arguments:
+ *     ttcache   - pointer to TT_CACHE structure
+ *     sp        - pointer to current solution
+ *     pp        - pointer to a phase record
+ *     iszderiv  - calculate dtdh [0/1]?
+ *     isfirst   - use first arriving composite tables?
+ *     is2nderiv - calculate second derivatives [0/1]?
+ *  Output Arguments:
+ *     key       - cache entry holding the key
+ *  Return:
+ *     0 if the prediction can be cached, 1 otherwise
+ *  Called by:
+ *     GetTravelTimePrediction
+ *  Calls:
+ *     PhaseCode
+ */
+static int TTcacheKey(TT_CACHE *ttcache, SOLREC *sp, PHAREC *pp,
+        int iszderiv, int isfirst, int is2nderiv, TT_CACHE_ENTRY *key)
+{
+    double q = 0.;
+    if (sp->depth < 0. || sp->depth > MaxHypocenterDepth ||
+        sp->depth == NULLVAL)
+        return 1;
+    if (pp->delta < 0. || pp->delta > 180. || pp->delta == NULLVAL)
+        return 1;
+    memset(key, 0, sizeof(TT_CACHE_ENTRY));
+    if ((key->code = PhaseCode(pp->phase)) < 0)
+        return 1;
+    key->flags = (iszderiv ? 1 : 0) | (is2nderiv ? 2 : 0) |
+                 ((isfirst + 1) << 2) | (UseLocalTT ? 16 : 0);
+    if (ttcache->tol > 0.) {
+        q = ttcache->tol / DEG2KM;
+        key->key[0] = floor(sp->lat / q);
+        key->key[1] = floor(sp->lon / q);
+        key->key[2] = floor(sp->depth / ttcache->tol);
+    }
+    else {
+        key->key[0] = sp->lat;
+        key->key[1] = sp->lon;
+        key->key[2] = sp->depth;
+        key->key[3] = pp->delta;
+        key->key[4] = pp->esaz;
+    }
+    key->key[5] = pp->StaLat;
+    key->key[6] = pp->StaLon;
+    key->key[7] = pp->StaElev;
+    return 0;
+}
+
+/*
+ *  Title:
+ *     TTcacheLookup
+ *  Synopsis:
+ *     Finds a prediction in the travel-time cache.
+ *     Linear probing over at most TTCACHEPROBE slots; on a miss the first
+ *     empty slot, or if there is none, the home slot is returned for the
+ *     new prediction.
+ *  Input Arguments:
+ *     ttcache - pointer to TT_CACHE structure
+ *     key     - cache entry holding the key
+ *  Output Arguments:
+ *     ishit   - 1 if the prediction was found, 0 otherwise
+ *  Return:
+ *     pointer to the matching entry or to the slot to be filled
+ *  Called by:
+ *     GetTravelTimePrediction
+ */
+static TT_CACHE_ENTRY *TTcacheLookup(TT_CACHE *ttcache, TT_CACHE_ENTRY *key,
+        int *ishit)
+{
+    TT_CACHE_ENTRY *cp = (TT_CACHE_ENTRY *)NULL;
+    unsigned long long h = 14695981039346656037ULL, w = 0;
+    int i, k, home;
+    *ishit = 0;
+    ttcache->nlookup++;
+/*
+ *  FNV-1a hash of phase code, flags and key bits, with a final mix so
+ *  that the low bits depend on all bits of the key
+ */
+    h = (h ^ (unsigned long long)key->code) * 1099511628211ULL;
+    h = (h ^ (unsigned long long)key->flags) * 1099511628211ULL;
+    for (i = 0; i < 8; i++) {
+        memcpy(&w, &key->key[i], sizeof(double));
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    home = (int)(h & (unsigned long long)(ttcache->size - 1));
+    for (i = 0; i < TTCACHEPROBE; i++) {
+        k = (home + i) & (ttcache->size - 1);
+        cp = &ttcache->entry[k];
+        if (!cp->used)
+            return cp;
+        if (cp->code == key->code && cp->flags == key->flags &&
+            memcmp(cp->key, key->key, sizeof(key->key)) == 0) {
+            ttcache->nhit++;
+            *ishit = 1;
+            return cp;
+        }
+    }
+    ttcache->nevict++;
+    return &ttcache->entry[home];
+}
+
+/*
+ *  Title:
+ *     GetTTgridValue
+ *  Synopsis:
+ *     Returns the TT table value for a phase at depth and delta.
+ *     If a travel-time grid is given, the travel time, slownesses and
+ *     bounce point distance are bilinearly interpolated from the four
+ *     surrounding grid nodes. The TT table is evaluated if there is no
+ *     grid or some of the nodes are invalid; if all of them are invalid
+ *     the phase is taken not to exist at depth and delta. The grid is
+ *     only used for the NA misfits, so it does not provide second
+ *     derivatives.
+ *  Input Arguments:
+ *     ttgrid    - pointer to TT_GRID structure or NULL
+ *     itab      - TT table index in the grid
+ *     tt_tablep - TT table structure for phase
+ *     depth     - depth
+ *     delta     - delta
+ *     iszderiv  - do we need dtdh [0/1]?
+ *     is2nderiv - do we need d2tdd and d2tdh [0/1]?
+ *  Output Arguments:
+ *     dtdd  - interpolated dtdd (horizontal slowness, s/deg)
+ *     dtdh  - interpolated dtdh (vertical slowness, s/km)
+ *     bpdel - bounce point distance (deg) if depth phase
+ *     d2tdd - interpolated second horizontal time derivative
+ *     d2tdh - interpolated second vertical time derivative
+ *  Return:
+ *     TT table value for a phase at depth and delta or -1. on error
+ *  Called by:
+ *     GetTravelTimePrediction
+ *  Calls:
+ *     GetTravelTimeTableValue, GetTTgridNode
+ */
+static double GetTTgridValue(TT_GRID *ttgrid, int itab, TT_TABLE *tt_tablep,
+        double depth, double delta, int iszderiv, double *dtdd, double *dtdh,
+        double *bpdel, int is2nderiv, double *d2tdd, double *d2tdh)
+{
+    double *n00, *n10, *n01, *n11;
+    double u = 0., v = 0., w[4], y[4];
+    int i, j, k;
+    if (ttgrid == NULL || tt_tablep->ndel == 0)
+        return GetTravelTimeTableValue(tt_tablep, depth, delta, iszderiv,
+                                       dtdd, dtdh, bpdel, is2nderiv,
+                                       d2tdd, d2tdh);
+/*
+ *  grid cell
+ */
+    i = (int)(delta / ttgrid->dres);
+    j = (int)(depth / ttgrid->zres);
+    if (i > ttgrid->ndel - 2) i = ttgrid->ndel - 2;
+    if (j > ttgrid->ndep - 2) j = ttgrid->ndep - 2;
+    n00 = GetTTgridNode(ttgrid, itab, tt_tablep, i, j);
+    n10 = GetTTgridNode(ttgrid, itab, tt_tablep, i + 1, j);
+    n01 = GetTTgridNode(ttgrid, itab, tt_tablep, i, j + 1);
+    n11 = GetTTgridNode(ttgrid, itab, tt_tablep, i + 1, j + 1);
+    if (n00 == NULL || n10 == NULL || n01 == NULL || n11 == NULL)
+        return GetTravelTimeTableValue(tt_tablep, depth, delta, iszderiv,
+                                       dtdd, dtdh, bpdel, is2nderiv,
+                                       d2tdd, d2tdh);
+/*
+ *  phase does not exist anywhere in the cell
+ */
+    if (n00[0] < 0 && n10[0] < 0 && n01[0] < 0 && n11[0] < 0) {
+        TTgridInterp++;
+        return -1.;
+    }
+/*
+ *  fall back to the TT table near branch ends and table edges
+ */
+    if (n00[0] < 0 || n10[0] < 0 || n01[0] < 0 || n11[0] < 0) {
+        TTgridExact++;
+        return GetTravelTimeTableValue(tt_tablep, depth, delta, iszderiv,
+                                       dtdd, dtdh, bpdel, is2nderiv,
+                                       d2tdd, d2tdh);
+    }
+/*
+ *  bilinear interpolation
+ */
+    u = delta / ttgrid->dres - (double)i;
+    v = depth / ttgrid->zres - (double)j;
+    w[0] = (1. - u) * (1. - v);
+    w[1] = u * (1. - v);
+    w[2] = (1. - u) * v;
+    w[3] = u * v;
+    for (k = 0; k < 4; k++)
+        y[k] = w[0] * n00[k] + w[1] * n10[k] + w[2] * n01[k] + w[3] * n11[k];
+    *dtdd = y[1];
+    *dtdh = iszderiv ? y[2] : 0.;
+    *bpdel = tt_tablep->isbounce ? y[3] : 0.;
+    *d2tdd = 0.;
+    *d2tdh = 0.;
+    TTgridInterp++;
+    return y[0];
+}
+
+/*
+ *  Title:
+ *     GetTTgridNode
+ *  Synopsis:
+ *     Returns a travel-time grid node (tt, dtdd, dtdh, bpdel).
+ *     The depth column of the node is calculated from the TT table when
+ *     first needed; invalid nodes have negative travel times.
+ *     The grid is shared by the NA sample threads. A column is calculated
+ *     under the grid lock and published only when it is complete, so the
+ *     threads only take the lock for columns not yet in the grid.
+ *  Input Arguments:
+ *     ttgrid    - pointer to TT_GRID structure
+ *     itab      - TT table index in the grid
+ *     tt_tablep - TT table structure for phase
+ *     i         - delta index
+ *     j         - depth index
+ *  Return:
+ *     pointer to grid node or NULL on error
+ *  Called by:
+ *     GetTTgridValue
+ *  Calls:
+ *     GetTravelTimeTableValue
+ */
+static double *GetTTgridNode(TT_GRID *ttgrid, int itab, TT_TABLE *tt_tablep,
+        int i, int j)
+{
+    double **col = (double **)NULL, *node = (double *)NULL;
+    double d2tdd = 0., d2tdh = 0.;
+    int k, nz = ttgrid->ndep;
+    col = __atomic_load_n(&ttgrid->col[itab], __ATOMIC_ACQUIRE);
+    if (col && (node = __atomic_load_n(&col[i], __ATOMIC_ACQUIRE)) != NULL)
+        return &node[4*j];
+    pthread_mutex_lock(&ttgrid->lock);
+    if ((col = ttgrid->col[itab]) == NULL) {
+        if ((col = (double **)calloc(ttgrid->ndel, sizeof(double *))) == NULL) {
+            pthread_mutex_unlock(&ttgrid->lock);
+            return (double *)NULL;
+        }
+        __atomic_store_n(&ttgrid->col[itab], col, __ATOMIC_RELEASE);
+    }
+    if ((node = col[i]) == NULL) {
+/*
+ *      evaluate the whole depth column
+ */
+        if ((node = (double *)calloc(4 * nz, sizeof(double))) == NULL) {
+            pthread_mutex_unlock(&ttgrid->lock);
+            return (double *)NULL;
+        }
+        for (k = 0; k < nz; k++)
+            node[4*k] = GetTravelTimeTableValue(tt_tablep,
+                            (double)k * ttgrid->zres, (double)i * ttgrid->dres,
+                            1, &node[4*k+1], &node[4*k+2], &node[4*k+3], 0,
+                            &d2tdd, &d2tdh);
+        ttgrid->nnodes += nz;
+        __atomic_store_n(&col[i], node, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ttgrid->lock);
+    return &node[4*j];
+}
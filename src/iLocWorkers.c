@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2018, Istvan Bondar,
+ * Written by Istvan Bondar, ibondar2014@gmail.com
+ *
+ * BSD Open Source License.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "iLoc.h"
+
+extern THREADLOCAL FILE *logfp;
+extern FILE *errfp;
+extern THREADLOCAL struct timeval t0;
+
+/*
+ * Functions:
+ *    PreforkWorkers
+ *    GetInstructionLine
+ *    ReportToSupervisor
+ *    FlushWorkerLog
+ */
+
+/*
+ *  worker side of the prefork pool
+ */
+static int WorkerQueue = -1;          /* instruction queue (datagram socket) */
+static int WorkerReport = -1;                /* counter report pipe (write) */
+static int WorkerLock[2] = {-1, -1};      /* log lock (one-byte token pipe) */
+static FILE *WorkerLogfp = (FILE *)NULL;            /* shared log file */
+static char *WorkerLogBuf = (char *)NULL;     /* log of the current event */
+static size_t WorkerLogLen = 0;
+static void FlushWorkerLog(int last);
+
+/*
+ *  counters reported by a worker to the supervisor
+ */
+typedef struct workercounts {
+    int total;                                      /* converged locations */
+    int fail;                                          /* failed locations */
+    int opt[7];                                   /* locator option counter */
+} WORKERCOUNTS;
+
+/*
+ *  Title:
+ *     PreforkWorkers
+ *  Synopsis:
+ *     Prefork worker pool for database-driven processing (--workers N).
+ *     Called after the aux data (TT tables, ETOPO, RSTT model, ...) have been
+ *        loaded, so that the workers inherit them copy-on-write, and before
+ *        the database connection is made, so that each worker owns its own
+ *        connection.
+ *     The supervisor feeds the instruction lines read from instructfp to a
+ *        shared queue (a datagram socket pair, one instruction per datagram),
+ *        the idle workers pull the next instruction from the queue.
+ *        At the end of input each worker gets an empty datagram, sends its
+ *        counters to the supervisor through a pipe and exits.
+ *     The supervisor aggregates the counters and waits for the workers.
+ *     The workers log into memory and append the log of an event to the
+ *        shared log file in one piece, holding the token of a lock pipe,
+ *        so that the logs of the events do not interleave.
+ *  Input Arguments:
+ *     nworkers   - number of worker processes
+ *     instructfp - instruction file pointer
+ *  Output Arguments:
+ *     total     - number of successful locations
+ *     fail      - number of failed locations
+ *     opt       - locator option counters
+ *  Return:
+ *     1 in the supervisor after all instructions have been processed,
+ *     0 in the workers (or if no worker could be started).
+ *  Called by:
+ *     main
+ *  Calls:
+ *     secs
+ */
+int PreforkWorkers(int nworkers, FILE *instructfp, int *total, int *fail,
+                   int *opt)
+{
+    WORKERCOUNTS wc;
+    pid_t *pids = (pid_t *)NULL;
+    char *line = NULL;
+    ssize_t nb = (ssize_t)0;
+    size_t nbytes = 0;
+    int queue[2], report[2];
+    int i, j, n = 0, ninstr = 0;
+    char token = 0;
+    if ((pids = (pid_t *)calloc(nworkers, sizeof(pid_t))) == NULL) {
+        fprintf(errfp, "PreforkWorkers: cannot allocate memory\n");
+        return 0;
+    }
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, queue)) {
+        fprintf(errfp, "PreforkWorkers: cannot create queue: %s\n",
+                strerror(errno));
+        Free(pids);
+        return 0;
+    }
+    if (pipe(report)) {
+        fprintf(errfp, "PreforkWorkers: cannot create pipe: %s\n",
+                strerror(errno));
+        close(queue[0]); close(queue[1]);
+        Free(pids);
+        return 0;
+    }
+    if (pipe(WorkerLock) || write(WorkerLock[1], &token, 1) != 1) {
+        fprintf(errfp, "PreforkWorkers: cannot create pipe: %s\n",
+                strerror(errno));
+        close(queue[0]); close(queue[1]);
+        close(report[0]); close(report[1]);
+        Free(pids);
+        return 0;
+    }
+/*
+ *  fork workers; do not let them inherit unflushed output
+ */
+    fflush(NULL);
+    for (i = 0; i < nworkers; i++) {
+        if ((pids[i] = fork()) < 0) {
+            fprintf(errfp, "PreforkWorkers: cannot fork: %s\n",
+                    strerror(errno));
+            break;
+        }
+        if (pids[i] == 0) {
+/*
+ *          worker: pull instructions from the queue
+ */
+            close(queue[0]);
+            close(report[0]);
+            WorkerQueue = queue[1];
+            WorkerReport = report[1];
+            Free(pids);
+/*
+ *          log into memory; fall back to the shared log file
+ */
+            WorkerLogfp = logfp;
+            if ((logfp = open_memstream(&WorkerLogBuf,
+                                        &WorkerLogLen)) == NULL) {
+                logfp = WorkerLogfp;
+                WorkerLogfp = (FILE *)NULL;
+            }
+            return 0;
+        }
+        n++;
+    }
+    close(queue[1]);
+    close(report[1]);
+    close(WorkerLock[0]);
+    close(WorkerLock[1]);
+    if (n == 0) {
+/*
+ *      no workers: process the instructions in this process
+ */
+        close(queue[0]);
+        close(report[0]);
+        Free(pids);
+        return 0;
+    }
+    fprintf(logfp, "PreforkWorkers: %d workers started\n", n);
+    fflush(logfp);
+/*
+ *  supervisor: feed instruction lines to the queue
+ */
+    signal(SIGPIPE, SIG_IGN);
+    while ((nb = getline(&line, &nbytes, instructfp)) > 0) {
+        if (nb >= LINLEN) {
+            fprintf(errfp, "PreforkWorkers: instruction too long, skipped\n");
+            continue;
+        }
+        if (send(queue[0], line, nb, 0) < 0) {
+            fprintf(errfp, "PreforkWorkers: no workers left: %s\n",
+                    strerror(errno));
+            break;
+        }
+        ninstr++;
+    }
+    Free(line);
+/*
+ *  end of input: one empty datagram per worker
+ */
+    for (i = 0; i < n; i++)
+        send(queue[0], "", 0, 0);
+/*
+ *  aggregate counters
+ */
+    for (i = 0; i < n; i++) {
+        if (read(report[0], &wc, sizeof(WORKERCOUNTS)) != sizeof(WORKERCOUNTS))
+            break;
+        *total += wc.total;
+        *fail += wc.fail;
+        for (j = 0; j < 7; j++) opt[j] += wc.opt[j];
+    }
+    if (i < n)
+        fprintf(errfp, "PreforkWorkers: %d workers did not report\n", n - i);
+    for (i = 0; i < n; i++)
+        waitpid(pids[i], NULL, 0);
+    close(queue[0]);
+    close(report[0]);
+    fprintf(logfp, "PreforkWorkers: %d instructions done by %d workers (%.2f)\n",
+            ninstr, n, secs(&t0));
+    Free(pids);
+    return 1;
+}
+
+/*
+ *  Title:
+ *     GetInstructionLine
+ *  Synopsis:
+ *     Gets the next instruction line; workers pull it from the queue of the
+ *     prefork pool, otherwise it is read from the instruction file.
+ *     Workers first append the log of the previous event to the log file.
+ *  Input Arguments:
+ *     line       - pointer to line buffer (allocated by getline if NULL)
+ *     nbytes     - size of the line buffer
+ *     instructfp - instruction file pointer
+ *  Return:
+ *     length of the line or -1 on end of input
+ *  Called by:
+ *     main
+ *  Calls:
+ *     FlushWorkerLog
+ */
+ssize_t GetInstructionLine(char **line, size_t *nbytes, FILE *instructfp)
+{
+    ssize_t nb;
+    if (WorkerQueue < 0)
+        return getline(line, nbytes, instructfp);
+    FlushWorkerLog(0);
+    if (*nbytes < LINLEN) {
+        Free(*line);
+        if ((*line = (char *)calloc(LINLEN, sizeof(char))) == NULL) {
+            fprintf(errfp, "GetInstructionLine: cannot allocate memory\n");
+            *nbytes = 0;
+            return -1;
+        }
+        *nbytes = LINLEN;
+    }
+    while ((nb = recv(WorkerQueue, *line, *nbytes - 1, 0)) < 0 &&
+           errno == EINTR)
+        ;
+    if (nb <= 0)
+        return -1;
+    (*line)[nb] = '\0';
+    return nb;
+}
+
+/*
+ *  Title:
+ *     ReportToSupervisor
+ *  Synopsis:
+ *     Sends the counters of a worker to the supervisor of the prefork pool
+ *     and hands the log file back to the worker.
+ *  Input Arguments:
+ *     total     - number of successful locations
+ *     fail      - number of failed locations
+ *     opt       - locator option counters
+ *  Return:
+ *     1 if called in a worker, 0 otherwise
+ *  Called by:
+ *     main
+ *  Calls:
+ *     FlushWorkerLog
+ */
+int ReportToSupervisor(int total, int fail, int *opt)
+{
+    WORKERCOUNTS wc;
+    int i;
+    if (WorkerReport < 0)
+        return 0;
+    FlushWorkerLog(1);
+    wc.total = total;
+    wc.fail = fail;
+    for (i = 0; i < 7; i++) wc.opt[i] = opt[i];
+    if (write(WorkerReport, &wc, sizeof(WORKERCOUNTS)) != sizeof(WORKERCOUNTS))
+        fprintf(errfp, "ReportToSupervisor: cannot report counters\n");
+    close(WorkerReport);
+    close(WorkerQueue);
+    WorkerReport = WorkerQueue = -1;
+    return 1;
+}
+
+/*
+ *  Title:
+ *     FlushWorkerLog
+ *  Synopsis:
+ *     Appends the in-memory log of a worker to the shared log file while
+ *     holding the token of the log lock pipe, then starts a new in-memory
+ *     log, or restores the shared log file if this is the last flush.
+ *  Input Arguments:
+ *     last - last flush of the worker?
+ *  Called by:
+ *     GetInstructionLine, ReportToSupervisor
+ */
+static void FlushWorkerLog(int last)
+{
+    char token;
+    if (WorkerLogfp == NULL)
+        return;
+    fclose(logfp);
+    if (WorkerLogLen) {
+        while (read(WorkerLock[0], &token, 1) < 0 && errno == EINTR)
+            ;
+        fwrite(WorkerLogBuf, 1, WorkerLogLen, WorkerLogfp);
+        fflush(WorkerLogfp);
+        write(WorkerLock[1], &token, 1);
+    }
+    Free(WorkerLogBuf);
+    WorkerLogLen = 0;
+    if (last || (logfp = open_memstream(&WorkerLogBuf,
+                                        &WorkerLogLen)) == NULL) {
+        logfp = WorkerLogfp;
+        WorkerLogfp = (FILE *)NULL;
+        close(WorkerLock[0]);
+        close(WorkerLock[1]);
+    }
+}
@@ -31,11 +31,11 @@
 #ifdef MYSQLDB
 
 #include "iLoc.h"
-extern int verbose;                                         /* verbose level */
-extern FILE *logfp;
+extern THREADLOCAL int verbose;                              /* verbose level */
+extern THREADLOCAL FILE *logfp;
 extern FILE *errfp;
-extern int errorcode;
-extern struct timeval t0;
+extern THREADLOCAL int errorcode;
+extern THREADLOCAL struct timeval t0;
 extern char InputDB[VALLEN];       /* read data from this DB account, if any */
 extern char OutputDB[VALLEN];    /* write results to this DB account, if any */
 extern char OutAgency[VALLEN];      /* author for new hypocentres and assocs */